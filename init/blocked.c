@@ -86,6 +86,10 @@ blocked_new (const void  *parent,
 		blocked->message = (NihDBusMessage *)data;
 		nih_ref (blocked->message, blocked);
 		break;
+	case BLOCKED_EMIT_EVENTS_METHOD:
+		blocked->batch = (ControlEmitBatch *)data;
+		nih_ref (blocked->batch, blocked);
+		break;
 	default:
 		nih_assert_not_reached ();
 	}
@@ -115,6 +119,7 @@ blocked_type_enum_to_str (BlockedType type)
 	state_enum_to_str (BLOCKED_INSTANCE_START_METHOD, type);
 	state_enum_to_str (BLOCKED_INSTANCE_STOP_METHOD, type);
 	state_enum_to_str (BLOCKED_INSTANCE_RESTART_METHOD, type);
+	state_enum_to_str (BLOCKED_EMIT_EVENTS_METHOD, type);
 
 	return NULL;
 }
@@ -142,6 +147,7 @@ blocked_type_str_to_enum (const char *type)
 	state_str_to_enum (BLOCKED_INSTANCE_START_METHOD, type);
 	state_str_to_enum (BLOCKED_INSTANCE_STOP_METHOD, type);
 	state_str_to_enum (BLOCKED_INSTANCE_RESTART_METHOD, type);
+	state_str_to_enum (BLOCKED_EMIT_EVENTS_METHOD, type);
 
 	return -1;
 }
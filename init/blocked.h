@@ -27,6 +27,7 @@
 
 #include "job.h"
 #include "event.h"
+#include "control.h"
 
 
 /**
@@ -44,7 +45,8 @@ typedef enum blocked_type {
 	BLOCKED_JOB_RESTART_METHOD,
 	BLOCKED_INSTANCE_START_METHOD,
 	BLOCKED_INSTANCE_STOP_METHOD,
-	BLOCKED_INSTANCE_RESTART_METHOD
+	BLOCKED_INSTANCE_RESTART_METHOD,
+	BLOCKED_EMIT_EVENTS_METHOD
 } BlockedType;
 
 
@@ -55,6 +57,7 @@ typedef enum blocked_type {
  * @job: job pointer if @type is BLOCKED_JOB,
  * @event: event pointer if @type is BLOCKED_EVENT,
  * @message: D-Bus message pointer if @type is BLOCKED_*_METHOD,
+ * @batch: batch of emitted events if @type is BLOCKED_EMIT_EVENTS_METHOD,
  * @data: generic pointer to blocked object.
  *
  * This structure is used to reference an object that is blocked on
@@ -66,10 +69,11 @@ typedef struct blocked {
 	BlockedType type;
 
 	union {
-		Job            *job;
-		Event          *event;
-		NihDBusMessage *message;
-		void           *data;
+		Job              *job;
+		Event            *event;
+		NihDBusMessage   *message;
+		ControlEmitBatch *batch;
+		void             *data;
 	};
 } Blocked;
 
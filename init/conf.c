@@ -26,9 +26,12 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/timerfd.h>
 
 #include <errno.h>
 #include <libgen.h>
+#include <poll.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -40,6 +43,7 @@
 #include <nih/io.h>
 #include <nih/file.h>
 #include <nih/watch.h>
+#include <nih/signal.h>
 #include <nih/logging.h>
 #include <nih/error.h>
 #include <nih/errors.h>
@@ -50,12 +54,87 @@
 #include "errors.h"
 #include "paths.h"
 #include "environ.h"
+#include "hash.h"
+#include "conf_cache.h"
+
+/**
+ * ConfPrefetch:
+ * @source: configuration source,
+ * @paths: job configuration files to parse,
+ * @stats: details of each of @paths when found,
+ * @count: number of entries in @paths and @stats.
+ *
+ * Job configuration files found by conf_source_prefetch() that are to be
+ * parsed in parallel.
+ **/
+typedef struct conf_prefetch {
+	ConfSource   *source;
+	char        **paths;
+	struct stat  *stats;
+	size_t        count;
+} ConfPrefetch;
+
+/**
+ * ConfPending:
+ * @entry: list header,
+ * @path: full path of changed file,
+ * @source: configuration source @path was changed in.
+ *
+ * A configuration file that has changed and is waiting for the changes
+ * to it to be coalesced before it is reloaded.
+ **/
+typedef struct conf_pending {
+	NihList     entry;
+	char       *path;
+	ConfSource *source;
+} ConfPending;
+
+/**
+ * ConfReloadChanged:
+ * @source: configuration source,
+ * @summary: summary to add to.
+ *
+ * State passed through nih_dir_walk() by conf_source_reload_changed().
+ **/
+typedef struct conf_reload_changed {
+	ConfSource        *source;
+	ConfReloadSummary *summary;
+} ConfReloadChanged;
+
 
 /* Prototypes for static functions */
 static int  conf_source_reload_file    (ConfSource *source)
 	__attribute__ ((warn_unused_result));
 static int  conf_source_reload_dir     (ConfSource *source)
 	__attribute__ ((warn_unused_result));
+static size_t conf_source_remove_stale (ConfSource *source);
+static void conf_cache_begin           (void);
+static void conf_cache_finish          (void);
+static void conf_source_reload_changed (ConfSource *source,
+					ConfReloadSummary *summary);
+static int  conf_changed_filter        (ConfReloadChanged *changed,
+					const char *path, int is_dir);
+static int  conf_changed_visitor       (ConfReloadChanged *changed,
+					const char *dirname, const char *path,
+					struct stat *statbuf);
+static void conf_reload_changed_path   (ConfSource *source, const char *path,
+					const struct stat *statbuf,
+					ConfReloadSummary *summary);
+static char *conf_find_override        (const ConfSource *source,
+					const char *path)
+	__attribute__ ((warn_unused_result));
+static int  conf_file_unchanged        (ConfFile *file, const char *path,
+					const struct stat *statbuf,
+					const char *override_path)
+	__attribute__ ((warn_unused_result));
+static int  conf_file_stamp_check      (ConfFileStamp *stamp, const char *path,
+					const struct stat *statbuf)
+	__attribute__ ((warn_unused_result));
+static void conf_file_stamp_set        (ConfFileStamp *stamp,
+					const struct stat *statbuf,
+					const char *buf, size_t len);
+static uint64_t conf_digest            (const char *buf, size_t len)
+	__attribute__ ((warn_unused_result));
 
 static int  conf_file_filter           (ConfSource *source, const char *path,
 					int is_dir);
@@ -74,6 +153,35 @@ static int  conf_file_visitor          (ConfSource *source,
 static int  conf_reload_path           (ConfSource *source, const char *path,
 					const char *override_path)
 	__attribute__ ((warn_unused_result));
+static void conf_load_path_with_override (ConfSource *source,
+					  const char *conf_path);
+static void conf_reload_override       (ConfSource *source, const char *path,
+					NihHash *done);
+static void conf_mark_done             (NihHash *done, const char *path);
+static int  conf_pending_add           (ConfSource *source, const char *path);
+static int  conf_pending_destroy       (ConfPending *pending);
+static int  conf_pending_arm           (int arm);
+static void conf_pending_watcher       (void *data, NihIoWatch *watch,
+					NihIoEvents events);
+static void conf_pending_discard       (void);
+static void conf_reload_pending        (ConfSource *source, const char *path,
+					NihHash *done);
+static ConfSource *conf_source_for_path (const Session *session,
+					const char *path)
+	__attribute__ ((warn_unused_result));
+static int  conf_dir_path_valid        (ConfSource *source, const char *path)
+	__attribute__ ((warn_unused_result));
+static void conf_source_prefetch       (ConfSource *source);
+static int  conf_parse_worker_count    (size_t files)
+	__attribute__ ((warn_unused_result));
+static int  conf_prefetch_filter       (ConfPrefetch *prefetch,
+					const char *path, int is_dir);
+static int  conf_prefetch_visitor      (ConfPrefetch *prefetch,
+					const char *dirname, const char *path,
+					struct stat *statbuf);
+static void conf_prefetch_worker       (ConfPrefetch *prefetch, int worker,
+					int workers, int fd)
+	__attribute__ ((noreturn));
 
 static inline int  is_conf_file        (const char *path)
 	__attribute__ ((warn_unused_result));
@@ -121,6 +229,56 @@ const char *session_file = NULL;
  **/
 NihList *conf_sources = NULL;
 
+/**
+ * conf_parse_workers:
+ *
+ * Number of processes to parse job configuration directories in when
+ * they are reloaded, or -1 for one per online CPU; zero or one parse
+ * in init itself.  At most CONF_PARSE_WORKERS_MAX are used.
+ **/
+int conf_parse_workers = -1;
+
+/**
+ * conf_coalesce_window:
+ *
+ * Number of milliseconds over which changes to configuration files
+ * notified by inotify are coalesced, so that a file written, renamed and
+ * overridden in quick succession is only reloaded once; zero or less to
+ * reload on every change.
+ **/
+int conf_coalesce_window = CONF_COALESCE_WINDOW;
+
+/**
+ * conf_coalesce_events:
+ *
+ * Number of changes to configuration files that have been coalesced.
+ **/
+size_t conf_coalesce_events = 0;
+
+/**
+ * conf_coalesce_saved:
+ *
+ * Number of times a configuration file was not reloaded because the
+ * change was coalesced with another, or covered by a full reload.
+ **/
+size_t conf_coalesce_saved = 0;
+
+/**
+ * conf_pending:
+ *
+ * Hash table of ConfPending structures indexed by path, for files that
+ * will be reloaded when conf_pending_fd next expires.
+ **/
+static NihHash *conf_pending = NULL;
+
+/**
+ * conf_pending_fd:
+ *
+ * Timer file descriptor that expires at the end of the coalescing
+ * window, or -1 if not yet created.
+ **/
+static int conf_pending_fd = -1;
+
 extern json_object *json_conf_sources;
 
 /**
@@ -343,13 +501,21 @@ conf_init (void)
 /**
  * conf_destroy:
  *
- * Clear: the conf_sources list.
+ * Clear: the conf_sources list and any pending reloads.
  **/
 void
 conf_destroy (void)
 {
 	if (conf_sources)
 		nih_free (conf_sources);
+
+	if (conf_pending) {
+		NIH_HASH_FOREACH_SAFE (conf_pending, iter)
+			nih_free (iter);
+
+		nih_free (conf_pending);
+		conf_pending = NULL;
+	}
 }
 
 /**
@@ -453,11 +619,16 @@ conf_file_new (ConfSource *source,
 
 	file->source = source;
 	file->flag = source->flag;
+
+	memset (&file->stamp, 0, sizeof (file->stamp));
+	file->override_path = NULL;
+	memset (&file->override, 0, sizeof (file->override));
+
 	file->data = NULL;
 
 	nih_alloc_set_destructor (file, conf_file_destroy);
 
-	nih_hash_add (source->files, &file->entry);
+	hash_add (source->files, &file->entry);
 
 	return file;
 }
@@ -492,6 +663,9 @@ void
 conf_reload (void)
 {
 	conf_init ();
+	conf_pending_discard ();
+
+	conf_cache_begin ();
 
 	NIH_LIST_FOREACH (conf_sources, iter) {
 		ConfSource *source = (ConfSource *)iter;
@@ -507,250 +681,1333 @@ conf_reload (void)
 			nih_free (err);
 		}
 	}
+
+	conf_cache_finish ();
 }
 
 /**
- * conf_source_reload:
- * @source: configuration source to reload.
+ * conf_cache_begin:
  *
- * Reloads the given configuration @source.
+ * Loads the configuration cache from conf_cache_file, if set, ready for
+ * a reload; otherwise an empty cache is created, since the cache also
+ * holds the job classes parsed in parallel by conf_source_prefetch().
  *
- * If not already established, an inotify watch is created so that future
- * changes to this source are automatically detected and parsed.  For files,
- * this watch is actually on the parent directory, since we need to watch
- * out for editors that rename over the top, etc.
+ * A cache that conf_cache_finish() could not save is still held in
+ * memory, and is used in preference to the older one on disk.
  *
- * We then parse the current state of the source.  The flag member is
- * toggled first, and this is propagated to all new and modified files and
- * items that we find as a result of parsing.  Once done, we scan for
- * anything with the wrong flag, and delete them.
+ * Any errors are logged and the cache left empty.
+ **/
+static void
+conf_cache_begin (void)
+{
+	if (conf_cache_file && conf_cache) {
+		conf_cache_reset ();
+	} else if (! conf_cache_file) {
+		conf_cache_init ();
+	} else if (conf_cache_load () < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		if (err->number != ENOENT)
+			nih_warn ("%s: %s: %s", conf_cache_file,
+				  _("Unable to load configuration cache"),
+				  err->message);
+		nih_free (err);
+	}
+}
+
+/**
+ * conf_cache_finish:
  *
- * Returns: zero on success, negative value on raised error.
+ * Saves the configuration cache to conf_cache_file, if set, after a
+ * reload and then discards it from memory.
+ *
+ * If the cache cannot be saved it is kept in memory instead, so that
+ * the next reload of either kind tries again with every entry rather
+ * than only those for files it parses.
+ *
+ * Any errors are logged.
  **/
-int
-conf_source_reload (ConfSource *source)
+static void
+conf_cache_finish (void)
 {
-	NihList deleted;
-	int     ret;
+	if (! conf_cache_file) {
+		conf_cache_free ();
+		return;
+	}
 
-	nih_assert (source != NULL);
+	nih_debug ("Loaded %zu jobs from configuration cache and parsed %zu, "
+		   "saving %.3fms", conf_cache_hits, conf_cache_misses,
+		   conf_cache_saved / 1000000.0);
 
-	nih_info (_("Loading configuration from %s"), source->path);
+	/* The cache is usually on a filesystem that is read-only early in
+	 * boot, so failing to save it is expected there; it will be saved
+	 * by a later reload, full or not.
+	 */
+	if (conf_cache_save () < 0) {
+		NihError *err;
 
-	/* Toggle the flag so we can detect deleted files and items. */
-	source->flag = (! source->flag);
+		err = nih_error_get ();
+		nih_debug ("%s: %s: %s", conf_cache_file,
+			   _("Unable to save configuration cache"),
+			   err->message);
+		nih_free (err);
+		return;
+	}
 
-	/* Reload the source itself. */
-	switch (source->type) {
-	case CONF_FILE:
-		ret = conf_source_reload_file (source);
-		break;
-	case CONF_DIR:
-	case CONF_JOB_DIR:
-		ret = conf_source_reload_dir (source);
-		break;
-	default:
-		nih_assert_not_reached ();
+	conf_cache_free ();
+}
+
+/**
+ * conf_reload_changed:
+ * @summary: summary to fill in.
+ *
+ * Reloads configuration sources as conf_reload() does, except that files
+ * which have not changed since they were last parsed, and whose override
+ * file has not changed either, are not parsed again and keep their
+ * existing items.  Files that were added or modified are parsed, and
+ * files that were removed are deleted, and the number of each is
+ * returned in @summary.
+ *
+ * A file is unchanged if its device, inode, size and modification time
+ * match those it had when last parsed; failing that, if its contents
+ * have the same digest, as when an editor or package manager replaces
+ * it with an identical copy.  Files restored over re-exec have not been
+ * parsed by this instance, so are always parsed again.
+ *
+ * Sources without an inotify watch are reloaded in full, so that another
+ * attempt is made to establish one.
+ *
+ * Any errors are logged through the usual mechanism, and not returned.
+ **/
+void
+conf_reload_changed (ConfReloadSummary *summary)
+{
+	nih_assert (summary != NULL);
+
+	conf_init ();
+	conf_pending_discard ();
+
+	memset (summary, 0, sizeof (ConfReloadSummary));
+
+	conf_cache_begin ();
+
+	NIH_LIST_FOREACH (conf_sources, iter) {
+		ConfSource *source = (ConfSource *)iter;
+
+		conf_source_reload_changed (source, summary);
 	}
 
-	/* Scan for files that have been deleted since the last time we
-	 * reloaded; these are simple to detect, as they will have the wrong
-	 * flag.
-	 *
-	 * We take them out of the files list and then we can delete the
-	 * attached jobs and free the file.  We can't just do this from
-	 * the one loop because to delete the jobs, we need to be able
-	 * to iterate the sources and files.
+	/* Files left unchanged were neither looked up in nor stored to the
+	 * cache, but their entries are still wanted.
 	 */
-	nih_list_init (&deleted);
-	NIH_HASH_FOREACH_SAFE (source->files, iter) {
-		ConfFile *file = (ConfFile *)iter;
+	NIH_LIST_FOREACH (conf_sources, iter) {
+		ConfSource *source = (ConfSource *)iter;
 
-		if (file->flag != source->flag)
-			nih_list_add (&deleted, &file->entry);
-	}
-	NIH_LIST_FOREACH_SAFE (&deleted, iter) {
-		ConfFile *file = (ConfFile *)iter;
+		NIH_HASH_FOREACH (source->files, file_iter) {
+			ConfFile *file = (ConfFile *)file_iter;
 
-		nih_info (_("Handling deletion of %s"), file->path);
-		nih_unref (file, source);
+			conf_cache_keep (file->path);
+		}
 	}
 
-	return ret;
+	conf_cache_finish ();
+
+	nih_info (_("Reloaded configuration: %zu added, %zu modified, "
+		    "%zu removed, %zu unchanged"),
+		  summary->added, summary->modified,
+		  summary->removed, summary->unchanged);
 }
 
 /**
- * conf_source_reload_file:
- * @source: configuration source to reload.
- *
- * Reloads the configuration file specified by @source.
+ * conf_source_reload_changed:
+ * @source: configuration source to reload,
+ * @summary: summary to add to.
  *
- * If not already established, an inotify watch is created on the parent
- * directory so that future changes to the file are automatically detected
- * and parsed.  It is the parent directory because we need to watch out for
- * editors that rename over the top, etc.
+ * Reloads the given configuration @source, only parsing files that have
+ * changed since they were last parsed; see conf_reload_changed().
  *
- * Returns: zero on success, negative value on raised error.
+ * As with conf_source_reload(), the flag member is toggled first, and
+ * copied to every file found whether or not it was parsed, so that files
+ * left with the wrong flag can be deleted.
  **/
-static int
-conf_source_reload_file (ConfSource *source)
+static void
+conf_source_reload_changed (ConfSource        *source,
+			    ConfReloadSummary *summary)
 {
-	NihError *err = NULL;
-	nih_local char *override_path = NULL;
-
-	struct stat statbuf;
+	ConfReloadChanged changed;
+	struct stat       statbuf;
+	size_t            before, removed;
+	int               full;
+	int               ret = 0;
 
 	nih_assert (source != NULL);
-	nih_assert (source->type == CONF_FILE);
+	nih_assert (summary != NULL);
 
-	/* this function should only be called for standard
-	 * configuration files.
-	 */
-	if (! source->watch) {
-		nih_local char *dpath = NULL;
-		char           *dname;
+	nih_info (_("Loading changed configuration from %s"), source->path);
 
-		dpath = NIH_MUST (nih_strdup (NULL, source->path));
-		dname = dirname (dpath);
+	/* Without a watch, reload in full so that one may be established */
+	full = (! source->watch);
+	before = hash_count (source->files);
 
-		source->watch = nih_watch_new (source, dname, FALSE, FALSE,
-					       (NihFileFilter)conf_file_filter,
-					       (NihCreateHandler)conf_create_modify_handler,
-					       (NihModifyHandler)conf_create_modify_handler,
-					       (NihDeleteHandler)conf_delete_handler,
-					       source);
+	source->flag = (! source->flag);
 
-		/* If successful mark the file descriptor close-on-exec,
-		 * otherwise stash the error for comparison with a later
-		 * failure to parse the file.
-		 */
-		if (source->watch) {
-			nih_io_set_cloexec (source->watch->fd);
-		} else {
-			err = nih_error_steal ();
+	switch (source->type) {
+	case CONF_FILE:
+		if (full) {
+			ret = conf_source_reload_file (source);
+		} else if (stat (source->path, &statbuf) == 0) {
+			conf_reload_changed_path (source, source->path,
+						  &statbuf, summary);
+		}
+		break;
+	case CONF_DIR:
+	case CONF_JOB_DIR:
+		if (full) {
+			ret = conf_source_reload_dir (source);
+			break;
 		}
-	}
 
-	/* Parse the file itself.  If this fails, then we can discard the
-	 * inotify error, since this one will be better.
-	 */
-	if (conf_reload_path (source, source->path, NULL) < 0) {
-		if (err)
-			nih_free (err);
+		changed.source = source;
+		changed.summary = summary;
 
-		return -1;
+		ret = nih_dir_walk (source->path,
+				    (NihFileFilter)conf_changed_filter,
+				    (NihFileVisitor)conf_changed_visitor, NULL,
+				    &changed);
+		break;
+	default:
+		nih_assert_not_reached ();
 	}
 
-	/* We were able to parse the file, but were not able to set up an
-	 * inotify watch.  This isn't critical, so we just warn about it,
-	 * unless this is simply that inotify isn't supported, in which case
-	 * we do nothing.
-	 */
-	if (err) {
-		if (err->number != ENOSYS)
-			nih_warn ("%s: %s: %s", source->path,
-				  _("Unable to watch configuration file"),
-				  err->message);
+	removed = conf_source_remove_stale (source);
+	summary->removed += removed;
 
-		nih_free (err);
+	/* Every file of a source reloaded in full was parsed again; those
+	 * that were not removed were modified, the rest added.
+	 */
+	if (full) {
+		summary->modified += before - removed;
+		summary->added += hash_count (source->files) - (before - removed);
 	}
 
-	if (! is_conf_file_std (source->path))
-		return 0;
-
-	override_path = toggle_conf_name (NULL, source->path);
-
-	if (lstat (override_path, &statbuf) != 0)
-		return 0;
-
-	nih_debug ("Updating configuration for %s from %s",
-		  source->path, override_path);
-	if (conf_reload_path (source, source->path, override_path) < 0) {
-		if (err)
-			nih_free (err);
+	if (ret < 0) {
+		NihError *err;
 
-		return -1;
+		err = nih_error_get ();
+		if (err->number != ENOENT)
+			nih_error ("%s: %s: %s", source->path,
+				   _("Unable to load configuration"),
+				   err->message);
+		nih_free (err);
 	}
-
-	return 0;
 }
 
 /**
- * conf_source_reload_dir:
- * @source: configuration source to reload.
- *
- * Reloads the configuration directory specified by @source.
- *
- * If not already established, an inotify watch is created on the directory
- * so that future changes to the structure or files within it are
- * automatically parsed.  This has the side-effect of parsing the current
- * tree.
+ * conf_changed_filter:
+ * @changed: state of reload,
+ * @path: path to check,
+ * @is_dir: TRUE if @path is a directory.
  *
- * Otherwise we walk the tree ourselves and parse all files that we find,
- * propagating the value of the flag member to all files so that deletion
- * can be detected by the calling function.
+ * Filters the directory walk of conf_source_reload_changed() in the same
+ * way as conf_dir_filter().
  *
- * Returns: zero on success, negative value on raised error.
+ * Returns: FALSE if @path should be visited, TRUE otherwise.
  **/
 static int
-conf_source_reload_dir (ConfSource *source)
+conf_changed_filter (ConfReloadChanged *changed,
+		     const char        *path,
+		     int                is_dir)
+{
+	nih_assert (changed != NULL);
+
+	return conf_dir_filter (changed->source, path, is_dir);
+}
+
+/**
+ * conf_changed_visitor:
+ * @changed: state of reload,
+ * @dirname: top-level directory being walked,
+ * @path: path found in directory,
+ * @statbuf: stat of @path.
+ *
+ * Called by conf_source_reload_changed() for each file found when walking
+ * a directory source, reloading it if it has changed.
+ *
+ * Returns: always zero.
+ **/
+static int
+conf_changed_visitor (ConfReloadChanged *changed,
+		      const char        *dirname,
+		      const char        *path,
+		      struct stat       *statbuf)
+{
+	nih_assert (changed != NULL);
+	nih_assert (dirname != NULL);
+	nih_assert (path != NULL);
+	nih_assert (statbuf != NULL);
+
+	if (! S_ISREG (statbuf->st_mode))
+		return 0;
+
+	if (is_conf_file_std (path))
+		conf_reload_changed_path (changed->source, path, statbuf,
+					  changed->summary);
+
+	return 0;
+}
+
+/**
+ * conf_reload_changed_path:
+ * @source: configuration source,
+ * @path: path of conf file,
+ * @statbuf: current details of @path,
+ * @summary: summary to add to.
+ *
+ * Reloads @path, along with its best override file, unless neither has
+ * changed since they were last parsed in which case the existing ConfFile
+ * is simply marked as found.
+ **/
+static void
+conf_reload_changed_path (ConfSource        *source,
+			  const char        *path,
+			  const struct stat *statbuf,
+			  ConfReloadSummary *summary)
+{
+	ConfFile       *file;
+	nih_local char *override_path = NULL;
+
+	nih_assert (source != NULL);
+	nih_assert (path != NULL);
+	nih_assert (statbuf != NULL);
+	nih_assert (summary != NULL);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, path);
+	override_path = conf_find_override (source, path);
+
+	if (file && conf_file_unchanged (file, path, statbuf, override_path)) {
+		file->flag = source->flag;
+		summary->unchanged++;
+		return;
+	}
+
+	if (file) {
+		summary->modified++;
+	} else {
+		summary->added++;
+	}
+
+	if (source->type != CONF_FILE) {
+		conf_load_path_with_override (source, path);
+		return;
+	}
+
+	if (conf_source_reload_file (source) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_error ("%s: %s: %s", source->path,
+			   _("Unable to load configuration"),
+			   err->message);
+		nih_free (err);
+	}
+}
+
+/**
+ * conf_find_override:
+ * @source: configuration source,
+ * @path: path of conf file.
+ *
+ * Finds the override file that would be applied to @path when loading
+ * it from @source.
+ *
+ * Returns: newly allocated path to override file or NULL if there is none.
+ **/
+static char *
+conf_find_override (const ConfSource *source,
+		    const char       *path)
+{
+	nih_local char *name = NULL;
+	char           *override_path;
+	struct stat     statbuf;
+
+	nih_assert (source != NULL);
+	nih_assert (path != NULL);
+
+	if (! is_conf_file_std (path))
+		return NULL;
+
+	if (source->type != CONF_FILE) {
+		name = conf_to_job_name (source->path, path);
+
+		return conf_get_best_override (name, source);
+	}
+
+	override_path = toggle_conf_name (NULL, path);
+
+	if (lstat (override_path, &statbuf) != 0) {
+		nih_free (override_path);
+		return NULL;
+	}
+
+	return override_path;
+}
+
+/**
+ * conf_file_unchanged:
+ * @file: configuration file,
+ * @path: path of @file,
+ * @statbuf: current details of @path,
+ * @override_path: override file that would now be applied, or NULL.
+ *
+ * Returns: TRUE if neither @path nor its override file have changed since
+ * @file was last parsed, FALSE if it must be parsed again.
+ **/
+static int
+conf_file_unchanged (ConfFile          *file,
+		     const char        *path,
+		     const struct stat *statbuf,
+		     const char        *override_path)
+{
+	struct stat override_stat;
+
+	nih_assert (file != NULL);
+	nih_assert (path != NULL);
+	nih_assert (statbuf != NULL);
+
+	/* Jobs that failed to parse are parsed again, so that the errors
+	 * are reported until they are fixed.
+	 */
+	if (file->source->type == CONF_JOB_DIR && ! file->job)
+		return FALSE;
+
+	if (! conf_file_stamp_check (&file->stamp, path, statbuf))
+		return FALSE;
+
+	if (! override_path)
+		return (file->override_path == NULL);
+
+	if ((! file->override_path)
+	    || strcmp (file->override_path, override_path))
+		return FALSE;
+
+	if (stat (override_path, &override_stat) < 0)
+		return FALSE;
+
+	return conf_file_stamp_check (&file->override, override_path,
+				      &override_stat);
+}
+
+/**
+ * conf_file_stamp_check:
+ * @stamp: stamp of file when last parsed,
+ * @path: path of file,
+ * @statbuf: current details of @path.
+ *
+ * Compares @path against @stamp; when only its inode or modification
+ * time differ, its contents are read and compared by digest, and @stamp
+ * is updated if they are the same.
+ *
+ * Returns: TRUE if @path has the contents described by @stamp, FALSE
+ * otherwise.
+ **/
+static int
+conf_file_stamp_check (ConfFileStamp     *stamp,
+		       const char        *path,
+		       const struct stat *statbuf)
+{
+	nih_local char *buf = NULL;
+	size_t          len;
+
+	nih_assert (stamp != NULL);
+	nih_assert (path != NULL);
+	nih_assert (statbuf != NULL);
+
+	if (! stamp->valid)
+		return FALSE;
+
+	if (stamp->dev == statbuf->st_dev
+	    && stamp->ino == statbuf->st_ino
+	    && stamp->size == statbuf->st_size
+	    && stamp->mtime.tv_sec == statbuf->st_mtim.tv_sec
+	    && stamp->mtime.tv_nsec == statbuf->st_mtim.tv_nsec)
+		return TRUE;
+
+	if ((! stamp->digest) || stamp->size != statbuf->st_size)
+		return FALSE;
+
+	buf = nih_file_read (NULL, path, &len);
+	if (! buf) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_free (err);
+
+		return FALSE;
+	}
+
+	if (conf_digest (buf, len) != stamp->digest)
+		return FALSE;
+
+	conf_file_stamp_set (stamp, statbuf, buf, len);
+
+	return TRUE;
+}
+
+/**
+ * conf_file_stamp_set:
+ * @stamp: stamp to set,
+ * @statbuf: details of file when read, or NULL,
+ * @buf: contents of file, or NULL if not read,
+ * @len: length of @buf.
+ *
+ * Records the file described by @statbuf and @buf in @stamp; if @statbuf
+ * is NULL, @stamp is cleared so that the file is always parsed again.
+ **/
+static void
+conf_file_stamp_set (ConfFileStamp     *stamp,
+		     const struct stat *statbuf,
+		     const char        *buf,
+		     size_t             len)
+{
+	nih_assert (stamp != NULL);
+
+	memset (stamp, 0, sizeof (ConfFileStamp));
+
+	if (! statbuf)
+		return;
+
+	stamp->valid = TRUE;
+	stamp->dev = statbuf->st_dev;
+	stamp->ino = statbuf->st_ino;
+	stamp->size = statbuf->st_size;
+	stamp->mtime = statbuf->st_mtim;
+
+	if (buf)
+		stamp->digest = conf_digest (buf, len);
+}
+
+/**
+ * conf_digest:
+ * @buf: data,
+ * @len: length of @buf.
+ *
+ * Calculates the 64-bit FNV-1a hash of @buf, which is cheap compared to
+ * parsing it.
+ *
+ * Returns: non-zero digest of @buf.
+ **/
+static uint64_t
+conf_digest (const char *buf,
+	     size_t      len)
+{
+	uint64_t digest = 0xcbf29ce484222325ULL;
+
+	nih_assert (buf != NULL);
+
+	for (size_t i = 0; i < len; i++) {
+		digest ^= (unsigned char)buf[i];
+		digest *= 0x100000001b3ULL;
+	}
+
+	/* Zero means not known */
+	return digest ? digest : 1;
+}
+
+/**
+ * conf_reload_file:
+ * @session: session of caller,
+ * @path: path of configuration file.
+ *
+ * Reloads the single configuration file @path, without rescanning the
+ * rest of its configuration source; @path is relative to the root of
+ * @session if that is a chroot session.
+ *
+ * A conf file is parsed along with its best override file, as when it
+ * is modified, and an override file causes each conf file it may apply
+ * to be parsed again.  If @path no longer exists, the ConfFile for it
+ * is deleted.
+ *
+ * Parse errors are logged and not returned, as with conf_reload().
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+conf_reload_file (const Session *session,
+		  const char    *path)
+{
+	ConfSource     *source;
+	ConfFile       *file;
+	nih_local char *full_path = NULL;
+	nih_local char *name = NULL;
+	nih_local char *override_path = NULL;
+	struct stat     statbuf;
+
+	nih_assert (path != NULL);
+
+	if (path[0] != '/')
+		nih_return_error (-1, CONF_FILE_UNKNOWN,
+				  _(CONF_FILE_UNKNOWN_STR));
+
+	conf_init ();
+
+	if (session && session->chroot) {
+		full_path = NIH_MUST (nih_sprintf (NULL, "%s%s",
+						   session->chroot, path));
+	} else {
+		full_path = NIH_MUST (nih_strdup (NULL, path));
+	}
+
+	source = conf_source_for_path (session, full_path);
+	if (! source)
+		nih_return_error (-1, CONF_FILE_UNKNOWN,
+				  _(CONF_FILE_UNKNOWN_STR));
+
+	nih_info (_("Reloading configuration file %s"), full_path);
+
+	if (source->type == CONF_FILE) {
+		if (stat (source->path, &statbuf) == 0)
+			return conf_source_reload_file (source);
+
+		/* Deleted since it was loaded */
+		file = (ConfFile *)nih_hash_lookup (source->files,
+						    source->path);
+		if (file) {
+			nih_unref (file, source);
+			return 0;
+		}
+
+		nih_return_system_error (-1);
+	}
+
+	if (is_conf_file_override (full_path)) {
+		conf_reload_override (source, full_path);
+		return 0;
+	}
+
+	if (stat (full_path, &statbuf) < 0) {
+		file = (ConfFile *)nih_hash_lookup (source->files, full_path);
+		if (file && errno == ENOENT) {
+			nih_info (_("Handling deletion of %s"), file->path);
+			nih_unref (file, source);
+			return 0;
+		}
+
+		nih_return_system_error (-1);
+	}
+
+	if (conf_reload_path (source, full_path, NULL) < 0)
+		return -1;
+
+	name = conf_to_job_name (source->path, full_path);
+	override_path = conf_get_best_override (name, source);
+	if (! override_path)
+		return 0;
+
+	nih_debug ("Loading override file %s for %s",
+		   override_path, full_path);
+
+	return conf_reload_path (source, full_path, override_path);
+}
+
+/**
+ * conf_source_for_path:
+ * @session: session,
+ * @path: full path of configuration file.
+ *
+ * Finds the configuration source of @session that @path belongs to:
+ * either a file source for @path or its override file, or a directory
+ * source containing a conf or override file named @path.
+ *
+ * Returns: configuration source, or NULL if @path is not in any.
+ **/
+static ConfSource *
+conf_source_for_path (const Session *session,
+		      const char    *path)
+{
+	nih_assert (path != NULL);
+
+	NIH_LIST_FOREACH (conf_sources, iter) {
+		ConfSource     *source = (ConfSource *)iter;
+		nih_local char *override_path = NULL;
+		size_t          len;
+
+		if (source->session != session)
+			continue;
+
+		if (source->type == CONF_FILE) {
+			if (! strcmp (source->path, path))
+				return source;
+
+			if (! is_conf_file_std (source->path))
+				continue;
+
+			override_path = toggle_conf_name (NULL, source->path);
+			if (! strcmp (override_path, path))
+				return source;
+
+			continue;
+		}
+
+		len = strlen (source->path);
+		if (strncmp (source->path, path, len) || path[len] != '/')
+			continue;
+
+		if (conf_dir_path_valid (source, path))
+			return source;
+	}
+
+	return NULL;
+}
+
+/**
+ * conf_dir_path_valid:
+ * @source: directory configuration source,
+ * @path: full path of file beneath @source.
+ *
+ * Checks that @path is a conf or override file that walking @source
+ * would find.  Each component of @path below @source must be a plain
+ * name, not empty, "." or "..", so that @path cannot lead outside
+ * @source; and each must pass conf_dir_filter() as it would during the
+ * walk, so that files in ignored directories are not loaded either.
+ *
+ * Returns: TRUE if @path belongs to @source, FALSE otherwise.
+ **/
+static int
+conf_dir_path_valid (ConfSource *source,
+		     const char *path)
+{
+	nih_local char *dir = NULL;
+	const char     *name;
+	const char     *end;
+	size_t          len;
+
+	nih_assert (source != NULL);
+	nih_assert (path != NULL);
+
+	dir = NIH_MUST (nih_strdup (NULL, path));
+
+	name = path + strlen (source->path) + 1;
+	for (;;) {
+		end = strchr (name, '/');
+		len = end ? (size_t)(end - name) : strlen (name);
+
+		if ((! len)
+		    || (len == 1 && name[0] == '.')
+		    || (len == 2 && name[0] == '.' && name[1] == '.'))
+			return FALSE;
+
+		if (! end)
+			break;
+
+		dir[end - path] = '\0';
+		if (conf_dir_filter (source, dir, TRUE))
+			return FALSE;
+		dir[end - path] = '/';
+
+		name = end + 1;
+	}
+
+	return ! conf_dir_filter (source, path, FALSE);
+}
+
+/**
+ * conf_source_reload:
+ * @source: configuration source to reload.
+ *
+ * Reloads the given configuration @source.
+ *
+ * If not already established, an inotify watch is created so that future
+ * changes to this source are automatically detected and parsed.  For files,
+ * this watch is actually on the parent directory, since we need to watch
+ * out for editors that rename over the top, etc.
+ *
+ * We then parse the current state of the source.  The flag member is
+ * toggled first, and this is propagated to all new and modified files and
+ * items that we find as a result of parsing.  Once done, we scan for
+ * anything with the wrong flag, and delete them.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+conf_source_reload (ConfSource *source)
+{
+	int     ret;
+
+	nih_assert (source != NULL);
+
+	nih_info (_("Loading configuration from %s"), source->path);
+
+	/* Toggle the flag so we can detect deleted files and items. */
+	source->flag = (! source->flag);
+
+	/* Reload the source itself. */
+	switch (source->type) {
+	case CONF_FILE:
+		ret = conf_source_reload_file (source);
+		break;
+	case CONF_DIR:
+	case CONF_JOB_DIR:
+		ret = conf_source_reload_dir (source);
+		break;
+	default:
+		nih_assert_not_reached ();
+	}
+
+	/* Scan for files that have been deleted since the last time we
+	 * reloaded; these are simple to detect, as they will have the wrong
+	 * flag.
+	 */
+	conf_source_remove_stale (source);
+
+	return ret;
+}
+
+/**
+ * conf_source_remove_stale:
+ * @source: configuration source.
+ *
+ * Deletes every file in @source whose flag differs from that of @source,
+ * since it was not found when @source was last reloaded.
+ *
+ * We take them out of the files list and then we can delete the
+ * attached jobs and free the file.  We can't just do this from
+ * the one loop because to delete the jobs, we need to be able
+ * to iterate the sources and files.
+ *
+ * Returns: number of files deleted.
+ **/
+static size_t
+conf_source_remove_stale (ConfSource *source)
+{
+	NihList deleted;
+	size_t  count = 0;
+
+	nih_assert (source != NULL);
+
+	nih_list_init (&deleted);
+	NIH_HASH_FOREACH_SAFE (source->files, iter) {
+		ConfFile *file = (ConfFile *)iter;
+
+		if (file->flag != source->flag)
+			nih_list_add (&deleted, &file->entry);
+	}
+	NIH_LIST_FOREACH_SAFE (&deleted, iter) {
+		ConfFile *file = (ConfFile *)iter;
+
+		nih_info (_("Handling deletion of %s"), file->path);
+		nih_unref (file, source);
+		count++;
+	}
+
+	return count;
+}
+
+/**
+ * conf_source_reload_file:
+ * @source: configuration source to reload.
+ *
+ * Reloads the configuration file specified by @source.
+ *
+ * If not already established, an inotify watch is created on the parent
+ * directory so that future changes to the file are automatically detected
+ * and parsed.  It is the parent directory because we need to watch out for
+ * editors that rename over the top, etc.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+conf_source_reload_file (ConfSource *source)
+{
+	NihError *err = NULL;
+	nih_local char *override_path = NULL;
+
+	struct stat statbuf;
+
+	nih_assert (source != NULL);
+	nih_assert (source->type == CONF_FILE);
+
+	/* this function should only be called for standard
+	 * configuration files.
+	 */
+	if (! source->watch) {
+		nih_local char *dpath = NULL;
+		char           *dname;
+
+		dpath = NIH_MUST (nih_strdup (NULL, source->path));
+		dname = dirname (dpath);
+
+		source->watch = nih_watch_new (source, dname, FALSE, FALSE,
+					       (NihFileFilter)conf_file_filter,
+					       (NihCreateHandler)conf_create_modify_handler,
+					       (NihModifyHandler)conf_create_modify_handler,
+					       (NihDeleteHandler)conf_delete_handler,
+					       source);
+
+		/* If successful mark the file descriptor close-on-exec,
+		 * otherwise stash the error for comparison with a later
+		 * failure to parse the file.
+		 */
+		if (source->watch) {
+			nih_io_set_cloexec (source->watch->fd);
+		} else {
+			err = nih_error_steal ();
+		}
+	}
+
+	/* Parse the file itself.  If this fails, then we can discard the
+	 * inotify error, since this one will be better.
+	 */
+	if (conf_reload_path (source, source->path, NULL) < 0) {
+		if (err)
+			nih_free (err);
+
+		return -1;
+	}
+
+	/* We were able to parse the file, but were not able to set up an
+	 * inotify watch.  This isn't critical, so we just warn about it,
+	 * unless this is simply that inotify isn't supported, in which case
+	 * we do nothing.
+	 */
+	if (err) {
+		if (err->number != ENOSYS)
+			nih_warn ("%s: %s: %s", source->path,
+				  _("Unable to watch configuration file"),
+				  err->message);
+
+		nih_free (err);
+	}
+
+	if (! is_conf_file_std (source->path))
+		return 0;
+
+	override_path = toggle_conf_name (NULL, source->path);
+
+	if (lstat (override_path, &statbuf) != 0)
+		return 0;
+
+	nih_debug ("Updating configuration for %s from %s",
+		  source->path, override_path);
+	if (conf_reload_path (source, source->path, override_path) < 0) {
+		if (err)
+			nih_free (err);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * conf_source_reload_dir:
+ * @source: configuration source to reload.
+ *
+ * Reloads the configuration directory specified by @source.
+ *
+ * If not already established, an inotify watch is created on the directory
+ * so that future changes to the structure or files within it are
+ * automatically parsed.  This has the side-effect of parsing the current
+ * tree.
+ *
+ * Otherwise we walk the tree ourselves and parse all files that we find,
+ * propagating the value of the flag member to all files so that deletion
+ * can be detected by the calling function.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+conf_source_reload_dir (ConfSource *source)
+{
+	NihError *err = NULL;
+
+	nih_assert (source != NULL);
+	nih_assert (source->type != CONF_FILE);
+
+	/* Parse job files in parallel ahead of loading them below, which
+	 * then finds them in the configuration cache and only has to
+	 * register them in order.
+	 */
+	if (source->type == CONF_JOB_DIR && ! source->session)
+		conf_source_prefetch (source);
+
+	if (! source->watch) {
+		source->watch = nih_watch_new (source, source->path,
+					       TRUE, TRUE,
+					       (NihFileFilter)conf_dir_filter,
+					       (NihCreateHandler)conf_create_modify_handler,
+					       (NihModifyHandler)conf_create_modify_handler,
+					       (NihDeleteHandler)conf_delete_handler,
+					       source);
+
+		/* If successful, the directory tree will have been walked
+		 * already; so just mark the file descriptor close-on-exec
+		 * and return; otherwise we'll try and walk ourselves, so
+		 * stash the error for comparison.
+		 */
+		if (source->watch) {
+			nih_io_set_cloexec (source->watch->fd);
+			return 0;
+		} else {
+			err = nih_error_steal ();
+		}
+	}
+
+	/* We're either performing a mandatory reload, or we failed to set
+	 * up an inotify watch; walk the directory tree the old fashioned
+	 * way.  If this fails too, then we can discard the inotify error
+	 * since this one will be better.
+	 */
+	if (nih_dir_walk (source->path, (NihFileFilter)conf_dir_filter,
+			  (NihFileVisitor)conf_file_visitor, NULL,
+			  source) < 0) {
+		if (err)
+			nih_free (err);
+
+		return -1;
+	}
+
+	/* We were able to walk the directory, but were not able to set up
+	 * an inotify watch.  This isn't critical, so we just warn about it,
+	 * unless this is simply that inotify isn't supported, in which case
+	 * we do nothing.
+	 */
+	if (err) {
+		if (err->number != ENOSYS)
+			nih_warn ("%s: %s: %s", source->path,
+				  _("Unable to watch configuration directory"),
+				  err->message);
+
+		nih_free (err);
+	}
+
+	return 0;
+}
+
+
+/**
+ * conf_parse_worker_count:
+ * @files: number of files to parse.
+ *
+ * Determine how many processes @files job configuration files should be
+ * parsed in, according to conf_parse_workers and the number of online
+ * CPUs.
+ *
+ * Returns: number of processes, less than two if @files should be
+ * parsed by init itself.
+ **/
+static int
+conf_parse_worker_count (size_t files)
+{
+	long workers = conf_parse_workers;
+
+	if (workers < 0)
+		workers = sysconf (_SC_NPROCESSORS_ONLN);
+
+	if (workers < 1)
+		return 0;
+
+	if (workers > CONF_PARSE_WORKERS_MAX)
+		workers = CONF_PARSE_WORKERS_MAX;
+
+	if ((size_t)workers > files / CONF_PARSE_WORKER_FILES)
+		workers = files / CONF_PARSE_WORKER_FILES;
+
+	return (int)workers;
+}
+
+/**
+ * conf_source_prefetch:
+ * @source: configuration source.
+ *
+ * Parses the job configuration files in @source that are not already in
+ * the configuration cache in a pool of child processes, adding the
+ * resulting job classes to the cache.
+ *
+ * Parsing needs nothing from init beyond the file, so it can be spread
+ * across processes; the job classes are only registered afterwards, in
+ * the usual order, when each file is loaded and found in the cache.
+ * Files that could not be parsed, or whose details have changed since,
+ * are simply parsed again by init itself so that any errors are
+ * reported as normal.
+ *
+ * Nothing is done if there is no configuration cache (that is, outside
+ * of conf_reload()) or there are too few files to be worth it.
+ **/
+static void
+conf_source_prefetch (ConfSource *source)
+{
+	nih_local ConfPrefetch *prefetch = NULL;
+	NihIoBuffer            *buffers[CONF_PARSE_WORKERS_MAX];
+	struct pollfd           fds[CONF_PARSE_WORKERS_MAX];
+	pid_t                   pids[CONF_PARSE_WORKERS_MAX];
+	int                     workers;
+	int                     started = 0;
+	int                     running;
+	size_t                  cached;
+	int64_t                 start;
+
+	nih_assert (source != NULL);
+	nih_assert (source->type == CONF_JOB_DIR);
+	nih_assert (! source->session);
+
+	if (! conf_cache || ! conf_parse_workers)
+		return;
+
+	start = conf_cache_clock ();
+
+	prefetch = NIH_MUST (nih_new (NULL, ConfPrefetch));
+	prefetch->source = source;
+	prefetch->paths = NULL;
+	prefetch->stats = NULL;
+	prefetch->count = 0;
+
+	if (nih_dir_walk (source->path, (NihFileFilter)conf_prefetch_filter,
+			  (NihFileVisitor)conf_prefetch_visitor, NULL,
+			  prefetch) < 0) {
+		nih_free (nih_error_get ());
+		return;
+	}
+
+	workers = conf_parse_worker_count (prefetch->count);
+	if (workers < 2)
+		return;
+
+	/* Any files left to a worker that could not be started are
+	 * parsed by init itself.
+	 */
+	for (int i = 0; i < workers; i++) {
+		int   pipefds[2];
+		pid_t pid;
+
+		if (pipe (pipefds) < 0)
+			break;
+
+		pid = fork ();
+		if (pid < 0) {
+			close (pipefds[0]);
+			close (pipefds[1]);
+			break;
+		} else if (! pid) {
+			close (pipefds[0]);
+			conf_prefetch_worker (prefetch, i, workers, pipefds[1]);
+		}
+
+		close (pipefds[1]);
+
+		buffers[started] = NIH_MUST (nih_io_buffer_new (prefetch));
+		fds[started].fd = pipefds[0];
+		fds[started].events = POLLIN;
+		pids[started] = pid;
+		started++;
+	}
+
+	/* Read from all workers at once so that none blocks on a full
+	 * pipe.
+	 */
+	running = started;
+	while (running) {
+		if (poll (fds, started, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		for (int i = 0; i < started; i++) {
+			NihIoBuffer *buffer = buffers[i];
+			ssize_t      len;
+
+			if (fds[i].fd < 0 || ! fds[i].revents)
+				continue;
+
+			NIH_ZERO (nih_io_buffer_resize (buffer,
+							CONF_PARSE_READ_SIZE));
+
+			len = read (fds[i].fd, buffer->buf + buffer->len,
+				    buffer->size - buffer->len);
+			if (len > 0) {
+				buffer->len += len;
+			} else if (len < 0 && errno == EINTR) {
+				continue;
+			} else {
+				close (fds[i].fd);
+				fds[i].fd = -1;
+				running--;
+			}
+		}
+	}
+
+	cached = hash_count (conf_cache);
+
+	for (int i = 0; i < started; i++) {
+		pid_t pid;
+		int   status;
+
+		if (fds[i].fd >= 0)
+			close (fds[i].fd);
+
+		do {
+			pid = waitpid (pids[i], &status, 0);
+		} while (pid < 0 && errno == EINTR);
+
+		if (pid < 0 || ! WIFEXITED (status) || WEXITSTATUS (status))
+			continue;
+
+		if (conf_cache_merge (buffers[i]->buf, buffers[i]->len) < 0)
+			nih_free (nih_error_get ());
+	}
+
+	nih_debug ("Parsed %zu of %zu job files in %s using %d processes "
+		   "in %.3fms", hash_count (conf_cache) - cached,
+		   prefetch->count, source->path, started,
+		   (conf_cache_clock () - start) / 1000000.0);
+}
+
+/**
+ * conf_prefetch_filter:
+ * @prefetch: files to parse,
+ * @path: path to check,
+ * @is_dir: TRUE if @path is a directory.
+ *
+ * Filters the files found by conf_source_prefetch() in the same way as
+ * conf_dir_filter().
+ *
+ * Returns: TRUE if @path should be ignored, FALSE otherwise.
+ **/
+static int
+conf_prefetch_filter (ConfPrefetch *prefetch,
+		      const char   *path,
+		      int           is_dir)
+{
+	nih_assert (prefetch != NULL);
+
+	return conf_dir_filter (prefetch->source, path, is_dir);
+}
+
+/**
+ * conf_prefetch_visitor:
+ * @prefetch: files to parse,
+ * @dirname: top-level directory being walked,
+ * @path: path found in directory,
+ * @statbuf: stat of @path.
+ *
+ * Adds @path to the files to be parsed by conf_source_prefetch() if it
+ * is a job configuration file that is not already in the configuration
+ * cache.
+ *
+ * Returns: always zero.
+ **/
+static int
+conf_prefetch_visitor (ConfPrefetch *prefetch,
+		       const char   *dirname,
+		       const char   *path,
+		       struct stat  *statbuf)
+{
+	nih_assert (prefetch != NULL);
+	nih_assert (path != NULL);
+	nih_assert (statbuf != NULL);
+
+	if (! S_ISREG (statbuf->st_mode) || ! is_conf_file_std (path))
+		return 0;
+
+	if (conf_cache_valid (path, statbuf))
+		return 0;
+
+	NIH_MUST (nih_str_array_add (&prefetch->paths, prefetch,
+				     &prefetch->count, path));
+
+	prefetch->stats = NIH_MUST (nih_realloc (prefetch->stats, prefetch,
+						 sizeof (struct stat) * prefetch->count));
+	prefetch->stats[prefetch->count - 1] = *statbuf;
+
+	return 0;
+}
+
+/**
+ * conf_prefetch_worker:
+ * @prefetch: files to parse,
+ * @worker: index of this worker,
+ * @workers: number of workers,
+ * @fd: file descriptor to write results to.
+ *
+ * Called in a child process to parse every @workers'th file in @prefetch
+ * starting with the @worker'th, and write the resulting job classes to
+ * @fd as a configuration cache.  Files that cannot be read or parsed are
+ * skipped.
+ *
+ * Does not return.
+ **/
+static void
+conf_prefetch_worker (ConfPrefetch *prefetch,
+		      int           worker,
+		      int           workers,
+		      int           fd)
 {
-	NihError *err = NULL;
+	nih_local char *data = NULL;
+	const char     *p;
+	size_t          len = 0;
 
-	nih_assert (source != NULL);
-	nih_assert (source->type != CONF_FILE);
+	nih_assert (prefetch != NULL);
+	nih_assert (workers > 0);
+	nih_assert (fd >= 0);
 
-	if (! source->watch) {
-		source->watch = nih_watch_new (source, source->path,
-					       TRUE, TRUE,
-					       (NihFileFilter)conf_dir_filter,
-					       (NihCreateHandler)conf_create_modify_handler,
-					       (NihModifyHandler)conf_create_modify_handler,
-					       (NihDeleteHandler)conf_delete_handler,
-					       source);
+	nih_signal_reset ();
 
-		/* If successful, the directory tree will have been walked
-		 * already; so just mark the file descriptor close-on-exec
-		 * and return; otherwise we'll try and walk ourselves, so
-		 * stash the error for comparison.
-		 */
-		if (source->watch) {
-			nih_io_set_cloexec (source->watch->fd);
-			return 0;
-		} else {
-			err = nih_error_steal ();
+	/* Results are collected in a cache of our own, rather than
+	 * added to the one inherited from init.
+	 */
+	conf_cache = NULL;
+	conf_cache_init ();
+
+	for (size_t i = (size_t)worker; i < prefetch->count; i += (size_t)workers) {
+		nih_local char *buf = NULL;
+		nih_local char *name = NULL;
+		JobClass       *class;
+		size_t          buflen, pos = 0, lineno = 1;
+		int64_t         start;
+
+		start = conf_cache_clock ();
+
+		buf = nih_file_read (NULL, prefetch->paths[i], &buflen);
+		if (! buf) {
+			nih_free (nih_error_get ());
+			continue;
 		}
-	}
 
-	/* We're either performing a mandatory reload, or we failed to set
-	 * up an inotify watch; walk the directory tree the old fashioned
-	 * way.  If this fails too, then we can discard the inotify error
-	 * since this one will be better.
-	 */
-	if (nih_dir_walk (source->path, (NihFileFilter)conf_dir_filter,
-			  (NihFileVisitor)conf_file_visitor, NULL,
-			  source) < 0) {
-		if (err)
-			nih_free (err);
+		name = conf_to_job_name (prefetch->source->path,
+					 prefetch->paths[i]);
 
-		return -1;
+		class = parse_job (NULL, NULL, NULL, name, buf, buflen,
+				   &pos, &lineno);
+		if (! class) {
+			nih_free (nih_error_get ());
+			continue;
+		}
+
+		conf_cache_store (prefetch->paths[i], &prefetch->stats[i],
+				  class, conf_cache_clock () - start);
+		nih_free (class);
 	}
 
-	/* We were able to walk the directory, but were not able to set up
-	 * an inotify watch.  This isn't critical, so we just warn about it,
-	 * unless this is simply that inotify isn't supported, in which case
-	 * we do nothing.
-	 */
-	if (err) {
-		if (err->number != ENOSYS)
-			nih_warn ("%s: %s: %s", source->path,
-				  _("Unable to watch configuration directory"),
-				  err->message);
+	data = conf_cache_to_data (NULL, &len);
+	if (! data)
+		_exit (1);
 
-		nih_free (err);
+	p = data;
+	while (len) {
+		ssize_t bytes;
+
+		bytes = write (fd, p, len);
+		if (bytes > 0) {
+			p += bytes;
+			len -= (size_t)bytes;
+		} else if (! bytes || errno != EINTR) {
+			_exit (1);
+		}
 	}
 
-	return 0;
+	_exit (0);
 }
 
 
@@ -901,10 +2158,6 @@ conf_create_modify_handler (ConfSource  *source,
 			    const char  *path,
 			    struct stat *statbuf)
 {
-	ConfFile *file = NULL;
-	char *config_path = NULL;
-	nih_local char *job_name = NULL;
-
 	nih_assert (source != NULL);
 	nih_assert (watch != NULL);
 	nih_assert (path != NULL);
@@ -917,6 +2170,12 @@ conf_create_modify_handler (ConfSource  *source,
 	if (! is_conf_file (path))
 		return;
 
+	/* Reload once the changes have been coalesced, unless called
+	 * for the existing files while the watch is being established.
+	 */
+	if (source->watch && conf_pending_add (source, path))
+		return;
+
         /* For config file, load it and it's override file */
 	if (is_conf_file_std (path)) {
 		conf_load_path_with_override (source, path);
@@ -924,6 +2183,35 @@ conf_create_modify_handler (ConfSource  *source,
 	}
 
 	/* For override files, reload all matching conf+override combos */
+	conf_reload_override (source, path, NULL);
+}
+
+/**
+ * conf_reload_override:
+ * @source: configuration source,
+ * @path: full path to override file,
+ * @done: conf files already reloaded, or NULL.
+ *
+ * Reloads every conf file in any directory source that the override
+ * file @path in @source may apply to, along with its best override file;
+ * this handles the creation, modification and deletion of @path alike.
+ *
+ * If @done is not NULL, conf files in it are skipped since they were
+ * reloaded with their current override already, and those reloaded are
+ * added to it.
+ **/
+static void
+conf_reload_override (ConfSource *source,
+		      const char *path,
+		      NihHash    *done)
+{
+	ConfFile *file = NULL;
+	char *config_path = NULL;
+	nih_local char *job_name = NULL;
+
+	nih_assert (source != NULL);
+	nih_assert (path != NULL);
+
 	job_name = conf_to_job_name (source->path, path);
 	NIH_LIST_FOREACH (conf_sources, iter) {
 		ConfSource *source = (ConfSource *)iter;
@@ -933,14 +2221,39 @@ conf_create_modify_handler (ConfSource  *source,
 
 		config_path = NIH_MUST (nih_sprintf (NULL, "%s/%s%s", source->path, job_name, CONF_EXT_STD));
 		file = (ConfFile *)nih_hash_lookup (source->files, config_path);
-		if (file) {
+		if (file && done && nih_hash_lookup (done, config_path)) {
+			conf_coalesce_saved++;
+		} else if (file) {
 			/* Find its override file and reload both */
 			conf_load_path_with_override (source, config_path);
+
+			if (done)
+				conf_mark_done (done, config_path);
 		}
 		nih_free (config_path);
 	}
+}
 
-	return;
+/**
+ * conf_mark_done:
+ * @done: hash table of paths,
+ * @path: path to add.
+ *
+ * Adds @path to @done, a hash table of NihListEntry structures.
+ **/
+static void
+conf_mark_done (NihHash    *done,
+		const char *path)
+{
+	NihListEntry *entry;
+
+	nih_assert (done != NULL);
+	nih_assert (path != NULL);
+
+	entry = NIH_MUST (nih_list_entry_new (done));
+	entry->str = NIH_MUST (nih_strdup (entry, path));
+
+	nih_hash_add (done, &entry->entry);
 }
 
 /**
@@ -990,6 +2303,10 @@ conf_delete_handler (ConfSource *source,
 		return;
 	}
 
+	/* Reload once the changes have been coalesced */
+	if (conf_pending_add (source, path))
+		return;
+
 	/* non-override files (and directories) are the simple case, so handle
 	 * them and leave.
 	 */
@@ -1007,6 +2324,270 @@ conf_delete_handler (ConfSource *source,
 	conf_create_modify_handler (source, watch, path, NULL);
 }
 
+/**
+ * conf_pending_add:
+ * @source: configuration source,
+ * @path: full path to created, modified or deleted file.
+ *
+ * Defers reloading @path until the end of the coalescing window begun
+ * by the first change to any configuration file, merging further changes
+ * to @path in the meantime; what is done is then decided from the state
+ * of @path at that time by conf_reload_pending().
+ *
+ * Returns: TRUE if reloading @path was deferred, FALSE if it should be
+ * reloaded immediately.
+ **/
+static int
+conf_pending_add (ConfSource *source,
+		  const char *path)
+{
+	ConfPending *pending;
+
+	nih_assert (source != NULL);
+	nih_assert (path != NULL);
+
+	if (conf_coalesce_window <= 0)
+		return FALSE;
+
+	if (! conf_pending)
+		conf_pending = NIH_MUST (nih_hash_string_new (NULL, 0));
+
+	pending = (ConfPending *)nih_hash_lookup (conf_pending, path);
+	if (pending) {
+		nih_debug ("Coalesced change to %s", path);
+
+		conf_coalesce_events++;
+		conf_coalesce_saved++;
+		return TRUE;
+	}
+
+	/* The first change starts the window */
+	if ((! hash_count (conf_pending)) && conf_pending_arm (TRUE) < 0) {
+		nih_warn ("%s: %s", _("Unable to coalesce configuration changes"),
+			  strerror (errno));
+		return FALSE;
+	}
+
+	conf_coalesce_events++;
+
+	pending = NIH_MUST (nih_new (source, ConfPending));
+
+	nih_list_init (&pending->entry);
+
+	pending->path = NIH_MUST (nih_strdup (pending, path));
+	pending->source = source;
+
+	nih_alloc_set_destructor (pending, conf_pending_destroy);
+
+	nih_hash_add (conf_pending, &pending->entry);
+
+	return TRUE;
+}
+
+/**
+ * conf_pending_destroy:
+ * @pending: pending reload to be destroyed.
+ *
+ * Removes @pending from the list it is in, whether that is the hash
+ * table of pending reloads or not; called when freed, including along
+ * with its source.
+ *
+ * Returns: zero.
+ **/
+static int
+conf_pending_destroy (ConfPending *pending)
+{
+	nih_assert (pending != NULL);
+
+	nih_list_destroy (&pending->entry);
+
+	return 0;
+}
+
+/**
+ * conf_pending_arm:
+ * @arm: TRUE to start the coalescing window, FALSE to cancel it.
+ *
+ * Sets conf_pending_fd to expire once conf_coalesce_window milliseconds
+ * have passed, creating it and watching it in the main loop if need be,
+ * or stops it from expiring.
+ *
+ * Returns: zero on success, negative value with errno set on error.
+ **/
+static int
+conf_pending_arm (int arm)
+{
+	struct itimerspec value;
+
+	if (conf_pending_fd < 0) {
+		if (! arm)
+			return 0;
+
+		conf_pending_fd = timerfd_create (CLOCK_MONOTONIC,
+						  TFD_NONBLOCK | TFD_CLOEXEC);
+		if (conf_pending_fd < 0)
+			return -1;
+
+		NIH_MUST (nih_io_add_watch (NULL, conf_pending_fd,
+					    NIH_IO_READ, conf_pending_watcher,
+					    NULL));
+	}
+
+	memset (&value, 0, sizeof (value));
+
+	if (arm) {
+		value.it_value.tv_sec = conf_coalesce_window / 1000;
+		value.it_value.tv_nsec = (conf_coalesce_window % 1000) * 1000000;
+	}
+
+	return timerfd_settime (conf_pending_fd, 0, &value, NULL);
+}
+
+/**
+ * conf_pending_watcher:
+ * @data: not used,
+ * @watch: NihIoWatch for conf_pending_fd,
+ * @events: events that occurred.
+ *
+ * Called when the coalescing window ends to reload the files changed
+ * within it.
+ **/
+static void
+conf_pending_watcher (void        *data,
+		      NihIoWatch  *watch,
+		      NihIoEvents  events)
+{
+	uint64_t expirations;
+	ssize_t  len;
+
+	nih_assert (watch != NULL);
+
+	do {
+		len = read (watch->fd, &expirations, sizeof (expirations));
+	} while (len < 0 && errno == EINTR);
+
+	/* Not yet expired */
+	if (len != sizeof (expirations))
+		return;
+
+	conf_flush_pending ();
+}
+
+/**
+ * conf_flush_pending:
+ *
+ * Reloads every configuration file with changes waiting to be coalesced
+ * now, rather than at the end of the coalescing window.  Called before
+ * any request that looks up jobs or emits events, so that coalescing is
+ * never seen by a client that installs a job and then uses it.
+ *
+ * Conf files are reloaded before override files so that a conf file
+ * changed along with its override file, as when a package is upgraded,
+ * is only reloaded once.
+ **/
+void
+conf_flush_pending (void)
+{
+	NihList            ready;
+	nih_local NihHash *done = NULL;
+
+	if (! conf_pending)
+		return;
+
+	(void)conf_pending_arm (FALSE);
+
+	nih_list_init (&ready);
+	NIH_HASH_FOREACH_SAFE (conf_pending, iter)
+		nih_list_add (&ready, iter);
+
+	done = NIH_MUST (nih_hash_string_new (NULL, 0));
+
+	NIH_LIST_FOREACH_SAFE (&ready, iter) {
+		ConfPending *pending = (ConfPending *)iter;
+
+		if (is_conf_file_override (pending->path))
+			continue;
+
+		conf_reload_pending (pending->source, pending->path, done);
+		nih_free (pending);
+	}
+
+	NIH_LIST_FOREACH_SAFE (&ready, iter) {
+		ConfPending *pending = (ConfPending *)iter;
+
+		conf_reload_pending (pending->source, pending->path, done);
+		nih_free (pending);
+	}
+}
+
+/**
+ * conf_pending_discard:
+ *
+ * Forgets every configuration file with changes waiting to be coalesced,
+ * since a full reload is about to reload them anyway.
+ **/
+static void
+conf_pending_discard (void)
+{
+	if (! conf_pending)
+		return;
+
+	(void)conf_pending_arm (FALSE);
+
+	NIH_HASH_FOREACH_SAFE (conf_pending, iter) {
+		ConfPending *pending = (ConfPending *)iter;
+
+		conf_coalesce_saved++;
+		nih_free (pending);
+	}
+}
+
+/**
+ * conf_reload_pending:
+ * @source: configuration source,
+ * @path: full path to changed file,
+ * @done: conf files already reloaded.
+ *
+ * Reloads @path after its changes have been coalesced, according to
+ * whether it now exists: a conf file is reloaded with its override file
+ * or deleted, and the conf files an override file applies to are
+ * reloaded.  Conf files reloaded are added to @done.
+ **/
+static void
+conf_reload_pending (ConfSource *source,
+		     const char *path,
+		     NihHash    *done)
+{
+	ConfFile    *file;
+	struct stat  statbuf;
+	int          exists;
+
+	nih_assert (source != NULL);
+	nih_assert (path != NULL);
+	nih_assert (done != NULL);
+
+	exists = (lstat (path, &statbuf) == 0);
+
+	/* note that symbolic links are ignored */
+	if (exists && ! S_ISREG (statbuf.st_mode))
+		return;
+
+	if (is_conf_file_override (path)) {
+		conf_reload_override (source, path, done);
+		return;
+	}
+
+	if (exists) {
+		conf_load_path_with_override (source, path);
+		conf_mark_done (done, path);
+		return;
+	}
+
+	file = (ConfFile *)nih_hash_lookup (source->files, path);
+	if (file)
+		nih_unref (file, source);
+}
+
 /**
  * conf_file_visitor:
  * @source: configuration source,
@@ -1073,15 +2654,37 @@ conf_reload_path (ConfSource *source,
 	ConfFile       *orig = NULL;
 	nih_local char *buf = NULL;
 	nih_local char *name = NULL;
-	size_t          len, pos, lineno;
+	size_t          len = 0, pos, lineno;
 	NihError       *err = NULL;
 	const char     *path_to_load;
+	struct stat     statbuf;
+	int             have_stat;
+	int             cacheable = FALSE;
+	JobClass       *cached = NULL;
+	int64_t         start = 0;
 
 	nih_assert (source != NULL);
 	nih_assert (path != NULL);
 
 	path_to_load = (override_path ? override_path : path);
 
+	/* Taken before reading the file, so that a change made in between
+	 * is detected by conf_reload_changed() rather than missed.
+	 */
+	have_stat = (stat (path_to_load, &statbuf) == 0);
+
+	/* System job definitions (but not overrides, which are applied on
+	 * top of them) may be loaded from the configuration cache if they
+	 * have not changed since they were parsed.
+	 */
+	if (have_stat && conf_cache && source->type == CONF_JOB_DIR
+	    && ! source->session && ! override_path) {
+		cacheable = TRUE;
+
+		name = conf_to_job_name (source->path, path);
+		cached = conf_cache_lookup (path, &statbuf, name);
+	}
+
 	/* If there is no corresponding override file, look up the old
 	 * conf file in memory, and then free it. In cases of failure,
 	 * we discard it anyway, so there's no particular reason
@@ -1128,21 +2731,23 @@ conf_reload_path (ConfSource *source,
 	 * bother creating a new ConfFile structure for it and bail out
 	 * now.
 	 */
-	buf = nih_file_read (NULL, path_to_load, &len);
-	if (! buf) {
-		if (! override_path && orig) {
-			/* Failed to reload the file from disk in all
-			 * likelihood because the configuration file was
-			 * deleted.
-			 *
-			 * Allow the ConfFile to be cleaned up taking
-			 * its JobClass (and possibly events that
-			 * JobClass was referencing) with it.
-			 */
-			nih_unref (orig, source);
+	if (! cached) {
+		buf = nih_file_read (NULL, path_to_load, &len);
+		if (! buf) {
+			if (! override_path && orig) {
+				/* Failed to reload the file from disk in all
+				 * likelihood because the configuration file
+				 * was deleted.
+				 *
+				 * Allow the ConfFile to be cleaned up taking
+				 * its JobClass (and possibly events that
+				 * JobClass was referencing) with it.
+				 */
+				nih_unref (orig, source);
+			}
+
+			return -1;
 		}
-
-		return -1;
 	}
 
 	/* Create a new ConfFile structure (if no @override_path specified) */
@@ -1150,6 +2755,18 @@ conf_reload_path (ConfSource *source,
 	if (! file)
 		file = NIH_MUST (conf_file_new (source, path));
 
+	if (override_path) {
+		if (file->override_path)
+			nih_free (file->override_path);
+		file->override_path = NIH_MUST (nih_strdup (file, override_path));
+
+		conf_file_stamp_set (&file->override,
+				     have_stat ? &statbuf : NULL, buf, len);
+	} else {
+		conf_file_stamp_set (&file->stamp,
+				     have_stat ? &statbuf : NULL, buf, len);
+	}
+
 	pos = 0;
 	lineno = 1;
 
@@ -1171,7 +2788,16 @@ conf_reload_path (ConfSource *source,
 		break;
 	case CONF_JOB_DIR:
 
-		name = conf_to_job_name (source->path, path);
+		if (! name)
+			name = conf_to_job_name (source->path, path);
+
+		if (cached) {
+			nih_debug ("Loading %s from cache of %s", name, path);
+
+			file->job = cached;
+			job_class_consider (file->job);
+			break;
+		}
 
 		/* Create a new job item and parse the buffer to produce
 		 * the job definition.
@@ -1183,9 +2809,16 @@ conf_reload_path (ConfSource *source,
 			nih_debug ("Loading %s from %s", name, path);
 		}
 
+		if (cacheable && conf_cache_file)
+			start = conf_cache_clock ();
+
 		file->job = parse_job (NULL, source->session, file->job,
 				name, buf, len, &pos, &lineno);
 
+		if (cacheable && conf_cache_file && file->job)
+			conf_cache_store (path, &statbuf, file->job,
+					  conf_cache_clock () - start);
+
 		/* Allow the original ConfFile which has now been replaced to be
 		 * destroyed which will also cause the original JobClass to be
 		 * freed.
@@ -1201,6 +2834,19 @@ conf_reload_path (ConfSource *source,
 		nih_assert_not_reached ();
 	}
 
+	/* Look up the user and group a job runs as now, so that one that
+	 * doesn't exist is reported when the job is loaded rather than
+	 * each time it is started.
+	 */
+	if (file->job && (file->job->setuid || file->job->setgid)
+	    && (job_class_credentials (file->job) < 0)) {
+		NihError *cred_err;
+
+		cred_err = nih_error_get ();
+		nih_warn ("%s: %s", path, cred_err->message);
+		nih_free (cred_err);
+	}
+
 	/* Finally, allow the original ConfFile to be destroyed without
 	 * affecting the new JobClass.
 	 */
@@ -1810,12 +3456,24 @@ error:
 ssize_t
 conf_source_get_index (const ConfSource *source)
 {
-	ssize_t i = 0;
+	StateIndex *index;
+	ssize_t     i = 0;
 
 	nih_assert (source);
 
 	conf_init ();
 
+	/* Sources are normally looked up by the pointer held in their
+	 * ConfFiles, so try that first.
+	 */
+	index = state_index (STATE_INDEX_CONF_SOURCES);
+	if (index) {
+		i = state_index_find (index, source);
+		if (i >= 0)
+			return i;
+		i = 0;
+	}
+
 	NIH_LIST_FOREACH (conf_sources, iter) {
 		ConfSource *s = (ConfSource *)iter;
 
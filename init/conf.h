@@ -20,6 +20,11 @@
 #ifndef INIT_CONF_H
 #define INIT_CONF_H
 
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <time.h>
+
 #include <nih/macros.h>
 
 #include <nih/hash.h>
@@ -30,6 +35,39 @@
 #include "job_class.h"
 
 
+/**
+ * CONF_PARSE_WORKERS_MAX:
+ *
+ * Maximum number of processes that job configuration is parsed in.
+ **/
+#define CONF_PARSE_WORKERS_MAX 8
+
+/**
+ * CONF_PARSE_WORKER_FILES:
+ *
+ * Minimum number of job configuration files given to each process
+ * parsing them; fewer files are not worth the cost of the process and
+ * are parsed by init itself.
+ **/
+#define CONF_PARSE_WORKER_FILES 16
+
+/**
+ * CONF_PARSE_READ_SIZE:
+ *
+ * Number of bytes read at a time from processes parsing job
+ * configuration.
+ **/
+#define CONF_PARSE_READ_SIZE 65536
+
+/**
+ * CONF_COALESCE_WINDOW:
+ *
+ * Default number of milliseconds over which changes to a configuration
+ * file are coalesced before it is reloaded.
+ **/
+#define CONF_COALESCE_WINDOW 100
+
+
 /**
  * ConfSourceType:
  *
@@ -76,12 +114,36 @@ typedef struct conf_source {
 	NihHash            *files;
 } ConfSource;
 
+/**
+ * ConfFileStamp:
+ * @valid: TRUE if the remaining members are set,
+ * @dev: device of file,
+ * @ino: inode number of file,
+ * @size: size of file,
+ * @mtime: modification time of file,
+ * @digest: digest of the contents of file, or zero if not known.
+ *
+ * Identifies the contents of a file as it was when last parsed, so that
+ * conf_reload_changed() can tell whether it needs to be parsed again.
+ **/
+typedef struct conf_file_stamp {
+	int             valid;
+	dev_t           dev;
+	ino_t           ino;
+	off_t           size;
+	struct timespec mtime;
+	uint64_t        digest;
+} ConfFileStamp;
+
 /**
  * ConfFile:
  * @entry: list header,
  * @path: path to file,
  * @source: configuration source,
  * @flag: reload flag,
+ * @stamp: contents of @path when last parsed,
+ * @override_path: override file last applied, or NULL,
+ * @override: contents of @override_path when last parsed,
  * @data: pointer to actual item.
  *
  * This structure represents a file within @source and links to the item
@@ -93,11 +155,15 @@ typedef struct conf_source {
  * the wrong flag value.
  **/
 typedef struct conf_file {
-	NihList     entry;
-	char       *path;
+	NihList        entry;
+	char          *path;
+
+	ConfSource    *source;
+	int            flag;
 
-	ConfSource *source;
-	int         flag;
+	ConfFileStamp  stamp;
+	char          *override_path;
+	ConfFileStamp  override;
 
 	union {
 		void     *data;
@@ -105,10 +171,30 @@ typedef struct conf_file {
 	};
 } ConfFile;
 
+/**
+ * ConfReloadSummary:
+ * @added: number of files parsed for the first time,
+ * @modified: number of files parsed again since they had changed,
+ * @removed: number of files that no longer exist,
+ * @unchanged: number of files that did not need to be parsed again.
+ *
+ * Describes the outcome of conf_reload_changed().
+ **/
+typedef struct conf_reload_summary {
+	size_t added;
+	size_t modified;
+	size_t removed;
+	size_t unchanged;
+} ConfReloadSummary;
+
 
 NIH_BEGIN_EXTERN
 
 extern NihList *conf_sources;
+extern int      conf_parse_workers;
+extern int      conf_coalesce_window;
+extern size_t   conf_coalesce_events;
+extern size_t   conf_coalesce_saved;
 
 
 void        conf_init          (void);
@@ -121,8 +207,12 @@ ConfFile *  conf_file_new      (ConfSource *source, const char *path)
 	__attribute__ ((warn_unused_result));
 
 void        conf_reload        (void);
+void        conf_reload_changed (ConfReloadSummary *summary);
+int         conf_reload_file   (const Session *session, const char *path)
+	__attribute__ ((warn_unused_result));
 int         conf_source_reload (ConfSource *source)
 	__attribute__ ((warn_unused_result));
+void        conf_flush_pending (void);
 
 int         conf_file_destroy  (ConfFile *file);
 
@@ -0,0 +1,843 @@
+/* upstart
+ *
+ * conf_cache.c - cache of parsed job configuration
+ *
+ * Copyright © 2015 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/string.h>
+#include <nih/file.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "conf_cache.h"
+#include "job_class.h"
+#include "state.h"
+#include "hash.h"
+#include "errors.h"
+
+
+/* Prototypes for static functions */
+static int             conf_cache_entry_destroy     (ConfCacheEntry *entry);
+static ConfCacheEntry *conf_cache_entry_new         (const char *path,
+						     const struct stat *statbuf)
+	__attribute__ ((warn_unused_result));
+static json_object *   conf_cache_entry_serialise   (const ConfCacheEntry *entry)
+	__attribute__ ((warn_unused_result));
+static ConfCacheEntry *conf_cache_entry_deserialise (json_object *json)
+	__attribute__ ((warn_unused_result));
+static int             conf_cache_entry_matches     (const ConfCacheEntry *entry,
+						     const struct stat *statbuf)
+	__attribute__ ((warn_unused_result));
+
+
+/* Settings that affect how job configuration is parsed */
+extern int default_console;
+extern int debug_stanza_enabled;
+
+
+/**
+ * conf_cache_file:
+ *
+ * Path to the configuration cache, or NULL if parsed configuration
+ * should not be cached.
+ **/
+char *conf_cache_file = NULL;
+
+/**
+ * conf_cache:
+ *
+ * Hash table of ConfCacheEntry structures indexed by path; only
+ * present while conf_reload() is running.
+ **/
+NihHash *conf_cache = NULL;
+
+/**
+ * conf_cache_hits:
+ *
+ * Number of job configuration files loaded from the cache since it was
+ * last loaded.
+ **/
+size_t conf_cache_hits = 0;
+
+/**
+ * conf_cache_misses:
+ *
+ * Number of job configuration files parsed since the cache was last
+ * loaded.
+ **/
+size_t conf_cache_misses = 0;
+
+/**
+ * conf_cache_saved:
+ *
+ * Nanoseconds of parsing avoided by loading from the cache since it was
+ * last loaded, less the time taken to do so.
+ **/
+int64_t conf_cache_saved = 0;
+
+/**
+ * conf_cache_dirty:
+ *
+ * TRUE if the cache held in memory differs from that on disk.
+ **/
+static int conf_cache_dirty = FALSE;
+
+
+/**
+ * conf_cache_clock:
+ *
+ * Returns: monotonic time in nanoseconds, for measuring parse times.
+ **/
+int64_t
+conf_cache_clock (void)
+{
+	struct timespec now;
+
+	(void)clock_gettime (CLOCK_MONOTONIC, &now);
+
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+/**
+ * conf_cache_entry_new:
+ * @path: path to job configuration file,
+ * @statbuf: details of @path.
+ *
+ * Allocates a new ConfCacheEntry for @path, valid for as long as @path
+ * matches @statbuf, and adds it to the cache.
+ *
+ * Returns: newly allocated ConfCacheEntry or NULL if insufficient memory.
+ **/
+static ConfCacheEntry *
+conf_cache_entry_new (const char        *path,
+		      const struct stat *statbuf)
+{
+	ConfCacheEntry *entry;
+
+	nih_assert (conf_cache);
+	nih_assert (path);
+	nih_assert (statbuf);
+
+	entry = nih_new (conf_cache, ConfCacheEntry);
+	if (! entry)
+		return NULL;
+
+	nih_list_init (&entry->entry);
+
+	entry->path = nih_strdup (entry, path);
+	if (! entry->path) {
+		nih_free (entry);
+		return NULL;
+	}
+
+	entry->dev = (int64_t)statbuf->st_dev;
+	entry->ino = (int64_t)statbuf->st_ino;
+	entry->size = (int64_t)statbuf->st_size;
+	entry->mtime_sec = (int64_t)statbuf->st_mtim.tv_sec;
+	entry->mtime_nsec = (int64_t)statbuf->st_mtim.tv_nsec;
+
+	entry->parse_time = 0;
+	entry->used = FALSE;
+	entry->json = NULL;
+
+	nih_alloc_set_destructor (entry, conf_cache_entry_destroy);
+
+	nih_hash_add (conf_cache, &entry->entry);
+
+	return entry;
+}
+
+/**
+ * conf_cache_entry_destroy:
+ * @entry: entry to be destroyed.
+ *
+ * Removes @entry from the cache and releases its JSON.
+ *
+ * Returns: zero.
+ **/
+static int
+conf_cache_entry_destroy (ConfCacheEntry *entry)
+{
+	nih_assert (entry);
+
+	nih_list_destroy (&entry->entry);
+
+	if (entry->json)
+		json_object_put (entry->json);
+
+	return 0;
+}
+
+/**
+ * conf_cache_entry_matches:
+ * @entry: cache entry,
+ * @statbuf: current details of file.
+ *
+ * Returns: TRUE if the file described by @statbuf is the one @entry
+ * was cached from, FALSE if it has been replaced or modified since.
+ **/
+static int
+conf_cache_entry_matches (const ConfCacheEntry *entry,
+			  const struct stat    *statbuf)
+{
+	nih_assert (entry);
+	nih_assert (statbuf);
+
+	return (entry->dev == (int64_t)statbuf->st_dev
+		&& entry->ino == (int64_t)statbuf->st_ino
+		&& entry->size == (int64_t)statbuf->st_size
+		&& entry->mtime_sec == (int64_t)statbuf->st_mtim.tv_sec
+		&& entry->mtime_nsec == (int64_t)statbuf->st_mtim.tv_nsec);
+}
+
+/**
+ * conf_cache_entry_serialise:
+ * @entry: cache entry to serialise.
+ *
+ * Convert @entry into a JSON representation for writing to the cache
+ * file.  Caller must free returned value using json_object_put().
+ *
+ * Returns: JSON-serialised ConfCacheEntry object, or NULL on error.
+ **/
+static json_object *
+conf_cache_entry_serialise (const ConfCacheEntry *entry)
+{
+	json_object *json;
+
+	nih_assert (entry);
+	nih_assert (entry->json);
+
+	json = json_object_new_object ();
+	if (! json)
+		return NULL;
+
+	if (! state_set_json_string_var_from_obj (json, entry, path))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, entry, dev))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, entry, ino))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, entry, size))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, entry, mtime_sec))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, entry, mtime_nsec))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, entry, parse_time))
+		goto error;
+
+	json_object_object_add (json, "class", json_object_get (entry->json));
+
+	return json;
+
+error:
+	json_object_put (json);
+	return NULL;
+}
+
+/**
+ * conf_cache_entry_deserialise:
+ * @json: JSON-serialised ConfCacheEntry object to deserialise.
+ *
+ * Create a ConfCacheEntry from @json and add it to the cache, replacing
+ * any existing entry for the same path.
+ *
+ * Returns: ConfCacheEntry object, or NULL on error.
+ **/
+static ConfCacheEntry *
+conf_cache_entry_deserialise (json_object *json)
+{
+	ConfCacheEntry  *entry;
+	json_object     *json_class;
+	nih_local char  *path = NULL;
+	struct stat      statbuf;
+
+	nih_assert (conf_cache);
+	nih_assert (json);
+
+	if (! state_check_json_type (json, object))
+		return NULL;
+
+	if (! state_get_json_string_var_strict (json, "path", NULL, path))
+		return NULL;
+
+	if (! state_get_json_var_full (json, "class", object, json_class))
+		return NULL;
+
+	entry = (ConfCacheEntry *)nih_hash_lookup (conf_cache, path);
+	if (entry)
+		nih_free (entry);
+
+	memset (&statbuf, 0, sizeof (statbuf));
+
+	entry = conf_cache_entry_new (path, &statbuf);
+	if (! entry)
+		return NULL;
+
+	if (! state_get_json_int_var_to_obj (json, entry, dev))
+		goto error;
+
+	if (! state_get_json_int_var_to_obj (json, entry, ino))
+		goto error;
+
+	if (! state_get_json_int_var_to_obj (json, entry, size))
+		goto error;
+
+	if (! state_get_json_int_var_to_obj (json, entry, mtime_sec))
+		goto error;
+
+	if (! state_get_json_int_var_to_obj (json, entry, mtime_nsec))
+		goto error;
+
+	if (! state_get_json_int_var_to_obj (json, entry, parse_time))
+		goto error;
+
+	entry->json = json_object_get (json_class);
+
+	return entry;
+
+error:
+	nih_free (entry);
+	return NULL;
+}
+
+
+/**
+ * conf_cache_init:
+ *
+ * Replaces any cache held in memory with an empty one and resets the
+ * statistics.
+ **/
+void
+conf_cache_init (void)
+{
+	conf_cache_free ();
+
+	conf_cache = NIH_MUST (nih_hash_string_new (NULL, 0));
+	conf_cache_dirty = FALSE;
+
+	conf_cache_hits = 0;
+	conf_cache_misses = 0;
+	conf_cache_saved = 0;
+}
+
+/**
+ * conf_cache_reset:
+ *
+ * Resets the statistics and marks every entry in the cache held in
+ * memory as unused, so that it may be filled by another reload as if it
+ * had just been loaded.
+ **/
+void
+conf_cache_reset (void)
+{
+	nih_assert (conf_cache);
+
+	NIH_HASH_FOREACH (conf_cache, iter) {
+		ConfCacheEntry *entry = (ConfCacheEntry *)iter;
+
+		entry->used = FALSE;
+	}
+
+	conf_cache_hits = 0;
+	conf_cache_misses = 0;
+	conf_cache_saved = 0;
+}
+
+/**
+ * conf_cache_load:
+ *
+ * Reads the cache of parsed job configuration from conf_cache_file,
+ * replacing any cache already in memory and resetting the statistics.
+ *
+ * An empty cache is created even if the file cannot be read or is not
+ * valid, so that it can be filled and saved with conf_cache_store()
+ * and conf_cache_save().
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+conf_cache_load (void)
+{
+	nih_local char *data = NULL;
+	size_t          len;
+
+	nih_assert (conf_cache_file);
+
+	conf_cache_init ();
+
+	data = nih_file_read (NULL, conf_cache_file, &len);
+	if (! data) {
+		conf_cache_dirty = TRUE;
+		return -1;
+	}
+
+	if (conf_cache_merge (data, len) < 0) {
+		/* Start afresh rather than trust part of the file */
+		NIH_HASH_FOREACH_SAFE (conf_cache, iter)
+			nih_free (iter);
+
+		return -1;
+	}
+
+	conf_cache_dirty = FALSE;
+
+	nih_debug ("Loaded %zu entries from configuration cache %s",
+		   hash_count (conf_cache), conf_cache_file);
+
+	return 0;
+}
+
+/**
+ * conf_cache_merge:
+ * @data: encoded cache,
+ * @len: length of @data.
+ *
+ * Adds the entries encoded in @data, as produced by conf_cache_to_data(),
+ * to the cache, replacing any existing entries for the same paths.
+ *
+ * @data is rejected if it was written by a different version of init, or
+ * with a different default console or debug stanza setting, since the
+ * job classes parsed would differ.
+ *
+ * Entries decoded before an error is found are kept, since each is
+ * complete in itself.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+conf_cache_merge (const char *data,
+		  size_t      len)
+{
+	json_object    *json = NULL;
+	json_object    *json_files;
+	nih_local char *version = NULL;
+	int             console = -1;
+	int             debug_stanza = FALSE;
+
+	nih_assert (conf_cache);
+	nih_assert (data);
+
+	conf_cache_dirty = TRUE;
+
+	json = state_binary_to_json (data, len);
+	if (! json)
+		goto error;
+
+	/* The serialisation of a job class may differ between versions,
+	 * so the cache is only valid for the version that wrote it.
+	 */
+	if (! state_get_json_string_var_strict (json, "version", NULL, version))
+		goto error;
+
+	if (strcmp (version, PACKAGE_STRING))
+		goto error;
+
+	/* Nor is it valid if parsing would now give different results */
+	if (! state_get_json_int_var (json, "default-console", console))
+		goto error;
+
+	if (console != default_console)
+		goto error;
+
+	if (! state_get_json_int_var (json, "debug-stanza", debug_stanza))
+		goto error;
+
+	if (debug_stanza != debug_stanza_enabled)
+		goto error;
+
+	if (! state_get_json_var_full (json, "files", array, json_files))
+		goto error;
+
+	for (int i = 0; i < json_object_array_length (json_files); i++) {
+		json_object *json_file;
+
+		json_file = json_object_array_get_idx (json_files, i);
+		if (! json_file)
+			goto error;
+
+		if (! conf_cache_entry_deserialise (json_file))
+			goto error;
+	}
+
+	json_object_put (json);
+
+	return 0;
+
+error:
+	if (json)
+		json_object_put (json);
+
+	nih_return_error (-1, CONF_CACHE_INVALID,
+			  _(CONF_CACHE_INVALID_STR));
+}
+
+/**
+ * conf_cache_to_data:
+ * @parent: parent for returned data,
+ * @len: length of returned data.
+ *
+ * Encodes every entry in the cache in the binary state encoding, in
+ * the form read by conf_cache_merge().
+ *
+ * If @parent is not NULL, it should be a pointer to another object
+ * which will be used as a parent for the returned data.  When all
+ * parents of the returned data are freed, the returned data will also
+ * be freed.
+ *
+ * Returns: newly allocated data, or NULL on error.
+ **/
+char *
+conf_cache_to_data (const void *parent,
+		    size_t     *len)
+{
+	json_object *json;
+	json_object *json_files;
+	char        *data;
+
+	nih_assert (conf_cache);
+	nih_assert (len);
+
+	json = json_object_new_object ();
+	if (! json)
+		return NULL;
+
+	if (! state_set_json_string_var (json, "version", PACKAGE_STRING))
+		goto error;
+
+	if (! state_set_json_int_var (json, "default-console", default_console))
+		goto error;
+
+	if (! state_set_json_int_var (json, "debug-stanza", debug_stanza_enabled))
+		goto error;
+
+	json_files = json_object_new_array ();
+	if (! json_files)
+		goto error;
+
+	json_object_object_add (json, "files", json_files);
+
+	NIH_HASH_FOREACH (conf_cache, iter) {
+		ConfCacheEntry *entry = (ConfCacheEntry *)iter;
+		json_object    *json_file;
+
+		json_file = conf_cache_entry_serialise (entry);
+		if (! json_file)
+			goto error;
+
+		json_object_array_add (json_files, json_file);
+	}
+
+	data = state_json_to_binary (parent, json, len);
+
+	json_object_put (json);
+
+	return data;
+
+error:
+	json_object_put (json);
+	return NULL;
+}
+
+/**
+ * conf_cache_save:
+ *
+ * Writes the cache to conf_cache_file if it has changed since it was
+ * loaded.  Only entries looked up or stored since then are kept, so
+ * files that no longer exist are dropped from the cache.
+ *
+ * The cache is written to a temporary file which is then renamed over
+ * conf_cache_file, so that readers see either the old or the new cache;
+ * failure leaves the old cache in place.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+conf_cache_save (void)
+{
+	nih_local char *data = NULL;
+	nih_local char *tmp = NULL;
+	const char     *p;
+	size_t          len;
+	ssize_t         bytes;
+	int             fd = -1;
+
+	nih_assert (conf_cache_file);
+	nih_assert (conf_cache);
+
+	NIH_HASH_FOREACH_SAFE (conf_cache, iter) {
+		ConfCacheEntry *entry = (ConfCacheEntry *)iter;
+
+		if (! entry->used) {
+			nih_free (entry);
+			conf_cache_dirty = TRUE;
+		}
+	}
+
+	if (! conf_cache_dirty)
+		return 0;
+
+	data = conf_cache_to_data (NULL, &len);
+	if (! data) {
+		errno = ENOMEM;
+		nih_return_system_error (-1);
+	}
+
+	tmp = NIH_MUST (nih_sprintf (NULL, "%s.new", conf_cache_file));
+
+	/* Jobs may hold secrets in their environment */
+	fd = open (tmp, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+		   S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		nih_return_system_error (-1);
+
+	p = data;
+	while (len) {
+		bytes = write (fd, p, len);
+
+		if (bytes > 0) {
+			p += bytes;
+			len -= (size_t)bytes;
+		} else if (! bytes || errno != EINTR) {
+			goto error;
+		}
+	}
+
+	if (close (fd) < 0) {
+		fd = -1;
+		goto error;
+	}
+	fd = -1;
+
+	if (rename (tmp, conf_cache_file) < 0)
+		goto error;
+
+	conf_cache_dirty = FALSE;
+
+	nih_debug ("Wrote %zu entries to configuration cache %s",
+		   hash_count (conf_cache), conf_cache_file);
+
+	return 0;
+
+error:
+	nih_error_raise_system ();
+
+	if (fd >= 0)
+		close (fd);
+
+	unlink (tmp);
+
+	return -1;
+}
+
+/**
+ * conf_cache_free:
+ *
+ * Discards the cache held in memory, without saving it.
+ **/
+void
+conf_cache_free (void)
+{
+	if (! conf_cache)
+		return;
+
+	nih_free (conf_cache);
+	conf_cache = NULL;
+}
+
+
+/**
+ * conf_cache_lookup:
+ * @path: path to job configuration file,
+ * @statbuf: current details of @path,
+ * @name: name of job.
+ *
+ * Looks up the job class parsed from @path in the cache and, if @path
+ * has not been replaced or modified since, creates a new JobClass named
+ * @name from it that may be used instead of parsing @path.
+ *
+ * Stale entries are removed from the cache.
+ *
+ * Returns: newly allocated JobClass, or NULL if none was cached.
+ **/
+JobClass *
+conf_cache_lookup (const char        *path,
+		   const struct stat *statbuf,
+		   const char        *name)
+{
+	ConfCacheEntry *entry;
+	JobClass       *class;
+	int64_t         start;
+
+	nih_assert (path);
+	nih_assert (statbuf);
+	nih_assert (name);
+
+	if (! conf_cache)
+		return NULL;
+
+	start = conf_cache_clock ();
+
+	entry = (ConfCacheEntry *)nih_hash_lookup (conf_cache, path);
+	if (! entry)
+		return NULL;
+
+	if (! conf_cache_entry_matches (entry, statbuf))
+		goto stale;
+
+	class = job_class_deserialise_config (NULL, name, entry->json);
+	if (! class)
+		goto stale;
+
+	entry->used = TRUE;
+
+	conf_cache_hits++;
+	conf_cache_saved += entry->parse_time - (conf_cache_clock () - start);
+
+	return class;
+
+stale:
+	nih_free (entry);
+	conf_cache_dirty = TRUE;
+
+	return NULL;
+}
+
+/**
+ * conf_cache_valid:
+ * @path: path to job configuration file,
+ * @statbuf: current details of @path.
+ *
+ * Returns: TRUE if the cache holds the job class parsed from @path and
+ * @path has not been replaced or modified since, FALSE otherwise.
+ **/
+int
+conf_cache_valid (const char        *path,
+		  const struct stat *statbuf)
+{
+	ConfCacheEntry *entry;
+
+	nih_assert (path);
+	nih_assert (statbuf);
+
+	if (! conf_cache)
+		return FALSE;
+
+	entry = (ConfCacheEntry *)nih_hash_lookup (conf_cache, path);
+
+	return entry && conf_cache_entry_matches (entry, statbuf);
+}
+
+/**
+ * conf_cache_keep:
+ * @path: path to job configuration file.
+ *
+ * Marks any entry for @path as still wanted, so that it is kept by
+ * conf_cache_save() even though it was neither looked up nor stored;
+ * used for files that were left unchanged rather than parsed again.
+ **/
+void
+conf_cache_keep (const char *path)
+{
+	ConfCacheEntry *entry;
+
+	nih_assert (path);
+
+	if (! conf_cache)
+		return;
+
+	entry = (ConfCacheEntry *)nih_hash_lookup (conf_cache, path);
+	if (entry)
+		entry->used = TRUE;
+}
+
+/**
+ * conf_cache_store:
+ * @path: path to job configuration file,
+ * @statbuf: details of @path when it was read,
+ * @class: job class parsed from @path,
+ * @parse_time: nanoseconds taken to parse @path.
+ *
+ * Adds @class to the cache, replacing any existing entry for @path, so
+ * that it may be loaded by conf_cache_lookup() for as long as @path
+ * matches @statbuf.
+ *
+ * @class must have been freshly parsed, since its instances are not
+ * cached.  Failure to serialise @class leaves @path uncached.
+ **/
+void
+conf_cache_store (const char        *path,
+		  const struct stat *statbuf,
+		  JobClass          *class,
+		  int64_t            parse_time)
+{
+	ConfCacheEntry *entry;
+
+	nih_assert (path);
+	nih_assert (statbuf);
+	nih_assert (class);
+	nih_assert (! class->session);
+
+	if (! conf_cache)
+		return;
+
+	conf_cache_misses++;
+	conf_cache_dirty = TRUE;
+
+	entry = (ConfCacheEntry *)nih_hash_lookup (conf_cache, path);
+	if (entry)
+		nih_free (entry);
+
+	entry = conf_cache_entry_new (path, statbuf);
+	if (! entry)
+		return;
+
+	entry->json = job_class_serialise (class);
+	if (! entry->json) {
+		nih_free (entry);
+		return;
+	}
+
+	entry->parse_time = parse_time;
+	entry->used = TRUE;
+}
@@ -0,0 +1,105 @@
+/* upstart
+ *
+ * Copyright © 2015 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_CONF_CACHE_H
+#define INIT_CONF_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+
+#include <nih/macros.h>
+#include <nih/hash.h>
+#include <nih/list.h>
+
+#include <json.h>
+
+#include "job_class.h"
+
+
+/**
+ * ConfCacheEntry:
+ * @entry: list header,
+ * @path: path to job configuration file,
+ * @dev: device of @path,
+ * @ino: inode number of @path,
+ * @size: size of @path,
+ * @mtime_sec: modification time of @path (seconds),
+ * @mtime_nsec: modification time of @path (nanoseconds),
+ * @parse_time: nanoseconds taken to parse @path,
+ * @used: TRUE if the entry was looked up or stored since the cache was
+ * loaded,
+ * @json: JSON-serialised JobClass parsed from @path.
+ *
+ * This structure holds the parsed job class for a single configuration
+ * file, along with the file details it is only valid for.
+ **/
+typedef struct conf_cache_entry {
+	NihList      entry;
+	char        *path;
+
+	int64_t      dev;
+	int64_t      ino;
+	int64_t      size;
+	int64_t      mtime_sec;
+	int64_t      mtime_nsec;
+
+	int64_t      parse_time;
+	int          used;
+
+	json_object *json;
+} ConfCacheEntry;
+
+
+NIH_BEGIN_EXTERN
+
+extern char    *conf_cache_file;
+extern NihHash *conf_cache;
+extern size_t   conf_cache_hits;
+extern size_t   conf_cache_misses;
+extern int64_t  conf_cache_saved;
+
+int64_t   conf_cache_clock   (void)
+	__attribute__ ((warn_unused_result));
+
+void      conf_cache_init    (void);
+void      conf_cache_reset   (void);
+int       conf_cache_load    (void)
+	__attribute__ ((warn_unused_result));
+int       conf_cache_save    (void)
+	__attribute__ ((warn_unused_result));
+void      conf_cache_free    (void);
+
+int       conf_cache_merge   (const char *data, size_t len)
+	__attribute__ ((warn_unused_result));
+char *    conf_cache_to_data (const void *parent, size_t *len)
+	__attribute__ ((warn_unused_result));
+
+int       conf_cache_valid   (const char *path, const struct stat *statbuf)
+	__attribute__ ((warn_unused_result));
+JobClass *conf_cache_lookup  (const char *path, const struct stat *statbuf,
+			      const char *name)
+	__attribute__ ((warn_unused_result));
+void      conf_cache_store   (const char *path, const struct stat *statbuf,
+			      JobClass *class, int64_t parse_time);
+void      conf_cache_keep    (const char *path);
+
+NIH_END_EXTERN
+
+#endif /* INIT_CONF_CACHE_H */
@@ -34,6 +34,7 @@
 #include <nih/alloc.h>
 #include <nih/string.h>
 #include <nih/list.h>
+#include <nih/hash.h>
 #include <nih/io.h>
 #include <nih/main.h>
 #include <nih/logging.h>
@@ -60,6 +61,7 @@
 #include "events.h"
 #include "paths.h"
 #include "xdg.h"
+#include "trace.h"
 
 #include "com.ubuntu.Upstart.h"
 #include "org.freedesktop.DBus.h"
@@ -80,6 +82,14 @@ static int   control_check_permission    (NihDBusMessage *message)
 	__attribute__ ((warn_unused_result));
 static void  control_session_file_create (void);
 static void  control_session_file_remove (void);
+static int   control_emit_admit          (NihDBusMessage *message,
+					  size_t count,
+					  ControlEmitSender **sender)
+	__attribute__ ((warn_unused_result));
+static int   control_emit_charge         (Event *event,
+					  ControlEmitSender *sender)
+	__attribute__ ((warn_unused_result));
+static int   control_emit_charge_destroy (ControlEmitSender **charge);
 
 /**
  * use_session_bus:
@@ -135,6 +145,37 @@ DBusConnection *control_bus = NULL;
  **/
 NihList *control_conns = NULL;
 
+/**
+ * control_emit_quota:
+ *
+ * Maximum number of outstanding events that a single D-Bus client may
+ * have emitted; zero means no limit.
+ **/
+int control_emit_quota = CONTROL_EMIT_QUOTA;
+
+/**
+ * control_emit_senders:
+ *
+ * Hash table of D-Bus clients with emitted events still outstanding,
+ * each entry is a ControlEmitSender structure.
+ **/
+static NihHash *control_emit_senders = NULL;
+
+/**
+ * control_rejected_emits_queue:
+ *
+ * Number of events refused because the event queue was full.
+ **/
+unsigned int control_rejected_emits_queue = 0;
+
+/**
+ * control_rejected_emits_quota:
+ *
+ * Number of events refused because the client had reached
+ * control_emit_quota.
+ **/
+unsigned int control_rejected_emits_quota = 0;
+
 /* External definitions */
 extern int      user_mode;
 extern int      disable_respawn;
@@ -143,7 +184,7 @@ extern char    *session_file;
 /**
  * control_init:
  *
- * Initialise the control connections list.
+ * Initialise the control connections list and emit quota table.
  **/
 void
 control_init (void)
@@ -151,6 +192,9 @@ control_init (void)
 	if (! control_conns)
 		control_conns = NIH_MUST (nih_list_new (NULL));
 
+	if (! control_emit_senders)
+		control_emit_senders = NIH_MUST (nih_hash_string_new (NULL, 0));
+
 	if (! control_server_address) {
 		if (user_mode) {
 			NIH_MUST (nih_strcat_sprintf (&control_server_address, NULL,
@@ -446,6 +490,8 @@ control_register_all (DBusConnection *conn)
  *
  * Called to request that Upstart reloads its configuration from disk,
  * useful when inotify is not available or the user is generally paranoid.
+ * Only files that have changed since they were last parsed are parsed
+ * again.
  *
  * Notes: chroot sessions are permitted to make this call.
  *
@@ -455,6 +501,8 @@ int
 control_reload_configuration (void           *data,
 			      NihDBusMessage *message)
 {
+	ConfReloadSummary summary;
+
 	nih_assert (message != NULL);
 
 	if (! control_check_permission (message)) {
@@ -467,7 +515,129 @@ control_reload_configuration (void           *data,
 	nih_info (_("Reloading configuration"));
 
 	/* This can only be called after deserialisation */
-	conf_reload ();
+	conf_reload_changed (&summary);
+
+	return 0;
+}
+
+/**
+ * control_reload_configuration_with_summary:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @added: number of files parsed for the first time,
+ * @modified: number of files parsed again since they had changed,
+ * @removed: number of files that no longer exist,
+ * @unchanged: number of files that did not need to be parsed again.
+ *
+ * Implements the ReloadConfigurationWithSummary method of the
+ * com.ubuntu.Upstart interface.
+ *
+ * As ReloadConfiguration, but returns a summary of what changed.
+ *
+ * Notes: chroot sessions are permitted to make this call.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_reload_configuration_with_summary (void           *data,
+					   NihDBusMessage *message,
+					   uint32_t       *added,
+					   uint32_t       *modified,
+					   uint32_t       *removed,
+					   uint32_t       *unchanged)
+{
+	ConfReloadSummary summary;
+
+	nih_assert (message != NULL);
+	nih_assert (added != NULL);
+	nih_assert (modified != NULL);
+	nih_assert (removed != NULL);
+	nih_assert (unchanged != NULL);
+
+	if (! control_check_permission (message)) {
+		nih_dbus_error_raise_printf (
+			DBUS_INTERFACE_UPSTART ".Error.PermissionDenied",
+			_("You do not have permission to reload configuration"));
+		return -1;
+	}
+
+	nih_info (_("Reloading configuration"));
+
+	conf_reload_changed (&summary);
+
+	*added = (uint32_t)summary.added;
+	*modified = (uint32_t)summary.modified;
+	*removed = (uint32_t)summary.removed;
+	*unchanged = (uint32_t)summary.unchanged;
+
+	return 0;
+}
+
+
+/**
+ * control_reload_job_configuration:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @paths: paths of configuration files to reload.
+ *
+ * Implements the ReloadJobConfiguration method of the com.ubuntu.Upstart
+ * interface.
+ *
+ * Called to request that Upstart reloads just the configuration files
+ * @paths, each a job configuration or override file, from disk; this
+ * avoids rescanning every configuration source when only a few files
+ * have been changed.  Files are reloaded in order, stopping at the first
+ * that cannot be, in which case an error is returned.
+ *
+ * Notes: chroot sessions are permitted to make this call, with @paths
+ * relative to their root.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_reload_job_configuration (void           *data,
+				  NihDBusMessage *message,
+				  char * const   *paths)
+{
+	Session *session;
+
+	nih_assert (message != NULL);
+	nih_assert (paths != NULL);
+
+	if (! control_check_permission (message)) {
+		nih_dbus_error_raise_printf (
+			DBUS_INTERFACE_UPSTART ".Error.PermissionDenied",
+			_("You do not have permission to reload configuration"));
+		return -1;
+	}
+
+	if (! *paths) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     _("No configuration files given"));
+		return -1;
+	}
+
+	/* Get the relevant session */
+	session = session_from_dbus (NULL, message);
+
+	/* Earlier changes must not be applied over the files reloaded */
+	conf_flush_pending ();
+
+	for (char * const *path = paths; *path; path++) {
+		NihError *err;
+
+		if (conf_reload_file (session, *path) == 0)
+			continue;
+
+		err = nih_error_get ();
+		nih_dbus_error_raise_printf (
+			err->number == CONF_FILE_UNKNOWN
+			? DBUS_ERROR_INVALID_ARGS : DBUS_ERROR_FAILED,
+			"%s: %s", *path, err->message);
+		nih_free (err);
+
+		return -1;
+	}
 
 	return 0;
 }
@@ -487,6 +657,9 @@ control_reload_configuration (void           *data,
  * which will be stored in @job.  If no job class with that name exists,
  * the com.ubuntu.Upstart.Error.UnknownJob D-Bus error will be raised.
  *
+ * Configuration changes waiting to be coalesced are loaded first, so
+ * that a job whose file was only just installed is found.
+ *
  * Returns: zero on success, negative value on raised error.
  **/
 int
@@ -505,6 +678,9 @@ control_get_job_by_name (void            *data,
 
 	job_class_init ();
 
+	/* A job just installed may still be waiting to be loaded */
+	conf_flush_pending ();
+
 	/* Verify that the name is valid */
 	if (! strlen (name)) {
 		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
@@ -562,6 +738,8 @@ control_get_job_by_name (void            *data,
  *
  * Called to obtain the paths of all known jobs, which will be stored in
  * @jobs.  If no jobs are registered, @jobs will point to an empty array.
+ * As with GetJobByName, configuration changes waiting to be coalesced are
+ * loaded first.
  *
  * Returns: zero on success, negative value on raised error.
  **/
@@ -579,6 +757,8 @@ control_get_all_jobs (void             *data,
 
 	job_class_init ();
 
+	conf_flush_pending ();
+
 	len = 0;
 	list = nih_str_array_new (message);
 	if (! list)
@@ -642,6 +822,10 @@ control_emit_event (void            *data,
  * finished starting (running for tasks) or stopping; when @wait is FALSE,
  * the method call returns once the event has been queued.
  *
+ * If the event queue is full, or the client already has
+ * control_emit_quota events outstanding, the
+ * com.ubuntu.Upstart.Error.Busy D-Bus error is returned immediately.
+ *
  * Returns: zero on success, negative value on raised error.
  **/
 int
@@ -652,8 +836,9 @@ control_emit_event_with_file (void            *data,
 			      int              wait,
 			      int              file)
 {
-	Event    *event;
-	Blocked  *blocked;
+	Event             *event;
+	Blocked           *blocked;
+	ControlEmitSender *sender;
 
 	nih_assert (message != NULL);
 	nih_assert (name != NULL);
@@ -682,6 +867,14 @@ control_emit_event_with_file (void            *data,
 		return -1;
 	}
 
+	if (control_emit_admit (message, 1, &sender) < 0) {
+		close (file);
+		return -1;
+	}
+
+	/* Jobs just installed should see the event */
+	conf_flush_pending ();
+
 	/* Make the event and block the message on it */
 	event = event_new (NULL, name, (char **)env);
 	if (! event) {
@@ -690,6 +883,13 @@ control_emit_event_with_file (void            *data,
 		return -1;
 	}
 
+	if (sender && (control_emit_charge (event, sender) < 0)) {
+		nih_error_raise_system ();
+		nih_free (event);
+		close (file);
+		return -1;
+	}
+
 	event->fd = file;
 	if (event->fd >= 0) {
 		long flags;
@@ -720,6 +920,471 @@ control_emit_event_with_file (void            *data,
 }
 
 
+/**
+ * control_emit_events:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @events: array of events to emit.
+ *
+ * Implements the top half of the EmitEvents method of the
+ * com.ubuntu.Upstart interface, the bottom half may be found in
+ * event_finished().
+ *
+ * Called to emit a batch of events in one method call, each element of
+ * @events giving the name, environment and wait flag of an event as for
+ * the EmitEvent method.  All of the events are added to the event queue
+ * in order before any of them are processed.  If any name or environment
+ * is not valid, the org.freedesktop.DBus.Error.InvalidArgs D-Bus error is
+ * returned immediately and no events are emitted.
+ *
+ * The method call returns once every event with its wait flag set has
+ * completed, or once all events have been queued if none have.  If any
+ * of the waited-for events fail, the com.ubuntu.Upstart.Error.EventFailed
+ * D-Bus error is returned instead.
+ *
+ * The batch is refused as a whole with the com.ubuntu.Upstart.Error.Busy
+ * D-Bus error if the event queue or the client's control_emit_quota
+ * has no room for all of its events.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_emit_events (void                                   *data,
+		     NihDBusMessage                         *message,
+		     ControlEmitEventsEventsElement * const *events)
+{
+	nih_local Event  **queued = NULL;
+	ControlEmitBatch  *batch;
+	ControlEmitSender *sender;
+	Session           *session;
+	size_t             len = 0;
+	size_t             i;
+
+	nih_assert (message != NULL);
+	nih_assert (events != NULL);
+
+	if (! control_check_permission (message)) {
+		nih_dbus_error_raise_printf (
+			DBUS_INTERFACE_UPSTART ".Error.PermissionDenied",
+			_("You do not have permission to emit an event"));
+		return -1;
+	}
+
+	/* Verify every event before emitting any of them */
+	for (ControlEmitEventsEventsElement * const *e = events; *e; e++) {
+		nih_assert ((*e)->item0 != NULL);
+		nih_assert ((*e)->item1 != NULL);
+
+		if (! strlen ((*e)->item0)) {
+			nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+						     _("Name may not be empty string"));
+			return -1;
+		}
+
+		if (! environ_all_valid ((*e)->item1)) {
+			nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+						     _("Env must be KEY=VALUE pairs"));
+			return -1;
+		}
+
+		len++;
+	}
+
+	if (control_emit_admit (message, len, &sender) < 0)
+		return -1;
+
+	conf_flush_pending ();
+
+	queued = nih_alloc (NULL, sizeof (Event *) * (len + 1));
+	if (! queued) {
+		nih_error_raise_system ();
+		return -1;
+	}
+
+	/* The batch is held by each of the events waited for, and by the
+	 * queued array until we return.
+	 */
+	batch = nih_new (queued, ControlEmitBatch);
+	if (! batch) {
+		nih_error_raise_system ();
+		return -1;
+	}
+
+	batch->message = message;
+	nih_ref (batch->message, batch);
+
+	batch->pending = 0;
+	batch->failed = FALSE;
+
+	/* Obtain the session once for the whole batch */
+	session = session_from_dbus (NULL, message);
+
+	for (i = 0; i < len; i++) {
+		Event   *event;
+		Blocked *blocked;
+
+		event = event_new (NULL, events[i]->item0, events[i]->item1);
+		if (! event)
+			goto error;
+
+		queued[i] = event;
+		event->session = session;
+
+		if (sender && (control_emit_charge (event, sender) < 0))
+			goto error;
+
+		if (events[i]->item2) {
+			blocked = blocked_new (event, BLOCKED_EMIT_EVENTS_METHOD,
+					       batch);
+			if (! blocked) {
+				nih_free (event);
+				goto error;
+			}
+
+			nih_list_add (&event->blocking, &blocked->entry);
+			batch->pending++;
+		}
+	}
+
+	/* Nothing to wait for, so reply now; otherwise the reply is sent
+	 * when the last waited-for event finishes.
+	 */
+	if (! batch->pending)
+		NIH_ZERO (control_emit_events_reply (message));
+
+	return 0;
+
+error:
+	nih_error_raise_system ();
+
+	/* Withdraw the events already queued */
+	while (i-- > 0)
+		nih_free (queued[i]);
+
+	return -1;
+}
+
+
+/**
+ * control_emit_admit:
+ * @message: D-Bus connection and message received,
+ * @count: number of events the client wishes to emit,
+ * @sender: pointer to store quota entry for client.
+ *
+ * Decides whether the client that sent @message may emit @count more
+ * events, based on the size of the event queue (see event_queue_admit())
+ * and the number of events the client already has outstanding.  If not,
+ * the com.ubuntu.Upstart.Error.Busy D-Bus error is raised and the
+ * appropriate rejection counter incremented.
+ *
+ * When quotas are in force, @sender is set to the quota entry for the
+ * client, which is referenced by @message; each event emitted should
+ * then be passed to control_emit_charge().  Otherwise @sender is set
+ * to NULL.
+ *
+ * Returns: zero if the events may be emitted, negative value on raised
+ * error.
+ **/
+static int
+control_emit_admit (NihDBusMessage     *message,
+		    size_t              count,
+		    ControlEmitSender **sender)
+{
+	nih_local char *name = NULL;
+	const char     *unique_name;
+
+	nih_assert (message != NULL);
+	nih_assert (sender != NULL);
+
+	*sender = NULL;
+
+	if (! event_queue_admit (count)) {
+		control_rejected_emits_queue += count;
+
+		nih_dbus_error_raise_printf (
+			DBUS_INTERFACE_UPSTART ".Error.Busy",
+			_("Too many events queued, try again later"));
+		return -1;
+	}
+
+	if (control_emit_quota <= 0)
+		return 0;
+
+	control_init ();
+
+	/* Private connections have no bus name, so use the connection
+	 * itself to identify the client.
+	 */
+	unique_name = message->message
+		? dbus_message_get_sender (message->message) : NULL;
+	if (unique_name) {
+		name = nih_strdup (NULL, unique_name);
+	} else {
+		name = nih_sprintf (NULL, "%p", (void *)message->connection);
+	}
+	if (! name)
+		nih_return_no_memory_error (-1);
+
+	*sender = (ControlEmitSender *)nih_hash_lookup (control_emit_senders,
+							name);
+	if (*sender) {
+		if ((*sender)->queued + count > (size_t)control_emit_quota) {
+			control_rejected_emits_quota += count;
+			*sender = NULL;
+
+			nih_dbus_error_raise_printf (
+				DBUS_INTERFACE_UPSTART ".Error.Busy",
+				_("Too many events queued by client, try again later"));
+			return -1;
+		}
+
+		nih_ref (*sender, message);
+		return 0;
+	}
+
+	if (count > (size_t)control_emit_quota) {
+		control_rejected_emits_quota += count;
+
+		nih_dbus_error_raise_printf (
+			DBUS_INTERFACE_UPSTART ".Error.Busy",
+			_("Too many events queued by client, try again later"));
+		return -1;
+	}
+
+	*sender = nih_new (message, ControlEmitSender);
+	if (! *sender)
+		nih_return_no_memory_error (-1);
+
+	nih_list_init (&(*sender)->entry);
+	nih_alloc_set_destructor (*sender, nih_list_destroy);
+
+	nih_ref (name, *sender);
+	(*sender)->name = name;
+	(*sender)->queued = 0;
+
+	nih_hash_add (control_emit_senders, &(*sender)->entry);
+
+	return 0;
+}
+
+/**
+ * control_emit_charge:
+ * @event: event emitted,
+ * @sender: quota entry for client that emitted it.
+ *
+ * Counts @event against the quota of @sender until the event is freed.
+ *
+ * Returns: zero on success, negative value on insufficient memory.
+ **/
+static int
+control_emit_charge (Event             *event,
+		     ControlEmitSender *sender)
+{
+	ControlEmitSender **charge;
+
+	nih_assert (event != NULL);
+	nih_assert (sender != NULL);
+
+	charge = nih_new (event, ControlEmitSender *);
+	if (! charge)
+		return -1;
+
+	*charge = sender;
+	nih_ref (sender, charge);
+	sender->queued++;
+
+	nih_alloc_set_destructor (charge, control_emit_charge_destroy);
+
+	return 0;
+}
+
+/**
+ * control_emit_charge_destroy:
+ * @charge: charge being freed.
+ *
+ * Called when an event emitted by a D-Bus client is freed to remove it
+ * from the client's count.
+ *
+ * Returns: zero.
+ **/
+static int
+control_emit_charge_destroy (ControlEmitSender **charge)
+{
+	nih_assert (charge != NULL);
+	nih_assert ((*charge)->queued > 0);
+
+	(*charge)->queued--;
+
+	return 0;
+}
+
+
+/**
+ * control_get_rejected_emits_queue:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @rejected_emits_queue: pointer for reply value.
+ *
+ * Implements the get method for the rejected_emits_queue property of the
+ * com.ubuntu.Upstart interface.
+ *
+ * Called to obtain the number of events refused because the event queue
+ * was full.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_get_rejected_emits_queue (void *          data,
+				  NihDBusMessage *message,
+				  uint32_t *      rejected_emits_queue)
+{
+	nih_assert (message != NULL);
+	nih_assert (rejected_emits_queue != NULL);
+
+	*rejected_emits_queue = control_rejected_emits_queue;
+
+	return 0;
+}
+
+/**
+ * control_get_rejected_emits_quota:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @rejected_emits_quota: pointer for reply value.
+ *
+ * Implements the get method for the rejected_emits_quota property of the
+ * com.ubuntu.Upstart interface.
+ *
+ * Called to obtain the number of events refused because the client
+ * emitting them had too many outstanding.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_get_rejected_emits_quota (void *          data,
+				  NihDBusMessage *message,
+				  uint32_t *      rejected_emits_quota)
+{
+	nih_assert (message != NULL);
+	nih_assert (rejected_emits_quota != NULL);
+
+	*rejected_emits_quota = control_rejected_emits_quota;
+
+	return 0;
+}
+
+/**
+ * control_get_config_parses_saved:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @config_parses_saved: pointer for reply value.
+ *
+ * Implements the get method for the config_parses_saved property of the
+ * com.ubuntu.Upstart interface.
+ *
+ * Called to obtain the number of times a configuration file was not
+ * reloaded because changes to it were coalesced.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_get_config_parses_saved (void *          data,
+				 NihDBusMessage *message,
+				 uint32_t *      config_parses_saved)
+{
+	nih_assert (message != NULL);
+	nih_assert (config_parses_saved != NULL);
+
+	*config_parses_saved = (uint32_t)conf_coalesce_saved;
+
+	return 0;
+}
+
+/**
+ * control_get_trace:
+ * @data: not used,
+ * @message: D-Bus connection and message received,
+ * @records: pointer for array of trace records reply.
+ *
+ * Implements the GetTrace method of the com.ubuntu.Upstart interface.
+ *
+ * Called to obtain the contents of the event and job lifecycle trace
+ * ring buffer, oldest first, which will be stored in @records.  Each
+ * record holds the monotonic time in nanoseconds, the kind of record,
+ * the event or job name, a detail string (the new job state, or the job
+ * process concerned), the process id and the wait status.  If tracing
+ * is disabled, @records will point to an empty array.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+control_get_trace (void                             *data,
+		   NihDBusMessage                   *message,
+		   ControlGetTraceRecordsElement  ***records)
+{
+	size_t count;
+
+	nih_assert (message != NULL);
+	nih_assert (records != NULL);
+
+	count = trace_count ();
+
+	*records = nih_alloc (message, (sizeof (ControlGetTraceRecordsElement *)
+					* (count + 1)));
+	if (! *records)
+		nih_return_no_memory_error (-1);
+
+	for (size_t i = 0; i < count; i++) {
+		const TraceRecord             *trace;
+		ControlGetTraceRecordsElement *record;
+		const char                    *detail;
+
+		trace = trace_get (i);
+		nih_assert (trace != NULL);
+
+		switch (trace->type) {
+		case TRACE_RECORD_JOB_STATE:
+			detail = job_state_name (trace->detail);
+			break;
+		case TRACE_RECORD_JOB_FORK:
+		case TRACE_RECORD_JOB_EXEC:
+		case TRACE_RECORD_JOB_REAP:
+			detail = process_name (trace->detail);
+			break;
+		default:
+			detail = NULL;
+			break;
+		}
+
+		record = nih_new (*records, ControlGetTraceRecordsElement);
+		if (! record)
+			goto error;
+
+		record->item0 = ((uint64_t)trace->time.tv_sec * 1000000000ULL
+				 + (uint64_t)trace->time.tv_nsec);
+		record->item1 = nih_strdup (record,
+					    trace_record_type_name (trace->type));
+		record->item2 = nih_strdup (record, trace->name);
+		record->item3 = nih_strdup (record, detail ? detail : "");
+		record->item4 = trace->pid;
+		record->item5 = trace->status;
+
+		if ((! record->item1) || (! record->item2) || (! record->item3))
+			goto error;
+
+		(*records)[i] = record;
+	}
+
+	(*records)[count] = NULL;
+
+	return 0;
+
+error:
+	nih_free (*records);
+	nih_return_no_memory_error (-1);
+}
+
+
 /**
  * control_get_version:
  * @data: not used,
@@ -1089,11 +1754,16 @@ control_prepare_reexec (void)
 int
 control_conn_to_index (const DBusConnection *connection)
 {
-	int conn_index = 0;
-	int found = FALSE;
+	StateIndex *index;
+	int         conn_index = 0;
+	int         found = FALSE;
 
 	nih_assert (connection);
 
+	index = state_index (STATE_INDEX_CONTROL_CONNS);
+	if (index)
+		return state_index_find (index, connection);
+
 	NIH_LIST_FOREACH (control_conns, iter) {
 		NihListEntry    *entry = (NihListEntry *)iter;
 		DBusConnection  *conn = (DBusConnection *)entry->data;
@@ -1124,11 +1794,16 @@ control_conn_to_index (const DBusConnection *connection)
 DBusConnection *
 control_conn_from_index (int conn_index)
 {
-	int i = 0;
+	StateIndex *index;
+	int         i = 0;
 
 	nih_assert (conn_index >= 0);
 	nih_assert (control_conns);
 
+	index = state_index (STATE_INDEX_CONTROL_CONNS);
+	if (index)
+		return (DBusConnection *)state_index_get (index, conn_index);
+
 	NIH_LIST_FOREACH (control_conns, iter) {
 		NihListEntry    *entry = (NihListEntry *)iter;
 		DBusConnection  *conn = (DBusConnection *)entry->data;
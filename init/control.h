@@ -22,6 +22,8 @@
 
 #include <dbus/dbus.h>
 
+#include <stdint.h>
+
 #include <nih/macros.h>
 #include <nih/list.h>
 
@@ -33,6 +35,8 @@
 #include "event.h"
 #include "quiesce.h"
 
+#include "com.ubuntu.Upstart.h"
+
 /**
  * USE_SESSION_BUS_ENV:
  *
@@ -86,6 +90,49 @@
 	}                                                             \
 }
 
+/**
+ * CONTROL_EMIT_QUOTA:
+ *
+ * The default number of events that a single D-Bus client may have
+ * outstanding before further events it emits are refused.
+ **/
+#define CONTROL_EMIT_QUOTA 8192
+
+
+/**
+ * ControlEmitSender:
+ * @entry: list header,
+ * @name: unique bus name of client, or connection address for private
+ * connections,
+ * @queued: number of events emitted by the client still outstanding.
+ *
+ * Entries in the control_emit_senders hash table, used to enforce
+ * control_emit_quota.  Each is referenced by the events it emitted and
+ * freed with the last of them.
+ **/
+typedef struct control_emit_sender {
+	NihList  entry;
+	char    *name;
+	size_t   queued;
+} ControlEmitSender;
+
+/**
+ * ControlEmitBatch:
+ * @message: D-Bus message to reply to,
+ * @pending: number of events still being waited for,
+ * @failed: TRUE if any of those events failed.
+ *
+ * This structure tracks an EmitEvents method call that is waiting for
+ * some of its events to finish.  It is referenced by a Blocked entry in
+ * each of those events, and freed along with the last of them.
+ **/
+typedef struct control_emit_batch {
+	NihDBusMessage *message;
+	unsigned int    pending;
+	int             failed;
+} ControlEmitBatch;
+
+
 NIH_BEGIN_EXTERN
 
 extern DBusServer     *control_server;
@@ -93,6 +140,10 @@ extern DBusConnection *control_bus;
 
 extern NihList        *control_conns;
 
+extern int             control_emit_quota;
+extern unsigned int    control_rejected_emits_queue;
+extern unsigned int    control_rejected_emits_quota;
+
 
 void control_init                 (void);
 void control_cleanup              (void);
@@ -107,6 +158,18 @@ void control_bus_close            (void);
 
 int  control_reload_configuration (void *data, NihDBusMessage *message)
 	__attribute__ ((warn_unused_result));
+int  control_reload_configuration_with_summary (void *data,
+						NihDBusMessage *message,
+						uint32_t *added,
+						uint32_t *modified,
+						uint32_t *removed,
+						uint32_t *unchanged)
+	__attribute__ ((warn_unused_result));
+
+int  control_reload_job_configuration (void *data,
+				       NihDBusMessage *message,
+				       char * const *paths)
+	__attribute__ ((warn_unused_result));
 
 int  control_get_job_by_name      (void *data, NihDBusMessage *message,
 				   const char *name, char **job)
@@ -123,11 +186,27 @@ int  control_emit_event_with_file (void *data, NihDBusMessage *message,
 				   const char *name, char * const *env,
 				   int wait, int file)
 	__attribute__ ((warn_unused_result));
+int  control_emit_events          (void *data, NihDBusMessage *message,
+				   ControlEmitEventsEventsElement * const *events)
+	__attribute__ ((warn_unused_result));
+int  control_get_trace            (void *data, NihDBusMessage *message,
+				   ControlGetTraceRecordsElement ***records)
+	__attribute__ ((warn_unused_result));
 
 int  control_get_version          (void *data, NihDBusMessage *message,
 				   char **version)
 	__attribute__ ((warn_unused_result));
 
+int  control_get_rejected_emits_queue (void *data, NihDBusMessage *message,
+				       uint32_t *rejected_emits_queue)
+	__attribute__ ((warn_unused_result));
+int  control_get_rejected_emits_quota (void *data, NihDBusMessage *message,
+				       uint32_t *rejected_emits_quota)
+	__attribute__ ((warn_unused_result));
+int  control_get_config_parses_saved (void *data, NihDBusMessage *message,
+				      uint32_t *config_parses_saved)
+	__attribute__ ((warn_unused_result));
+
 int  control_get_log_priority     (void *data, NihDBusMessage *message,
 				   char **log_priority)
 	__attribute__ ((warn_unused_result));
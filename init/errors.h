@@ -56,7 +56,13 @@ enum {
 	CONTROL_NAME_TAKEN,
 
 	/* Errors while manipulating cgroups */
-	CGROUP_ERROR
+	CGROUP_ERROR,
+
+	/* Errors while loading the configuration cache */
+	CONF_CACHE_INVALID,
+
+	/* Errors while reloading configuration files */
+	CONF_FILE_UNKNOWN
 };
 
 /* Error strings for defined messages */
@@ -80,5 +86,7 @@ enum {
 #define PARSE_EXPECTED_VARIABLE_STR	N_("Expected variable name before value")
 #define PARSE_MISMATCHED_PARENS_STR	N_("Mismatched parentheses")
 #define CONTROL_NAME_TAKEN_STR		N_("Name already taken")
+#define CONF_CACHE_INVALID_STR		N_("Invalid configuration cache")
+#define CONF_FILE_UNKNOWN_STR		N_("Not a file in any configuration source")
 
 #endif /* INIT_ERRORS_H */
@@ -45,6 +45,7 @@
 #include "control.h"
 #include "errors.h"
 #include "quiesce.h"
+#include "trace.h"
 
 #include "com.ubuntu.Upstart.h"
 
@@ -74,17 +75,136 @@ extern json_object *json_events;
  **/
 NihList *events = NULL;
 
+/**
+ * event_queue:
+ *
+ * This list holds the events that event_poll() needs to look at, in the
+ * order that they need looking at; that is, newly pending events and those
+ * that have become unblocked.  Each item is the queue member of an Event
+ * structure.
+ *
+ * Events that are handling and blocked are not in this list, so the cost
+ * of event_poll() does not depend on how many of those there are.
+ **/
+NihList *event_queue = NULL;
+
+/**
+ * event_count:
+ *
+ * Number of events in the events list.
+ **/
+size_t event_count = 0;
+
+/**
+ * event_queue_high_watermark:
+ *
+ * Once this many events are outstanding, event_queue_admit() refuses
+ * further events until the list has drained to
+ * event_queue_low_watermark.  Zero means no limit.
+ **/
+int event_queue_high_watermark = EVENT_QUEUE_HIGH_WATERMARK;
+
+/**
+ * event_queue_low_watermark:
+ *
+ * Number of outstanding events below which event_queue_admit() accepts
+ * events again after having reached event_queue_high_watermark.
+ **/
+int event_queue_low_watermark = EVENT_QUEUE_LOW_WATERMARK;
+
+/**
+ * event_queue_full:
+ *
+ * TRUE between the events list reaching event_queue_high_watermark and
+ * draining to event_queue_low_watermark.
+ **/
+static int event_queue_full = FALSE;
+
+/**
+ * event_names:
+ *
+ * This hash table holds a single shared copy of each event name used by
+ * the events and event operators in existence, so that names can be
+ * compared by pointer rather than by string.  Each entry is an EventName
+ * structure.
+ *
+ * The table is rebuilt as events and operators are deserialised after a
+ * stateful re-exec, so there is no need to serialise it.
+ **/
+NihHash *event_names = NULL;
+
 
 /**
  * event_init:
  *
- * Initialise the event list.
+ * Initialise the event list, event queue and event names hash table.
  **/
 void
 event_init (void)
 {
 	if (! events)
 		events = NIH_MUST (nih_list_new (NULL));
+
+	if (! event_queue)
+		event_queue = NIH_MUST (nih_list_new (NULL));
+
+	if (! event_names)
+		event_names = NIH_MUST (nih_hash_string_new (NULL, 0));
+}
+
+/**
+ * event_name_intern:
+ * @parent: object that will use the name,
+ * @name: name to intern.
+ *
+ * Finds the shared copy of @name in the event names hash table, creating
+ * it if this is the first use of @name, and adds a reference to it from
+ * @parent.
+ *
+ * All event and event operator names are obtained from this function, so
+ * two names are equal if and only if they are the same pointer.  The
+ * returned string must not be modified, and should be released with
+ * nih_unref() rather than nih_free() if @parent no longer needs it.
+ *
+ * Returns: shared copy of @name or NULL if insufficient memory.
+ **/
+char *
+event_name_intern (const void *parent,
+		   const char *name)
+{
+	EventName *entry;
+	char      *str;
+
+	nih_assert (parent != NULL);
+	nih_assert (name != NULL);
+
+	event_init ();
+
+	entry = (EventName *)nih_hash_lookup (event_names, name);
+	if (entry) {
+		nih_ref (entry->name, parent);
+		return entry->name;
+	}
+
+	str = nih_strdup (NULL, name);
+	if (! str)
+		return NULL;
+
+	entry = nih_new (str, EventName);
+	if (! entry) {
+		nih_free (str);
+		return NULL;
+	}
+
+	nih_list_init (&entry->entry);
+	nih_alloc_set_destructor (entry, nih_list_destroy);
+
+	entry->name = str;
+
+	nih_hash_add (event_names, &entry->entry);
+	nih_ref (str, parent);
+
+	return str;
 }
 
 
@@ -146,11 +266,14 @@ event_new (const void  *parent,
 	event->blockers = 0;
 	nih_list_init (&event->blocking);
 
-	nih_alloc_set_destructor (event, nih_list_destroy);
+	nih_list_init (&event->queue.entry);
+	event->queue.data = event;
+
+	nih_alloc_set_destructor (event, event_destroy);
 
 
 	/* Fill in the event details */
-	event->name = nih_strdup (event, name);
+	event->name = event_name_intern (event, name);
 	if (! event->name) {
 		nih_free (event);
 		return NULL;
@@ -164,6 +287,10 @@ event_new (const void  *parent,
 	/* Place it in the pending list */
 	nih_debug ("Pending %s event", name);
 	nih_list_add (events, &event->entry);
+	nih_list_add (event_queue, &event->queue.entry);
+	event_count++;
+
+	TRACE (TRACE_RECORD_EVENT_NEW, event->name, 0, 0, 0);
 
 	nih_main_loop_interrupt ();
 
@@ -171,6 +298,33 @@ event_new (const void  *parent,
 }
 
 
+/**
+ * event_destroy:
+ * @event: event to be destroyed.
+ *
+ * Removes @event from the events list and from the event queue.
+ *
+ * Normally used or called from an nih_alloc() destructor so that the
+ * list items are automatically removed from their containing lists when
+ * freed.
+ *
+ * Returns: zero.
+ **/
+int
+event_destroy (Event *event)
+{
+	nih_assert (event != NULL);
+
+	if (! NIH_LIST_EMPTY (&event->entry))
+		event_count--;
+
+	nih_list_destroy (&event->queue.entry);
+	nih_list_destroy (&event->entry);
+
+	return 0;
+}
+
+
 /**
  * event_block:
  * @event: event to block.
@@ -197,6 +351,9 @@ event_block (Event *event)
  * event which blocks it from finishing, and wish to discard that reference.
  *
  * It must match a previous call to event_block().
+ *
+ * When the last blocker of a handling event is removed, the event is
+ * queued to be finished by the next call to event_poll().
  **/
 void
 event_unblock (Event *event)
@@ -205,68 +362,127 @@ event_unblock (Event *event)
 	nih_assert (event->blockers > 0);
 
 	event->blockers--;
+
+	/* Once nothing is blocking a handling event, it can be finished
+	 * so queue it for event_poll().
+	 */
+	if ((! event->blockers) && (event->progress == EVENT_HANDLING)) {
+		TRACE (TRACE_RECORD_EVENT_UNBLOCKED, event->name, 0, 0, 0);
+
+		event_init ();
+
+		if (NIH_LIST_EMPTY (&event->queue.entry)) {
+			nih_list_add (event_queue, &event->queue.entry);
+			nih_main_loop_interrupt ();
+		}
+	}
 }
 
 
 /**
  * event_poll:
  *
- * This function is used to process the list of events; any in the pending
+ * This function is used to process the queue of events; any in the pending
  * state are moved into the handling state and job states changed.  Any
  * in the finished state will have subscribers and jobs notified that the
  * event has completed.
  *
- * Events remain in the handling state while they have blocking jobs.
+ * Events remain in the handling state while they have blocking jobs, and
+ * are not looked at again until event_unblock() removes the last of them.
  *
- * This function will only return once the events list is empty, or all
- * events are in the handling state; so any time an event queues another,
- * it will be processed immediately.
+ * This function will only return once the event queue is empty; so any
+ * time an event queues another, it will be processed immediately.  Jobs
+ * whose starting or stopping event was skipped are moved on between
+ * events.
  *
  * Normally this function is used as a main loop callback.
  **/
 void
 event_poll (void)
 {
-	int poll_again;
-
 	event_init ();
 
-	do {
-		poll_again = FALSE;
+	for (;;) {
+		NihListEntry *entry;
+		Event        *event;
+
+		/* Jobs whose starting or stopping event was skipped carry
+		 * on here, now that no event is being handled.
+		 */
+		if (job_poll_deferred ())
+			continue;
+
+		if (NIH_LIST_EMPTY (event_queue))
+			break;
 
-		NIH_LIST_FOREACH_SAFE (events, iter) {
-			Event *event = (Event *)iter;
+		entry = (NihListEntry *)event_queue->next;
+		event = (Event *)entry->data;
 
-			/* Ignore events that we're handling and are
-			 * blocked, there's nothing we can do to hurry them.
-			 *
-			 * Decide whether to poll again based on the state
-			 * before handling the event; that way we always loop
-			 * at least once more after finding a pending or
-			 * finished event, in case they added new events as
-			 * a side effect that we missed.
-			 */
-			switch (event->progress) {
-			case EVENT_PENDING:
-				event_pending (event);
-				poll_again = TRUE;
-
-				/* fall through */
-			case EVENT_HANDLING:
-				if (event->blockers)
-					break;
-
-				event->progress = EVENT_FINISHED;
-				/* fall through */
-			case EVENT_FINISHED:
-				event_finished (event);
-				poll_again = TRUE;
+		nih_list_remove (&entry->entry);
+
+		/* Ignore events that we're handling and are blocked,
+		 * there's nothing we can do to hurry them; they will be
+		 * queued again once unblocked.
+		 */
+		switch (event->progress) {
+		case EVENT_PENDING:
+			event_pending (event);
+
+			/* fall through */
+		case EVENT_HANDLING:
+			if (event->blockers)
 				break;
-			default:
-				nih_assert_not_reached ();
-			}
+
+			event->progress = EVENT_FINISHED;
+			/* fall through */
+		case EVENT_FINISHED:
+			event_finished (event);
+			break;
+		default:
+			nih_assert_not_reached ();
 		}
-	} while (poll_again);
+	}
+}
+
+
+/**
+ * event_queue_admit:
+ * @count: number of events to be added.
+ *
+ * Used before emitting events on behalf of a D-Bus client to decide
+ * whether the events list has room for @count more.  Once the list holds
+ * event_queue_high_watermark events, no more are admitted until it has
+ * drained to event_queue_low_watermark, so that a client emitting events
+ * in a loop cannot grow it without bound.
+ *
+ * Events generated by the init daemon itself are never refused.
+ *
+ * Returns: TRUE if the events may be emitted, FALSE if not.
+ **/
+int
+event_queue_admit (size_t count)
+{
+	if (event_queue_high_watermark <= 0)
+		return TRUE;
+
+	if (event_queue_full
+	    && (event_count <= (size_t)event_queue_low_watermark)) {
+		nih_info (_("Event queue drained to %zu events, "
+			    "accepting events again"), event_count);
+		event_queue_full = FALSE;
+	}
+
+	if ((! event_queue_full)
+	    && (event_count >= (size_t)event_queue_high_watermark)) {
+		nih_warn (_("Event queue reached %zu events, "
+			    "refusing events until it drains"), event_count);
+		event_queue_full = TRUE;
+	}
+
+	if (event_queue_full)
+		return FALSE;
+
+	return (event_count + count <= (size_t)event_queue_high_watermark);
 }
 
 
@@ -290,6 +506,8 @@ event_pending (Event *event)
 	nih_info (_("Handling %s event"), event->name);
 	event->progress = EVENT_HANDLING;
 
+	TRACE (TRACE_RECORD_EVENT_HANDLING, event->name, 0, 0, 0);
+
 	event_pending_handle_jobs (event);
 }
 
@@ -298,23 +516,34 @@ event_pending (Event *event)
  * @event: event to be handled.
  *
  * This function is called whenever an event reaches the handling state.
- * It iterates the list of jobs and stops or starts any necessary.
+ * It iterates the job classes subscribed to the event and stops or starts
+ * any necessary.
  **/
 static void
 event_pending_handle_jobs (Event *event)
 {
-	int  empty = TRUE;
+	NihList *subscribers;
+	int      empty = TRUE;
 
 #ifdef ENABLE_CGROUPS
-	int  warn = FALSE;
+	int      warn = FALSE;
 #endif /* ENABLE_CGROUPS */
 
 	nih_assert (event != NULL);
 
 	job_class_init ();
 
-	NIH_HASH_FOREACH_SAFE (job_classes, iter) {
-		JobClass *class = (JobClass *)iter;
+	/* Only classes that name this event in their start on or stop on
+	 * condition can be affected by it, and jobs share the stop on
+	 * condition of their class.
+	 */
+	subscribers = job_class_subscribers (event->name);
+	if (! subscribers)
+		goto done;
+
+	NIH_LIST_FOREACH_SAFE (subscribers, iter) {
+		JobClassSubscriber *subscriber = (JobClassSubscriber *)iter;
+		JobClass           *class = subscriber->class;
 
 		/* Only affect jobs within the same session as the event
 		 * unless the event has no session, in which case do them
@@ -420,6 +649,7 @@ event_pending_handle_jobs (Event *event)
 		}
 	}
 
+done:
 #ifdef ENABLE_CGROUPS
 	if (warn)
 		nih_debug ("Cannot start some jobs until cgroup manager available");
@@ -464,6 +694,8 @@ event_finished (Event *event)
 
 	nih_debug ("Finished %s event", event->name);
 
+	TRACE (TRACE_RECORD_EVENT_FINISHED, event->name, 0, 0, 0);
+
 	NIH_LIST_FOREACH_SAFE (&event->blocking, iter) {
 		Blocked *blocked = (Blocked *)iter;
 
@@ -491,6 +723,29 @@ event_finished (Event *event)
 						  blocked->message));
 			}
 
+			break;
+		case BLOCKED_EMIT_EVENTS_METHOD:
+			/* Event was one of a batch that an emit method call
+			 * is waiting for, send the reply once the last of
+			 * them has finished, or an error if any failed.
+			 */
+			if (event->failed)
+				blocked->batch->failed = TRUE;
+
+			nih_assert (blocked->batch->pending > 0);
+			if (--blocked->batch->pending)
+				break;
+
+			if (blocked->batch->failed) {
+				NIH_ZERO (nih_dbus_message_error (
+						  blocked->batch->message,
+						  DBUS_INTERFACE_UPSTART ".Error.EventFailed",
+						  "%s", _("Event failed")));
+			} else {
+				NIH_ZERO (control_emit_events_reply (
+						  blocked->batch->message));
+			}
+
 			break;
 		default:
 			nih_assert_not_reached ();
@@ -806,12 +1061,17 @@ event_progress_str_to_enum (const char *progress)
 int
 event_to_index (const Event *event)
 {
-	int event_index = 0;
-	int found = FALSE;
+	StateIndex *index;
+	int         event_index = 0;
+	int         found = FALSE;
 
 	nih_assert (event);
 	event_init ();
 
+	index = state_index (STATE_INDEX_EVENTS);
+	if (index)
+		return state_index_find (index, event);
+
 	NIH_LIST_FOREACH (events, iter) {
 		Event *tmp = (Event *)iter;
 
@@ -841,11 +1101,16 @@ event_to_index (const Event *event)
 Event *
 event_from_index (int event_index)
 {
-	int i = 0;
+	StateIndex *index;
+	int         i = 0;
 
 	nih_assert (event_index >= 0);
 	event_init ();
 
+	index = state_index (STATE_INDEX_EVENTS);
+	if (index)
+		return (Event *)state_index_get (index, event_index);
+
 	NIH_LIST_FOREACH (events, iter) {
 		Event *event = (Event *)iter;
 
@@ -22,12 +22,31 @@
 
 #include <nih/macros.h>
 #include <nih/list.h>
+#include <nih/hash.h>
 
 #include "session.h"
 #include "state.h"
 
 #include <json.h>
 
+/**
+ * EVENT_QUEUE_HIGH_WATERMARK:
+ *
+ * The default number of events that may be outstanding before events
+ * emitted by D-Bus clients are refused.
+ **/
+#define EVENT_QUEUE_HIGH_WATERMARK 16384
+
+/**
+ * EVENT_QUEUE_LOW_WATERMARK:
+ *
+ * The default number of outstanding events that the list must drain to,
+ * once it has reached the high watermark, before events from D-Bus
+ * clients are accepted again.
+ **/
+#define EVENT_QUEUE_LOW_WATERMARK 12288
+
+
 /**
  * EventProgress:
  *
@@ -41,18 +60,33 @@ typedef enum event_progress {
 	EVENT_FINISHED
 } EventProgress;
 
+/**
+ * EventName:
+ * @entry: list header,
+ * @name: shared copy of name.
+ *
+ * Entries in the event names hash table.  Each is allocated as a child of
+ * @name, which is referenced by every event and event operator using it
+ * and freed, taking the entry with it, when the last of those is freed.
+ **/
+typedef struct event_name {
+	NihList  entry;
+	char    *name;
+} EventName;
+
 /**
  * Event:
  * @entry: list header,
  * @session: session the event is attached to,
- * @name: string name of the event,
+ * @name: string name of the event, shared via event_name_intern(),
  * @env: NULL-terminated array of environment variables,
  * @fd: open file descriptor associated with a particular
  *      socket-bridge socket (see socket-event(8)),
  * @progress: progress of event,
  * @failed: whether this event has failed,
  * @blockers: number of blockers for finishing,
- * @blocking: messages and jobs we're blocking.
+ * @blocking: messages and jobs we're blocking,
+ * @queue: entry in event_queue, data member is the event itself.
  *
  * Events are one of the core concepts of upstart; they occur whenever
  * something, somewhere changes state.  They are idenitied by a unique
@@ -64,6 +98,10 @@ typedef enum event_progress {
  * that event through the queue.
  *
  * Events remain in the handling state while @blockers is non-zero.
+ *
+ * @queue is only linked into event_queue while there is something for
+ * event_poll() to do for the event; that is, while it is pending,
+ * finished, or handling but no longer blocked.
  **/
 typedef struct event {
 	NihList          entry;
@@ -78,6 +116,8 @@ typedef struct event {
 
 	unsigned int     blockers;
 	NihList          blocking;
+
+	NihListEntry     queue;
 } Event;
 
 
@@ -85,17 +125,29 @@ NIH_BEGIN_EXTERN
 
 extern int      paused;
 extern NihList *events;
+extern NihList *event_queue;
+extern NihHash *event_names;
+extern size_t   event_count;
+extern int      event_queue_high_watermark;
+extern int      event_queue_low_watermark;
 
 
 void   event_init    (void);
 
+char * event_name_intern (const void *parent, const char *name)
+	__attribute__ ((warn_unused_result));
+
 Event *event_new     (const void *parent, const char *name, char **env);
+int    event_destroy (Event *event);
 
 void   event_block   (Event *event);
 void   event_unblock (Event *event);
 
 void   event_poll    (void);
 
+int    event_queue_admit (size_t count)
+	__attribute__ ((warn_unused_result));
+
 json_object *event_serialise (const Event *event)
 	__attribute__ ((warn_unused_result));
 
@@ -44,6 +44,15 @@
 #include "errors.h"
 
 
+/**
+ * EVENT_OPERATOR_GLOB_CHARS:
+ *
+ * Characters that have special meaning to fnmatch() in the value of an
+ * operator environment entry.
+ **/
+#define EVENT_OPERATOR_GLOB_CHARS "*?[\\"
+
+
 /**
  * event_operator_new:
  * @parent: parent object for new operator,
@@ -91,22 +100,30 @@ event_operator_new (const void         *parent,
 	oper->value = FALSE;
 
 	if (oper->type == EVENT_MATCH) {
-		oper->name = nih_strdup (oper, name);
+		oper->name = event_name_intern (oper, name);
 		if (! oper->name) {
 			nih_free (oper);
 			return NULL;
 		}
 
 		oper->env = env;
-		if (oper->env)
-			nih_ref (oper->env, oper);
 	} else {
 		oper->name = NULL;
 		oper->env = NULL;
 	}
 
+	oper->matches = NULL;
 	oper->event = NULL;
 
+	if (oper->env) {
+		if (event_operator_compile (oper) < 0) {
+			nih_free (oper);
+			return NULL;
+		}
+
+		nih_ref (oper->env, oper);
+	}
+
 	nih_alloc_set_destructor (oper, event_operator_destroy);
 
 	return oper;
@@ -156,6 +173,11 @@ event_operator_copy (const void          *parent,
 			nih_free (oper);
 			return NULL;
 		}
+
+		if (event_operator_compile (oper) < 0) {
+			nih_free (oper);
+			return NULL;
+		}
 	}
 
 	if (old_oper->event) {
@@ -248,6 +270,223 @@ event_operator_update (EventOperator *oper)
 	}
 }
 
+/**
+ * event_operator_match_parse:
+ * @match: match to fill in,
+ * @source: operator environment entry.
+ *
+ * Parses the operator environment entry @source, which may be a positional
+ * value or in KEY=VALUE or KEY!=VALUE form, into @match, deciding how the
+ * value should be compared against that of an event.
+ **/
+static void
+event_operator_match_parse (EventOperatorMatch *match,
+			    const char         *source)
+{
+	const char *oval;
+	size_t      len;
+
+	nih_assert (match != NULL);
+	nih_assert (source != NULL);
+
+	match->source = source;
+	match->negate = FALSE;
+
+	oval = strstr (source, "!=");
+	if (! oval)
+		oval = strchr (source, '=');
+
+	if (oval) {
+		match->name = source;
+		match->name_len = oval - source;
+
+		/* != means we negate the result (and skip the !) */
+		if (*oval == '!') {
+			match->negate = TRUE;
+			oval++;
+		}
+
+		/* Value to match against follows the equals. */
+		oval++;
+	} else {
+		/* Value to match against is the whole string. */
+		match->name = NULL;
+		match->name_len = 0;
+		oval = source;
+	}
+
+	len = strlen (oval);
+
+	match->value = oval;
+	match->value_len = len;
+
+	/* Only values containing a variable reference can be changed by
+	 * expansion, and those that don't contain a glob character can
+	 * only match themselves.  Globs consisting of a literal string
+	 * and a single leading or trailing star are common enough to be
+	 * worth treating specially too.
+	 */
+	if (strchr (oval, '$')) {
+		match->type = EVENT_MATCH_EXPAND;
+	} else if (strcspn (oval, EVENT_OPERATOR_GLOB_CHARS) == len) {
+		match->type = EVENT_MATCH_EXACT;
+	} else if ((oval[len - 1] == '*')
+		   && (strcspn (oval, EVENT_OPERATOR_GLOB_CHARS) == len - 1)) {
+		match->type = EVENT_MATCH_PREFIX;
+		match->value_len = len - 1;
+	} else if ((oval[0] == '*')
+		   && (strcspn (oval + 1, EVENT_OPERATOR_GLOB_CHARS) == len - 1)) {
+		match->type = EVENT_MATCH_SUFFIX;
+		match->value = oval + 1;
+		match->value_len = len - 1;
+	} else {
+		match->type = EVENT_MATCH_GLOB;
+	}
+}
+
+/**
+ * event_operator_match_value:
+ * @match: parsed operator environment entry,
+ * @eval: value from event,
+ * @env: NULL-terminated array of environment variables for expansion.
+ *
+ * Compares the value from @match against the event value @eval, ignoring
+ * whether @match is negated.
+ *
+ * Returns: TRUE if the values match, FALSE if they do not, or -1 if the
+ * operator value could not be expanded.
+ **/
+static int
+event_operator_match_value (const EventOperatorMatch *match,
+			    const char               *eval,
+			    char * const             *env)
+{
+	nih_local char *expoval = NULL;
+	size_t          len;
+	int             ret = FALSE;
+
+	nih_assert (match != NULL);
+	nih_assert (eval != NULL);
+
+	switch (match->type) {
+	case EVENT_MATCH_EXACT:
+		ret = (! strcmp (match->value, eval));
+		break;
+	case EVENT_MATCH_PREFIX:
+		ret = (! strncmp (match->value, eval, match->value_len));
+		break;
+	case EVENT_MATCH_SUFFIX:
+		len = strlen (eval);
+		ret = ((len >= match->value_len)
+		       && (! strcmp (match->value,
+				     eval + len - match->value_len)));
+		break;
+	case EVENT_MATCH_GLOB:
+		ret = (! fnmatch (match->value, eval, 0));
+		break;
+	case EVENT_MATCH_EXPAND:
+		/* Expand operator value against given environment before
+		 * matching; silently discard errors, since otherwise we'd
+		 * be excessively noisy on every event.
+		 */
+		while (! (expoval = environ_expand (NULL, match->value, env))) {
+			NihError *err;
+
+			err = nih_error_get ();
+			if (err->number != ENOMEM) {
+				nih_free (err);
+				return -1;
+			}
+			nih_free (err);
+		}
+
+		ret = (! fnmatch (expoval, eval, 0));
+		break;
+	default:
+		nih_assert_not_reached ();
+	}
+
+	return ret;
+}
+
+/**
+ * event_operator_compiled:
+ * @oper: operator to check.
+ *
+ * Checks whether the compiled matches of @oper are present and were
+ * built from the current entries of its environment.
+ *
+ * Returns: TRUE if the compiled matches of @oper may be used, FALSE
+ * otherwise.
+ **/
+static int
+event_operator_compiled (const EventOperator *oper)
+{
+	size_t i;
+
+	nih_assert (oper != NULL);
+
+	if (! (oper->matches && oper->env))
+		return FALSE;
+
+	for (i = 0; oper->env[i]; i++)
+		if (oper->matches[i].source != oper->env[i])
+			return FALSE;
+
+	return (oper->matches[i].source == NULL);
+}
+
+/**
+ * event_operator_compile:
+ * @oper: operator to compile.
+ *
+ * Parses each entry of the environment of @oper once, storing the results
+ * in its matches member so that event_operator_match() need not repeat
+ * the work for every event.  Any previously compiled matches are
+ * discarded.
+ *
+ * This is called automatically when an operator is created with, or
+ * copied from one with, environment; and by event_operator_match() if
+ * the environment has been changed since.
+ *
+ * This may only be called if the type of @oper is EVENT_MATCH.
+ *
+ * Returns: zero on success, negative value if insufficient memory.
+ **/
+int
+event_operator_compile (EventOperator *oper)
+{
+	EventOperatorMatch *matches;
+	size_t              len;
+
+	nih_assert (oper != NULL);
+	nih_assert (oper->type == EVENT_MATCH);
+
+	if (oper->matches) {
+		nih_free (oper->matches);
+		oper->matches = NULL;
+	}
+
+	if (! oper->env)
+		return 0;
+
+	for (len = 0; oper->env[len]; len++)
+		;
+
+	matches = nih_alloc (oper, sizeof (EventOperatorMatch) * (len + 1));
+	if (! matches)
+		return -1;
+
+	for (size_t i = 0; i < len; i++)
+		event_operator_match_parse (&matches[i], oper->env[i]);
+
+	memset (&matches[len], 0, sizeof (EventOperatorMatch));
+
+	oper->matches = matches;
+
+	return 0;
+}
+
 /**
  * event_operator_match:
  * @oper: operator to match against.
@@ -264,7 +503,8 @@ event_operator_update (EventOperator *oper)
  * Matching of environment is done first by position until the first variable
  * in @oper with a name specified is found, and subsequently by name.  Each
  * value is matched against the equivalent in @event as a glob, undergoing
- * expansion against @env first.
+ * expansion against @env first; values compiled by event_operator_compile()
+ * as not needing either are compared directly.
  *
  * This may only be called if the type of @oper is EVENT_MATCH.
  *
@@ -275,8 +515,9 @@ event_operator_match (EventOperator *oper,
 		      Event         *event,
 		      char * const  *env)
 {
-	char * const *oenv;
-	char * const *eenv;
+	EventOperatorMatch  parsed;
+	char * const       *eenv;
+	int                 compiled;
 
 	nih_assert (oper != NULL);
 	nih_assert (oper->type == EVENT_MATCH);
@@ -284,43 +525,44 @@ event_operator_match (EventOperator *oper,
 	nih_assert (oper->node.right == NULL);
 	nih_assert (event != NULL);
 
-	/* Names must match */
-	if (strcmp (oper->name, event->name))
+	/* Names must match; both are interned so need only be compared
+	 * by pointer.
+	 */
+	if (oper->name != event->name)
 		return FALSE;
 
+	if (! oper->env)
+		return TRUE;
+
+	/* Use the compiled form of the operator environment, compiling it
+	 * again if it has been changed; should that fail, each entry is
+	 * parsed as we go instead.
+	 */
+	compiled = (event_operator_compiled (oper)
+		    || (event_operator_compile (oper) == 0));
+
 	/* Match operator environment variables against those from the event,
 	 * starting both from the beginning.
 	 */
-	for (oenv = oper->env, eenv = event->env; oenv && *oenv;
-	     oenv++, eenv++) {
-		nih_local char *expoval = NULL;
-		char           *oval, *eval;
-		int             negate = FALSE;
-		int             ret;
-
-		oval = strstr (*oenv, "!=");
-		if (! oval)
-			oval = strchr (*oenv, '=');
-
-		if (oval) {
-			/* Hunt through the event environment to find the
-			 * equivalent entry */
-			eenv = environ_lookup (event->env, *oenv,
-					       oval - *oenv);
-
-			/* != means we negate the result (and skip the !) */
-			if (*oval == '!') {
-				negate = TRUE;
-				oval++;
-			}
-
-			/* Value to match against follows the equals. */
-			oval++;
+	eenv = event->env;
+	for (size_t i = 0; oper->env[i]; i++, eenv++) {
+		const EventOperatorMatch *match;
+		char                     *eval;
+		int                       ret;
+
+		if (compiled) {
+			match = &oper->matches[i];
 		} else {
-			/* Value to match against is the whole string. */
-			oval = *oenv;
+			event_operator_match_parse (&parsed, oper->env[i]);
+			match = &parsed;
 		}
 
+		/* Hunt through the event environment to find the
+		 * equivalent entry */
+		if (match->name)
+			eenv = environ_lookup (event->env, match->name,
+					       match->name_len);
+
 		/* Make sure we haven't gone off the end of the event
 		 * environment array; this catches both too many positional
 		 * matches and no such variable.
@@ -336,24 +578,11 @@ event_operator_match (EventOperator *oper,
 		nih_assert (eval != NULL);
 		eval++;
 
-		/* Expand operator value against given environment before
-		 * matching; silently discard errors, since otherwise we'd
-		 * be excessively noisy on every event.
-		 */
-		while (! (expoval = environ_expand (NULL, oval, env))) {
-			NihError *err;
-
-			err = nih_error_get ();
-			if (err->number != ENOMEM) {
-				nih_free (err);
-				return FALSE;
-			}
-			nih_free (err);
-		}
-
-		ret = fnmatch (expoval, eval, 0);
+		ret = event_operator_match_value (match, eval, env);
+		if (ret < 0)
+			return FALSE;
 
-		if (negate ? (! ret) : ret)
+		if (match->negate ? ret : (! ret))
 			return FALSE;
 	}
 
@@ -38,6 +38,53 @@ typedef enum event_operator_type {
 	EVENT_MATCH
 } EventOperatorType;
 
+/**
+ * EventOperatorMatchType:
+ *
+ * This is used to record how an environment value of an EVENT_MATCH
+ * operator is compared against the value from an event, as decided by
+ * event_operator_compile().
+ **/
+typedef enum event_operator_match_type {
+	EVENT_MATCH_EXACT,
+	EVENT_MATCH_PREFIX,
+	EVENT_MATCH_SUFFIX,
+	EVENT_MATCH_GLOB,
+	EVENT_MATCH_EXPAND
+} EventOperatorMatchType;
+
+/**
+ * EventOperatorMatch:
+ * @source: operator environment entry compiled,
+ * @type: how @value is compared,
+ * @negate: TRUE if the result of the comparison is negated,
+ * @name: name of the event variable to compare, or NULL if positional,
+ * @name_len: length of @name,
+ * @value: value or pattern to compare against,
+ * @value_len: length of @value.
+ *
+ * Each of these structures is the pre-parsed form of a single entry in
+ * the environment of an EVENT_MATCH operator.  @name and @value point
+ * into @source rather than being copies.
+ *
+ * EVENT_MATCH_EXACT values contain no glob or variable references and
+ * are compared with strcmp(), EVENT_MATCH_PREFIX and EVENT_MATCH_SUFFIX
+ * values consist of a literal string preceded or followed by a single
+ * "*" and are compared with strncmp(), the "*" being excluded from
+ * @value.  EVENT_MATCH_GLOB values are passed to fnmatch() as-is, and
+ * only EVENT_MATCH_EXPAND values, which contain a "$", are expanded
+ * against the job environment first.
+ **/
+typedef struct event_operator_match {
+	const char             *source;
+	EventOperatorMatchType  type;
+	int                     negate;
+	const char             *name;
+	size_t                  name_len;
+	const char             *value;
+	size_t                  value_len;
+} EventOperatorMatch;
+
 /**
  * EventOperator:
  * @node: tree node,
@@ -45,6 +92,7 @@ typedef enum event_operator_type {
  * @value: operator value,
  * @name: name of event to match (EVENT_MATCH only),
  * @env: environment variables of event to match (EVENT_MATCH only),
+ * @matches: compiled form of @env (EVENT_MATCH only),
  * @event: event matched (EVENT_MATCH only).
  *
  * This structure is used to build up an event expression tree; the leaf
@@ -59,6 +107,10 @@ typedef enum event_operator_type {
  *
  * Once an event has been matched, the @event member is set and a reference
  * held until the structure is cleared.
+ *
+ * @matches is a NULL-terminated array built from @env by
+ * event_operator_compile(), it is rebuilt automatically if the entries
+ * of @env are replaced.
  **/
 typedef struct event_operator {
 	NihTree             node;
@@ -68,6 +120,7 @@ typedef struct event_operator {
 
 	char               *name;
 	char              **env;
+	EventOperatorMatch *matches;
 
 	Event              *event;
 } EventOperator;
@@ -86,6 +139,9 @@ EventOperator *event_operator_copy        (const void *parent,
 int            event_operator_destroy     (EventOperator *oper);
 
 void           event_operator_update      (EventOperator *oper);
+
+int            event_operator_compile     (EventOperator *oper)
+	__attribute__ ((warn_unused_result));
 int            event_operator_match       (EventOperator *oper, Event *event,
 					   char * const *env);
 
@@ -0,0 +1,213 @@
+/* upstart
+ *
+ * hash.c - growth policy for hash tables
+ *
+ * Copyright © 2015 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <stdint.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/logging.h>
+
+#include "hash.h"
+
+
+/**
+ * hash_sizes:
+ *
+ * Prime bin counts that hash_grow() chooses between; a table is only
+ * ever resized to a larger one.
+ **/
+static const size_t hash_sizes[] = {
+	17, 37, 79, 163, 331, 673, 1361, 2729, 5471, 10949, 21911, 43853,
+	87719, 175447, 350899, 701819, 1403641, 2807303, 5614657, 11229331,
+};
+
+
+/**
+ * hash_add:
+ * @hash: destination hash table,
+ * @entry: entry to be added.
+ *
+ * Adds @entry to @hash exactly as nih_hash_add() does, then grows @hash
+ * if the bin @entry was added to has become long, so that tables created
+ * with a default size of nih_hash_string_new() keep short bins however
+ * many entries are added.
+ *
+ * Entries sharing a key always share a bin however large the table, so
+ * only entries with different keys count towards the length of a bin.
+ * The table is grown straight to the next of hash_sizes rather than by
+ * hash_grow(), which would have to count every entry to decide; a bin
+ * holding more than HASH_CHAIN_MAX different keys is already a sign of
+ * a table too small for its entries.
+ *
+ * Since growing moves every entry to a new bin, this must not be called
+ * while @hash is being iterated.  Failure to grow is not an error; the
+ * table remains valid at its existing size.
+ *
+ * Returns: @entry.
+ **/
+NihList *
+hash_add (NihHash *hash,
+	  NihList *entry)
+{
+	NihList    *bin;
+	const void *last = NULL;
+	size_t      len = 0;
+
+	nih_assert (hash != NULL);
+	nih_assert (entry != NULL);
+
+	nih_hash_add (hash, entry);
+
+	bin = &hash->bins[hash->hash_function (hash->key_function (entry))
+			  % hash->size];
+
+	NIH_LIST_FOREACH (bin, iter) {
+		const void *key = hash->key_function (iter);
+
+		/* Count a run of entries with the same key only once */
+		if (last && (! hash->cmp_function (key, last)))
+			continue;
+
+		last = key;
+
+		if (++len > HASH_CHAIN_MAX) {
+			for (size_t i = 0; i < NIH_N_ELEMENTS (hash_sizes); i++) {
+				if (hash_sizes[i] > hash->size) {
+					(void)hash_resize (hash, hash_sizes[i]);
+					break;
+				}
+			}
+
+			break;
+		}
+	}
+
+	return entry;
+}
+
+/**
+ * hash_grow:
+ * @hash: hash table to grow.
+ *
+ * Resizes @hash if it holds more than HASH_LOAD_MAX entries per bin, to
+ * the smallest of hash_sizes with room for twice its current entries.
+ *
+ * Like hash_add(), this must not be called while @hash is being iterated.
+ *
+ * Returns: zero if @hash is large enough or was resized, negative value
+ * on insufficient memory.
+ **/
+int
+hash_grow (NihHash *hash)
+{
+	size_t count;
+	size_t size = 0;
+
+	nih_assert (hash != NULL);
+
+	count = hash_count (hash);
+	if (count <= hash->size * HASH_LOAD_MAX)
+		return 0;
+
+	for (size_t i = 0; i < NIH_N_ELEMENTS (hash_sizes); i++) {
+		size = hash_sizes[i];
+		if (size >= count * 2)
+			break;
+	}
+
+	if (size <= hash->size)
+		return 0;
+
+	return hash_resize (hash, size);
+}
+
+/**
+ * hash_resize:
+ * @hash: hash table to resize,
+ * @size: new number of bins.
+ *
+ * Moves every entry in @hash into a new set of @size bins.  Entries
+ * that share a bin keep their relative order, so nih_hash_search()
+ * still returns entries with the same key in the order they were added.
+ *
+ * Returns: zero on success, negative value on insufficient memory in
+ * which case @hash is unchanged.
+ **/
+int
+hash_resize (NihHash *hash,
+	     size_t   size)
+{
+	NihList *bins;
+
+	nih_assert (hash != NULL);
+	nih_assert (size > 0);
+
+	bins = nih_alloc (hash, sizeof (NihList) * size);
+	if (! bins)
+		return -1;
+
+	for (size_t i = 0; i < size; i++)
+		nih_list_init (&bins[i]);
+
+	for (size_t i = 0; i < hash->size; i++) {
+		while (! NIH_LIST_EMPTY (&hash->bins[i])) {
+			NihList  *entry = hash->bins[i].next;
+			uint32_t  hashval;
+
+			hashval = hash->hash_function (hash->key_function (entry));
+			nih_list_add (&bins[hashval % size], entry);
+		}
+	}
+
+	nih_free (hash->bins);
+
+	hash->bins = bins;
+	hash->size = size;
+
+	return 0;
+}
+
+/**
+ * hash_count:
+ * @hash: hash table.
+ *
+ * Returns: number of entries in @hash.
+ **/
+size_t
+hash_count (const NihHash *hash)
+{
+	size_t count = 0;
+
+	nih_assert (hash != NULL);
+
+	for (size_t i = 0; i < hash->size; i++) {
+		NIH_LIST_FOREACH (&hash->bins[i], iter)
+			count++;
+	}
+
+	return count;
+}
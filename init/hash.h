@@ -0,0 +1,55 @@
+/* upstart
+ *
+ * Copyright © 2015 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_HASH_H
+#define INIT_HASH_H
+
+#include <nih/macros.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+
+
+/**
+ * HASH_CHAIN_MAX:
+ *
+ * Number of entries with different keys a bin may hold before
+ * hash_add() grows the table.
+ **/
+#define HASH_CHAIN_MAX 8
+
+/**
+ * HASH_LOAD_MAX:
+ *
+ * Average number of entries per bin above which hash_grow() resizes a
+ * table.
+ **/
+#define HASH_LOAD_MAX 1
+
+
+NIH_BEGIN_EXTERN
+
+NihList *hash_add    (NihHash *hash, NihList *entry);
+int      hash_grow   (NihHash *hash);
+int      hash_resize (NihHash *hash, size_t size)
+	__attribute__ ((warn_unused_result));
+size_t   hash_count  (const NihHash *hash)
+	__attribute__ ((warn_unused_result));
+
+NIH_END_EXTERN
+
+#endif /* INIT_HASH_H */
@@ -34,6 +34,7 @@
 #include <nih/list.h>
 #include <nih/hash.h>
 #include <nih/signal.h>
+#include <nih/main.h>
 #include <nih/logging.h>
 
 #include <nih-dbus/dbus_error.h>
@@ -57,6 +58,8 @@
 #include "parse_job.h"
 #include "state.h"
 #include "apparmor.h"
+#include "trace.h"
+#include "hash.h"
 
 #ifdef ENABLE_CGROUPS
 #include "cgroup.h"
@@ -92,6 +95,31 @@ job_deserialise_kill_timer (json_object *json)
 static int 
 job_destroy (Job *job);
 
+static void job_defer (Job *job);
+
+/**
+ * skip_unobserved_events:
+ *
+ * If TRUE, the starting, started, stopping and stopped events for a job
+ * are not emitted at all when no job class refers to them in its start on
+ * or stop on condition; the job instead carries on as though the event
+ * had been emitted and finished.
+ *
+ * Such events are then not visible to D-Bus clients either, so this is
+ * only enabled by default in user mode.
+ **/
+int skip_unobserved_events = FALSE;
+
+/**
+ * job_deferred:
+ *
+ * List of jobs in the starting or stopping state whose event was skipped,
+ * waiting for job_poll_deferred() to move them on as though the event had
+ * finished.  Each item is an NihListEntry allocated as a child of the job,
+ * so that a freed job drops out of the list.
+ **/
+static NihList *job_deferred = NULL;
+
 /**
  * job_destroy:
  *
@@ -234,7 +262,7 @@ job_new (JobClass   *class,
 	job->trace_forks = 0;
 	job->trace_state = TRACE_NONE;
 
-	nih_hash_add (class->instances, &job->entry);
+	hash_add (class->instances, &job->entry);
 
 	NIH_LIST_FOREACH (control_conns, iter) {
 		NihListEntry   *entry = (NihListEntry *)iter;
@@ -412,6 +440,8 @@ job_change_state (Job      *job,
 		old_state = job->state;
 		job->state = state;
 
+		TRACE (TRACE_RECORD_JOB_STATE, job_name (job), job->state, 0, 0);
+
 		NIH_LIST_FOREACH (control_conns, iter) {
 			NihListEntry   *entry = (NihListEntry *)iter;
 			DBusConnection *conn = (DBusConnection *)entry->data;
@@ -453,7 +483,13 @@ job_change_state (Job      *job,
 			job->failed_process = PROCESS_INVALID;
 			job->exit_status = 0;
 
+			/* If the event was skipped, there's nothing to
+			 * wait for; but we may be handling another event,
+			 * so leave moving on to the main loop.
+			 */
 			job->blocker = job_emit_event (job);
+			if (! job->blocker)
+				job_defer (job);
 
 			break;
 		case JOB_SECURITY_SPAWNING:
@@ -586,6 +622,8 @@ job_change_state (Job      *job,
 				    || (old_state == JOB_PRE_STOP));
 
 			job->blocker = job_emit_event (job);
+			if (! job->blocker)
+				job_defer (job);
 
 			break;
 		case JOB_KILLED:
@@ -662,6 +700,71 @@ job_change_state (Job      *job,
 	}
 }
 
+/**
+ * job_defer:
+ * @job: job in the starting or stopping state.
+ *
+ * Called instead of blocking @job on its starting or stopping event when
+ * that event was skipped.  Moving the job on at once could run it all the
+ * way to the waiting state, and free its class, in the middle of event
+ * handling, so it is queued for job_poll_deferred() instead.
+ **/
+static void
+job_defer (Job *job)
+{
+	NihListEntry *entry;
+
+	nih_assert (job != NULL);
+	nih_assert ((job->state == JOB_STARTING)
+		    || (job->state == JOB_STOPPING));
+
+	if (! job_deferred)
+		job_deferred = NIH_MUST (nih_list_new (NULL));
+
+	entry = NIH_MUST (nih_list_entry_new (job));
+	entry->data = job;
+
+	nih_list_add (job_deferred, &entry->entry);
+	nih_main_loop_interrupt ();
+}
+
+/**
+ * job_poll_deferred:
+ *
+ * Moves each job queued by job_defer() into its next state, as
+ * event_finished() would have done had its event not been skipped.
+ *
+ * Called from event_poll() between events, where no event is being
+ * handled.
+ *
+ * Returns: TRUE if any job was moved on, FALSE if none were queued.
+ **/
+int
+job_poll_deferred (void)
+{
+	int polled = FALSE;
+
+	if (! job_deferred)
+		return FALSE;
+
+	while (! NIH_LIST_EMPTY (job_deferred)) {
+		NihListEntry *entry = (NihListEntry *)job_deferred->next;
+		Job          *job = (Job *)entry->data;
+
+		nih_free (entry);
+		polled = TRUE;
+
+		if (job->blocker
+		    || ((job->state != JOB_STARTING)
+			&& (job->state != JOB_STOPPING)))
+			continue;
+
+		job_change_state (job, job_next_state (job));
+	}
+
+	return polled;
+}
+
 /**
  * job_next_state:
  * @job: job undergoing state change.
@@ -1023,7 +1126,12 @@ job_finished (Job *job,
  * that caused the failure and either an EXIT_STATUS or EXIT_SIGNAL
  * environment variable detailing it.
  *
- * Returns: new Event in the queue.
+ * When skip_unobserved_events is TRUE and no job class refers to the
+ * event, nothing is emitted and NULL is returned; callers should then
+ * proceed as if the event had already finished, using job_defer() if
+ * they might be called while an event is being handled.
+ *
+ * Returns: new Event in the queue, or NULL if the event was skipped.
  **/
 Event *
 job_emit_event (Job *job)
@@ -1058,6 +1166,18 @@ job_emit_event (Job *job)
 		nih_assert_not_reached ();
 	}
 
+	/* Don't bother constructing an event that no job could react to */
+	if (skip_unobserved_events) {
+		NihList *subscribers;
+
+		subscribers = job_class_subscribers (name);
+		if ((! subscribers) || NIH_LIST_EMPTY (subscribers)) {
+			nih_debug ("Skipping unobserved %s event for %s",
+				   name, job_name (job));
+			return NULL;
+		}
+	}
+
 	len = 0;
 	env = NIH_MUST (nih_str_array_new (NULL));
 
@@ -1610,8 +1730,9 @@ job_reload (Job            *job,
 		return -1;
 	}
 
-	if (kill (job->pid[PROCESS_MAIN], job->class->reload_signal) < 0)
-		nih_return_system_error (-1);
+	if (job_process_send_signal (job, PROCESS_MAIN,
+				     job->class->reload_signal, FALSE) < 0)
+		return -1;
 
 	NIH_ZERO (job_reload_reply (message));
 	return 0;
@@ -1798,6 +1919,7 @@ job_serialise (const Job *job)
 {
 	json_object      *json;
 	json_object      *json_pid;
+	json_object      *json_pidfd;
 	json_object      *json_fds;
 	json_object      *json_logs;
 	json_object      *json_handler_data;
@@ -1856,6 +1978,23 @@ job_serialise (const Job *job)
 
 	json_object_object_add (json, "pid", json_pid);
 
+	/* Pass the pidfds held for the processes when the new instance
+	 * inherits our file descriptors.
+	 */
+	if (state_pass_fds) {
+		int pidfds[PROCESS_LAST];
+
+		for (int process = 0; process < PROCESS_LAST; process++)
+			pidfds[process] = job_process_pidfd (job, process);
+
+		json_pidfd = state_serialise_int_array (int, pidfds,
+							PROCESS_LAST);
+		if (! json_pidfd)
+			goto error;
+
+		json_object_object_add (json, "pidfd", json_pidfd);
+	}
+
 	/* Encode the blocking event as an index number which represents
 	 * the event's position in the JSON events array.
 	 */
@@ -2035,9 +2174,12 @@ job_deserialise (JobClass *parent, json_object *json)
 	json_object    *json_kill_timer;
 	json_object    *json_fds;
 	json_object    *json_pid;
+	json_object    *json_pidfd;
 	json_object    *json_logs;
 	json_object    *json_process_data;
 	json_object    *json_stop_on = NULL;
+	int            *pidfds = NULL;
+	size_t          pidfds_len = 0;
 	size_t          len;
 	int             ret;
 
@@ -2143,6 +2285,14 @@ job_deserialise (JobClass *parent, json_object *json)
 			goto error;
 	}
 
+	/* A job left in the starting or stopping state without an event
+	 * to wait for had its event skipped; queue it to carry on.
+	 */
+	if ((! job->blocker)
+	    && ((job->state == JOB_STARTING)
+		|| (job->state == JOB_STOPPING)))
+		job_defer (job);
+
 	if (! state_get_json_enum_var (json,
 				process_type_str_to_enum,
 				"kill_process", job->kill_process))
@@ -2228,6 +2378,31 @@ job_deserialise (JobClass *parent, json_object *json)
 		goto error;
 	}
 
+	/* Older versions, or a state file, don't pass pidfds */
+	if (json_object_object_get_ex (json, "pidfd", &json_pidfd)) {
+		ret = state_deserialise_int_array (job, json_pidfd,
+				int, &pidfds, &pidfds_len);
+		if (ret < 0)
+			goto error;
+	}
+
+	/* Index the restored pids so job_process_find() can see them,
+	 * adopting any pidfds that still refer to them.
+	 */
+	for (int process = 0; process < PROCESS_LAST; process++) {
+		pid_t pid = job->pid[process];
+		int   pidfd = -1;
+
+		if (pidfds && ((size_t)process < pidfds_len))
+			pidfd = pidfds[process];
+
+		job->pid[process] = 0;
+		job_process_set_pid_with_fd (job, process, pid, pidfd);
+	}
+
+	if (pidfds)
+		nih_free (pidfds);
+
 	if (! state_get_json_int_var_to_obj (json, job, trace_forks))
 			goto error;
 
@@ -2645,7 +2820,7 @@ job_child_error_handler (Job *job, ProcessType process)
 	nih_assert (process > PROCESS_INVALID);
 	nih_assert (process < PROCESS_LAST);
 
-	job->pid[process] = 0;
+	job_process_set_pid (job, process, 0);
 
 	switch (process) {
 	case PROCESS_SECURITY:
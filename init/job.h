@@ -233,6 +233,7 @@ void        job_change_goal     (Job *job, JobGoal goal);
 
 void        job_change_state    (Job *job, JobState state);
 JobState    job_next_state      (Job *job);
+int         job_poll_deferred   (void);
 
 void        job_failed          (Job *job, ProcessType process, int status);
 void        job_finished        (Job *job, int failed);
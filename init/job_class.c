@@ -29,6 +29,10 @@
 #include <signal.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <grp.h>
+#include <pwd.h>
+#include <limits.h>
+#include <time.h>
 
 #include <nih/macros.h>
 #include <nih/alloc.h>
@@ -36,6 +40,7 @@
 #include <nih/list.h>
 #include <nih/hash.h>
 #include <nih/tree.h>
+#include <nih/error.h>
 #include <nih/logging.h>
 
 #include <nih-dbus/dbus_error.h>
@@ -50,11 +55,14 @@
 #include "session.h"
 #include "job_class.h"
 #include "job.h"
+#include "job_process.h"
 #include "event_operator.h"
 #include "blocked.h"
 #include "conf.h"
 #include "control.h"
 #include "parse_job.h"
+#include "hash.h"
+#include "errors.h"
 
 #ifdef ENABLE_CGROUPS
 #include "cgroup.h"
@@ -73,6 +81,12 @@ extern char **environ;
 /* Prototypes for static functions */
 static void  job_class_add (JobClass *class);
 static int   job_class_remove (JobClass *class, const Session *session);
+static void  job_class_subscribe (JobClass *class, EventOperator *root);
+static void  job_class_unsubscribe (JobClass *class);
+static int   job_class_subscriber_destroy (JobClassSubscriber *subscriber);
+static int   job_class_subscription_destroy (JobClassSubscription *sub);
+static int   job_class_deserialise_fields (JobClass *class, json_object *json)
+	__attribute__ ((warn_unused_result));
 
 /**
  * default_console:
@@ -92,6 +106,19 @@ int default_console = -1;
  **/
 NihHash *job_classes = NULL;
 
+/**
+ * job_class_subscriptions:
+ *
+ * This hash table maps event names to the registered job classes whose
+ * start on or stop on condition names that event, so that an event need
+ * only be matched against the classes that can be affected by it.
+ * Each entry is a JobClassSubscription structure.
+ *
+ * Job instances share the stop on condition of their class, so they are
+ * reached through the class rather than being indexed separately.
+ **/
+NihHash *job_class_subscriptions = NULL;
+
 /**
  * job_environ:
  *
@@ -117,6 +144,9 @@ job_class_init (void)
 {
 	if (! job_classes)
 		job_classes = NIH_MUST (nih_hash_string_new (NULL, 0));
+
+	if (! job_class_subscriptions)
+		job_class_subscriptions = NIH_MUST (nih_hash_string_new (NULL, 0));
 }
 
 /**
@@ -398,6 +428,11 @@ job_class_new (const void *parent,
 
 	nih_list_init (&class->cgroups);
 
+	class->fast_spawn = FALSE;
+	class->credentials = NULL;
+
+	nih_list_init (&class->subscriptions);
+
 	return class;
 
 error:
@@ -405,6 +440,204 @@ error:
 	return NULL;
 }
 
+/**
+ * job_class_fast_spawn:
+ * @class: job class to check.
+ *
+ * Determines whether the processes of @class may be spawned with
+ * posix_spawn() rather than fork(), which is the case when they need
+ * no setup other than their standard file descriptors, session, signal
+ * state, working directory and file mode creation mask.
+ *
+ * Processes spawned in this way keep our own supplementary groups rather
+ * than those of root, and are not traced, so classes that expect the
+ * main process to fork are excluded.
+ *
+ * This should be called once the class has been parsed, with the result
+ * stored in its fast_spawn member.
+ *
+ * Returns: TRUE if processes of @class may be spawned quickly,
+ * FALSE otherwise.
+ **/
+int
+job_class_fast_spawn (const JobClass *class)
+{
+	nih_assert (class != NULL);
+
+	if (class->console != CONSOLE_NONE)
+		return FALSE;
+
+	if ((class->expect == EXPECT_DAEMON) || (class->expect == EXPECT_FORK))
+		return FALSE;
+
+	if (class->debug || class->session)
+		return FALSE;
+
+	if (class->chroot || class->chdir || class->setuid || class->setgid)
+		return FALSE;
+
+	if (class->apparmor_switch)
+		return FALSE;
+
+	if ((class->nice != JOB_NICE_INVALID)
+	    || (class->oom_score_adj != JOB_DEFAULT_OOM_SCORE_ADJ))
+		return FALSE;
+
+	for (int i = 0; i < RLIMIT_NLIMITS; i++)
+		if (class->limits[i])
+			return FALSE;
+
+#ifdef ENABLE_CGROUPS
+	if (! NIH_LIST_EMPTY (&class->cgroups))
+		return FALSE;
+#endif /* ENABLE_CGROUPS */
+
+	return TRUE;
+}
+
+/**
+ * job_class_credentials:
+ * @class: job class to resolve ids for.
+ *
+ * Looks up the user and group ids named by the setuid and setgid stanzas
+ * of @class and, when we are running as root, the supplementary groups
+ * processes should have, storing them in the credentials member of
+ * @class so that they need not be looked up in every child.
+ *
+ * Resolved ids are reused for JOB_CREDENTIALS_TTL seconds; since a job
+ * class is replaced whenever its configuration is reloaded, that
+ * also discards them.
+ *
+ * The ids of jobs with a chroot can only be looked up within it, so
+ * the credentials member is left as NULL for them.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+job_class_credentials (JobClass *class)
+{
+	JobCredentials  *creds;
+	struct timespec  now;
+	struct passwd   *pwd = NULL;
+	struct group    *grp;
+
+	nih_assert (class != NULL);
+
+	if (class->chroot || (class->session && class->session->chroot))
+		return 0;
+
+	if (clock_gettime (CLOCK_MONOTONIC, &now) < 0)
+		nih_return_system_error (-1);
+
+	if (class->credentials) {
+		if ((now.tv_sec - class->credentials->resolved)
+		    < JOB_CREDENTIALS_TTL)
+			return 0;
+
+		nih_free (class->credentials);
+		class->credentials = NULL;
+	}
+
+	creds = nih_new (class, JobCredentials);
+	if (! creds)
+		nih_return_no_memory_error (-1);
+
+	creds->resolved = now.tv_sec;
+	creds->uid = (uid_t)-1;
+	creds->gid = (gid_t)-1;
+	creds->groups = NULL;
+	creds->ngroups = 0;
+
+	/* Without resetting errno, it's impossible to distinguish between
+	 * a non-existent user or group and an error during lookup.
+	 */
+	if (class->setuid) {
+		errno = 0;
+		pwd = getpwnam (class->setuid);
+		if (! pwd) {
+			if (errno != 0) {
+				nih_error_raise_system ();
+			} else {
+				nih_error_raise (JOB_PROCESS_INVALID_SETUID,
+						 _(JOB_PROCESS_INVALID_SETUID_STR));
+			}
+			goto error;
+		}
+
+		creds->uid = pwd->pw_uid;
+		/* This will be overridden if setgid is also set: */
+		creds->gid = pwd->pw_gid;
+	}
+
+	if (class->setgid) {
+		errno = 0;
+		grp = getgrnam (class->setgid);
+		if (! grp) {
+			if (errno != 0) {
+				nih_error_raise_system ();
+			} else {
+				nih_error_raise (JOB_PROCESS_INVALID_SETGID,
+						 _(JOB_PROCESS_INVALID_SETGID_STR));
+			}
+			goto error;
+		}
+
+		creds->gid = grp->gr_gid;
+	}
+
+	/* Build the list that initgroups() would set up for the user,
+	 * including the group being changed to, or our own group.  Only
+	 * root can change it, so leave it alone otherwise.
+	 */
+	if (geteuid () == 0) {
+		gid_t group;
+		int   ngroups = 32;
+
+		if (! pwd) {
+			pwd = getpwuid (geteuid ());
+			if (! pwd) {
+				nih_error_raise_system ();
+				goto error;
+			}
+		}
+
+		group = class->setgid ? creds->gid : getegid ();
+
+		for (;;) {
+			int len = ngroups;
+
+			creds->groups = nih_realloc (creds->groups, creds,
+						     sizeof (gid_t) * ngroups);
+			if (! creds->groups) {
+				nih_error_raise_no_memory ();
+				goto error;
+			}
+
+			if (getgrouplist (pwd->pw_name, group,
+					  creds->groups, &len) >= 0) {
+				creds->ngroups = len;
+				break;
+			}
+
+			/* Older libraries don't return the number needed */
+			ngroups = (len > ngroups) ? len : ngroups * 2;
+			if (ngroups > NGROUPS_MAX) {
+				errno = EINVAL;
+				nih_error_raise_system ();
+				goto error;
+			}
+		}
+	}
+
+	class->credentials = creds;
+
+	return 0;
+
+error:
+	nih_free (creds);
+	return -1;
+}
+
 /**
  * job_class_get_registered:
  *
@@ -611,7 +844,10 @@ job_class_add (JobClass *class)
 	if (! class)
 		return;
 
-	nih_hash_add (job_classes, &class->entry);
+	hash_add (job_classes, &class->entry);
+
+	job_class_subscribe (class, class->start_on);
+	job_class_subscribe (class, class->stop_on);
 
 	NIH_LIST_FOREACH (control_conns, iter) {
 		NihListEntry   *entry = (NihListEntry *)iter;
@@ -674,6 +910,8 @@ job_class_remove (JobClass *class, const Session *session)
 
 	nih_list_remove (&class->entry);
 
+	job_class_unsubscribe (class);
+
 	NIH_LIST_FOREACH (control_conns, iter) {
 		NihListEntry   *entry = (NihListEntry *)iter;
 		DBusConnection *conn = (DBusConnection *)entry->data;
@@ -684,6 +922,195 @@ job_class_remove (JobClass *class, const Session *session)
 	return TRUE;
 }
 
+/**
+ * job_class_subscribe:
+ * @class: class to subscribe,
+ * @root: root of event operator tree, may be NULL.
+ *
+ * Adds @class to the subscriber list of every event named in the
+ * EventOperator tree @root, creating the JobClassSubscription entries in
+ * job_class_subscriptions as required.  A class is only added once to
+ * each list, no matter how many times the event is named.
+ *
+ * The JobClassSubscriber entries are allocated as children of @class and
+ * recorded in its subscriptions list, so they are removed from the lists
+ * automatically should @class be freed.
+ **/
+static void
+job_class_subscribe (JobClass      *class,
+		     EventOperator *root)
+{
+	nih_assert (class != NULL);
+
+	job_class_init ();
+
+	if (! root)
+		return;
+
+	NIH_TREE_FOREACH_POST (&root->node, iter) {
+		EventOperator        *oper = (EventOperator *)iter;
+		JobClassSubscription *sub;
+		JobClassSubscriber   *subscriber;
+		NihListEntry         *entry;
+		int                   subscribed = FALSE;
+
+		if (oper->type != EVENT_MATCH)
+			continue;
+
+		sub = (JobClassSubscription *)nih_hash_lookup (
+			job_class_subscriptions, oper->name);
+		if (! sub) {
+			sub = NIH_MUST (nih_new (job_class_subscriptions,
+						 JobClassSubscription));
+
+			nih_list_init (&sub->entry);
+			nih_alloc_set_destructor (sub,
+						  job_class_subscription_destroy);
+
+			sub->name = NIH_MUST (event_name_intern (sub, oper->name));
+			nih_list_init (&sub->classes);
+
+			nih_hash_add (job_class_subscriptions, &sub->entry);
+		}
+
+		/* The subscription list itself may hold the cursor of an
+		 * event being dispatched, so look for a duplicate in the
+		 * class's own, much shorter, list instead.
+		 */
+		NIH_LIST_FOREACH (&class->subscriptions, sub_iter) {
+			NihListEntry *sub_entry = (NihListEntry *)sub_iter;
+
+			subscriber = (JobClassSubscriber *)sub_entry->data;
+			if (subscriber->subscription == sub) {
+				subscribed = TRUE;
+				break;
+			}
+		}
+
+		if (subscribed)
+			continue;
+
+		subscriber = NIH_MUST (nih_new (class, JobClassSubscriber));
+
+		nih_list_init (&subscriber->entry);
+		nih_alloc_set_destructor (subscriber,
+					  job_class_subscriber_destroy);
+
+		subscriber->class = class;
+		subscriber->subscription = sub;
+
+		nih_list_add (&sub->classes, &subscriber->entry);
+
+		entry = NIH_MUST (nih_list_entry_new (subscriber));
+		entry->data = subscriber;
+
+		nih_list_add (&class->subscriptions, &entry->entry);
+	}
+}
+
+/**
+ * job_class_unsubscribe:
+ * @class: class to unsubscribe.
+ *
+ * Removes @class from the subscriber list of every event it is
+ * subscribed to, freeing any JobClassSubscription entries that are left
+ * with no subscribers.
+ **/
+static void
+job_class_unsubscribe (JobClass *class)
+{
+	nih_assert (class != NULL);
+
+	NIH_LIST_FOREACH_SAFE (&class->subscriptions, iter) {
+		NihListEntry *entry = (NihListEntry *)iter;
+
+		/* Frees the entry too, since it's a child */
+		nih_free (entry->data);
+	}
+}
+
+/**
+ * job_class_subscriber_destroy:
+ * @subscriber: subscriber to be destroyed.
+ *
+ * Removes @subscriber from the list of its subscription, and frees the
+ * subscription if that leaves it with no subscribers.
+ *
+ * An event being dispatched to the subscription's classes keeps its
+ * iteration cursor in the list, so the subscription is never freed from
+ * underneath it.
+ *
+ * Returns: zero.
+ **/
+static int
+job_class_subscriber_destroy (JobClassSubscriber *subscriber)
+{
+	JobClassSubscription *sub;
+
+	nih_assert (subscriber != NULL);
+
+	nih_list_destroy (&subscriber->entry);
+
+	sub = subscriber->subscription;
+	if (sub && NIH_LIST_EMPTY (&sub->classes))
+		nih_free (sub);
+
+	return 0;
+}
+
+/**
+ * job_class_subscription_destroy:
+ * @sub: subscription to be destroyed.
+ *
+ * Removes @sub from the job_class_subscriptions hash table and detaches
+ * any remaining subscribers from it.
+ *
+ * Returns: zero.
+ **/
+static int
+job_class_subscription_destroy (JobClassSubscription *sub)
+{
+	nih_assert (sub != NULL);
+
+	NIH_LIST_FOREACH_SAFE (&sub->classes, iter) {
+		JobClassSubscriber *subscriber = (JobClassSubscriber *)iter;
+
+		subscriber->subscription = NULL;
+		nih_list_remove (&subscriber->entry);
+	}
+
+	nih_list_destroy (&sub->entry);
+
+	return 0;
+}
+
+/**
+ * job_class_subscribers:
+ * @name: name of event.
+ *
+ * Finds the registered job classes whose start on or stop on condition
+ * names the event @name.  The list must be iterated with
+ * NIH_LIST_FOREACH_SAFE() if handling the event may cause classes to be
+ * registered or deregistered.
+ *
+ * Returns: list of JobClassSubscriber objects, or NULL if no class is
+ * interested in @name.
+ **/
+NihList *
+job_class_subscribers (const char *name)
+{
+	JobClassSubscription *sub;
+
+	nih_assert (name != NULL);
+
+	job_class_init ();
+
+	sub = (JobClassSubscription *)nih_hash_lookup (job_class_subscriptions,
+						       name);
+
+	return sub ? &sub->classes : NULL;
+}
+
 /**
  * job_class_register:
  * @class: class to register,
@@ -2147,71 +2574,26 @@ error:
 }
 
 /**
- * job_class_deserialise:
- * @json: JSON-serialised JobClass object to deserialise.
+ * job_class_deserialise_fields:
+ * @class: job class to fill in,
+ * @json: JSON-serialised JobClass object.
  *
- * Create JobClass from provided JSON and add to the
- * job classes table.
+ * Set the configuration of @class, as opposed to its running instances,
+ * from @json.
  *
- * Returns: JobClass object, or NULL on error.
+ * Returns: zero on success, -1 on error.
  **/
-JobClass *
-job_class_deserialise (json_object *json)
+static int
+job_class_deserialise_fields (JobClass    *class,
+			      json_object *json)
 {
 	json_object    *json_normalexit;
-	JobClass       *class = NULL;
-	ConfFile       *file = NULL;
-	Session        *session;
-	int             session_index = -1;
-	int             ret;
-	nih_local char *name = NULL;
-	nih_local char *path = NULL;
 	json_object    *json_start_on = NULL;
 	json_object    *json_stop_on = NULL;
+	int             ret;
 
+	nih_assert (class);
 	nih_assert (json);
-	nih_assert (job_classes);
-
-	if (! state_check_json_type (json, object))
-		goto error;
-
-	if (! state_get_json_int_var (json, "session", session_index))
-		goto error;
-
-	if (session_index < 0)
-		goto error;
-
-	session = session_from_index (session_index);
-
-	/* XXX: chroot and old user session jobs not currently supported */
-	if (session) {
-		nih_info ("WARNING: deserialisation of user/chroot "
-				"sessions not currently supported");
-		goto error;
-	}
-
-	if (! state_get_json_string_var_strict (json, "name", NULL, name))
-		goto error;
-
-	/* Create the class and associate it with the ConfFile */
-	class = job_class_new (NULL, name, session);
-	if (! class)
-		goto error;
-
-	/* Lookup the ConfFile associated with this class.
-	 *
-	 * Don't error if this fails since previous serialisation data
-	 * formats did not encode ConfSources and ConfFiles.
-	 */
-	file = conf_file_find (name, session);
-	if (file)
-		file->job = class;
-
-	/* job_class_new() sets path */
-	if (! state_get_json_string_var_strict (json, "path", NULL, path))
-		goto error;
-
-	nih_assert (! strcmp (class->path, path));
 
 	/* Discard default instance as we're about to be handed a fresh
 	 * string from the JSON.
@@ -2401,6 +2783,78 @@ job_class_deserialise (json_object *json)
 	if (process_deserialise_all (json, class->process, class->process) < 0)
 		goto error;
 
+	return 0;
+
+error:
+	return -1;
+}
+
+/**
+ * job_class_deserialise:
+ * @json: JSON-serialised JobClass object to deserialise.
+ *
+ * Create JobClass from provided JSON and add to the
+ * job classes table.
+ *
+ * Returns: JobClass object, or NULL on error.
+ **/
+JobClass *
+job_class_deserialise (json_object *json)
+{
+	JobClass       *class = NULL;
+	ConfFile       *file = NULL;
+	Session        *session;
+	int             session_index = -1;
+	nih_local char *name = NULL;
+	nih_local char *path = NULL;
+
+	nih_assert (json);
+	nih_assert (job_classes);
+
+	if (! state_check_json_type (json, object))
+		goto error;
+
+	if (! state_get_json_int_var (json, "session", session_index))
+		goto error;
+
+	if (session_index < 0)
+		goto error;
+
+	session = session_from_index (session_index);
+
+	/* XXX: chroot and old user session jobs not currently supported */
+	if (session) {
+		nih_info ("WARNING: deserialisation of user/chroot "
+				"sessions not currently supported");
+		goto error;
+	}
+
+	if (! state_get_json_string_var_strict (json, "name", NULL, name))
+		goto error;
+
+	/* Create the class and associate it with the ConfFile */
+	class = job_class_new (NULL, name, session);
+	if (! class)
+		goto error;
+
+	/* Lookup the ConfFile associated with this class.
+	 *
+	 * Don't error if this fails since previous serialisation data
+	 * formats did not encode ConfSources and ConfFiles.
+	 */
+	file = conf_file_find (name, session);
+	if (file)
+		file->job = class;
+
+	/* job_class_new() sets path */
+	if (! state_get_json_string_var_strict (json, "path", NULL, path))
+		goto error;
+
+	nih_assert (! strcmp (class->path, path));
+
+	if (job_class_deserialise_fields (class, json) < 0)
+		goto error;
+
 	if (file) {
 		/* Add the class to the job_classes hash if ConfFiles were
 		 * available in the serialisation data.
@@ -2431,6 +2885,92 @@ job_class_deserialise (json_object *json)
 	}
 #endif /* ENABLE_CGROUPS */
 
+	class->fast_spawn = job_class_fast_spawn (class);
+
+	return class;
+
+error:
+	if (class)
+		nih_free (class);
+
+	return NULL;
+}
+
+/**
+ * job_class_deserialise_config:
+ * @parent: parent for new job class,
+ * @name: name of job class,
+ * @json: JSON-serialised JobClass object to deserialise.
+ *
+ * Create a JobClass named @name from the configuration in @json, as
+ * produced by job_class_serialise() for a freshly parsed class.  Unlike
+ * job_class_deserialise() no instances are created and the class is
+ * not added to the job classes table, so the result may be used in
+ * place of parse_job().
+ *
+ * Only classes without a session may be deserialised in this way.
+ *
+ * If @parent is not NULL, it should be a pointer to another object
+ * which will be used as a parent for the returned job class.  When all
+ * parents of the returned job class are freed, the returned job class
+ * will also be freed.
+ *
+ * Returns: new JobClass object, or NULL on error.
+ **/
+JobClass *
+job_class_deserialise_config (const void  *parent,
+			      const char  *name,
+			      json_object *json)
+{
+	JobClass       *class = NULL;
+	int             session_index = -1;
+	nih_local char *json_name = NULL;
+	nih_local char *path = NULL;
+
+	nih_assert (name);
+	nih_assert (json);
+
+	if (! state_check_json_type (json, object))
+		goto error;
+
+	if (! state_get_json_int_var (json, "session", session_index))
+		goto error;
+
+	if (session_index != 0)
+		goto error;
+
+	if (! state_get_json_string_var_strict (json, "name", NULL, json_name))
+		goto error;
+
+	if (strcmp (json_name, name))
+		goto error;
+
+	class = job_class_new (parent, name, NULL);
+	if (! class)
+		goto error;
+
+	if (! state_get_json_string_var_strict (json, "path", NULL, path))
+		goto error;
+
+	if (strcmp (class->path, path))
+		goto error;
+
+	if (job_class_deserialise_fields (class, json) < 0)
+		goto error;
+
+#ifdef ENABLE_CGROUPS
+	if (json_object_object_get_ex (json, "cgmanager_wait", NULL)) {
+
+		if (cgroup_deserialise_all (class, &class->cgroups, json) < 0)
+			goto error;
+
+		if (! state_get_json_int_var_to_obj (json, class, cgmanager_wait))
+			goto error;
+	}
+#endif /* ENABLE_CGROUPS */
+
+	class->fast_spawn = job_class_fast_spawn (class);
+
 	return class;
 
 error:
@@ -2598,7 +3138,9 @@ error:
  * job_class_prepare_reexec:
  *
  * Prepare for a re-exec by clearing the CLOEXEC bit on all log object
- * file descriptors associated with their parent jobs.
+ * file descriptors associated with their parent jobs, first copying
+ * any unflushed log data into memfds when state_pass_fds is set, in
+ * which case the pidfds held for job processes are also passed.
  **/
 void
 job_class_prepare_reexec (void)
@@ -2617,12 +3159,32 @@ job_class_prepare_reexec (void)
 				int  fd;
 				Log *log;
 
+				/* Pass the pidfd held for the process */
+				if (state_pass_fds) {
+					fd = job_process_pidfd (job, process);
+					if (fd >= 0 && state_modify_cloexec (fd, FALSE) < 0)
+						goto error;
+				}
+
 				log = job->log[process];
 
-				/* No associated job process or logger has detected
-				 * remote end of pty has closed.
+				/* No associated job process */
+				if (! log)
+					continue;
+
+				/* Copy unflushed data into a memfd that the new
+				 * instance will inherit.
 				 */
-				if (! log || ! log->io)
+				if (state_pass_fds) {
+					log_prepare_reexec (log);
+
+					fd = log->unflushed_fd;
+					if (fd >= 0 && state_modify_cloexec (fd, FALSE) < 0)
+						goto error;
+				}
+
+				/* Logger has detected remote end of pty has closed */
+				if (! log->io)
 					continue;
 
 				nih_assert (log->io->watch);
@@ -2650,6 +3212,43 @@ error:
 	nih_warn (_("unable to clear CLOEXEC bit on log fd"));
 }
 
+/**
+ * job_class_cancel_reexec:
+ *
+ * Called when a stateful re-exec prepared by job_class_prepare_reexec()
+ * falls back to a stateless one, which would not know of the pidfds held
+ * for job processes or the memfds of unflushed log data that were to be
+ * passed.  Their CLOEXEC bit is set again so that they are closed by the
+ * re-exec, while remaining ours should that fail.
+ **/
+void
+job_class_cancel_reexec (void)
+{
+	job_class_init ();
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		NIH_HASH_FOREACH (class->instances, job_iter) {
+			Job *job = (Job *)job_iter;
+
+			for (int process = 0; process < PROCESS_LAST; process++) {
+				int  fd;
+				Log *log;
+
+				fd = job_process_pidfd (job, process);
+				if (fd >= 0)
+					(void)state_modify_cloexec (fd, TRUE);
+
+				log = job->log ? job->log[process] : NULL;
+				if (log && (log->unflushed_fd >= 0))
+					(void)state_modify_cloexec (log->unflushed_fd,
+								    TRUE);
+			}
+		}
+	}
+}
+
 /**
  * job_class_max_kill_timeout:
  *
@@ -126,6 +126,36 @@ typedef enum console_type {
 	"PATH",			\
 	"TERM"
 
+/**
+ * JOB_CREDENTIALS_TTL:
+ *
+ * Number of seconds that the user and group ids resolved for a job class
+ * are used before they are looked up again.
+ **/
+#define JOB_CREDENTIALS_TTL 300
+
+
+/**
+ * JobCredentials:
+ * @resolved: time the ids were resolved, from the monotonic clock,
+ * @uid: user id to change to, or -1,
+ * @gid: group id to change to, or -1,
+ * @groups: supplementary group ids to set, or NULL if they are to be
+ * left unchanged,
+ * @ngroups: number of entries in @groups.
+ *
+ * This structure holds the user, group and supplementary groups that
+ * processes of a job class are run with, looked up from the user and
+ * group names given in the class.
+ **/
+typedef struct job_credentials {
+	time_t  resolved;
+	uid_t   uid;
+	gid_t   gid;
+	gid_t  *groups;
+	size_t  ngroups;
+} JobCredentials;
+
 
 /**
  * JobClass:
@@ -169,7 +199,14 @@ typedef enum console_type {
  * @cgroups: list of CGroup objects representing the cgroups the
  *  job is required to run in,
  * @cgmanager_wait: TRUE if job waiting for cgroup manager to be
- * available.
+ * available,
+ * @fast_spawn: TRUE if processes need none of the setup that requires
+ * them to be forked, set by job_class_fast_spawn() when parsed,
+ * @credentials: user and group ids resolved from @setuid and @setgid,
+ * set by job_class_credentials(),
+ * @subscriptions: list of NihListEntry objects whose data member is a
+ * JobClassSubscriber for this class, one per event named in @start_on
+ * or @stop_on while the class is registered.
  *
  * This structure holds the configuration of a known task or service that
  * should be tracked by the init daemon; as tasks and services are
@@ -232,12 +269,50 @@ typedef struct job_class {
 	char	       *apparmor_switch;
 	NihList         cgroups;
 	int             cgmanager_wait;
+
+	int             fast_spawn;
+	JobCredentials *credentials;
+
+	NihList         subscriptions;
 } JobClass;
 
+/**
+ * JobClassSubscription:
+ * @entry: list header,
+ * @name: name of event,
+ * @classes: list of JobClassSubscriber objects for the registered classes
+ * with @name in their start on or stop on condition.
+ *
+ * Entries in the job_class_subscriptions hash table, used to find the
+ * classes that an event may affect without visiting every class.
+ **/
+typedef struct job_class_subscription {
+	NihList  entry;
+	char    *name;
+	NihList  classes;
+} JobClassSubscription;
+
+/**
+ * JobClassSubscriber:
+ * @entry: list header,
+ * @class: subscribed class,
+ * @subscription: subscription @class is listed in.
+ *
+ * Entries in the classes list of a JobClassSubscription, allocated as
+ * children of @class so that a freed class drops out of the list, taking
+ * the subscription with it once it has no other subscribers.
+ **/
+typedef struct job_class_subscriber {
+	NihList               entry;
+	JobClass             *class;
+	JobClassSubscription *subscription;
+} JobClassSubscriber;
+
 
 NIH_BEGIN_EXTERN
 
 extern NihHash  *job_classes;
+extern NihHash  *job_class_subscriptions;
 
 void        job_class_init                 (void);
 
@@ -261,11 +336,18 @@ JobClass  * job_class_new                  (const void *parent,
 					    Session *session)
 	__attribute__ ((warn_unused_result));
 
+int         job_class_fast_spawn           (const JobClass *class)
+	__attribute__ ((warn_unused_result));
+int         job_class_credentials          (JobClass *class)
+	__attribute__ ((warn_unused_result));
+
 int         job_class_consider             (JobClass *class);
 int         job_class_reconsider           (JobClass *class);
 
 void        job_class_add_safe             (JobClass *class);
 
+NihList   * job_class_subscribers          (const char *name);
+
 void        job_class_register             (JobClass *class,
 					    DBusConnection *conn, int signal);
 void        job_class_unregister           (JobClass *class,
@@ -359,6 +441,10 @@ json_object *job_class_serialise (JobClass *class)
 JobClass *job_class_deserialise (json_object *json)
 	__attribute__ ((warn_unused_result));
 
+JobClass *job_class_deserialise_config (const void *parent, const char *name,
+					json_object *json)
+	__attribute__ ((warn_unused_result));
+
 json_object * job_class_serialise_all (void)
 	__attribute__ ((warn_unused_result));
 
@@ -375,6 +461,7 @@ int job_class_deserialise_job_environ (json_object *json)
 	__attribute__ ((warn_unused_result));
 
 void job_class_prepare_reexec (void);
+void job_class_cancel_reexec  (void);
 
 time_t     job_class_max_kill_timeout (void)
 	__attribute__ ((warn_unused_result));
@@ -32,6 +32,9 @@
 #include <sys/ptrace.h>
 #include <sys/resource.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 
 #include <time.h>
 #include <errno.h>
@@ -47,10 +50,14 @@
 #include <libgen.h>
 #include <termios.h>
 #include <grp.h>
+#include <fcntl.h>
+#include <spawn.h>
 
 #include <nih/macros.h>
 #include <nih/alloc.h>
 #include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
 #include <nih/signal.h>
 #include <nih/io.h>
 #include <nih/logging.h>
@@ -68,6 +75,10 @@
 #include "control.h"
 #include "xdg.h"
 #include "apparmor.h"
+#include "trace.h"
+#include "spawner.h"
+#include "state.h"
+#include "hash.h"
 
 #ifdef ENABLE_CGROUPS
 #include "cgroup.h"
@@ -81,6 +92,43 @@
  **/
 #define SHELL_CHARS "~`!$^&*()=|\\{}[];\"'<>?"
 
+/**
+ * JOB_PROCESS_FAST_SPAWN:
+ *
+ * Defined if posix_spawn() can make new processes session leaders and
+ * change their working directory, as needed to spawn the processes of
+ * classes with fast_spawn set.
+ **/
+#if defined (POSIX_SPAWN_SETSID) && defined (__GLIBC__) \
+	&& ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 29)))
+#define JOB_PROCESS_FAST_SPAWN 1
+#endif
+
+/**
+ * JOB_PROCESS_SCRIPT_MEMFD:
+ *
+ * Defined if scripts can be held in sealed memory files, shared by all
+ * processes that run them, rather than fed to each through a pipe.
+ **/
+#if defined (MFD_ALLOW_SEALING) && defined (F_ADD_SEALS)
+#define JOB_PROCESS_SCRIPT_MEMFD 1
+#endif
+
+/**
+ * JOB_PROCESS_PIDFD:
+ *
+ * Defined if the system calls needed to supervise processes through
+ * pidfds are known; whether the kernel supports them is only found out
+ * when they are first used.
+ **/
+#if defined (SYS_pidfd_open) && defined (SYS_pidfd_send_signal)
+#define JOB_PROCESS_PIDFD 1
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+#endif
+
 
 /**
  * JobProcessWireError:
@@ -95,6 +143,19 @@ typedef struct job_process_wire_error {
 	int                 errnum;
 } JobProcessWireError;
 
+/**
+ * JobProcessSpawnFailure:
+ * @job: job whose process could not be spawned,
+ * @process: process that could not be spawned.
+ *
+ * Passed to job_process_spawn_failed_timer() so that the failure is
+ * handled from the main loop, as it is when the child reports one.
+ **/
+typedef struct job_process_spawn_failure {
+	Job         *job;
+	ProcessType  process;
+} JobProcessSpawnFailure;
+
 /**
  * log_dir:
  *
@@ -112,6 +173,21 @@ int disable_respawn = FALSE;
 
 /* Prototypes for static functions */
 static void job_process_remap_fd        (int *fd, int reserved_fd, int error_fd);
+#ifdef JOB_PROCESS_FAST_SPAWN
+static pid_t job_process_fast_spawn     (JobClass *class, char * const argv[],
+					 char * const *env, int script_fd,
+					 ProcessType process,
+					 int *job_process_fd)
+	__attribute__ ((warn_unused_result));
+#endif /* JOB_PROCESS_FAST_SPAWN */
+#ifdef JOB_PROCESS_SCRIPT_MEMFD
+static int   job_process_script_memfd   (const char *script)
+	__attribute__ ((warn_unused_result));
+#endif /* JOB_PROCESS_SCRIPT_MEMFD */
+static void  job_process_release_scripts (Process *keep);
+static void  job_process_spawn_failed   (Job *job, ProcessType process);
+static void  job_process_spawn_failed_timer (JobProcessSpawnFailure *failure,
+					     NihTimer *timer);
 
 /**
  * disable_job_logging:
@@ -129,6 +205,41 @@ int disable_job_logging = 0;
  **/
 int no_inherit_env = FALSE;
 
+/**
+ * JOB_PROCESS_PIDFDS_SHARE:
+ *
+ * pidfds are held for job processes only while they take up less than
+ * one in this many of the file descriptors we may have open; other
+ * processes are supervised through SIGCHLD alone.
+ **/
+#define JOB_PROCESS_PIDFDS_SHARE 2
+
+/**
+ * job_process_pids:
+ *
+ * This hash table holds a JobProcessPid entry for each process that a
+ * job is supervising, indexed by process id.  It is kept in step with
+ * the pid array of each job by job_process_set_pid(), and grows with
+ * the number of processes.
+ **/
+NihHash *job_process_pids = NULL;
+
+/**
+ * job_process_pidfds:
+ *
+ * TRUE while pidfds may be used to supervise job processes, cleared once
+ * the kernel has been found not to support them so that we rely on
+ * SIGCHLD alone.
+ **/
+static int job_process_pidfds = TRUE;
+
+/**
+ * job_process_pidfds_held:
+ *
+ * Number of pidfds currently held for job processes.
+ **/
+static size_t job_process_pidfds_held = 0;
+
 /* Prototypes for static functions */
 static void job_process_kill_timer      (Job *job, NihTimer *timer);
 static void job_process_terminated      (Job *job, ProcessType process,
@@ -141,6 +252,22 @@ static void job_process_trace_signal    (Job *job, ProcessType process,
 					 int signum);
 static void job_process_trace_fork      (Job *job, ProcessType process);
 static void job_process_trace_exec      (Job *job, ProcessType process);
+static void job_process_pids_init       (void);
+static const void *job_process_pid_key  (NihList *entry);
+static uint32_t job_process_pid_hash    (const void *key);
+static int  job_process_pid_cmp         (const void *key1, const void *key2);
+static JobProcessPid *job_process_pid_entry (const Job *job,
+					     ProcessType process);
+static int  job_process_pid_destroy     (JobProcessPid *entry);
+static int  job_process_pidfd_allowed   (void);
+static int  job_process_pidfd_open      (pid_t pid);
+static int  job_process_pidfd_signal    (int pidfd, int signal);
+static int  job_process_pidfd_check     (int pidfd, pid_t pid);
+static void job_process_pidfd_watcher   (JobProcessPid *entry,
+					 NihIoWatch *watch,
+					 NihIoEvents events);
+static void job_process_child_dispatch  (pid_t pid, NihChildEvents event,
+					 int status);
 
 extern char         *control_server_address;
 extern int           user_mode;
@@ -166,19 +293,25 @@ extern time_t        quiesce_phase_time;
  * When executed with the shell, if the command (which may be an entire
  * script) is reasonably small (less than 1KB) it is passed to the
  * shell using the POSIX-specified -c option.  Otherwise the shell is told
- * to read commands from one of the special /proc/self/fd/NN devices and NihIo
- * used to feed the script into that device.  A pointer to the NihIo object
- * is not kept or stored because it will automatically clean itself up should
- * the script go away as the other end of the pipe will be closed.
+ * to read commands from one of the special /proc/self/fd/NN devices.
+ * That is a sealed memory file holding the script, created once for
+ * @process and shared by every process that runs it while no more than
+ * PROCESS_SCRIPT_FDS_MAX are kept; where one can't be created, NihIo is
+ * used to feed the script into a pipe instead.  A pointer to the NihIo
+ * object is not kept or stored because it will automatically clean itself
+ * up should the script go away as the other end of the pipe will be
+ * closed.
  *
  * In either case the shell is run with the -e option so that commands will
  * fail if their exit status is not checked.
  *
  * This function will only block on temporary job_process_spawn_with_fd() error
- * (for example fork() failure): in normal operation it returns as soon as
- * the fork() was successful, registering an NihIo which provides
- * asynchronous handling of the child setup stage. The specified error
- * handler will be called should child setup fail.
+ * (for example fork() failure), other than running out of file descriptors
+ * which is handled from the main loop as a failure to spawn the process
+ * once closing the script files kept for reuse has not helped; in normal
+ * operation it returns as soon as the fork() was successful, registering
+ * an NihIo which provides asynchronous handling of the child setup stage.
+ * The specified error handler will be called should child setup fail.
  *
  * It is up to the caller to decide whether non-temporary errors are a reason
  * to change the job state or not.
@@ -194,9 +327,13 @@ job_process_start (Job                    *job,
 	char              **e;
 	size_t              argc, envc;
 	int                 fds[2] = { -1, -1 };
+	int                 script_fd = -1;
+	int                 close_script = FALSE;
+	int                 released = FALSE;
 	int                 trace = FALSE, shell = FALSE;
 	int                 job_process_fd = -1;
 	JobProcessData     *process_data = NULL;
+	pid_t               pid;
 
 	nih_assert (job);
 	nih_assert (process > PROCESS_INVALID);
@@ -255,11 +392,36 @@ job_process_start (Job                    *job,
 		} else {
 			nih_local char *cmd = NULL;
 
-			/* Close the writing end when the child is exec'd */
-			NIH_ZERO (pipe (fds));
-			nih_io_set_cloexec (fds[1]);
+#ifdef JOB_PROCESS_SCRIPT_MEMFD
+			if (proc->script_fd != -1) {
+				script_fd = proc->script_fd;
+			} else {
+				script_fd = job_process_script_memfd (script);
 
-			shell = TRUE;
+				/* Only so many are kept for reuse */
+				if ((script_fd != -1)
+				    && (! process_set_script (proc, script_fd)))
+					close_script = TRUE;
+			}
+#endif /* JOB_PROCESS_SCRIPT_MEMFD */
+
+			if (script_fd == -1) {
+				/* Close the writing end when the child is
+				 * exec'd
+				 */
+				if (pipe (fds) < 0) {
+					nih_warn (_("Failed to spawn %s %s process: %s"),
+						  job_name (job),
+						  process_name (process),
+						  strerror (errno));
+					job_process_spawn_failed (job, process);
+					return;
+				}
+				nih_io_set_cloexec (fds[1]);
+
+				script_fd = fds[0];
+				shell = TRUE;
+			}
 
 			cmd = NIH_MUST (nih_sprintf (argv, "%s/%d",
 						     "/proc/self/fd",
@@ -309,17 +471,52 @@ job_process_start (Job                    *job,
 		|| (job->class->expect == EXPECT_FORK)))
 		trace = TRUE;
 
-	/* Spawn the process, repeat until fork() works */
-	while ((job->pid[process] = job_process_spawn_with_fd (job, argv, env,
-					trace, fds[0], process, &job_process_fd)) < 0) {
+	/* Spawn the process, repeat until fork() works.  Running out of
+	 * file descriptors is not helped by trying again at once, so the
+	 * script files kept for other processes are closed first, and the
+	 * process fails to spawn if that is not enough.
+	 */
+	while ((pid = job_process_spawn_with_fd (job, argv, env,
+					trace, script_fd, process, &job_process_fd)) < 0) {
 		NihError *err;
+		int       errnum;
 
 		err = nih_error_get ();
 		nih_warn ("%s: %s", _("Temporary process spawn error"),
 				err->message);
+		errnum = err->number;
 		nih_free (err);
+
+		if ((errnum != EMFILE) && (errnum != ENFILE))
+			continue;
+
+		if (! released) {
+			job_process_release_scripts (proc);
+			released = TRUE;
+		} else {
+			nih_warn (_("Failed to spawn %s %s process: %s"),
+				  job_name (job), process_name (process),
+				  strerror (errnum));
+
+			if (close_script)
+				close (script_fd);
+			if (shell) {
+				close (fds[0]);
+				close (fds[1]);
+			}
+
+			job_process_spawn_failed (job, process);
+			return;
+		}
 	}
 
+	if (close_script)
+		close (script_fd);
+
+	job_process_set_pid (job, process, pid);
+
+	TRACE (TRACE_RECORD_JOB_FORK, job_name (job), process, pid, 0);
+
 	nih_info (_("%s %s process (%d)"),
 		  job_name (job), process_name (process), job->pid[process]);
 
@@ -361,6 +558,157 @@ job_process_start (Job                    *job,
 			job_process_fd, process_data);
 }
 
+/**
+ * job_process_release_scripts:
+ * @keep: process whose script file is in use.
+ *
+ * Closes the script files kept by the processes of every registered job
+ * class other than @keep, releasing file descriptors when we have run
+ * out; they are created again when next needed.
+ **/
+static void
+job_process_release_scripts (Process *keep)
+{
+	job_class_init ();
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		for (ProcessType i = 0; i < PROCESS_LAST; i++) {
+			if (class->process[i] && (class->process[i] != keep))
+				process_clear_script (class->process[i]);
+		}
+	}
+}
+
+/**
+ * job_process_spawn_failed:
+ * @job: job whose process could not be spawned,
+ * @process: process that could not be spawned.
+ *
+ * Arranges for @process of @job to be handled as having failed to spawn
+ * once we return to the main loop, since job_process_start() is called
+ * while the job is changing state.
+ **/
+static void
+job_process_spawn_failed (Job         *job,
+			  ProcessType  process)
+{
+	JobProcessSpawnFailure *failure;
+	NihTimer               *timer;
+
+	nih_assert (job != NULL);
+
+	timer = NIH_MUST (nih_timer_add_timeout (
+			  job, 0,
+			  (NihTimerCb)job_process_spawn_failed_timer, NULL));
+
+	failure = NIH_MUST (nih_new (timer, JobProcessSpawnFailure));
+	failure->job = job;
+	failure->process = process;
+
+	timer->data = failure;
+}
+
+/**
+ * job_process_spawn_failed_timer:
+ * @failure: details of failure,
+ * @timer: timer that caused us to be called.
+ *
+ * Handles a process that could not be spawned just as one whose child
+ * reported that it could not be set up.
+ **/
+static void
+job_process_spawn_failed_timer (JobProcessSpawnFailure *failure,
+				NihTimer               *timer)
+{
+	nih_assert (failure != NULL);
+	nih_assert (timer != NULL);
+
+	job_child_error_handler (failure->job, failure->process);
+}
+
+#ifdef JOB_PROCESS_SCRIPT_MEMFD
+/**
+ * job_process_script_memfd:
+ * @script: script to be run by the shell.
+ *
+ * Creates a memory file holding @script, sealed against any further
+ * changes, that the shell can be told to read commands from using one
+ * of the special /proc/self/fd/NN devices.  Since each shell opens the
+ * device again, the file may be shared by every process that runs
+ * @script.
+ *
+ * The returned file descriptor is closed-on-exec and never the special
+ * fd 9, so it must be dup()d there for the child.
+ *
+ * Returns: file descriptor or -1 if the file could not be created.
+ **/
+static int
+job_process_script_memfd (const char *script)
+{
+	nih_local char *buf = NULL;
+	size_t          len;
+	size_t          written = 0;
+	int             fd;
+
+	nih_assert (script != NULL);
+
+	/* As when feeding the script through a pipe, instruct the shell
+	 * to close the extra fd so it isn't leaked to the commands run.
+	 */
+	buf = NIH_MUST (nih_sprintf (NULL, "exec %d<&-\n%s",
+				     JOB_PROCESS_SCRIPT_FD, script));
+	len = strlen (buf);
+
+	fd = memfd_create ("upstart-script", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		goto error;
+
+	/* Keep clear of the special fd, so that the child always dup()s
+	 * the file there, which also clears close-on-exec.
+	 */
+	if (fd <= JOB_PROCESS_SCRIPT_FD) {
+		int tmp;
+
+		tmp = fcntl (fd, F_DUPFD_CLOEXEC, JOB_PROCESS_SCRIPT_FD + 1);
+		close (fd);
+
+		fd = tmp;
+		if (fd < 0)
+			goto error;
+	}
+
+	while (written < len) {
+		ssize_t ret;
+
+		ret = write (fd, buf + written, len - written);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			goto error;
+		}
+
+		written += ret;
+	}
+
+	if (fcntl (fd, F_ADD_SEALS, (F_SEAL_SHRINK | F_SEAL_GROW
+				     | F_SEAL_WRITE | F_SEAL_SEAL)) < 0)
+		goto error;
+
+	return fd;
+
+error:
+	nih_debug ("Unable to create script file: %s", strerror (errno));
+
+	if (fd >= 0)
+		close (fd);
+
+	return -1;
+}
+#endif /* JOB_PROCESS_SCRIPT_MEMFD */
+
 /**
  * job_process_spawn_with_fd:
  * @job: job of process to be spawned,
@@ -397,6 +745,9 @@ job_process_start (Job                    *job,
  * closed setup was successful and the caller can then mark the job
  * process as started.
  *
+ * If the spawner process is running, the process is forked by it rather
+ * than by ourselves; it is still our child, and is set up identically.
+ *
  * Spawning a process may fail for temporary reasons, usually due to a failure
  * of the fork() syscall.
  *
@@ -411,24 +762,14 @@ job_process_spawn_with_fd (Job          *job,
 		   ProcessType   process,
 		   int          *job_process_fd)
 {
-	sigset_t        child_set, orig_set;
-	pid_t           pid;
-	int             i, fds[2] = { -1, -1 };
-	int             pty_master = -1;
-	int             pty_slave = -1;
-	char            pts_name[PATH_MAX];
-	char            filename[PATH_MAX];
-	FILE           *fd;
-	nih_local char *log_path = NULL;
-	JobClass       *class;
-	uid_t           job_setuid = -1;
-	gid_t           job_setgid = -1;
-	struct passwd   *pwd = NULL;
-	struct group    *grp = NULL;
-
-#ifdef ENABLE_CGROUPS
+	sigset_t         child_set, orig_set;
+	pid_t            pid;
+	int              fds[2] = { -1, -1 };
+	int              pty_master = -1;
+	nih_local char  *log_path = NULL;
+	JobClass        *class;
+	JobProcessSpawn  spawn;
 	int              cgroups_needed = FALSE;
-#endif /* ENABLE_CGROUPS */
 
 	nih_assert (job != NULL);
 	nih_assert (job->class != NULL);
@@ -454,6 +795,19 @@ job_process_spawn_with_fd (Job          *job,
 
 #endif /* ENABLE_CGROUPS */
 
+#ifdef JOB_PROCESS_FAST_SPAWN
+	/* Processes that need no setup of their own needn't be forked;
+	 * should that fail we try again the usual way, which fails in
+	 * the same manner but reports it in the usual way.
+	 */
+	if (class->fast_spawn && (! trace) && (! cgroups_needed)) {
+		pid = job_process_fast_spawn (class, argv, env, script_fd,
+					      process, job_process_fd);
+		if (pid > 0)
+			return pid;
+	}
+#endif /* JOB_PROCESS_FAST_SPAWN */
+
 	/* Create a pipe to communicate with the child process until it
 	 * execs so we know whether that was successful or an error occurred.
 	 */
@@ -517,6 +871,95 @@ job_process_spawn_with_fd (Job          *job,
 		}
 	}
 
+	/* Resolve everything the child needs from the job and its class
+	 * now, so that it may be set up by either ourselves or the spawner.
+	 */
+	memset (&spawn, 0, sizeof (spawn));
+
+	spawn.argv = argv;
+	spawn.env = env;
+	spawn.process = process;
+	spawn.trace = trace;
+	spawn.debug = class->debug;
+	spawn.script_fd = script_fd;
+
+	spawn.console = class->console;
+	spawn.pty_master = pty_master;
+
+	/* Only the main process is confined, so the pre- and post-
+	 * processes are not.
+	 */
+	if (process == PROCESS_MAIN)
+		spawn.apparmor_switch = class->apparmor_switch;
+
+	memcpy (spawn.limits, class->limits, sizeof (spawn.limits));
+	spawn.umask = class->umask;
+	spawn.nice = class->nice;
+	spawn.oom_score_adj = class->oom_score_adj;
+
+	if (class->session)
+		spawn.session_chroot = class->session->chroot;
+	spawn.chroot = class->chroot;
+
+	if (class->chdir) {
+		spawn.chdir = class->chdir;
+	} else if (user_mode == FALSE) {
+		spawn.chdir = "/";
+	}
+
+	spawn.setuid = class->setuid;
+	spawn.setgid = class->setgid;
+
+	/* Use the user and group ids already resolved for a class that
+	 * changes them where we can; should that fail, the child looks
+	 * them up itself and reports the error as usual.  Other jobs run
+	 * as ourselves, and the child sets up their groups just as it
+	 * always has.
+	 */
+	if ((class->setuid || class->setgid)
+	    && (job_class_credentials (class) < 0)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_debug ("Unable to resolve credentials for %s: %s",
+			   class->name, err->message);
+		nih_free (err);
+	}
+	spawn.credentials = class->credentials;
+
+	if (cgroups_needed)
+		spawn.job = job;
+
+	/* Hand the process to the spawner if we have one; it can't join
+	 * the cgroup manager's connection, so those jobs are always
+	 * spawned by ourselves.  Should the spawner fail for any reason
+	 * we fall back to forking the process ourselves.
+	 */
+	if (spawner_available () && (! cgroups_needed)) {
+		pid = spawner_spawn (&spawn, fds[1]);
+		if (pid > 0) {
+			if (class->debug) {
+				nih_info (_("Pausing %s (%d) [pre-exec] for debug"),
+					  class->name, pid);
+			}
+
+			close (fds[1]);
+
+			*job_process_fd = fds[0];
+
+			nih_io_set_cloexec (*job_process_fd);
+
+			return pid;
+		} else {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_debug ("%s: %s", _("Unable to spawn process from spawner"),
+				   err->message);
+			nih_free (err);
+		}
+	}
+
 	/* Block all signals while we fork to avoid the child process running
 	 * our own signal handlers before we've reset them all back to the
 	 * default.
@@ -562,27 +1005,209 @@ job_process_spawn_with_fd (Job          *job,
 		return -1;
 	}
 
-	/* We're now in the child process.
-	 *
-	 * The rest of this function sets the child up and ends by executing
-	 * the new binary.  Failures are handled by terminating the child
-	 * and writing an error back to the parent.
+	/* We're now in the child process; close the reading end of the
+	 * pipe with our parent and set ourselves up.
 	 */
+	close (fds[0]);
 
-	/* Close the reading end of the pipe with our parent and mark the
-	 * writing end to be closed-on-exec so the parent knows we got that
-	 * far because read() returned zero.
+	job_process_spawn_child (&spawn, fds[1], &orig_set);
+}
+
+#ifdef JOB_PROCESS_FAST_SPAWN
+/**
+ * job_process_fast_spawn:
+ * @class: job class of process to be spawned,
+ * @argv: NULL-terminated list of arguments for the process,
+ * @env: NULL-terminated list of environment variables for the process,
+ * @script_fd: script file descriptor,
+ * @process: job process to spawn,
+ * @job_process_fd: readable child setup pipe file descriptor.
+ *
+ * This function spawns a new process for a job of @class, which must have
+ * fast_spawn set, using posix_spawn() rather than fork(); the C library
+ * creates the process with clone(CLONE_VM|CLONE_VFORK) so neither our page
+ * tables nor our signal handlers are copied, and reports a failure to
+ * execute the binary before returning.
+ *
+ * Since the process has already been executed, @job_process_fd is the
+ * reading end of a pipe that is already closed for writing, so the caller
+ * sees its setup succeed just as it does for a forked process.
+ *
+ * Only binaries given with a path are spawned in this way, since
+ * posix_spawnp() would search our own PATH rather than that in @env.
+ *
+ * No error is raised, the caller should spawn the process the usual way
+ * if this fails.
+ *
+ * Returns: process id of new process, or zero if it was not spawned.
+ **/
+static pid_t
+job_process_fast_spawn (JobClass     *class,
+			char * const  argv[],
+			char * const *env,
+			int           script_fd,
+			ProcessType   process,
+			int          *job_process_fd)
+{
+	posix_spawn_file_actions_t  actions;
+	posix_spawnattr_t           attr;
+	sigset_t                    mask;
+	char                       *no_env[] = { NULL };
+	int                         fds[2] = { -1, -1 };
+	mode_t                      orig_umask = 0;
+	pid_t                       pid = 0;
+	int                         ret;
+
+	nih_assert (class != NULL);
+	nih_assert (class->fast_spawn);
+	nih_assert (argv != NULL);
+	nih_assert (argv[0] != NULL);
+	nih_assert (job_process_fd != NULL);
+
+	if (! strchr (argv[0], '/'))
+		return 0;
+
+	if (pipe2 (fds, O_CLOEXEC) < 0)
+		return 0;
+
+	if (posix_spawn_file_actions_init (&actions)) {
+		close (fds[0]);
+		close (fds[1]);
+		return 0;
+	}
+
+	if (posix_spawnattr_init (&attr)) {
+		posix_spawn_file_actions_destroy (&actions);
+		close (fds[0]);
+		close (fds[1]);
+		return 0;
+	}
+
+	/* Equivalent of system_setup_console() with CONSOLE_NONE and of
+	 * moving the script to the special fd 9.
 	 */
-	close (fds[0]);
+	ret = posix_spawn_file_actions_addopen (&actions, STDIN_FILENO,
+						DEV_NULL, O_RDWR | O_NOCTTY, 0);
+	if (! ret)
+		ret = posix_spawn_file_actions_adddup2 (&actions, STDIN_FILENO,
+							STDOUT_FILENO);
+	if (! ret)
+		ret = posix_spawn_file_actions_adddup2 (&actions, STDIN_FILENO,
+							STDERR_FILENO);
+
+	if ((! ret) && (script_fd != -1)
+	    && (script_fd != JOB_PROCESS_SCRIPT_FD)) {
+		ret = posix_spawn_file_actions_adddup2 (&actions, script_fd,
+							JOB_PROCESS_SCRIPT_FD);
+		if (! ret)
+			ret = posix_spawn_file_actions_addclose (&actions,
+								 script_fd);
+	}
 
-	job_process_remap_fd (&fds[1], JOB_PROCESS_SCRIPT_FD, fds[1]);
-	nih_io_set_cloexec (fds[1]);
+	if ((! ret) && (process != PROCESS_SECURITY) && (user_mode == FALSE))
+		ret = posix_spawn_file_actions_addchdir_np (&actions, "/");
 
-	if (class->console == CONSOLE_LOG) {
+	/* Become the leader of a new session and process group, with all
+	 * signals at their default handling and our usual signal mask.
+	 */
+	sigfillset (&mask);
+	if (! ret)
+		ret = posix_spawnattr_setsigdefault (&attr, &mask);
+
+	sigprocmask (SIG_SETMASK, NULL, &mask);
+	if (! ret)
+		ret = posix_spawnattr_setsigmask (&attr, &mask);
+
+	if (! ret)
+		ret = posix_spawnattr_setflags (&attr, (POSIX_SPAWN_SETSID
+							| POSIX_SPAWN_SETSIGDEF
+							| POSIX_SPAWN_SETSIGMASK));
+
+	if (! ret) {
+		/* The file mode creation mask is inherited */
+		if (process != PROCESS_SECURITY)
+			orig_umask = umask (class->umask);
+
+		fflush (NULL);
+
+		ret = posix_spawn (&pid, argv[0], &actions, &attr, argv,
+				   env ? env : no_env);
+
+		if (process != PROCESS_SECURITY)
+			umask (orig_umask);
+	}
+
+	posix_spawnattr_destroy (&attr);
+	posix_spawn_file_actions_destroy (&actions);
+
+	close (fds[1]);
+
+	if (ret) {
+		nih_debug ("%s: %s", _("Unable to spawn process quickly"),
+			   strerror (ret));
+		close (fds[0]);
+		return 0;
+	}
+
+	*job_process_fd = fds[0];
+
+	return pid;
+}
+#endif /* JOB_PROCESS_FAST_SPAWN */
+
+/**
+ * job_process_spawn_child:
+ * @spawn: details of process to set up,
+ * @error_fd: writing end of pipe to parent,
+ * @orig_set: signal mask to restore.
+ *
+ * This function is called in a newly forked child, either by
+ * job_process_spawn_with_fd() or by the spawner process, to set up the
+ * process described by @spawn and end by executing the new binary.
+ *
+ * Failures are handled by terminating the child and writing an error
+ * back to the parent over @error_fd, which is closed when the new binary
+ * is executed.
+ *
+ * This function never returns.
+ **/
+void
+job_process_spawn_child (const JobProcessSpawn *spawn,
+			 int                    error_fd,
+			 const sigset_t        *orig_set)
+{
+	int              i;
+	int              pty_master;
+	int              pty_slave = -1;
+	int              script_fd;
+	char             pts_name[PATH_MAX];
+	char             filename[PATH_MAX];
+	FILE            *fd;
+	uid_t            job_setuid = -1;
+	gid_t            job_setgid = -1;
+	struct passwd   *pwd = NULL;
+	struct group    *grp = NULL;
+
+	nih_assert (spawn != NULL);
+	nih_assert (spawn->argv != NULL);
+	nih_assert (error_fd >= 0);
+	nih_assert (orig_set != NULL);
+
+	pty_master = spawn->pty_master;
+	script_fd = spawn->script_fd;
+
+	/* Mark the writing end of the pipe with our parent to be
+	 * closed-on-exec so the parent knows we got that far because read()
+	 * returned zero.
+	 */
+	job_process_remap_fd (&error_fd, JOB_PROCESS_SCRIPT_FD, error_fd);
+	nih_io_set_cloexec (error_fd);
+
+	if (spawn->console == CONSOLE_LOG) {
 		struct sigaction act;
 		struct sigaction ignore;
 
-		job_process_remap_fd (&pty_master, JOB_PROCESS_SCRIPT_FD, fds[1]);
+		job_process_remap_fd (&pty_master, JOB_PROCESS_SCRIPT_FD, error_fd);
 
 		/* Child is the slave, so won't need this */
 		nih_io_set_cloexec (pty_master);
@@ -596,38 +1221,38 @@ job_process_spawn_with_fd (Job          *job,
 
 		if (sigaction (SIGCHLD, &ignore, &act) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_SIGNAL, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_SIGNAL, 0);
 		}
 
 		if (grantpt (pty_master) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_GRANTPT, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_GRANTPT, 0);
 		}
 
 		/* Restore child handler */
 		if (sigaction (SIGCHLD, &act, NULL) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_SIGNAL, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_SIGNAL, 0);
 		}
 
 		if (unlockpt (pty_master) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_UNLOCKPT, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_UNLOCKPT, 0);
 		}
 
 		if (ptsname_r (pty_master, pts_name, sizeof(pts_name)) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_PTSNAME, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_PTSNAME, 0);
 		}
 
 		pty_slave = open (pts_name, O_RDWR | O_NOCTTY);
 
 		if (pty_slave < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_OPENPT_SLAVE, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_OPENPT_SLAVE, 0);
 		}
 
-		job_process_remap_fd (&pty_slave, JOB_PROCESS_SCRIPT_FD, fds[1]);
+		job_process_remap_fd (&pty_slave, JOB_PROCESS_SCRIPT_FD, error_fd);
 	}
 
 	/* Move the script fd to special fd 9; the only gotcha is if that
@@ -637,7 +1262,7 @@ job_process_spawn_with_fd (Job          *job,
 		int tmp = dup2 (script_fd, JOB_PROCESS_SCRIPT_FD);
 		if (tmp < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_DUP, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_DUP, 0);
 		}
 		close (script_fd);
 		script_fd = tmp;
@@ -649,15 +1274,15 @@ job_process_spawn_with_fd (Job          *job,
 	setsid ();
 
 	/* Set the process environment from the function parameters. */
-	environ = (char **)env;
+	environ = (char **)spawn->env;
 
 	/* Set the standard file descriptors to an output of our chosing;
 	 * any other open descriptor must be intended for the child, or have
 	 * the FD_CLOEXEC flag so it's automatically closed when we exec()
 	 * later.
 	 */
-	if (system_setup_console (class->console, FALSE) < 0) {
-		if (class->console == CONSOLE_OUTPUT) {
+	if (system_setup_console (spawn->console, FALSE) < 0) {
+		if (spawn->console == CONSOLE_OUTPUT) {
 			NihError *err;
 
 			err = nih_error_get ();
@@ -666,60 +1291,60 @@ job_process_spawn_with_fd (Job          *job,
 			nih_free (err);
 
 			if (system_setup_console (CONSOLE_NONE, FALSE) < 0)
-				job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CONSOLE, 0);
+				job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CONSOLE, 0);
 		} else
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CONSOLE, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CONSOLE, 0);
 	}
 
-	if (class->console == CONSOLE_LOG) {
+	if (spawn->console == CONSOLE_LOG) {
 		/* Redirect stdout and stderr to the logger fd */
 		if (dup2 (pty_slave, STDOUT_FILENO) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_DUP, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_DUP, 0);
 		}
 
 		if (dup2 (pty_slave, STDERR_FILENO) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_DUP, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_DUP, 0);
 		}
 
 		close (pty_slave);
 	}
 
-	/* Switch to the specified AppArmor profile, but only for the main
-	   process, so we don't confine the pre- and post- processes.
+	/* Switch to the specified AppArmor profile, which is only given
+	 * for the main process.
 	 */
-	if ((class->apparmor_switch) && (process == PROCESS_MAIN)) {
+	if (spawn->apparmor_switch) {
 		nih_local char *profile = NULL;
 
 		/* Use the environment to expand the AppArmor profile name
 		 */
 		profile = NIH_SHOULD (environ_expand (NULL,
-						      class->apparmor_switch,
+						      spawn->apparmor_switch,
 						      environ));
 
 		if (! profile) {
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_SECURITY, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_SECURITY, 0);
 		}
 
 		if (apparmor_switch (profile) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_SECURITY, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_SECURITY, 0);
 		}
 	}
 
-	if (process != PROCESS_SECURITY) {
+	if (spawn->process != PROCESS_SECURITY) {
 		/* Set resource limits for the process, skipping over any that
 		 * aren't set in the job class such that they inherit from
 		 * ourselves (and we inherit from kernel defaults).
 		 */
 		for (i = 0; i < RLIMIT_NLIMITS; i++) {
-			if (! class->limits[i])
+			if (! spawn->limits[i])
 				continue;
 
-			if (setrlimit (i, class->limits[i]) < 0) {
+			if (setrlimit (i, spawn->limits[i]) < 0) {
 				nih_error_raise_system ();
-				job_process_error_abort (fds[1],
+				job_process_error_abort (error_fd,
 							 JOB_PROCESS_ERROR_RLIMIT, i);
 			}
 		}
@@ -727,41 +1352,41 @@ job_process_spawn_with_fd (Job          *job,
 		/* Set the file mode creation mask; this is one of the few operations
 		 * that can never fail.
 		 */
-		umask (class->umask);
+		umask (spawn->umask);
 
 		/* Adjust the process priority ("nice level").
 		 */
-		if (class->nice != JOB_NICE_INVALID &&
-		    setpriority (PRIO_PROCESS, 0, class->nice) < 0) {
+		if (spawn->nice != JOB_NICE_INVALID &&
+		    setpriority (PRIO_PROCESS, 0, spawn->nice) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1],
+			job_process_error_abort (error_fd,
 						 JOB_PROCESS_ERROR_PRIORITY, 0);
 		}
 
 		/* Adjust the process OOM killer priority.
 		 */
-		if (class->oom_score_adj != JOB_DEFAULT_OOM_SCORE_ADJ) {
+		if (spawn->oom_score_adj != JOB_DEFAULT_OOM_SCORE_ADJ) {
 			int oom_value;
 			snprintf (filename, sizeof (filename),
 				  "/proc/%d/oom_score_adj", getpid ());
-			oom_value = class->oom_score_adj;
+			oom_value = spawn->oom_score_adj;
 			fd = fopen (filename, "w");
 			if ((! fd) && (errno == ENOENT)) {
 				snprintf (filename, sizeof (filename),
 					  "/proc/%d/oom_adj", getpid ());
-				oom_value = (class->oom_score_adj
-					     * ((class->oom_score_adj < 0) ? 17 : 15)) / 1000;
+				oom_value = (spawn->oom_score_adj
+					     * ((spawn->oom_score_adj < 0) ? 17 : 15)) / 1000;
 				fd = fopen (filename, "w");
 			}
 			if (! fd) {
 				nih_error_raise_system ();
-				job_process_error_abort (fds[1], JOB_PROCESS_ERROR_OOM_ADJ, 0);
+				job_process_error_abort (error_fd, JOB_PROCESS_ERROR_OOM_ADJ, 0);
 			} else {
 				fprintf (fd, "%d\n", oom_value);
 
 				if (fclose (fd)) {
 					nih_error_raise_system ();
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_OOM_ADJ, 0);
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_OOM_ADJ, 0);
 				}
 			}
 		}
@@ -769,10 +1394,10 @@ job_process_spawn_with_fd (Job          *job,
 		/* Handle changing a chroot session job prior to dealing with
 		 * the 'chroot' stanza.
 		 */
-		if (class->session && class->session->chroot) {
-			if (chroot (class->session->chroot) < 0) {
+		if (spawn->session_chroot) {
+			if (chroot (spawn->session_chroot) < 0) {
 				nih_error_raise_system ();
-				job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CHROOT, 0);
+				job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CHROOT, 0);
 			}
 		}
 
@@ -780,10 +1405,10 @@ job_process_spawn_with_fd (Job          *job,
 		 * we do this before the working directory call so that is always
 		 * relative to the new root.
 		 */
-		if (class->chroot) {
-			if (chroot (class->chroot) < 0) {
+		if (spawn->chroot) {
+			if (chroot (spawn->chroot) < 0) {
 				nih_error_raise_system ();
-				job_process_error_abort (fds[1],
+				job_process_error_abort (error_fd,
 							 JOB_PROCESS_ERROR_CHROOT, 0);
 			}
 		}
@@ -792,10 +1417,10 @@ job_process_spawn_with_fd (Job          *job,
 		 * configured in the job, or to the root directory of the filesystem
 		 * (or at least relative to the chroot).
 		 */
-		if (class->chdir || user_mode == FALSE) {
-			if (chdir (class->chdir ? class->chdir : "/") < 0) {
+		if (spawn->chdir) {
+			if (chdir (spawn->chdir) < 0) {
 				nih_error_raise_system ();
-				job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CHDIR, 0);
+				job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CHDIR, 0);
 			}
 		}
 
@@ -804,20 +1429,25 @@ job_process_spawn_with_fd (Job          *job,
 		 * UID and GID from the names to accommodate both chroot
 		 * session jobs and jobs with a chroot stanza.
 		 */
-		if (class->setuid) {
+		if (spawn->credentials) {
+			job_setuid = spawn->credentials->uid;
+			job_setgid = spawn->credentials->gid;
+		}
+
+		if (spawn->setuid && (! spawn->credentials)) {
 			/* Without resetting errno, it's impossible to
 			 * distinguish between a non-existent user and and
 			 * error during lookup */
 			errno = 0;
-			pwd = getpwnam (class->setuid);
+			pwd = getpwnam (spawn->setuid);
 			if (! pwd) {
 				if (errno != 0) {
 					nih_error_raise_system ();
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_GETPWNAM, 0);
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_GETPWNAM, 0);
 				} else {
 					nih_error_raise (JOB_PROCESS_INVALID_SETUID,
 							 JOB_PROCESS_INVALID_SETUID_STR);
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_BAD_SETUID, 0);
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_BAD_SETUID, 0);
 				}
 			}
 
@@ -826,17 +1456,17 @@ job_process_spawn_with_fd (Job          *job,
 			job_setgid = pwd->pw_gid;
 		}
 
-		if (class->setgid) {
+		if (spawn->setgid && (! spawn->credentials)) {
 			errno = 0;
-			grp = getgrnam (class->setgid);
+			grp = getgrnam (spawn->setgid);
 			if (! grp) {
 				if (errno != 0) {
 					nih_error_raise_system ();
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_GETGRNAM, 0);
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_GETGRNAM, 0);
 				} else {
 					nih_error_raise (JOB_PROCESS_INVALID_SETGID,
 							 JOB_PROCESS_INVALID_SETGID_STR);
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_BAD_SETGID, 0);
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_BAD_SETGID, 0);
 				}
 			}
 
@@ -847,18 +1477,27 @@ job_process_spawn_with_fd (Job          *job,
 		    (job_setuid != (uid_t) -1 || job_setgid != (gid_t) -1) &&
 		    fchown (script_fd, job_setuid, job_setgid) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CHOWN, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CHOWN, 0);
 		}
 
 		/* Make sure we always have the needed pwd and grp structs.
 		 * Then pass those to initgroups() to setup the user's group list.
-		 * Only do that if we're root as initgroups() won't work when non-root. */
-		if (geteuid () == 0) {
+		 * Only do that if we're root as initgroups() won't work when non-root.
+		 * Resolved credentials already hold the list initgroups() would
+		 * set up. */
+		if ((geteuid () == 0) && spawn->credentials) {
+			if (spawn->credentials->groups
+			    && setgroups (spawn->credentials->ngroups,
+					  spawn->credentials->groups) < 0) {
+				nih_error_raise_system ();
+				job_process_error_abort (error_fd, JOB_PROCESS_ERROR_INITGROUPS, 0);
+			}
+		} else if (geteuid () == 0) {
 			if (! pwd) {
 				pwd = getpwuid (geteuid ());
 				if (! pwd) {
 					nih_error_raise_system ();
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_GETPWUID, 0);
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_GETPWUID, 0);
 				}
 			}
 
@@ -866,28 +1505,28 @@ job_process_spawn_with_fd (Job          *job,
 				grp = getgrgid (getegid ());
 				if (! grp) {
 					nih_error_raise_system ();
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_GETGRGID, 0);
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_GETGRGID, 0);
 				}
 			}
 
 			if (pwd && grp) {
 				if (initgroups (pwd->pw_name, grp->gr_gid) < 0) {
 					nih_error_raise_system ();
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_INITGROUPS, 0);
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_INITGROUPS, 0);
 				}
 			}
 		}
 
 #ifdef ENABLE_CGROUPS
-		if (cgroups_needed) {
+		if (spawn->job) {
 			if (cgroup_manager_connect () < 0)
-				job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CGROUP_MGR_CONNECT, 0);
+				job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CGROUP_MGR_CONNECT, 0);
 
-			if (! cgroup_setup (&job->class->cgroups,
-						env,
-						class->setuid ? job_setuid : geteuid (),
-						class->setgid ? job_setgid : getegid ())) {
-				job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CGROUP_SETUP, 0);
+			if (! cgroup_setup (&spawn->job->class->cgroups,
+						spawn->env,
+						spawn->setuid ? job_setuid : geteuid (),
+						spawn->setgid ? job_setgid : getegid ())) {
+				job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CGROUP_SETUP, 0);
 			}
 
 			/* If spawning the last process for the job,
@@ -895,9 +1534,9 @@ job_process_spawn_with_fd (Job          *job,
 			 * all job cgroups relating to this job once all
 			 * job processes have completed.
 			 */
-			if (job_last_process (job, process)) {
-				if (! cgroup_clear (&job->class->cgroups)) {
-					job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CGROUP_CLEAR, 0);
+			if (job_last_process (spawn->job, spawn->process)) {
+				if (! cgroup_clear (&spawn->job->class->cgroups)) {
+					job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CGROUP_CLEAR, 0);
 				}
 			}
 		}
@@ -906,12 +1545,12 @@ job_process_spawn_with_fd (Job          *job,
 		/* Start dropping privileges */
 		if (job_setgid != (gid_t) -1 && setgid (job_setgid) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_SETGID, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_SETGID, 0);
 		}
 
 		if (job_setuid != (uid_t)-1 && setuid (job_setuid) < 0) {
 			nih_error_raise_system ();
-			job_process_error_abort (fds[1], JOB_PROCESS_ERROR_SETUID, 0);
+			job_process_error_abort (error_fd, JOB_PROCESS_ERROR_SETUID, 0);
 		}
 	}
 
@@ -920,7 +1559,7 @@ job_process_spawn_with_fd (Job          *job,
 	 * surprisingly handle them before we've exec()d the new process.
 	 */
 	nih_signal_reset ();
-	sigprocmask (SIG_SETMASK, &orig_set, NULL);
+	sigprocmask (SIG_SETMASK, orig_set, NULL);
 
 	/* Notes:
 	 *
@@ -940,12 +1579,12 @@ job_process_spawn_with_fd (Job          *job,
 	 *   the parents file descriptors open until it continues to
 	 *   call exec below.
 	 */
-	if (class->debug) {
+	if (spawn->debug) {
 		/* Since we have not exec'd at this point, we will still
 		 * have a copy of the parents fds open. As such, re-exec
 		 * will not work.
 		 */
-		close (fds[1]);
+		close (error_fd);
 		raise (SIGSTOP);
 	}
 
@@ -954,24 +1593,24 @@ job_process_spawn_with_fd (Job          *job,
 	 * the process is running with the correct group and user
 	 * ownership.
 	 */
-	if (cgroups_needed && cgroup_enter_groups (&job->class->cgroups) != TRUE)
-		job_process_error_abort (fds[1], JOB_PROCESS_ERROR_CGROUP_ENTER, 0);
+	if (spawn->job && cgroup_enter_groups (&spawn->job->class->cgroups) != TRUE)
+		job_process_error_abort (error_fd, JOB_PROCESS_ERROR_CGROUP_ENTER, 0);
 
 #endif /* ENABLE_CGROUPS */
 
 	/* Set up a process trace if we need to trace forks */
-	if (trace) {
+	if (spawn->trace) {
 		if (ptrace (PTRACE_TRACEME, 0, NULL, 0) < 0) {
 			nih_error_raise_system();
-			job_process_error_abort (fds[1],
+			job_process_error_abort (error_fd,
 						 JOB_PROCESS_ERROR_PTRACE, 0);
 		}
 	}
 
 	/* Execute the process, if we escape from here it failed */
-	if (execvp (argv[0], argv) < 0) {
+	if (execvp (spawn->argv[0], spawn->argv) < 0) {
 		nih_error_raise_system ();
-		job_process_error_abort (fds[1], JOB_PROCESS_ERROR_EXEC, 0);
+		job_process_error_abort (error_fd, JOB_PROCESS_ERROR_EXEC, 0);
 	}
 
 	nih_assert_not_reached ();
@@ -1295,7 +1934,8 @@ job_process_kill (Job         *job,
 		  nih_signal_to_name (job->class->kill_signal),
 		  job_name (job), process_name (process), job->pid[process]);
 
-	if (system_kill (job->pid[process], job->class->kill_signal) < 0) {
+	if (job_process_send_signal (job, process,
+				     job->class->kill_signal, TRUE) < 0) {
 		NihError *err;
 
 		err = nih_error_get ();
@@ -1438,7 +2078,7 @@ job_process_kill_timer (Job      *job,
 		  "KILL",
 		  job_name (job), process_name (process), job->pid[process]);
 
-	if (system_kill (job->pid[process], SIGKILL) < 0) {
+	if (job_process_send_signal (job, process, SIGKILL, TRUE) < 0) {
 		NihError *err;
 
 		err = nih_error_get ();
@@ -1487,6 +2127,12 @@ job_process_handler (void           *data,
 	if (! job)
 		return;
 
+	if ((event == NIH_CHILD_EXITED)
+	    || (event == NIH_CHILD_KILLED)
+	    || (event == NIH_CHILD_DUMPED))
+		TRACE (TRACE_RECORD_JOB_REAP, job_name (job), process,
+		       pid, status);
+
 	/* Check the job's normal exit clauses to see whether this is a failure
 	 * worth warning about.
 	 */
@@ -1894,7 +2540,7 @@ job_process_terminated (Job         *job,
 		endutxent();
 
 		/* Clear the process pid field */
-		job->pid[process] = 0;
+		job_process_set_pid (job, process, 0);
 	}
 
 	/* Mark the job as failed */
@@ -1993,7 +2639,8 @@ job_process_stopped (Job         *job,
 	 * job behaves that way.
 	 */
 	if (job->class->expect == EXPECT_STOP) {
-		kill (job->pid[process], SIGCONT);
+		if (job_process_send_signal (job, process, SIGCONT, FALSE) < 0)
+			nih_free (nih_error_get ());
 		job_change_state (job, job_next_state (job));
 	}
 }
@@ -2184,7 +2831,7 @@ job_process_trace_fork (Job         *job,
 	/* Update the process we're supervising which is about to get SIGSTOP
 	 * so set the trace options to capture it.
 	 */
-	job->pid[process] = (pid_t)data;
+	job_process_set_pid (job, process, (pid_t)data);
 	job->trace_state = TRACE_NEW_CHILD;
 
 	/* We may have already had the wait notification for the new child
@@ -2253,9 +2900,9 @@ job_process_trace_exec (Job         *job,
  * @pid: process id to find,
  * @process: pointer to place process which is running @pid.
  *
- * Finds the job with a process of the given @pid in the jobs hash table.
- * If @process is not NULL, the @process variable is set to point at the
- * process entry in the table which has @pid.
+ * Finds the job with a process of the given @pid in the job process pids
+ * hash table.  If @process is not NULL, the @process variable is set to
+ * point at the process entry in the table which has @pid.
  *
  * Returns: job found or NULL if not known.
  **/
@@ -2263,30 +2910,568 @@ Job *
 job_process_find (pid_t        pid,
 		  ProcessType *process)
 {
+	JobProcessPid *entry = NULL;
+
 	nih_assert (pid > 0);
 
-	job_class_init ();
+	job_process_pids_init ();
 
-	NIH_HASH_FOREACH (job_classes, iter) {
-		JobClass *class = (JobClass *)iter;
+	while ((entry = (JobProcessPid *)nih_hash_search (
+			job_process_pids, &pid,
+			entry ? &entry->entry : NULL)) != NULL) {
+		/* Ignore entries for a pid that has since been
+		 * overwritten without going through job_process_set_pid().
+		 */
+		if (entry->job->pid[entry->process] != pid)
+			continue;
 
-		NIH_HASH_FOREACH (class->instances, job_iter) {
-			Job *job = (Job *)job_iter;
-			int  i;
+		if (process)
+			*process = entry->process;
 
-			for (i = 0; i < PROCESS_LAST; i++) {
-				if (job->pid[i] == pid) {
-					if (process)
-						*process = i;
-					return job;
-				}
-			}
+		return entry->job;
+	}
+
+	return NULL;
+}
+
+/**
+ * job_process_set_pid:
+ * @job: job to update,
+ * @process: process of @job to update,
+ * @pid: new process id, or zero.
+ *
+ * Sets the pid of @process of @job to @pid, updating the job process pids
+ * hash table so that job_process_find() will return @job for @pid and
+ * no longer return it for the previous pid.
+ *
+ * This must be used in preference to assigning to the pid array of a job
+ * directly.
+ **/
+void
+job_process_set_pid (Job         *job,
+		     ProcessType  process,
+		     pid_t        pid)
+{
+	job_process_set_pid_with_fd (job, process, pid, -1);
+}
+
+/**
+ * job_process_set_pid_with_fd:
+ * @job: job to update,
+ * @process: process of @job to update,
+ * @pid: new process id, or zero,
+ * @pidfd: pidfd for @pid, or -1.
+ *
+ * Sets the pid of @process of @job to @pid as job_process_set_pid()
+ * does, and where the kernel supports them, holds a pidfd for @pid
+ * watched in the main loop so that it is reaped as soon as it terminates.
+ *
+ * @pidfd is normally -1, in which case a new pidfd is opened; otherwise
+ * it is one passed over a re-exec, which is only used if it still refers
+ * to @pid.  No pidfd is held once job_process_pidfd_allowed() says too
+ * many are, in which case @pidfd is closed if it does refer to @pid.
+ **/
+void
+job_process_set_pid_with_fd (Job         *job,
+			     ProcessType  process,
+			     pid_t        pid,
+			     int          pidfd)
+{
+	JobProcessPid *entry;
+
+	nih_assert (job != NULL);
+	nih_assert (process > PROCESS_INVALID);
+	nih_assert (process < PROCESS_LAST);
+
+	job_process_pids_init ();
+
+	entry = job_process_pid_entry (job, process);
+	if (entry)
+		nih_free (entry);
+
+	job->pid[process] = pid;
+
+	if (pid <= 0)
+		return;
+
+	entry = NIH_MUST (nih_new (job, JobProcessPid));
+
+	nih_list_init (&entry->entry);
+	nih_alloc_set_destructor (entry, job_process_pid_destroy);
+
+	entry->pid = pid;
+	entry->job = job;
+	entry->process = process;
+	entry->pidfd = -1;
+	entry->watch = NULL;
+
+	hash_add (job_process_pids, &entry->entry);
+
+	if (! job_process_pidfd_allowed ()) {
+		if (job_process_pidfd_check (pidfd, pid))
+			close (pidfd);
+		return;
+	}
+
+	if ((pidfd != -1) && job_process_pidfd_check (pidfd, pid)) {
+		/* Stop it being leaked to our children again */
+		(void)state_modify_cloexec (pidfd, TRUE);
+
+		entry->pidfd = pidfd;
+	} else {
+		entry->pidfd = job_process_pidfd_open (pid);
+		if (entry->pidfd < 0) {
+			entry->pidfd = -1;
+			return;
+		}
+	}
+
+	job_process_pidfds_held++;
+
+	/* Should we be unable to watch it, SIGCHLD still tells us when
+	 * the process terminates.
+	 */
+	entry->watch = nih_io_add_watch (entry, entry->pidfd, NIH_IO_READ,
+					 (NihIoWatcher)job_process_pidfd_watcher,
+					 entry);
+	if (! entry->watch) {
+		close (entry->pidfd);
+		entry->pidfd = -1;
+		job_process_pidfds_held--;
+	}
+}
+
+/**
+ * job_process_pidfd:
+ * @job: job to look up,
+ * @process: process of @job.
+ *
+ * Returns: pidfd held for @process of @job, or -1 if there is none.
+ **/
+int
+job_process_pidfd (const Job   *job,
+		   ProcessType  process)
+{
+	JobProcessPid *entry;
+
+	nih_assert (job != NULL);
+	nih_assert (process > PROCESS_INVALID);
+	nih_assert (process < PROCESS_LAST);
+
+	job_process_pids_init ();
+
+	entry = job_process_pid_entry (job, process);
+
+	return entry ? entry->pidfd : -1;
+}
+
+/**
+ * job_process_send_signal:
+ * @job: job to signal,
+ * @process: process of @job to signal,
+ * @signal: signal to send,
+ * @group: TRUE to signal the process group of @process.
+ *
+ * Sends @signal to @process of @job, or to its process group when @group
+ * is TRUE.
+ *
+ * The signal is sent through the pidfd held for the process where there
+ * is one, so it cannot reach another process that has reused the pid;
+ * process groups can't be signalled that way, so instead the pidfd is
+ * used to check that the process is still ours first.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+job_process_send_signal (Job         *job,
+			 ProcessType  process,
+			 int          signal,
+			 int          group)
+{
+	JobProcessPid *entry;
+	pid_t          pid;
+
+	nih_assert (job != NULL);
+	nih_assert (process > PROCESS_INVALID);
+	nih_assert (process < PROCESS_LAST);
+
+	pid = job->pid[process];
+	nih_assert (pid > 0);
+
+	job_process_pids_init ();
+
+	entry = job_process_pid_entry (job, process);
+	if (entry && (entry->pidfd != -1)) {
+		if (job_process_pidfd_signal (entry->pidfd,
+					      group ? 0 : signal) < 0) {
+			if (errno != ENOSYS)
+				nih_return_system_error (-1);
+		} else if (! group) {
+			return 0;
 		}
 	}
 
+	if (group)
+		return system_kill (pid, signal);
+
+	if (kill (pid, signal) < 0)
+		nih_return_system_error (-1);
+
+	return 0;
+}
+
+/**
+ * job_process_pids_init:
+ *
+ * Initialise the job process pids hash table.
+ **/
+static void
+job_process_pids_init (void)
+{
+	if (! job_process_pids)
+		job_process_pids = NIH_MUST (nih_hash_new (
+				NULL, 0,
+				job_process_pid_key,
+				job_process_pid_hash,
+				job_process_pid_cmp));
+}
+
+/**
+ * job_process_pid_key:
+ * @entry: JobProcessPid entry.
+ *
+ * Key function for the job process pids hash table.
+ *
+ * Returns: pointer to the pid of @entry.
+ **/
+static const void *
+job_process_pid_key (NihList *entry)
+{
+	nih_assert (entry != NULL);
+
+	return &((JobProcessPid *)entry)->pid;
+}
+
+/**
+ * job_process_pid_hash:
+ * @key: pointer to pid.
+ *
+ * Hash function for the job process pids hash table; process ids are
+ * already well distributed so are used directly.
+ *
+ * Returns: hash value of @key.
+ **/
+static uint32_t
+job_process_pid_hash (const void *key)
+{
+	nih_assert (key != NULL);
+
+	return (uint32_t)*(const pid_t *)key;
+}
+
+/**
+ * job_process_pid_cmp:
+ * @key1: pointer to first pid,
+ * @key2: pointer to second pid.
+ *
+ * Comparison function for the job process pids hash table.
+ *
+ * Returns: zero if the pids are equal, non-zero otherwise.
+ **/
+static int
+job_process_pid_cmp (const void *key1,
+		     const void *key2)
+{
+	nih_assert (key1 != NULL);
+	nih_assert (key2 != NULL);
+
+	return *(const pid_t *)key1 != *(const pid_t *)key2;
+}
+
+/**
+ * job_process_pid_entry:
+ * @job: job to look up,
+ * @process: process of @job.
+ *
+ * Finds the entry in the job process pids hash table for @process of
+ * @job.
+ *
+ * Returns: entry found or NULL if @process has no pid.
+ **/
+static JobProcessPid *
+job_process_pid_entry (const Job   *job,
+		       ProcessType  process)
+{
+	JobProcessPid *entry = NULL;
+
+	nih_assert (job != NULL);
+	nih_assert (job_process_pids != NULL);
+
+	if (job->pid[process] <= 0)
+		return NULL;
+
+	while ((entry = (JobProcessPid *)nih_hash_search (
+			job_process_pids, &job->pid[process],
+			entry ? &entry->entry : NULL)) != NULL) {
+		if ((entry->job == job) && (entry->process == process))
+			return entry;
+	}
+
 	return NULL;
 }
 
+/**
+ * job_process_pid_destroy:
+ * @entry: entry to be destroyed.
+ *
+ * Removes @entry from the job process pids hash table and closes the
+ * pidfd it holds, if any.
+ *
+ * Normally used or called from an nih_alloc() destructor.
+ *
+ * Returns: zero.
+ **/
+static int
+job_process_pid_destroy (JobProcessPid *entry)
+{
+	nih_assert (entry != NULL);
+
+	nih_list_destroy (&entry->entry);
+
+	if (entry->pidfd != -1) {
+		close (entry->pidfd);
+
+		nih_assert (job_process_pidfds_held > 0);
+		job_process_pidfds_held--;
+	}
+
+	return 0;
+}
+
+/**
+ * job_process_pidfd_allowed:
+ *
+ * Checks whether another pidfd may be held for a job process, which it
+ * may while those held take up less than one in JOB_PROCESS_PIDFDS_SHARE
+ * of the file descriptors we may have open; beyond that, processes are
+ * supervised through SIGCHLD alone, leaving the rest for job logs,
+ * scripts and the like.
+ *
+ * Returns: TRUE if a pidfd may be held, FALSE otherwise.
+ **/
+static int
+job_process_pidfd_allowed (void)
+{
+	struct rlimit rlim;
+
+	if (getrlimit (RLIMIT_NOFILE, &rlim) < 0)
+		return TRUE;
+
+	if (rlim.rlim_cur == RLIM_INFINITY)
+		return TRUE;
+
+	return (job_process_pidfds_held
+		< rlim.rlim_cur / JOB_PROCESS_PIDFDS_SHARE);
+}
+
+/**
+ * job_process_pidfd_open:
+ * @pid: process id.
+ *
+ * Opens a pidfd referring to @pid, which is closed-on-exec.  Once the
+ * kernel is found not to support pidfds, no further attempt is made.
+ *
+ * Returns: pidfd or -1 on error, with errno set.
+ **/
+static int
+job_process_pidfd_open (pid_t pid)
+{
+#ifdef JOB_PROCESS_PIDFD
+	int fd;
+
+	nih_assert (pid > 0);
+
+	if (! job_process_pidfds) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	fd = syscall (SYS_pidfd_open, pid, 0);
+	if ((fd < 0) && (errno == ENOSYS))
+		job_process_pidfds = FALSE;
+
+	return fd;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif /* JOB_PROCESS_PIDFD */
+}
+
+/**
+ * job_process_pidfd_signal:
+ * @pidfd: pidfd of process,
+ * @signal: signal to send, or zero.
+ *
+ * Sends @signal to the process @pidfd refers to; when @signal is zero,
+ * only checks that it could be sent.
+ *
+ * Returns: zero on success, -1 on error, with errno set.
+ **/
+static int
+job_process_pidfd_signal (int pidfd,
+			  int signal)
+{
+	nih_assert (pidfd >= 0);
+
+#ifdef JOB_PROCESS_PIDFD
+	return syscall (SYS_pidfd_send_signal, pidfd, signal, NULL, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif /* JOB_PROCESS_PIDFD */
+}
+
+/**
+ * job_process_pidfd_check:
+ * @pidfd: file descriptor,
+ * @pid: process id.
+ *
+ * Checks that @pidfd is an open pidfd referring to @pid, as given by
+ * the kernel in its fdinfo.
+ *
+ * Returns: TRUE if @pidfd refers to @pid, FALSE otherwise.
+ **/
+static int
+job_process_pidfd_check (int   pidfd,
+			 pid_t pid)
+{
+	char   path[PATH_MAX];
+	char   line[80];
+	FILE  *fdinfo;
+	int    match = FALSE;
+
+	nih_assert (pid > 0);
+
+	if ((pidfd < 0) || (! state_fd_valid (pidfd)))
+		return FALSE;
+
+	snprintf (path, sizeof (path), "/proc/self/fdinfo/%d", pidfd);
+
+	fdinfo = fopen (path, "r");
+	if (! fdinfo)
+		return FALSE;
+
+	while (fgets (line, sizeof (line), fdinfo)) {
+		int fdinfo_pid;
+
+		if (sscanf (line, "Pid:\t%d", &fdinfo_pid) == 1) {
+			match = (fdinfo_pid == pid);
+			break;
+		}
+	}
+
+	fclose (fdinfo);
+
+	return match;
+}
+
+/**
+ * job_process_pidfd_watcher:
+ * @entry: JobProcessPid for process,
+ * @watch: NihIoWatch for its pidfd,
+ * @events: events that occurred.
+ *
+ * Called when the pidfd held for a job process becomes readable, which
+ * happens once the process has terminated.  The process is reaped and
+ * handlers registered with nih_child_add_watch() are called as they
+ * would be by nih_child_poll(), without waiting for SIGCHLD and checking
+ * every child.
+ *
+ * If the process can't be reaped this way, because it isn't our child
+ * or the kernel doesn't support it, the pidfd is no longer watched and
+ * SIGCHLD is relied upon instead.
+ **/
+static void
+job_process_pidfd_watcher (JobProcessPid *entry,
+			   NihIoWatch    *watch,
+			   NihIoEvents    events)
+{
+#ifdef JOB_PROCESS_PIDFD
+	siginfo_t      info;
+	NihChildEvents event;
+
+	nih_assert (entry != NULL);
+	nih_assert (watch != NULL);
+
+	memset (&info, 0, sizeof (info));
+
+	if (waitid (P_PIDFD, entry->pidfd, &info, WEXITED | WNOHANG) < 0) {
+		if (errno == EINVAL)
+			job_process_pidfds = FALSE;
+
+		goto unwatch;
+	}
+
+	switch (info.si_code) {
+	case CLD_EXITED:
+		event = NIH_CHILD_EXITED;
+		break;
+	case CLD_KILLED:
+		event = NIH_CHILD_KILLED;
+		break;
+	case CLD_DUMPED:
+		event = NIH_CHILD_DUMPED;
+		break;
+	default:
+		goto unwatch;
+	}
+
+	/* This will normally free @entry */
+	job_process_child_dispatch (info.si_pid, event, info.si_status);
+
+	return;
+
+unwatch:
+	nih_free (watch);
+	entry->watch = NULL;
+#endif /* JOB_PROCESS_PIDFD */
+}
+
+/**
+ * job_process_child_dispatch:
+ * @pid: process that changed,
+ * @event: event that occurred on the child,
+ * @status: exit status or signal raised.
+ *
+ * Calls the handlers registered with nih_child_add_watch() for @pid
+ * terminating, freeing those for @pid alone afterwards as nih_child_poll()
+ * does.
+ **/
+static void
+job_process_child_dispatch (pid_t          pid,
+			    NihChildEvents event,
+			    int            status)
+{
+	nih_assert (pid > 0);
+
+	nih_child_init ();
+
+	NIH_LIST_FOREACH_SAFE (nih_child_watches, iter) {
+		NihChildWatch *watch = (NihChildWatch *)iter;
+
+		if ((watch->pid != pid) && (watch->pid != -1))
+			continue;
+
+		if (! (watch->events & event))
+			continue;
+
+		watch->handler (watch->data, pid, event, status);
+
+		if (watch->pid == pid)
+			nih_free (watch);
+	}
+}
+
 /**
  * job_process_log_path:
  *
@@ -2555,6 +3740,10 @@ job_process_close_handler (JobProcessData  *process_data,
 	process = process_data->process;
 	status = process_data->status;
 
+	if (job)
+		TRACE (TRACE_RECORD_JOB_EXEC, job_name (job), process,
+		       job->pid[process], 0);
+
 	/* Ensure the job process error fd is closed before attempting
 	 * to handle any scripts.
 	 */
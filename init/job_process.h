@@ -21,9 +21,13 @@
 #define INIT_JOB_PROCESS_H
 
 #include <sys/types.h>
+#include <sys/resource.h>
+
+#include <signal.h>
 
 #include <nih/macros.h>
 #include <nih/child.h>
+#include <nih/io.h>
 #include <nih/error.h>
 
 #include "process.h"
@@ -129,6 +133,91 @@ typedef struct job_process_error {
 } JobProcessError;
 
 
+/**
+ * JobProcessPid:
+ * @entry: list header,
+ * @pid: process id,
+ * @job: job running @pid,
+ * @process: process of @job that is running @pid,
+ * @pidfd: file descriptor referring to @pid, or -1,
+ * @watch: watch on @pidfd for @pid terminating, or NULL.
+ *
+ * Entries in the job process pids hash table, one for each non-zero
+ * element of each job's pid array, allowing the job running a given
+ * process to be found without visiting every job.
+ *
+ * Where the kernel supports them, @pidfd is held so that the process
+ * can be reaped as soon as it terminates and signalled without any
+ * risk of its pid having been reused.
+ *
+ * Entries are allocated as children of @job so are removed when it is
+ * freed.
+ **/
+typedef struct job_process_pid {
+	NihList      entry;
+	pid_t        pid;
+	Job         *job;
+	ProcessType  process;
+	int          pidfd;
+	NihIoWatch  *watch;
+} JobProcessPid;
+
+/**
+ * JobProcessSpawn:
+ * @argv: NULL-terminated list of arguments for the process,
+ * @env: NULL-terminated list of environment variables for the process,
+ * @process: job process being spawned,
+ * @trace: whether to trace the process,
+ * @debug: whether to stop the process before it is executed,
+ * @script_fd: script file descriptor, or -1,
+ * @console: console type of the process,
+ * @pty_master: master side of the pty for CONSOLE_LOG, or -1,
+ * @apparmor_switch: AppArmor profile to switch to, or NULL,
+ * @limits: resource limits, NULL entries are inherited,
+ * @umask: file mode creation mask,
+ * @nice: process priority, or JOB_NICE_INVALID,
+ * @oom_score_adj: OOM killer adjustment,
+ * @session_chroot: root directory of the job's chroot session, or NULL,
+ * @chroot: root directory, or NULL,
+ * @chdir: working directory, or NULL,
+ * @setuid: user to run the process as, or NULL,
+ * @setgid: group to run the process as, or NULL,
+ * @credentials: ids resolved from @setuid and @setgid, or NULL if they
+ * are to be looked up by the child,
+ * @job: job to set up cgroups for, or NULL if none are needed.
+ *
+ * This structure holds everything needed to set up a job process once
+ * it has been forked, resolved from the job and its class beforehand so
+ * that the spawner process can set up the child without either.
+ **/
+typedef struct job_process_spawn {
+	char * const   *argv;
+	char * const   *env;
+	ProcessType     process;
+	int             trace;
+	int             debug;
+	int             script_fd;
+
+	ConsoleType     console;
+	int             pty_master;
+
+	const char     *apparmor_switch;
+
+	struct rlimit  *limits[RLIMIT_NLIMITS];
+	mode_t          umask;
+	int             nice;
+	int             oom_score_adj;
+
+	const char     *session_chroot;
+	const char     *chroot;
+	const char     *chdir;
+	const char     *setuid;
+	const char     *setgid;
+	const JobCredentials *credentials;
+
+	Job            *job;
+} JobProcessSpawn;
+
 /**
  * JobProcessErrorHandler:
  *
@@ -142,6 +231,8 @@ typedef void (*JobProcessErrorHandler) (Job *job, JobState state, ProcessType pr
 
 NIH_BEGIN_EXTERN
 
+extern NihHash *job_process_pids;
+
 void   job_process_start      (Job *job, ProcessType process);
 void   job_process_run_bottom (JobProcessData *handler_data);
 
@@ -168,6 +259,15 @@ void   job_process_handler (void *ptr, pid_t pid,
 
 Job   *job_process_find     (pid_t pid, ProcessType *process);
 
+void   job_process_set_pid  (Job *job, ProcessType process, pid_t pid);
+void   job_process_set_pid_with_fd (Job *job, ProcessType process,
+				    pid_t pid, int pidfd);
+int    job_process_pidfd    (const Job *job, ProcessType process)
+	__attribute__ ((warn_unused_result));
+int    job_process_send_signal (Job *job, ProcessType process,
+				int signal, int group)
+	__attribute__ ((warn_unused_result));
+
 char  *job_process_log_path (Job *job, int user_job)
 	__attribute__ ((warn_unused_result));
 
@@ -199,6 +299,10 @@ void job_process_error_abort     (int fd, JobProcessErrorType type,
 					 int arg)
 	__attribute__ ((noreturn));
 
+void job_process_spawn_child     (const JobProcessSpawn *spawn,
+				  int error_fd, const sigset_t *orig_set)
+	__attribute__ ((noreturn));
+
 NIH_END_EXTERN
 
 #endif /* INIT_JOB_PROCESS_H */
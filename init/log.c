@@ -20,6 +20,11 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */    
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <limits.h>
 #include <signal.h>
@@ -36,6 +41,20 @@ static int  log_file_open   (Log *log);
 static int  log_file_write  (Log *log, const char *buf, size_t len);
 static void log_read_watch  (Log *log);
 static void log_flush       (Log *log);
+static int  log_unflushed_to_memfd   (Log *log)
+	__attribute__ ((warn_unused_result));
+static int  log_unflushed_from_memfd (Log *log, int fd)
+	__attribute__ ((warn_unused_result));
+
+/**
+ * LOG_UNFLUSHED_SEALS:
+ *
+ * Seals applied to the memfd holding unflushed data across a re-exec,
+ * preventing its contents from changing once written.
+ **/
+#ifdef F_ADD_SEALS
+#define LOG_UNFLUSHED_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+#endif
 
 /**
  * log_flushed:
@@ -125,6 +144,7 @@ log_new (const void *parent,
 	log->fd            = -1;
 	log->uid           = uid;
 	log->unflushed     = NULL;
+	log->unflushed_fd  = -1;
 	log->io            = NULL;
 	log->detached      = 0;
 	log->remote_closed = 0;
@@ -191,6 +211,11 @@ log_destroy (Log *log)
 
 	log->fd = -1;
 
+	if (log->unflushed_fd != -1)
+		close (log->unflushed_fd);
+
+	log->unflushed_fd = -1;
+
 	return 0;
 }
 
@@ -941,10 +966,17 @@ log_serialise (Log *log)
 	if (! state_set_json_int_var_from_obj (json, log, uid))
 		goto error;
 
-	/* Encode unflushed data as hex to ensure any embedded
-	 * nulls are handled.
+	/* When passing state to a new instance, hand over the sealed
+	 * memfd copy of unflushed data made by log_prepare_reexec()
+	 * rather than encoding and copying it as part of the state.
 	 */
-	if (log->unflushed && log->unflushed->len) {
+	if (state_pass_fds && log->unflushed_fd != -1) {
+		if (! state_set_json_int_var_from_obj (json, log, unflushed_fd))
+			goto error;
+	} else if (log->unflushed && log->unflushed->len) {
+		/* Encode unflushed data as hex to ensure any embedded
+		 * nulls are handled.
+		 */
 		unflushed_hex = state_data_to_hex (NULL,
 				log->unflushed->buf,
 				log->unflushed->len);
@@ -1047,7 +1079,15 @@ log_deserialise (const void *parent,
 	if (! log->unflushed)
 		goto error;
 
-	if (json_object_object_get_ex (json, "unflushed", NULL)) {
+	if (json_object_object_get_ex (json, "unflushed_fd", NULL)) {
+		int unflushed_fd = -1;
+
+		if (! state_get_json_int_var (json, "unflushed_fd", unflushed_fd))
+			goto error;
+
+		if (log_unflushed_from_memfd (log, unflushed_fd) < 0)
+			goto error;
+	} else if (json_object_object_get_ex (json, "unflushed", NULL)) {
 		if (! state_get_json_string_var_strict (json, "unflushed", NULL, unflushed_hex))
 			goto error;
 
@@ -1079,3 +1119,153 @@ error:
 	nih_free (log);
 	return NULL;
 }
+
+/**
+ * log_prepare_reexec:
+ * @log: log to prepare.
+ *
+ * Prepare @log for a re-exec by copying any unflushed data into a
+ * sealed memfd, replacing any earlier copy, for log_serialise() to hand
+ * over to the new instance.  If that is not possible, the data is
+ * serialised inline instead.
+ **/
+void
+log_prepare_reexec (Log *log)
+{
+	nih_assert (log);
+
+	if (log->unflushed_fd != -1) {
+		close (log->unflushed_fd);
+		log->unflushed_fd = -1;
+	}
+
+	if (log->unflushed && log->unflushed->len)
+		log->unflushed_fd = log_unflushed_to_memfd (log);
+}
+
+/**
+ * log_unflushed_to_memfd:
+ * @log: log whose unflushed data is to be copied.
+ *
+ * Write the unflushed data of @log into a new memfd, then seal it so
+ * that the next instance can trust its contents across a re-exec.
+ *
+ * The descriptor is close-on-exec; job_class_prepare_reexec() clears
+ * that immediately before re-exec.
+ *
+ * Returns: file descriptor, or -1 if memfds are not available or on
+ * error, in which case the data should be serialised inline.
+ **/
+static int
+log_unflushed_to_memfd (Log *log)
+{
+#if defined (MFD_ALLOW_SEALING) && defined (F_ADD_SEALS)
+	const char  *buf;
+	size_t       len;
+	int          fd;
+
+	nih_assert (log);
+	nih_assert (log->unflushed);
+
+	fd = memfd_create ("upstart-log", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -1;
+
+	buf = log->unflushed->buf;
+	len = log->unflushed->len;
+
+	while (len) {
+		ssize_t ret;
+
+		ret = write (fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			goto error;
+		}
+
+		buf += ret;
+		len -= (size_t)ret;
+	}
+
+	if (fcntl (fd, F_ADD_SEALS, LOG_UNFLUSHED_SEALS) < 0)
+		goto error;
+
+	return fd;
+
+error:
+	close (fd);
+	return -1;
+#else
+	return -1;
+#endif
+}
+
+/**
+ * log_unflushed_from_memfd:
+ * @log: log to receive unflushed data,
+ * @fd: memfd created by log_unflushed_to_memfd() in the previous
+ * instance.
+ *
+ * Append the contents of @fd to the unflushed data of @log, reading
+ * straight into its buffer, and close @fd.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+static int
+log_unflushed_from_memfd (Log *log, int fd)
+{
+	struct stat  statbuf;
+	size_t       size;
+	size_t       done = 0;
+
+	nih_assert (log);
+	nih_assert (log->unflushed);
+
+	if (fd < 0)
+		return -1;
+
+#ifdef F_GET_SEALS
+	{
+		int seals = fcntl (fd, F_GET_SEALS);
+
+		if (seals < 0
+		    || (seals & LOG_UNFLUSHED_SEALS) != LOG_UNFLUSHED_SEALS)
+			goto error;
+	}
+#endif
+
+	if (fstat (fd, &statbuf) < 0)
+		goto error;
+
+	size = (size_t)statbuf.st_size;
+
+	if (nih_io_buffer_resize (log->unflushed, size) < 0)
+		goto error;
+
+	while (done < size) {
+		ssize_t ret;
+
+		ret = pread (fd, log->unflushed->buf + log->unflushed->len + done,
+			     size - done, (off_t)done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			goto error;
+		} else if (! ret) {
+			goto error;
+		}
+
+		done += (size_t)ret;
+	}
+
+	log->unflushed->len += size;
+
+	close (fd);
+
+	return 0;
+
+error:
+	close (fd);
+	return -1;
+}
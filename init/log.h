@@ -57,6 +57,8 @@
  * @io: NihIo associated with jobs stdout and stderr,
  * @uid: User ID of caller,
  * @unflushed: Unflushed data,
+ * @unflushed_fd: sealed memfd holding a copy of @unflushed made by
+ * log_prepare_reexec() for the next instance, or -1,
  * @detached: TRUE if log is no longer associated with a parent (job),
  * @remote_closed: TRUE if remote end of pty has been closed,
  * @open_errno: value of errno immediately after last attempt to open @path.
@@ -67,6 +69,7 @@ typedef struct log {
 	NihIo       *io;
 	uid_t        uid;
 	NihIoBuffer *unflushed;
+	int          unflushed_fd;
 	int          detached;
 	int          remote_closed;
 	int          open_errno;
@@ -88,6 +91,7 @@ int   log_handle_unflushed   (void *parent, Log *log)
 int   log_clear_unflushed    (void)
 	__attribute__ ((warn_unused_result));
 void  log_unflushed_init     (void);
+void  log_prepare_reexec     (Log *log);
 json_object * log_serialise (Log *log)
 	__attribute__ ((warn_unused_result));
 Log * log_deserialise (const void *parent, json_object *json)
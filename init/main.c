@@ -69,6 +69,8 @@
 #include "control.h"
 #include "state.h"
 #include "xdg.h"
+#include "trace.h"
+#include "spawner.h"
 
 
 /* Prototypes for static functions */
@@ -138,6 +140,38 @@ static char *initial_event = NULL;
  **/
 static int disable_startup_event = FALSE;
 
+/**
+ * emit_unobserved_events:
+ *
+ * If TRUE, always emit job lifecycle events even in user mode, where
+ * they are otherwise skipped when no job refers to them.
+ **/
+static int emit_unobserved_events = FALSE;
+
+/**
+ * trace_record_count:
+ *
+ * Number of event and job lifecycle records to keep in the trace ring
+ * buffer; zero disables tracing.
+ **/
+static int trace_record_count = 0;
+
+/**
+ * disable_conf_cache:
+ *
+ * If TRUE, always parse job configuration rather than caching it in
+ * conf_cache_file.
+ **/
+static int disable_conf_cache = FALSE;
+
+/**
+ * use_spawner:
+ *
+ * If TRUE, fork job processes from the spawner process rather than
+ * from ourselves.
+ **/
+static int use_spawner = FALSE;
+
 /**
  * disable_dbus:
  *
@@ -154,9 +188,16 @@ extern int          use_session_bus;
 extern int          default_console;
 extern int          write_state_file;
 extern char        *log_dir;
+extern char        *conf_cache_file;
+extern int          conf_parse_workers;
+extern int          conf_coalesce_window;
 extern DBusBusType  dbus_bus_type;
 extern mode_t       initial_umask;
 extern int          debug_stanza_enabled;
+extern int          skip_unobserved_events;
+extern int          event_queue_high_watermark;
+extern int          event_queue_low_watermark;
+extern int          control_emit_quota;
 
 #ifdef ENABLE_CGROUPS
 extern int          disable_cgroups;
@@ -174,12 +215,30 @@ static NihOption options[] = {
 	{ 0, "chroot-sessions", N_("enable chroot sessions"),
 		NULL, NULL, &chroot_sessions, NULL },
 
+	{ 0, "conf-cache", N_("specify alternative file to cache parsed job configuration in"),
+		NULL, "FILE", &conf_cache_file, NULL },
+
+	{ 0, "conf-coalesce", N_("milliseconds to coalesce changes to configuration files over (0 to reload on every change)"),
+		NULL, "MS", &conf_coalesce_window, nih_option_int },
+
 	{ 0, "confdir", N_("specify alternative directory to load configuration files from"),
 		NULL, "DIR", NULL, conf_dir_setter },
 
 	{ 0, "default-console", N_("default value for console stanza"),
 		NULL, "VALUE", NULL, console_type_setter },
 
+	{ 0, "emit-quota", N_("maximum number of outstanding events per D-Bus client (0 for no limit)"),
+		NULL, "COUNT", &control_emit_quota, nih_option_int },
+
+	{ 0, "emit-unobserved-events", N_("always emit job events, even if no job refers to them"),
+		NULL, NULL, &emit_unobserved_events, NULL },
+
+	{ 0, "event-queue-high", N_("number of outstanding events at which D-Bus clients are refused (0 for no limit)"),
+		NULL, "COUNT", &event_queue_high_watermark, nih_option_int },
+
+	{ 0, "event-queue-low", N_("number of outstanding events below which D-Bus clients are accepted again"),
+		NULL, "COUNT", &event_queue_low_watermark, nih_option_int },
+
 	{ 0, "logdir", N_("specify alternative directory to store job output logs in"),
 		NULL, "DIR", &log_dir, NULL },
 
@@ -188,6 +247,9 @@ static NihOption options[] = {
 		NULL, NULL, &disable_cgroups, NULL },
 #endif /* ENABLE_CGROUPS */
 
+	{ 0, "no-conf-cache", N_("do not cache parsed job configuration"),
+		NULL, NULL, &disable_conf_cache, NULL },
+
 	{ 0, "no-dbus", N_("do not connect to a D-Bus bus"),
 		NULL, NULL, &disable_dbus, NULL },
 
@@ -200,6 +262,9 @@ static NihOption options[] = {
 	{ 0, "no-startup-event", N_("do not emit any startup event (for testing)"),
 		NULL, NULL, &disable_startup_event, NULL },
 
+	{ 0, "parse-workers", N_("number of processes to parse job configuration in (0 to parse in init)"),
+		NULL, "COUNT", &conf_parse_workers, nih_option_int },
+
 	{ 0, "prepend-confdir", N_("specify additional initial directory to load configuration files from"),
 		NULL, "DIR", NULL, prepend_conf_dir_setter },
 
@@ -214,9 +279,18 @@ static NihOption options[] = {
 	{ 0, "session", N_("use D-Bus session bus rather than system bus (for testing)"),
 		NULL, NULL, &use_session_bus, NULL },
 
+	{ 0, "skip-unobserved-events", N_("do not emit job events that no job refers to"),
+		NULL, NULL, &skip_unobserved_events, NULL },
+
+	{ 0, "spawner", N_("fork job processes from a helper process started early"),
+		NULL, NULL, &use_spawner, NULL },
+
 	{ 0, "startup-event", N_("specify an alternative initial event (for testing)"),
 		NULL, "NAME", &initial_event, NULL },
 
+	{ 0, "trace-records", N_("number of event and job lifecycle timestamps to keep (0 to disable)"),
+		NULL, "COUNT", &trace_record_count, nih_option_int },
+
 	{ 0, "user", N_("start in user mode (as used for user sessions)"),
 		NULL, NULL, &user_mode, NULL },
 
@@ -270,6 +344,30 @@ main (int   argc,
 	if (! user_mode)
 		no_inherit_env = TRUE;
 
+	/* User sessions are dominated by short-lived jobs whose events
+	 * are rarely of interest to anything else.
+	 */
+	if (emit_unobserved_events) {
+		skip_unobserved_events = FALSE;
+	} else if (user_mode) {
+		skip_unobserved_events = TRUE;
+	}
+
+	if (event_queue_low_watermark > event_queue_high_watermark)
+		event_queue_low_watermark = event_queue_high_watermark;
+
+	if (trace_record_count > 0)
+		trace_init ((size_t)trace_record_count);
+
+	/* Session Inits parse few jobs, and should not share the cache of
+	 * the system init.
+	 */
+	if (disable_conf_cache) {
+		conf_cache_file = NULL;
+	} else if (! conf_cache_file && ! user_mode) {
+		conf_cache_file = CONF_CACHE_FILE;
+	}
+
 #ifndef DEBUG
 	if (use_session_bus == FALSE && user_mode == FALSE) {
 
@@ -559,6 +657,18 @@ main (int   argc,
 		}
 	}
 
+	/* Start the spawner before our heap grows, since it is a copy of
+	 * ourselves that every job process will be forked from.
+	 */
+	if (use_spawner && (spawner_start () < 0)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_warn ("%s: %s", _("Unable to start spawner process"),
+			  err->message);
+		nih_free (err);
+	}
+
 
 	if (restart) {
 		if (state_fd == -1) {
@@ -1019,8 +1129,10 @@ static void
 hup_handler (void      *data,
 	     NihSignal *signal)
 {
+	ConfReloadSummary summary;
+
 	nih_info (_("Reloading configuration"));
-	conf_reload ();
+	conf_reload_changed (&summary);
 }
 
 /**
@@ -367,6 +367,8 @@ parse_job (const void *parent,
 		return NULL;
 	}
 
+	class->fast_spawn = job_class_fast_spawn (class);
+
 	return class;
 }
 
@@ -408,6 +410,7 @@ parse_exec (Process         *process,
 
 	if (process->command)
 		nih_unref (process->command, process);
+	process_clear_script (process);
 
 	process->script = FALSE;
 	process->command = nih_config_parse_command (process, file, len,
@@ -455,6 +458,7 @@ parse_script (Process         *process,
 
 	if (process->command)
 		nih_unref (process->command, process);
+	process_clear_script (process);
 
 	process->script = TRUE;
 	process->command = nih_config_parse_block (process, file, len,
@@ -1004,6 +1008,9 @@ parse_on_operand (JobClass         *class,
 				return -1;
 			}
 		}
+
+		if (event_operator_compile (oper) < 0)
+			nih_return_system_error (-1);
 	}
 
 	return 0;
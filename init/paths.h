@@ -174,6 +174,16 @@
 #define JOB_LOGDIR "/var/log/upstart"
 #endif
 
+/**
+ * CONF_CACHE_FILE:
+ *
+ * File that parsed system job configuration is cached in, so that
+ * unchanged files need not be parsed again on the next boot.
+ **/
+#ifndef CONF_CACHE_FILE
+#define CONF_CACHE_FILE "/var/cache/upstart/conf.cache"
+#endif
+
 /**
  * LOGDIR_ENV:
  *
@@ -25,6 +25,7 @@
 
 
 #include <string.h>
+#include <unistd.h>
 
 #include <nih/macros.h>
 #include <nih/alloc.h>
@@ -35,6 +36,14 @@
 #include "state.h"
 
 
+/**
+ * process_script_fds:
+ *
+ * Number of script files currently kept open by Process structures.
+ **/
+static size_t process_script_fds = 0;
+
+
 /**
  * process_new:
  * @parent: parent of new process.
@@ -58,10 +67,84 @@ process_new  (const void *parent)
 
 	process->script = FALSE;
 	process->command = NULL;
+	process->script_fd = -1;
+
+	nih_alloc_set_destructor (process, process_destroy);
 
 	return process;
 }
 
+/**
+ * process_destroy:
+ * @process: process to be destroyed.
+ *
+ * Closes the script file of @process, if it has one.
+ *
+ * Normally used or called from an nih_alloc() destructor.
+ *
+ * Returns: zero.
+ **/
+int
+process_destroy (Process *process)
+{
+	nih_assert (process != NULL);
+
+	process_clear_script (process);
+
+	return 0;
+}
+
+/**
+ * process_set_script:
+ * @process: process to set script of,
+ * @fd: sealed memory file holding the command of @process.
+ *
+ * Keeps @fd as the script file of @process, which must have none, so that
+ * it may be reused by every process that runs the command, unless
+ * PROCESS_SCRIPT_FDS_MAX are already kept; in that case the caller must
+ * close @fd once it has been used.
+ *
+ * Returns: TRUE if @fd is kept, FALSE otherwise.
+ **/
+int
+process_set_script (Process *process,
+		    int      fd)
+{
+	nih_assert (process != NULL);
+	nih_assert (process->script_fd == -1);
+	nih_assert (fd >= 0);
+
+	if (process_script_fds >= PROCESS_SCRIPT_FDS_MAX)
+		return FALSE;
+
+	process->script_fd = fd;
+	process_script_fds++;
+
+	return TRUE;
+}
+
+/**
+ * process_clear_script:
+ * @process: process to clear.
+ *
+ * Closes the script file of @process, if it has one, so that it is
+ * created again from the command the next time it is needed; this must
+ * be called whenever the command is changed.
+ **/
+void
+process_clear_script (Process *process)
+{
+	nih_assert (process != NULL);
+
+	if (process->script_fd != -1) {
+		close (process->script_fd);
+		process->script_fd = -1;
+
+		nih_assert (process_script_fds > 0);
+		process_script_fds--;
+	}
+}
+
 
 /**
  * process_name:
@@ -24,6 +24,15 @@
 
 #include <json.h>
 
+/**
+ * PROCESS_SCRIPT_FDS_MAX:
+ *
+ * Number of script files that may be kept open for reuse at once, across
+ * every Process; scripts beyond these are created for each process that
+ * runs them.
+ **/
+#define PROCESS_SCRIPT_FDS_MAX 128
+
 /**
  * ProcessType:
  *
@@ -53,7 +62,9 @@ typedef enum process_type {
 /**
  * Process:
  * @script: whether a shell will be required,
- * @command: command or script to be run.
+ * @command: command or script to be run,
+ * @script_fd: sealed memory file holding @command as fed to the shell,
+ * or -1 if not yet created.
  *
  * This structure is used for process definitions in the job class, defining
  * processes that will be run by its instances.
@@ -66,6 +77,7 @@ typedef enum process_type {
 typedef struct process {
 	int    script;
 	char  *command;
+	int    script_fd;
 } Process;
 
 
@@ -73,6 +85,10 @@ NIH_BEGIN_EXTERN
 
 Process *   process_new       (const void *parent)
 	__attribute__ ((warn_unused_result));
+int         process_destroy   (Process *process);
+int         process_set_script   (Process *process, int fd)
+	__attribute__ ((warn_unused_result));
+void        process_clear_script (Process *process);
 
 const char *process_name      (ProcessType process)
 	__attribute__ ((const));
@@ -457,12 +457,19 @@ error:
 int
 session_get_index (const Session *session)
 {
-	int i;
+	StateIndex *index;
+	int         i;
 
 	/* Handle NULL session (which is not encoded) */
 	if (! session)
 		return 0;
 
+	index = state_index (STATE_INDEX_SESSIONS);
+	if (index) {
+		i = state_index_find (index, session);
+		return i < 0 ? -1 : i + 1;
+	}
+
 	/* Sessions are serialised in order, so just return the list
 	 * index.
 	 */
@@ -491,8 +498,9 @@ session_get_index (const Session *session)
 Session *
 session_from_index (int idx)
 {
-	int       i;
-	Session  *session;
+	StateIndex *index;
+	int         i;
+	Session    *session;
 
 	nih_assert (idx >= 0);
 
@@ -500,6 +508,13 @@ session_from_index (int idx)
 	if (! idx)
 		return NULL;
 
+	index = state_index (STATE_INDEX_SESSIONS);
+	if (index) {
+		session = (Session *)state_index_get (index, idx - 1);
+		nih_assert (session);
+		return session;
+	}
+
 	i = 1;
 	NIH_LIST_FOREACH (sessions, iter) {
 		session = (Session *)iter;
@@ -0,0 +1,920 @@
+/* upstart
+ *
+ * spawner.c - out-of-process spawning of job processes
+ *
+ * Copyright © 2015 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <dirent.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/child.h>
+#include <nih/signal.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "job_process.h"
+#include "spawner.h"
+
+
+/**
+ * SPAWNER_FDS_MAX:
+ *
+ * Number of file descriptors that may accompany a spawn request: the
+ * child setup pipe, the gate, the script and the pty master.
+ **/
+#define SPAWNER_FDS_MAX 4
+
+
+/**
+ * SpawnerString:
+ *
+ * Optional strings of a JobProcessSpawn, in the order they follow a
+ * SpawnerWireRequest; those that are NULL are omitted.
+ **/
+typedef enum spawner_string {
+	SPAWNER_STRING_APPARMOR_SWITCH,
+	SPAWNER_STRING_SESSION_CHROOT,
+	SPAWNER_STRING_CHROOT,
+	SPAWNER_STRING_CHDIR,
+	SPAWNER_STRING_SETUID,
+	SPAWNER_STRING_SETGID,
+	SPAWNER_STRING_LAST
+} SpawnerString;
+
+/**
+ * SpawnerWireRequest:
+ *
+ * This structure is used to pass a JobProcessSpawn to the spawner process.
+ * It is followed by @ngroups supplementary group ids, then the optional
+ * strings given in @strings_set, then @argc arguments and @envc
+ * environment variables, each terminated by a nul byte; the file
+ * descriptors are passed alongside it.
+ **/
+typedef struct spawner_wire_request {
+	int           process;
+	int           trace;
+	int           debug;
+	int           console;
+	int           has_script_fd;
+	int           has_pty_master;
+
+	uint32_t      limits_set;
+	struct rlimit limits[RLIMIT_NLIMITS];
+	mode_t        umask;
+	int           nice;
+	int           oom_score_adj;
+
+	int           has_credentials;
+	uid_t         uid;
+	gid_t         gid;
+	int           has_groups;
+	uint32_t      ngroups;
+
+	uint32_t      strings_set;
+	uint32_t      argc;
+	uint32_t      envc;
+} SpawnerWireRequest;
+
+/**
+ * SpawnerWireReply:
+ *
+ * This structure is used to pass the result of a spawn request back from
+ * the spawner process; @pid is the process id of the new process, or
+ * zero if it could not be created, in which case @errnum is the system
+ * error number.
+ *
+ * Errors setting up the new process are not passed here, the new process
+ * writes them to the child setup pipe exactly as if we had forked it.
+ **/
+typedef struct spawner_wire_reply {
+	pid_t pid;
+	int   errnum;
+} SpawnerWireReply;
+
+
+/* Prototypes for static functions */
+static void   spawner_main           (int fd)
+	__attribute__ ((noreturn));
+static void   spawner_close_fds      (int keep_fd);
+static pid_t  spawner_clone          (void);
+static void   spawner_handler        (void *data, pid_t pid,
+				      NihChildEvents event, int status);
+static char  *spawner_request_pack   (const void *parent,
+				      const JobProcessSpawn *spawn,
+				      size_t *len)
+	__attribute__ ((warn_unused_result));
+static char **spawner_request_unpack (const void *parent, char *buf,
+				      size_t len, const int *fds, size_t nfds,
+				      JobProcessSpawn *spawn, int *error_fd,
+				      int *gate_fd)
+	__attribute__ ((warn_unused_result));
+
+
+/**
+ * spawner_pid:
+ *
+ * Process id of the spawner process, or zero if it is not running.
+ **/
+pid_t spawner_pid = 0;
+
+/**
+ * spawner_fd:
+ *
+ * Our end of the socket connected to the spawner process, or -1 if it
+ * is not running.
+ **/
+int spawner_fd = -1;
+
+/**
+ * spawner_reply_timeout:
+ *
+ * Milliseconds to wait for the spawner process to reply to a spawn
+ * request before giving up on it.
+ **/
+int spawner_reply_timeout = SPAWNER_REPLY_TIMEOUT;
+
+/**
+ * spawner_watch:
+ *
+ * Child watch on the spawner process so that we notice it terminating.
+ **/
+static NihChildWatch *spawner_watch = NULL;
+
+
+/**
+ * spawner_start:
+ *
+ * Start the spawner process, a copy of ourselves forked before our heap
+ * has grown that job processes are then forked from in our stead, so
+ * that the cost of fork() no longer grows with the number of jobs we
+ * hold; it should be called as early as possible.
+ *
+ * Processes created by the spawner are still our children, are traced
+ * by us and are reaped by us.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+spawner_start (void)
+{
+	int      fds[2] = { -1, -1 };
+	sigset_t child_set, orig_set;
+	pid_t    pid;
+
+	nih_assert (spawner_fd < 0);
+
+	if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+		nih_return_system_error (-1);
+
+	/* Block all signals while we fork to avoid the spawner running
+	 * our own signal handlers before it has reset them.
+	 */
+	sigfillset (&child_set);
+	sigprocmask (SIG_BLOCK, &child_set, &orig_set);
+
+	fflush (NULL);
+
+	pid = fork ();
+	if (pid < 0) {
+		nih_error_raise_system ();
+
+		sigprocmask (SIG_SETMASK, &orig_set, NULL);
+		close (fds[0]);
+		close (fds[1]);
+		return -1;
+	} else if (pid == 0) {
+		close (fds[0]);
+		spawner_close_fds (fds[1]);
+
+		nih_signal_reset ();
+
+		sigemptyset (&child_set);
+		sigprocmask (SIG_SETMASK, &child_set, NULL);
+
+		spawner_main (fds[1]);
+	}
+
+	sigprocmask (SIG_SETMASK, &orig_set, NULL);
+	close (fds[1]);
+
+	spawner_fd = fds[0];
+	spawner_pid = pid;
+
+	spawner_watch = NIH_MUST (nih_child_add_watch (
+					  NULL, pid,
+					  (NIH_CHILD_EXITED | NIH_CHILD_KILLED
+					   | NIH_CHILD_DUMPED),
+					  spawner_handler, NULL));
+
+	nih_debug ("Started spawner process (%d)", pid);
+
+	return 0;
+}
+
+/**
+ * spawner_stop:
+ *
+ * Stop using the spawner process, which exits once it notices its socket
+ * has been closed; job processes are spawned directly from then on.
+ **/
+void
+spawner_stop (void)
+{
+	if (spawner_watch) {
+		nih_free (spawner_watch);
+		spawner_watch = NULL;
+	}
+
+	if (spawner_fd >= 0) {
+		close (spawner_fd);
+		spawner_fd = -1;
+	}
+
+	spawner_pid = 0;
+}
+
+/**
+ * spawner_available:
+ *
+ * Returns: TRUE if job processes may be passed to the spawner process,
+ * FALSE otherwise.
+ **/
+int
+spawner_available (void)
+{
+	return spawner_fd >= 0;
+}
+
+/**
+ * spawner_spawn:
+ * @spawn: details of process to spawn,
+ * @error_fd: writing end of child setup pipe.
+ *
+ * Ask the spawner process to fork a new process and set it up according
+ * to @spawn, exactly as job_process_spawn_with_fd() would itself; the
+ * file descriptors in @spawn and @error_fd are passed to the spawner, and
+ * remain open here.
+ *
+ * The new process waits at a gate, the other end of which we keep,
+ * until we have its process id; should the reply be lost, the gate is
+ * closed instead and the process exits without doing anything, so that
+ * the caller may safely create the process some other way.
+ *
+ * The spawner is stopped, and killed, if it does not reply within
+ * spawner_reply_timeout or can no longer be reached.
+ *
+ * Returns: process id of new process on success, -1 on raised error.
+ **/
+pid_t
+spawner_spawn (const JobProcessSpawn *spawn,
+	       int                    error_fd)
+{
+	nih_local char   *buf = NULL;
+	size_t            len;
+	int               fds[SPAWNER_FDS_MAX];
+	size_t            nfds = 0;
+	char              control[CMSG_SPACE (sizeof (fds))];
+	struct msghdr     msg;
+	struct iovec      iov;
+	struct cmsghdr   *cmsg;
+	struct pollfd     pfd;
+	SpawnerWireReply  reply;
+	int               gate[2];
+	ssize_t           ret;
+
+	nih_assert (spawn != NULL);
+	nih_assert (error_fd >= 0);
+	nih_assert (spawner_fd >= 0);
+
+	buf = spawner_request_pack (NULL, spawn, &len);
+	if (! buf)
+		return -1;
+
+	if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, gate) < 0)
+		nih_return_system_error (-1);
+
+	fds[nfds++] = error_fd;
+	fds[nfds++] = gate[0];
+	if (spawn->script_fd != -1)
+		fds[nfds++] = spawn->script_fd;
+	if (spawn->pty_master != -1)
+		fds[nfds++] = spawn->pty_master;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE (sizeof (int) * nfds);
+
+	cmsg = CMSG_FIRSTHDR (&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN (sizeof (int) * nfds);
+	memcpy (CMSG_DATA (cmsg), fds, sizeof (int) * nfds);
+
+	/* Never take a SIGPIPE should the spawner have gone away */
+	do {
+		ret = sendmsg (spawner_fd, &msg, MSG_NOSIGNAL);
+	} while ((ret < 0) && (errno == EINTR));
+
+	close (gate[0]);
+
+	if (ret < 0) {
+		nih_error_raise_system ();
+
+		if ((errno == EPIPE) || (errno == ECONNRESET))
+			spawner_stop ();
+
+		close (gate[1]);
+		return -1;
+	}
+
+	/* The spawner replies as soon as the new process exists, it does
+	 * not wait for it to be set up.
+	 */
+	pfd.fd = spawner_fd;
+	pfd.events = POLLIN;
+
+	do {
+		ret = poll (&pfd, 1, spawner_reply_timeout);
+	} while ((ret < 0) && (errno == EINTR));
+
+	if (ret > 0) {
+		do {
+			ret = recv (spawner_fd, &reply, sizeof (reply),
+				    MSG_DONTWAIT);
+		} while ((ret < 0) && (errno == EINTR));
+
+		if ((ret >= 0) && (ret != sizeof (reply))) {
+			ret = -1;
+			errno = EPROTO;
+		}
+	} else if (! ret) {
+		ret = -1;
+		errno = ETIMEDOUT;
+	}
+
+	if (ret < 0) {
+		nih_error_raise_system ();
+
+		/* Make sure the spawner cannot go on to create the process
+		 * after we give up, then release any it already has.
+		 */
+		if (spawner_pid > 0)
+			kill (spawner_pid, SIGKILL);
+		spawner_stop ();
+
+		close (gate[1]);
+		return -1;
+	}
+
+	if (reply.pid <= 0) {
+		close (gate[1]);
+		errno = reply.errnum;
+		nih_return_system_error (-1);
+	}
+
+	/* Let the new process go on to set itself up */
+	while (send (gate[1], "", 1, MSG_NOSIGNAL) < 0) {
+		if (errno != EINTR)
+			break;
+	}
+
+	close (gate[1]);
+
+	return reply.pid;
+}
+
+
+/**
+ * spawner_handler:
+ * @data: unused,
+ * @pid: process that changed,
+ * @event: event that occurred on the child,
+ * @status: exit status, signal raised or ptrace event.
+ *
+ * Called when the spawner process terminates, we carry on by spawning
+ * job processes directly.
+ **/
+static void
+spawner_handler (void           *data,
+		 pid_t           pid,
+		 NihChildEvents  event,
+		 int             status)
+{
+	nih_assert (pid > 0);
+
+	nih_warn (_("Spawner process (%d) terminated, spawning job processes directly"),
+		  pid);
+
+	/* The watch is freed once we return */
+	spawner_watch = NULL;
+
+	spawner_stop ();
+}
+
+
+/**
+ * spawner_main:
+ * @fd: spawner end of socket.
+ *
+ * Main loop of the spawner process, reading spawn requests from @fd and
+ * replying with the process id of each new process; the new processes
+ * set themselves up with job_process_spawn_child().
+ *
+ * The spawner exits when @fd is closed.
+ **/
+static void
+spawner_main (int fd)
+{
+	static union {
+		SpawnerWireRequest wire;
+		char               buf[SPAWNER_REQUEST_MAX];
+	} request;
+	sigset_t empty_set;
+
+	nih_assert (fd >= 0);
+
+	sigemptyset (&empty_set);
+
+	for (;;) {
+		nih_local char  **strv = NULL;
+		char              control[CMSG_SPACE (sizeof (int) * SPAWNER_FDS_MAX)];
+		int               fds[SPAWNER_FDS_MAX];
+		size_t            nfds = 0;
+		int               error_fd = -1;
+		int               gate_fd = -1;
+		struct msghdr     msg;
+		struct iovec      iov;
+		struct cmsghdr   *cmsg;
+		JobProcessSpawn   spawn;
+		SpawnerWireReply  reply;
+		ssize_t           len;
+		pid_t             pid;
+
+		iov.iov_base = request.buf;
+		iov.iov_len = sizeof (request.buf);
+
+		memset (&msg, 0, sizeof (msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof (control);
+
+		len = recvmsg (fd, &msg, 0);
+		if ((len < 0) && (errno == EINTR))
+			continue;
+
+		if (len <= 0)
+			_exit (0);
+
+		for (cmsg = CMSG_FIRSTHDR (&msg); cmsg;
+		     cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+			size_t n;
+
+			if ((cmsg->cmsg_level != SOL_SOCKET)
+			    || (cmsg->cmsg_type != SCM_RIGHTS))
+				continue;
+
+			n = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+			if (n > SPAWNER_FDS_MAX - nfds)
+				n = SPAWNER_FDS_MAX - nfds;
+
+			memcpy (&fds[nfds], CMSG_DATA (cmsg), sizeof (int) * n);
+			nfds += n;
+		}
+
+		reply.pid = 0;
+		reply.errnum = 0;
+
+		if (! (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+			strv = spawner_request_unpack (NULL, request.buf, len,
+						       fds, nfds, &spawn,
+						       &error_fd, &gate_fd);
+
+		if (! strv) {
+			reply.errnum = EINVAL;
+		} else {
+			pid = spawner_clone ();
+			if (pid == 0) {
+				char go;
+
+				close (fd);
+
+				/* Init closes the gate without a byte if it
+				 * never learns of us.
+				 */
+				do {
+					len = read (gate_fd, &go, 1);
+				} while ((len < 0) && (errno == EINTR));
+
+				if (len != 1)
+					_exit (0);
+
+				close (gate_fd);
+
+				job_process_spawn_child (&spawn, error_fd,
+							 &empty_set);
+			} else if (pid < 0) {
+				reply.errnum = errno;
+			} else {
+				reply.pid = pid;
+			}
+		}
+
+		/* The new process has its own copies */
+		for (size_t i = 0; i < nfds; i++)
+			close (fds[i]);
+
+		while (send (fd, &reply, sizeof (reply), MSG_NOSIGNAL) < 0) {
+			if (errno != EINTR)
+				_exit (0);
+		}
+	}
+}
+
+/**
+ * spawner_close_fds:
+ * @keep_fd: file descriptor to keep open.
+ *
+ * Close every file descriptor other than the standard ones and @keep_fd,
+ * so that the spawner does not hold open anything we had open when it
+ * was started, or pass it on to job processes.
+ **/
+static void
+spawner_close_fds (int keep_fd)
+{
+	DIR           *dir;
+	struct dirent *ent;
+
+	dir = opendir ("/proc/self/fd");
+	if (! dir)
+		return;
+
+	while ((ent = readdir (dir)) != NULL) {
+		char *end;
+		long  fd;
+
+		fd = strtol (ent->d_name, &end, 10);
+		if ((end == ent->d_name) || *end)
+			continue;
+
+		if ((fd <= STDERR_FILENO) || (fd == keep_fd)
+		    || (fd == dirfd (dir)))
+			continue;
+
+		close (fd);
+	}
+
+	closedir (dir);
+}
+
+/**
+ * spawner_clone:
+ *
+ * Equivalent to fork(), except that the new process is a child of our
+ * parent rather than of ourselves, so that init can wait for, and trace,
+ * job processes created by the spawner.
+ *
+ * Returns: process id of new process in the parent, zero in the child,
+ * negative value on error.
+ **/
+static pid_t
+spawner_clone (void)
+{
+	/* The stack and flags arguments are swapped on these */
+#if defined (__s390__) || defined (__CRIS__)
+	return syscall (SYS_clone, 0, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL);
+#else
+	return syscall (SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, NULL);
+#endif
+}
+
+
+/**
+ * spawner_request_pack:
+ * @parent: parent object for new buffer,
+ * @spawn: details of process to spawn,
+ * @len: pointer to store length of buffer.
+ *
+ * Serialise @spawn as a SpawnerWireRequest followed by its strings, the
+ * file descriptors are not included.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned buffer.  When all parents
+ * of the returned buffer are freed, the returned buffer will also be
+ * freed.
+ *
+ * Returns: newly allocated buffer or NULL on raised error.
+ **/
+static char *
+spawner_request_pack (const void             *parent,
+		      const JobProcessSpawn  *spawn,
+		      size_t                 *len)
+{
+	SpawnerWireRequest  wire;
+	const char         *strings[SPAWNER_STRING_LAST];
+	char               *buf;
+	char               *p;
+	size_t              size;
+	size_t              i;
+
+	nih_assert (spawn != NULL);
+	nih_assert (spawn->argv != NULL);
+	nih_assert (len != NULL);
+
+	memset (&wire, 0, sizeof (wire));
+
+	wire.process = spawn->process;
+	wire.trace = spawn->trace;
+	wire.debug = spawn->debug;
+	wire.console = spawn->console;
+	wire.has_script_fd = (spawn->script_fd != -1);
+	wire.has_pty_master = (spawn->pty_master != -1);
+
+	for (i = 0; i < RLIMIT_NLIMITS; i++) {
+		if (! spawn->limits[i])
+			continue;
+
+		wire.limits_set |= (1U << i);
+		wire.limits[i] = *spawn->limits[i];
+	}
+
+	wire.umask = spawn->umask;
+	wire.nice = spawn->nice;
+	wire.oom_score_adj = spawn->oom_score_adj;
+
+	if (spawn->credentials) {
+		wire.has_credentials = TRUE;
+		wire.uid = spawn->credentials->uid;
+		wire.gid = spawn->credentials->gid;
+
+		if (spawn->credentials->groups) {
+			wire.has_groups = TRUE;
+			wire.ngroups = spawn->credentials->ngroups;
+		}
+	}
+
+	strings[SPAWNER_STRING_APPARMOR_SWITCH] = spawn->apparmor_switch;
+	strings[SPAWNER_STRING_SESSION_CHROOT] = spawn->session_chroot;
+	strings[SPAWNER_STRING_CHROOT] = spawn->chroot;
+	strings[SPAWNER_STRING_CHDIR] = spawn->chdir;
+	strings[SPAWNER_STRING_SETUID] = spawn->setuid;
+	strings[SPAWNER_STRING_SETGID] = spawn->setgid;
+
+	size = sizeof (wire) + sizeof (gid_t) * wire.ngroups;
+
+	for (i = 0; i < SPAWNER_STRING_LAST; i++) {
+		if (! strings[i])
+			continue;
+
+		wire.strings_set |= (1U << i);
+		size += strlen (strings[i]) + 1;
+	}
+
+	for (i = 0; spawn->argv[i]; i++)
+		size += strlen (spawn->argv[i]) + 1;
+	wire.argc = i;
+
+	for (i = 0; spawn->env && spawn->env[i]; i++)
+		size += strlen (spawn->env[i]) + 1;
+	wire.envc = i;
+
+	if (size > SPAWNER_REQUEST_MAX) {
+		errno = E2BIG;
+		nih_return_system_error (NULL);
+	}
+
+	buf = nih_alloc (parent, size);
+	if (! buf)
+		nih_return_no_memory_error (NULL);
+
+	memcpy (buf, &wire, sizeof (wire));
+	p = buf + sizeof (wire);
+
+	if (wire.ngroups) {
+		memcpy (p, spawn->credentials->groups,
+			sizeof (gid_t) * wire.ngroups);
+		p += sizeof (gid_t) * wire.ngroups;
+	}
+
+	for (i = 0; i < SPAWNER_STRING_LAST; i++)
+		if (strings[i])
+			p = stpcpy (p, strings[i]) + 1;
+
+	for (i = 0; i < wire.argc; i++)
+		p = stpcpy (p, spawn->argv[i]) + 1;
+
+	for (i = 0; i < wire.envc; i++)
+		p = stpcpy (p, spawn->env[i]) + 1;
+
+	nih_assert ((size_t)(p - buf) == size);
+
+	*len = size;
+
+	return buf;
+}
+
+/**
+ * spawner_request_unpack:
+ * @parent: parent object for new array,
+ * @buf: serialised request,
+ * @len: length of @buf,
+ * @fds: file descriptors received with @buf,
+ * @nfds: number of entries in @fds,
+ * @spawn: JobProcessSpawn to fill in,
+ * @error_fd: pointer to store writing end of child setup pipe,
+ * @gate_fd: pointer to store gate the new process waits at.
+ *
+ * Fill in @spawn from the request in @buf, which must be suitably
+ * aligned for a SpawnerWireRequest and remain valid for as long as
+ * @spawn is used.
+ *
+ * If @parent is not NULL, it should be a pointer to another object which
+ * will be used as a parent for the returned array.  When all parents
+ * of the returned array are freed, the returned array will also be
+ * freed.
+ *
+ * Returns: newly allocated array holding the arguments and environment
+ * of @spawn, and parent of its credentials, or NULL if the request is
+ * malformed or insufficient memory.
+ **/
+static char **
+spawner_request_unpack (const void       *parent,
+			char             *buf,
+			size_t            len,
+			const int        *fds,
+			size_t            nfds,
+			JobProcessSpawn  *spawn,
+			int              *error_fd,
+			int              *gate_fd)
+{
+	SpawnerWireRequest  *wire;
+	JobCredentials      *creds = NULL;
+	const char          *strings[SPAWNER_STRING_LAST];
+	char               **strv;
+	char                *p;
+	size_t               i;
+
+	nih_assert (buf != NULL);
+	nih_assert (fds != NULL);
+	nih_assert (spawn != NULL);
+	nih_assert (error_fd != NULL);
+	nih_assert (gate_fd != NULL);
+
+	if (len < sizeof (SpawnerWireRequest))
+		return NULL;
+
+	wire = (SpawnerWireRequest *)buf;
+
+	if ((wire->argc < 1) || (wire->argc > len) || (wire->envc > len))
+		return NULL;
+
+	if (nfds != (2 + (wire->has_script_fd ? 1 : 0)
+		     + (wire->has_pty_master ? 1 : 0)))
+		return NULL;
+
+	if ((wire->console == CONSOLE_LOG) != (wire->has_pty_master != 0))
+		return NULL;
+
+	if ((wire->ngroups && (! wire->has_groups))
+	    || (wire->has_groups && (! wire->has_credentials))
+	    || (wire->ngroups > (len - sizeof (SpawnerWireRequest)) / sizeof (gid_t)))
+		return NULL;
+
+	strv = nih_alloc (parent, sizeof (char *) * (wire->argc + wire->envc + 2));
+	if (! strv)
+		return NULL;
+
+	/* Split the strings that follow the request, each must be
+	 * terminated within the buffer and there must be nothing after
+	 * the last.
+	 */
+	p = buf + sizeof (SpawnerWireRequest);
+
+	if (wire->has_credentials) {
+		creds = nih_new (strv, JobCredentials);
+		if (! creds)
+			goto error;
+
+		creds->resolved = 0;
+		creds->uid = wire->uid;
+		creds->gid = wire->gid;
+		creds->groups = wire->has_groups ? (gid_t *)p : NULL;
+		creds->ngroups = wire->ngroups;
+
+		p += sizeof (gid_t) * wire->ngroups;
+	}
+
+	for (i = 0; i < SPAWNER_STRING_LAST; i++) {
+		char *end;
+
+		strings[i] = NULL;
+		if (! (wire->strings_set & (1U << i)))
+			continue;
+
+		end = memchr (p, '\0', len - (p - buf));
+		if (! end)
+			goto error;
+
+		strings[i] = p;
+		p = end + 1;
+	}
+
+	for (i = 0; i < wire->argc + wire->envc; i++) {
+		char *end;
+
+		end = memchr (p, '\0', len - (p - buf));
+		if (! end)
+			goto error;
+
+		/* Each list is NULL-terminated */
+		strv[i < wire->argc ? i : i + 1] = p;
+		p = end + 1;
+	}
+
+	if (p != buf + len)
+		goto error;
+
+	strv[wire->argc] = NULL;
+	strv[wire->argc + wire->envc + 1] = NULL;
+
+	memset (spawn, 0, sizeof (JobProcessSpawn));
+
+	spawn->argv = strv;
+	spawn->env = strv + wire->argc + 1;
+	spawn->process = wire->process;
+	spawn->trace = wire->trace;
+	spawn->debug = wire->debug;
+	spawn->console = wire->console;
+
+	*error_fd = fds[0];
+	*gate_fd = fds[1];
+	spawn->script_fd = wire->has_script_fd ? fds[2] : -1;
+	spawn->pty_master = wire->has_pty_master ? fds[nfds - 1] : -1;
+
+	spawn->apparmor_switch = strings[SPAWNER_STRING_APPARMOR_SWITCH];
+
+	for (i = 0; i < RLIMIT_NLIMITS; i++)
+		spawn->limits[i] = ((wire->limits_set & (1U << i))
+				    ? &wire->limits[i] : NULL);
+
+	spawn->umask = wire->umask;
+	spawn->nice = wire->nice;
+	spawn->oom_score_adj = wire->oom_score_adj;
+
+	spawn->session_chroot = strings[SPAWNER_STRING_SESSION_CHROOT];
+	spawn->chroot = strings[SPAWNER_STRING_CHROOT];
+	spawn->chdir = strings[SPAWNER_STRING_CHDIR];
+	spawn->setuid = strings[SPAWNER_STRING_SETUID];
+	spawn->setgid = strings[SPAWNER_STRING_SETGID];
+	spawn->credentials = creds;
+
+	/* Never set up by the spawner */
+	spawn->job = NULL;
+
+	return strv;
+
+error:
+	nih_free (strv);
+	return NULL;
+}
@@ -0,0 +1,64 @@
+/* upstart
+ *
+ * Copyright © 2015 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_SPAWNER_H
+#define INIT_SPAWNER_H
+
+#include <sys/types.h>
+
+#include <nih/macros.h>
+
+#include "job_process.h"
+
+
+/**
+ * SPAWNER_REQUEST_MAX:
+ *
+ * Largest spawn request, in bytes, that may be sent to the spawner
+ * process; processes with larger argument lists and environments are
+ * spawned directly.
+ **/
+#define SPAWNER_REQUEST_MAX 65536
+
+/**
+ * SPAWNER_REPLY_TIMEOUT:
+ *
+ * Default milliseconds to wait for the spawner process to reply to a
+ * spawn request before giving up on it.
+ **/
+#define SPAWNER_REPLY_TIMEOUT 5000
+
+
+NIH_BEGIN_EXTERN
+
+extern pid_t spawner_pid;
+extern int   spawner_fd;
+extern int   spawner_reply_timeout;
+
+int   spawner_start     (void)
+	__attribute__ ((warn_unused_result));
+void  spawner_stop      (void);
+int   spawner_available (void)
+	__attribute__ ((warn_unused_result));
+
+pid_t spawner_spawn     (const JobProcessSpawn *spawn, int error_fd)
+	__attribute__ ((warn_unused_result));
+
+NIH_END_EXTERN
+
+#endif /* INIT_SPAWNER_H */
@@ -23,6 +23,7 @@
 # include <config.h>
 #endif /* HAVE_CONFIG_H */
 
+#include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
 #include <signal.h>
@@ -88,8 +89,86 @@ int restart = FALSE;
  **/
 int write_state_file = FALSE;
 
+/**
+ * state_pass_fds:
+ *
+ * TRUE while preparing for and serialising state for a new instance
+ * across a re-exec in the binary encoding, allowing objects to hand over
+ * bulk data in file descriptors that the new instance inherits rather
+ * than inline in the serialisation data.
+ **/
+int state_pass_fds = FALSE;
+
+/**
+ * state_indexing:
+ *
+ * TRUE between state_index_begin() and state_index_end(), while
+ * state_index() may build and return index tables.
+ **/
+static int state_indexing = FALSE;
+
+/**
+ * state_indexes:
+ *
+ * Index tables built by state_index(), one for each StateIndexType.
+ **/
+static StateIndex *state_indexes[STATE_INDEX_LAST];
+
+/**
+ * state_batches:
+ *
+ * EmitEvents method calls restored by state_deserialise_batch(), so that
+ * every event waited for by a call shares the same ControlEmitBatch.  Each
+ * item is an NihListEntry allocated as a child of the batch.
+ **/
+static NihList *state_batches = NULL;
+
 /* Prototypes for static functions */
-static void state_write_file (NihIoBuffer *buffer);
+static void state_write_file (json_object *json);
+static int state_text_required (void)
+	__attribute__ ((warn_unused_result));
+static json_object *state_to_json (void);
+static int state_from_json (json_object *json);
+static json_object *state_read_json (int fd)
+	__attribute__ ((warn_unused_result));
+static int state_stream_put (StateStream *stream, const void *src, size_t n)
+	__attribute__ ((warn_unused_result));
+static int state_stream_flush (StateStream *stream)
+	__attribute__ ((warn_unused_result));
+static int state_stream_begin (StateStream *stream, StateBinaryTag tag,
+			       size_t count)
+	__attribute__ ((warn_unused_result));
+static int state_stream_end (StateStream *stream, StateBinaryTag tag)
+	__attribute__ ((warn_unused_result));
+static int state_stream_key (StateStream *stream, const char *key)
+	__attribute__ ((warn_unused_result));
+static int state_stream_value (StateStream *stream, json_object *json)
+	__attribute__ ((warn_unused_result));
+static ssize_t state_reader_fill (StateReader *reader)
+	__attribute__ ((warn_unused_result));
+static int state_reader_get (StateReader *reader, void *dest, size_t n)
+	__attribute__ ((warn_unused_result));
+static int state_data_is_binary (const char *data, size_t len)
+	__attribute__ ((warn_unused_result));
+static int state_binary_put (char **data, size_t *len, size_t *size,
+			     const void *src, size_t n)
+	__attribute__ ((warn_unused_result));
+static int state_binary_encode (char **data, size_t *len, size_t *size,
+				json_object *json)
+	__attribute__ ((warn_unused_result));
+static json_object *state_binary_read (StateReader *reader, int *error)
+	__attribute__ ((warn_unused_result));
+static json_object *state_binary_decode (StateReader *reader, int *error)
+	__attribute__ ((warn_unused_result));
+static StateIndex *state_index_build (StateIndexType type);
+static int state_serialise_message (json_object *json,
+				    NihDBusMessage *message)
+	__attribute__ ((warn_unused_result));
+static NihDBusMessage *state_deserialise_message (const void *parent,
+						  json_object *json)
+	__attribute__ ((warn_unused_result));
+static ControlEmitBatch *state_deserialise_batch (json_object *json)
+	__attribute__ ((warn_unused_result));
 
 /**
  * state_read:
@@ -144,11 +223,10 @@ state_read (int fd)
 /**
  * state_write:
  *
- * @fd: Open file descriptor to write JSON to,
- * @state_data: JSON string representing internal object state,
- * @len: length of @state_data.
+ * @fd: Open file descriptor to write serialisation data to.
  *
- * Write internal state to specified file descriptor in JSON format.
+ * Serialise internal state, writing it to specified file descriptor as
+ * it is generated (see state_write_objects()).
  *
  * Signals are assumed to be blocked when this call is made.
  *
@@ -161,7 +239,7 @@ state_read (int fd)
  * Returns: 0 on success, or -1 on error.
  **/
 int
-state_write (int fd, const char *state_data, size_t len)
+state_write (int fd)
 {
 	int             nfds;
 	int             ret;
@@ -169,8 +247,6 @@ state_write (int fd, const char *state_data, size_t len)
 	struct timeval  timeout;
 
 	nih_assert (fd != -1);
-	nih_assert (state_data);
-	nih_assert (len);
 
 	/* must be called from child process */
 	nih_assert (getpid () != (pid_t)1);
@@ -196,7 +272,7 @@ state_write (int fd, const char *state_data, size_t len)
 
 	nih_assert (ret == 1);
 
-	if (state_write_objects (fd, state_data, len) < 0)
+	if (state_write_objects (fd) < 0)
 		return -1;
 
 	return 0;
@@ -208,7 +284,11 @@ state_write (int fd, const char *state_data, size_t len)
  *
  * @fd: file descriptor to read serialisation data from.
  *
- * Read serialisation data from specified file descriptor.
+ * Read serialisation data from specified file descriptor and recreate
+ * internal state from it.  The data is decoded as it is read, so the
+ * document as a whole is never held in memory alongside the objects
+ * decoded from it.
+ *
  * @fd is assumed to be open and readable.
  *
  * Returns: 0 on success, -1 on error.
@@ -216,74 +296,165 @@ state_write (int fd, const char *state_data, size_t len)
 int
 state_read_objects (int fd)
 {
-	ssize_t                  ret;
-	int                      initial_size = 4096;
-	nih_local NihIoBuffer   *buffer = NULL;
-	nih_local char          *buf = NULL;
+	json_object  *json;
+	int           ret = -1;
 
 	nih_assert (fd != -1);
 
-	buffer = nih_io_buffer_new (NULL);
+	json = state_read_json (fd);
+	if (! json) {
+		nih_error ("%s",
+				_("Detected invalid serialisation data"));
+		return -1;
+	}
 
-	buf = nih_alloc (NULL, initial_size);
-	if (! buf)
-		goto error;
+	/* Recreate internal state */
+	if (state_from_json (json) < 0)
+		goto out;
 
-	/* Read the JSON data into the buffer */
-	do {
-		if (nih_io_buffer_resize (buffer, initial_size) < 0)
-			goto error;
+	if (write_state_file || getenv (STATE_FILE_ENV))
+		state_write_file (json);
+
+	ret = 0;
+
+out:
+	/* Failed to reconstruct internal state so attempt to write
+	 * the JSON state data to a file to allow for manual post
+	 * re-exec analysis.
+	 */
+	if (ret < 0 && log_dir)
+		state_write_file (json);
+
+	json_object_put (json);
+
+	return ret;
+}
+
+/**
+ * state_read_json:
+ *
+ * @fd: file descriptor to read serialisation data from.
+ *
+ * Read serialisation data in either encoding from @fd until end of
+ * file, a chunk at a time, decoding it as it arrives.
+ *
+ * Returns: new JSON object which the caller must release with
+ * json_object_put(), or NULL on error.
+ **/
+static json_object *
+state_read_json (int fd)
+{
+	StateReader             reader;
+	json_object            *json = NULL;
+	struct json_tokener    *tok = NULL;
+	ssize_t                 ret;
+	int                     error = FALSE;
 
-		ret = read (fd, buf, initial_size);
+	nih_assert (fd != -1);
+
+	reader.fd = fd;
+	reader.buf = nih_alloc (NULL, STATE_STREAM_CHUNK);
+	if (! reader.buf)
+		return NULL;
+
+	reader.pos = reader.end = reader.buf;
+
+	/* Read enough to tell which encoding is in use */
+	while (reader.end - reader.pos < STATE_BINARY_MAGIC_LEN) {
+		ret = read (fd, (char *)reader.end,
+			    STATE_STREAM_CHUNK - (size_t)(reader.end - reader.buf));
 		if (ret < 0) {
 			if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
-				goto error;
+				goto out;
 			continue;
 		} else if (! ret)
 			break;
 
-		if (nih_io_buffer_push (buffer, buf, ret) < 0)
-			goto error;
-	} while (TRUE);
+		reader.end += ret;
+	}
 
-	/* Recreate internal state from JSON */
-	if (state_from_string (buffer->buf) < 0)
-		goto error;
+	if (state_data_is_binary (reader.pos, (size_t)(reader.end - reader.pos))) {
+		reader.pos += STATE_BINARY_MAGIC_LEN;
 
-	if (write_state_file || getenv (STATE_FILE_ENV))
-		state_write_file (buffer);
+		json = state_binary_read (&reader, &error);
+		if (error)
+			goto out;
 
-	return 0;
+		/* Trailing data means the encoding is not what we expect */
+		if (reader.pos != reader.end || state_reader_fill (&reader) != 0) {
+			error = TRUE;
+			goto out;
+		}
+	} else {
+		enum json_tokener_error tok_error;
 
-error:
-	/* Failed to reconstruct internal state so attempt to write
-	 * the JSON state data to a file to allow for manual post
-	 * re-exec analysis.
-	 */
-	if (buffer->len && log_dir)
-		state_write_file (buffer);
+		tok = json_tokener_new ();
+		if (! tok)
+			goto out;
 
-	return -1;
+		while (TRUE) {
+			json = json_tokener_parse_ex (tok, reader.pos,
+						      (int)(reader.end - reader.pos));
+			tok_error = json_tokener_get_error (tok);
+
+			if (json || tok_error != json_tokener_continue)
+				break;
+
+			reader.pos = reader.end;
+			if (state_reader_fill (&reader) <= 0)
+				break;
+		}
+
+		if (! json) {
+			if (tok_error != json_tokener_continue)
+				nih_error ("%s: %s",
+						_("Detected invalid serialisation data"),
+						json_tokener_error_desc (tok_error));
+			goto out;
+		}
+	}
+
+out:
+	if (tok)
+		json_tokener_free (tok);
+
+	nih_free (reader.buf);
+
+	if (error && json) {
+		json_object_put (json);
+		json = NULL;
+	}
+
+	return json;
 }
 
 /**
  * state_write_file:
  *
- * @buffer: NihIoBuffer containing JSON data.
+ * @json: JSON object representing internal state.
  *
- * Write JSON data contained in @buffer to STATE_FILE below log_dir.
+ * Write @json as JSON text to STATE_FILE below log_dir.
  *
  * Failures are ignored since this is designed to be called in an error
  * scenario anyway.
  **/
 void
-state_write_file (NihIoBuffer *buffer)
+state_write_file (json_object *json)
 {
 	int              fd;
 	ssize_t          bytes;
 	nih_local char  *state_file = NULL;
+	const char      *data;
+	size_t           len;
+
+	nih_assert (json);
+
+	/* Note that the returned value is managed by json-c! */
+	data = json_object_to_json_string (json);
+	if (! data)
+		return;
 
-	nih_assert (buffer);
+	len = strlen (data);
 
 	state_file = nih_sprintf (NULL, "%s/%s", log_dir, STATE_FILE);
 	if (! state_file)
@@ -294,14 +465,13 @@ state_write_file (NihIoBuffer *buffer)
 	if (fd < 0)
 		return;
 
-	while (TRUE) {
-		bytes = write (fd, buffer->buf, buffer->len);
+	while (len) {
+		bytes = write (fd, data, len);
 
-		if (! bytes)
-			break;
-		else if (bytes > 0)
-			nih_io_buffer_shrink (buffer, (size_t)bytes);
-		else if (bytes < 0 && errno != EINTR)
+		if (bytes > 0) {
+			data += bytes;
+			len -= (size_t)bytes;
+		} else if (! bytes || errno != EINTR)
 			break;
 	}
 
@@ -309,1540 +479,2841 @@ state_write_file (NihIoBuffer *buffer)
 }
 
 /**
- * state_write_objects:
- *
- * @fd: file descriptor to write serialisation data on,
- * @state_data: JSON string representing internal object state,
- * @len: length of @state_data.
+ * state_text_required:
  *
- * Write serialisation data to specified file descriptor.
- * @fd is assumed to be open and valid to write to.
+ * Determine whether serialisation data passed to a new instance must be
+ * JSON text, which is the case if a state file has been requested so
+ * that it is human-readable and self-contained.
  *
- * Returns: 0 on success, -1 on error.
+ * Returns: TRUE if JSON text is required, FALSE if the binary encoding
+ * may be used.
  **/
-int
-state_write_objects (int fd, const char *state_data, size_t len)
+static int
+state_text_required (void)
 {
-	ssize_t   ret;
-
-	nih_assert (fd != -1);
-	nih_assert (state_data);
-	nih_assert (len);
-
-	ret = write (fd, state_data, len);
-
-	return (ret < 0 ? -1 : 0);
+	return write_state_file || getenv (STATE_FILE_ENV);
 }
 
 /**
- * state_to_string:
+ * state_write_objects:
  *
- * @json_string; newly-allocated string,
- * @len: length of @json_string.
+ * @fd: file descriptor to write serialisation data on.
  *
- * Serialise internal data structures to a JSON string.
+ * Serialise internal data structures, writing them to specified file
+ * descriptor in STATE_STREAM_CHUNK sized chunks as they are generated:
+ * each Event, JobClass and ConfSource is serialised, written and
+ * released in turn, so the complete document never exists in memory.
+ *
+ * The data is in the binary encoding, identical to that produced by
+ * state_to_data(), or JSON text if a state file has been requested.
+ *
+ * @fd is assumed to be open and valid to write to.
  *
  * Returns: 0 on success, -1 on error.
  **/
 int
-state_to_string (char **json_string, size_t *len)
+state_write_objects (int fd)
 {
-	json_object  *json;
-	json_object  *json_job_environ;
-	json_object  *json_control_bus_address;
-	const char   *value;
+	StateStream   stream;
+	json_object  *json = NULL;
+	size_t        count;
+	uint8_t       version = STATE_BINARY_VERSION;
+	int           ret = -1;
 
-#ifdef ENABLE_CGROUPS
-	json_object  *json_cgroup_manager_address;
-#endif /* ENABLE_CGROUPS */
+	nih_assert (fd != -1);
 
-	nih_assert (json_string);
-	nih_assert (len);
+	stream.fd = fd;
+	stream.binary = ! state_text_required ();
+	stream.separate = FALSE;
+	stream.len = 0;
+	stream.size = STATE_STREAM_CHUNK;
+	stream.buf = nih_alloc (NULL, stream.size);
+	if (! stream.buf)
+		return -1;
 
-	json = json_object_new_object ();
+	session_init ();
+	event_init ();
+	job_class_init ();
+	conf_init ();
 
-	if (! json)
-		return -1;
+	state_index_begin ();
 
-	json_sessions = session_serialise_all ();
-	if (! json_sessions) {
+	if (stream.binary) {
+		if (state_stream_put (&stream, STATE_BINARY_MAGIC,
+				      STATE_BINARY_MAGIC_LEN) < 0)
+			goto out;
+
+		if (state_stream_put (&stream, &version, sizeof (version)) < 0)
+			goto out;
+	}
+
+	/* Members of the top-level object, as added by state_to_json() */
+	count = 6;
+#ifdef ENABLE_CGROUPS
+	count++;
+#endif /* ENABLE_CGROUPS */
+
+	if (state_stream_begin (&stream, STATE_BINARY_OBJECT, count) < 0)
+		goto out;
+
+	/* There are few enough sessions to write them all at once */
+	json = session_serialise_all ();
+	if (! json) {
 		nih_error ("%s Sessions", _("Failed to serialise"));
-		goto error;
+		goto out;
 	}
 
-	json_object_object_add (json, "sessions", json_sessions);
+	if (state_stream_key (&stream, "sessions") < 0
+	    || state_stream_value (&stream, json) < 0)
+		goto out;
 
-	json_events = event_serialise_all ();
-	if (! json_events) {
-		nih_error ("%s Events", _("Failed to serialise"));
-		goto error;
+	json_object_put (json);
+	json = NULL;
+
+	count = 0;
+	NIH_LIST_FOREACH (events, iter)
+		count++;
+
+	if (state_stream_key (&stream, "events") < 0
+	    || state_stream_begin (&stream, STATE_BINARY_ARRAY, count) < 0)
+		goto out;
+
+	NIH_LIST_FOREACH (events, iter) {
+		Event *event = (Event *)iter;
+
+		json = event_serialise (event);
+		if (! json) {
+			nih_error ("%s Events", _("Failed to serialise"));
+			goto out;
+		}
+
+		if (state_stream_value (&stream, json) < 0)
+			goto out;
+
+		json_object_put (json);
+		json = NULL;
 	}
 
-	json_object_object_add (json, "events", json_events);
+	if (state_stream_end (&stream, STATE_BINARY_ARRAY) < 0)
+		goto out;
 
-	json_control_bus_address = control_serialise_bus_address ();
+	json = control_serialise_bus_address ();
 
 	/* Take care to distinguish between memory failure and an
 	 * as-yet-not-set control bus address.
 	 */
-	if (! json_control_bus_address && control_bus_address) {
+	if (! json && control_bus_address) {
 		nih_error ("%s %s",
 				_("Failed to serialise"),
 			       _("control bus address"));
-		goto error;
+		goto out;
 	}
 
-	json_object_object_add (json, "control_bus_address", json_control_bus_address);
+	if (state_stream_key (&stream, "control_bus_address") < 0
+	    || state_stream_value (&stream, json) < 0)
+		goto out;
+
+	if (json) {
+		json_object_put (json);
+		json = NULL;
+	}
 
 #ifdef ENABLE_CGROUPS
-	json_cgroup_manager_address = cgroup_manager_serialise ();
+	json = cgroup_manager_serialise ();
 
 	/* Take care to distinguish between memory failure and an
 	 * as-yet-not-set cgroup manager address.
 	 */
-	if (! json_cgroup_manager_address && cgroup_manager_address) {
+	if (! json && cgroup_manager_address) {
 		nih_error ("%s %s",
 				_("Failed to serialise"),
 			       _("cgroup manager address"));
-		goto error;
+		goto out;
 	}
 
-	json_object_object_add (json, "cgroup_manager_address", json_cgroup_manager_address);
-#endif /* ENABLE_CGROUPS */
+	if (state_stream_key (&stream, "cgroup_manager_address") < 0
+	    || state_stream_value (&stream, json) < 0)
+		goto out;
 
-	json_job_environ = job_class_serialise_job_environ ();
+	if (json) {
+		json_object_put (json);
+		json = NULL;
+	}
+#endif /* ENABLE_CGROUPS */
 
-	if (! json_job_environ) {
+	json = job_class_serialise_job_environ ();
+	if (! json) {
 		nih_error ("%s global job environment",
 				_("Failed to serialise"));
-		goto error;
+		goto out;
 	}
 
-	json_object_object_add (json, "job_environment", json_job_environ);
+	if (state_stream_key (&stream, "job_environment") < 0
+	    || state_stream_value (&stream, json) < 0)
+		goto out;
 
-	json_classes = job_class_serialise_all ();
+	json_object_put (json);
+	json = NULL;
 
-	if (! json_classes) {
-		nih_error ("%s JobClasses", _("Failed to serialise"));
-		goto error;
+	count = 0;
+	NIH_HASH_FOREACH (job_classes, iter)
+		count++;
+
+	if (state_stream_key (&stream, "job_classes") < 0
+	    || state_stream_begin (&stream, STATE_BINARY_ARRAY, count) < 0)
+		goto out;
+
+	NIH_HASH_FOREACH (job_classes, iter) {
+		JobClass *class = (JobClass *)iter;
+
+		json = job_class_serialise (class);
+		if (! json) {
+			nih_error ("%s JobClasses", _("Failed to serialise"));
+			goto out;
+		}
+
+		if (state_stream_value (&stream, json) < 0)
+			goto out;
+
+		json_object_put (json);
+		json = NULL;
 	}
 
-	json_object_object_add (json, "job_classes", json_classes);
+	if (state_stream_end (&stream, STATE_BINARY_ARRAY) < 0)
+		goto out;
 
-	json_conf_sources = conf_source_serialise_all ();
+	count = 0;
+	NIH_LIST_FOREACH (conf_sources, iter)
+		count++;
 
-	if (! json_conf_sources) {
-		nih_error ("%s ConfSources", _("Failed to serialise"));
-		goto error;
+	if (state_stream_key (&stream, "conf_sources") < 0
+	    || state_stream_begin (&stream, STATE_BINARY_ARRAY, count) < 0)
+		goto out;
+
+	NIH_LIST_FOREACH (conf_sources, iter) {
+		ConfSource *source = (ConfSource *)iter;
+
+		json = conf_source_serialise (source);
+		if (! json) {
+			nih_error ("%s ConfSources", _("Failed to serialise"));
+			goto out;
+		}
+
+		if (state_stream_value (&stream, json) < 0)
+			goto out;
+
+		json_object_put (json);
+		json = NULL;
 	}
 
-	json_object_object_add (json, "conf_sources", json_conf_sources);
+	if (state_stream_end (&stream, STATE_BINARY_ARRAY) < 0)
+		goto out;
 
-	/* Note that the returned value is managed by json-c! */
-	value = json_object_to_json_string (json);
-	if (! value)
-		goto error;
+	if (state_stream_end (&stream, STATE_BINARY_OBJECT) < 0)
+		goto out;
 
-	*len = strlen (value);
+	if (state_stream_flush (&stream) < 0)
+		goto out;
 
-	*json_string = NIH_MUST (nih_strndup (NULL, value, *len));
+	ret = 0;
 
-	json_object_put (json);
+out:
+	if (json)
+		json_object_put (json);
 
-	return 0;
+	state_index_end ();
 
-error:
-	json_object_put (json);
-	return -1;
+	nih_free (stream.buf);
+
+	return ret;
 }
 
 /**
- * state_from_string:
+ * state_stream_put:
  *
- * @state: JSON-encoded state.
+ * @stream: stream to write to,
+ * @src: bytes to write,
+ * @n: number of bytes in @src.
  *
- * Convert JSON string back to an internal representation.
+ * Append @n bytes from @src to @stream, writing out its buffer once it
+ * holds a chunk's worth of data.
  *
  * Returns: 0 on success, -1 on error.
  **/
-int
-state_from_string (const char *state)
+static int
+state_stream_put (StateStream  *stream,
+		  const void   *src,
+		  size_t        n)
 {
-	int                       ret = -1;
-	json_object              *json;
-	json_object              *json_job_environ;
-	json_object              *json_control_bus_address;
-	enum json_tokener_error   error;
-
-#ifdef ENABLE_CGROUPS
-	json_object              *json_cgroup_manager_address;
-#endif /* ENABLE_CGROUPS */
+	nih_assert (stream);
 
-	nih_assert (state);
+	if (state_binary_put (&stream->buf, &stream->len, &stream->size,
+			      src, n) < 0)
+		return -1;
 
-	/* This function is called before conf_source_new (), so setup
-	 * the environment.
-	 */
-	conf_init ();
+	if (stream->len >= STATE_STREAM_CHUNK)
+		return state_stream_flush (stream);
 
-	json = json_tokener_parse_verbose (state, &error);
+	return 0;
+}
 
-	if (! json) {
-		nih_error ("%s: %s",
-				_("Detected invalid serialisation data"),
-				json_tokener_error_desc (error));
-		return ret;
-	}
-
-	if (! state_check_json_type (json, object))
-		goto out;
-
-	if (session_deserialise_all (json) < 0) {
-		nih_error ("%s Sessions", _("Failed to deserialise"));
-		goto out;
-	}
-
-	if (event_deserialise_all (json) < 0) {
-		nih_error ("%s Events", _("Failed to deserialise"));
-		goto out;
-	}
-
-	ret = json_object_object_get_ex (json, "control_bus_address", &json_control_bus_address);
-
-	if (json_control_bus_address) {
-		if (control_deserialise_bus_address (json_control_bus_address) < 0) {
-			nih_error ("%s control details", _("Failed to deserialise"));
-			goto out;
-		}
-	} else if (! ret) {
-		/* Probably deserialising from older format that doesn't
-		 * encode control details.
-		 */
-		nih_warn ("%s", _("No control details present in state data"));
-	}
-
-#ifdef ENABLE_CGROUPS
-	ret = json_object_object_get_ex (json, "cgroup_manager_address", &json_cgroup_manager_address);
+/**
+ * state_stream_flush:
+ *
+ * @stream: stream to flush.
+ *
+ * Write all buffered data in @stream to its file descriptor.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+static int
+state_stream_flush (StateStream *stream)
+{
+	const char *data;
+	size_t      len;
 
-	if (json_cgroup_manager_address) {
-		if (cgroup_manager_deserialise (json_cgroup_manager_address) < 0) {
-			nih_error ("%s %s",
-					_("Failed to deserialise"),
-					_("cgroup manager address"));
-			goto out;
-		}
-	} else if (! ret) {
-		nih_warn ("No %s in state data", _("cgroup manager address"));
-	}
-#endif /* ENABLE_CGROUPS */
+	nih_assert (stream);
 
-	/* Again, we cannot error here since older JSON state data did
-	 * not encode ConfSource or ConfFile objects.
-	 */
-	if (json_object_object_get_ex (json, "conf_sources", NULL)) {
-		if (conf_source_deserialise_all (json) < 0) {
-			nih_error ("%s ConfSources", _("Failed to deserialise"));
-			goto out;
-		}
-	} else {
-		nih_warn ("%s", _("No ConfSources present in state data"));
-	}
+	data = stream->buf;
+	len = stream->len;
 
-	if (json_object_object_get_ex (json, "job_environment", &json_job_environ)) {
-		if (job_class_deserialise_job_environ (json_job_environ) < 0) {
-			nih_error ("%s global job environment",
-					_("Failed to deserialise"));
-			goto out;
-		}
-	} else {
-		nih_warn ("%s", _("No global job environment data present in state data"));
-	}
+	while (len) {
+		ssize_t ret;
 
-	if (job_class_deserialise_all (json) < 0) {
-		nih_error ("%s JobClasses", _("Failed to deserialise"));
-		goto out;
-	}
+		ret = write (stream->fd, data, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		} else if (! ret)
+			return -1;
 
-	if (state_deserialise_resolve_deps (json) < 0) {
-		nih_error (_("Failed to resolve deserialisation dependencies"));
-		goto out;
+		data += ret;
+		len -= (size_t)ret;
 	}
 
-	ret = 0;
-
-out:
-	/* Only need to free the root JSON node */
-	json_object_put (json);
+	stream->len = 0;
 
-	return ret;
+	return 0;
 }
 
-
 /**
- * state_modify_cloexec:
+ * state_stream_begin:
  *
- * @fd: file descriptor,
- * @set: set close-on-exec flag if TRUE, clear if FALSE.
+ * @stream: stream to write to,
+ * @tag: STATE_BINARY_ARRAY or STATE_BINARY_OBJECT,
+ * @count: number of elements or members that will follow.
  *
- * Set or clear the close-on-exec file descriptor flag.
+ * Write the start of an array or object to @stream; each element is
+ * then written with state_stream_value(), or each member with
+ * state_stream_key() followed by state_stream_value(), and the whole
+ * finished with state_stream_end().
  *
  * Returns: 0 on success, -1 on error.
  **/
-int
-state_modify_cloexec (int fd, int set)
+static int
+state_stream_begin (StateStream     *stream,
+		    StateBinaryTag   tag,
+		    size_t           count)
 {
-	long   flags;
-	int    ret;
+	uint8_t   byte = tag;
+	uint32_t  value = (uint32_t)count;
 
-	nih_assert (fd >= 0);
+	nih_assert (stream);
+	nih_assert (tag == STATE_BINARY_ARRAY || tag == STATE_BINARY_OBJECT);
 
-	flags = fcntl (fd, F_GETFD);
+	if (stream->binary) {
+		if (count > UINT32_MAX)
+			return -1;
 
-	if (flags < 0)
-		return -1;
+		if (state_stream_put (stream, &byte, sizeof (byte)) < 0)
+			return -1;
 
-	if (set)
-		flags |= FD_CLOEXEC;
-	else
-		flags &= ~FD_CLOEXEC;
+		return state_stream_put (stream, &value, sizeof (value));
+	}
 
-	ret = fcntl (fd, F_SETFD, flags);
-	if (ret < 0)
+	if (stream->separate && state_stream_put (stream, ",", 1) < 0)
 		return -1;
 
-	return 0;
+	stream->separate = FALSE;
+
+	return state_stream_put (stream,
+				 tag == STATE_BINARY_ARRAY ? "[" : "{", 1);
 }
 
 /**
- * state_fd_valid:
- * @fd: file descriptor.
+ * state_stream_end:
  *
- * Return TRUE if @fd is valid, else FALSE.
+ * @stream: stream to write to,
+ * @tag: tag passed to the matching state_stream_begin().
+ *
+ * Write the end of an array or object to @stream.
+ *
+ * Returns: 0 on success, -1 on error.
  **/
-int
-state_fd_valid (int fd)
+static int
+state_stream_end (StateStream     *stream,
+		  StateBinaryTag   tag)
 {
-	int flags = 0;
-
-	if (fd < 0)
-		return FALSE;
-
-	errno = 0;
-	flags = fcntl (fd, F_GETFL);
+	nih_assert (stream);
+	nih_assert (tag == STATE_BINARY_ARRAY || tag == STATE_BINARY_OBJECT);
 
-	if (flags < 0)
-		return FALSE;
+	if (stream->binary)
+		return 0;
 
-	/* redundant really */
-	if (errno == EBADF)
-		return FALSE;
+	stream->separate = TRUE;
 
-	return TRUE;
+	return state_stream_put (stream,
+				 tag == STATE_BINARY_ARRAY ? "]" : "}", 1);
 }
 
 /**
- * state_serialise_str_array:
+ * state_stream_key:
  *
- * @array: string array to serialise.
+ * @stream: stream to write to,
+ * @key: name of object member.
  *
- * Convert string array @array into a JSON array object.
+ * Write the name of the next member of an object to @stream.  @key is
+ * not escaped in JSON text so must not need to be.
  *
- * Returns: JSON-serialised @array, or NULL on error.
+ * Returns: 0 on success, -1 on error.
  **/
-json_object *
-state_serialise_str_array (char ** const array)
+static int
+state_stream_key (StateStream  *stream,
+		  const char   *key)
 {
-	char * const       *elem;
-	json_object        *json;
-	json_object        *json_element;
-	int                 i;
-
-	nih_assert (array);
+	size_t  len;
 
-	json = json_object_new_array ();
-	if (! json)
-		return NULL;
+	nih_assert (stream);
+	nih_assert (key);
 
-	for (elem = array, i = 0; elem && *elem; ++elem, ++i) {
+	len = strlen (key);
 
-		json_element = json_object_new_string (*elem);
+	if (stream->binary) {
+		uint32_t key_len = (uint32_t)len;
 
-		if (! json_element)
-			goto error;
+		if (state_stream_put (stream, &key_len, sizeof (key_len)) < 0)
+			return -1;
 
-		if (json_object_array_put_idx (json, i, json_element) < 0)
-			goto error;
+		return state_stream_put (stream, key, len);
 	}
 
-	return json;
+	if (stream->separate && state_stream_put (stream, ",", 1) < 0)
+		return -1;
 
-error:
-	json_object_put (json);
-	return NULL;
+	stream->separate = FALSE;
+
+	if (state_stream_put (stream, "\"", 1) < 0
+	    || state_stream_put (stream, key, len) < 0
+	    || state_stream_put (stream, "\":", 2) < 0)
+		return -1;
+
+	return 0;
 }
 
 /**
- * _state_deserialise_str_array:
- *
- * @parent: parent object for new array (may be NULL),
- * @json: JSON array object representing a string array,
- * @array: string array,
- * @len: length of returned array,
- * @env: TRUE if @json represents an array of environment
- * variables, FALSE for simple strings.
+ * state_stream_value:
  *
- * Convert JSON array object @json into a string array.
+ * @stream: stream to write to,
+ * @json: JSON value to write.
  *
- * If @len is >0, @array will contain the newly-allocated array.
- * If @len is zero, the contents of @array are undefined.
+ * Write @json and everything within it to @stream as an array element
+ * or object member value.
  *
  * Returns: 0 on success, -1 on error.
  **/
-int
-_state_deserialise_str_array (void           *parent,
-			      json_object    *json,
-			      char         ***array,
-			      size_t         *len,
-			      int             env)
+static int
+state_stream_value (StateStream  *stream,
+		    json_object  *json)
 {
-	nih_assert (json);
-	nih_assert (array);
-	nih_assert (len);
+	const char *value;
 
-	if (! state_check_json_type (json, array))
-		return -1;
+	nih_assert (stream);
 
-	*len = json_object_array_length (json);
+	if (stream->binary) {
+		if (state_binary_encode (&stream->buf, &stream->len,
+					 &stream->size, json) < 0)
+			return -1;
 
-	if (! *len)
-		return 0;
+		if (stream->len >= STATE_STREAM_CHUNK)
+			return state_stream_flush (stream);
 
-	*array = nih_str_array_new (parent);
+		return 0;
+	}
 
-	if (! *array)
+	if (stream->separate && state_stream_put (stream, ",", 1) < 0)
 		return -1;
 
-	for (size_t i = 0; i < *len; i++) {
-		json_object  *json_element;
-		const char   *element;
-		char        **new;
-
-		json_element = json_object_array_get_idx (json, i);
-		if (! json_element)
-			goto error;
-
-		if (! state_check_json_type (json_element, string))
-			goto error;
-
-		element = json_object_get_string (json_element);
-		if (! element)
-			goto error;
-
-		if (env) {
-			new = environ_add (array, parent, NULL, TRUE, element);
-			if (! new)
-				goto error;
-			*array = new;
-		} else {
-			new = nih_str_array_add (array, parent, NULL, element);
-
-			if (! new)
-				goto error;
-			*array = new;
-		}
-	}
+	stream->separate = TRUE;
 
-	return 0;
+	/* Note that the returned value is managed by json-c! */
+	value = json_object_to_json_string (json);
+	if (! value)
+		return -1;
 
-error:
-	nih_free (*array);
-	*array = NULL;
-	return -1;
+	return state_stream_put (stream, value, strlen (value));
 }
 
 /**
- * state_serialise_int32_array:
- *
- * @array: array of 32-bit integers,
- * @count: number of values in @array,
+ * state_to_json:
  *
- * Convert integer array @array into a JSON array object.
+ * Serialise internal data structures to a JSON object.
  *
- * Returns: JSON-serialised @array, or NULL on error.
+ * Returns: new JSON object which the caller must release with
+ * json_object_put(), or NULL on error.
  **/
-json_object *
-state_serialise_int32_array (int32_t *array, int count)
+static json_object *
+state_to_json (void)
 {
-	json_object   *json;
-	json_object   *json_element;
-	int            i;
+	json_object  *json;
+	json_object  *json_job_environ;
+	json_object  *json_control_bus_address;
 
-	nih_assert (count >= 0);
+#ifdef ENABLE_CGROUPS
+	json_object  *json_cgroup_manager_address;
+#endif /* ENABLE_CGROUPS */
 
-	json = json_object_new_array ();
-	if (! json)
+	json = json_object_new_object ();
+
+	if (! json)
 		return NULL;
 
-	if (! count || ! array)
-		return json;
+	state_index_begin ();
 
-	for (i = 0; i < count; ++i) {
+	json_sessions = session_serialise_all ();
+	if (! json_sessions) {
+		nih_error ("%s Sessions", _("Failed to serialise"));
+		goto error;
+	}
 
-		json_element = json_object_new_int (array[i]);
+	json_object_object_add (json, "sessions", json_sessions);
 
-		if (! json_element)
-			goto error;
+	json_events = event_serialise_all ();
+	if (! json_events) {
+		nih_error ("%s Events", _("Failed to serialise"));
+		goto error;
+	}
 
-		if (json_object_array_put_idx (json, i, json_element) < 0)
-			goto error;
+	json_object_object_add (json, "events", json_events);
+
+	json_control_bus_address = control_serialise_bus_address ();
+
+	/* Take care to distinguish between memory failure and an
+	 * as-yet-not-set control bus address.
+	 */
+	if (! json_control_bus_address && control_bus_address) {
+		nih_error ("%s %s",
+				_("Failed to serialise"),
+			       _("control bus address"));
+		goto error;
 	}
 
-	return json;
+	json_object_object_add (json, "control_bus_address", json_control_bus_address);
 
-error:
-	json_object_put (json);
-	return NULL;
-}
+#ifdef ENABLE_CGROUPS
+	json_cgroup_manager_address = cgroup_manager_serialise ();
 
-/**
- * state_serialise_int64_array:
- *
- * @array: array of 64-bit integers,
- * @count: number of values in @array,
- *
- * Convert integer array @array into a JSON array object.
- *
- * Returns: JSON-serialised @array, or NULL on error.
- **/
-json_object *
-state_serialise_int64_array (int64_t *array, int count)
-{
-	json_object   *json;
-	json_object   *json_element;
-	int            i;
+	/* Take care to distinguish between memory failure and an
+	 * as-yet-not-set cgroup manager address.
+	 */
+	if (! json_cgroup_manager_address && cgroup_manager_address) {
+		nih_error ("%s %s",
+				_("Failed to serialise"),
+			       _("cgroup manager address"));
+		goto error;
+	}
 
-	nih_assert (count >= 0);
+	json_object_object_add (json, "cgroup_manager_address", json_cgroup_manager_address);
+#endif /* ENABLE_CGROUPS */
 
-	json = json_object_new_array ();
-	if (! json)
-		return NULL;
+	json_job_environ = job_class_serialise_job_environ ();
 
-	if (! count || ! array)
-		return json;
+	if (! json_job_environ) {
+		nih_error ("%s global job environment",
+				_("Failed to serialise"));
+		goto error;
+	}
 
-	for (i = 0; i < count; ++i) {
+	json_object_object_add (json, "job_environment", json_job_environ);
 
-		json_element = json_object_new_int64 (array[i]);
+	json_classes = job_class_serialise_all ();
 
-		if (! json_element)
-			goto error;
+	if (! json_classes) {
+		nih_error ("%s JobClasses", _("Failed to serialise"));
+		goto error;
+	}
 
-		if (json_object_array_put_idx (json, i, json_element) < 0)
-			goto error;
+	json_object_object_add (json, "job_classes", json_classes);
+
+	json_conf_sources = conf_source_serialise_all ();
+
+	if (! json_conf_sources) {
+		nih_error ("%s ConfSources", _("Failed to serialise"));
+		goto error;
 	}
 
+	json_object_object_add (json, "conf_sources", json_conf_sources);
+
+	state_index_end ();
+
 	return json;
 
 error:
+	state_index_end ();
+
 	json_object_put (json);
 	return NULL;
 }
 
 /**
- * state_deserialise_int32_array:
- *
- * @parent: parent object for new array,
- * @json: JSON array object representing an integer array,
- * @array: array of 32-bit integers,
- * @len: length of @array.
+ * state_to_string:
  *
- * Convert JSON array object @json into an array of 32-bit integers.
+ * @json_string; newly-allocated string,
+ * @len: length of @json_string.
  *
- * If @len is >0, @array will contain the newly-allocated array.
- * If @len is zero, the contents of @array are undefined.
+ * Serialise internal data structures to a JSON string.
  *
  * Returns: 0 on success, -1 on error.
  **/
 int
-state_deserialise_int32_array (void          *parent,
-			       json_object   *json,
-			       int32_t      **array,
-			       size_t        *len)
+state_to_string (char **json_string, size_t *len)
 {
-	nih_assert (parent);
-	nih_assert (json);
-	nih_assert (array);
-	nih_assert (len);
-
-	if (! state_check_json_type (json, array))
-		return -1;
-
-	*len = json_object_array_length (json);
+	json_object  *json;
+	const char   *value;
 
-	if (! *len)
-		return 0;
+	nih_assert (json_string);
+	nih_assert (len);
 
-	*array = nih_realloc (*array, parent, (*len) * sizeof (int32_t));
-	if (! *array)
+	json = state_to_json ();
+	if (! json)
 		return -1;
 
-	for (size_t i = 0; i < *len; i++) {
-		json_object  *json_element;
+	/* Note that the returned value is managed by json-c! */
+	value = json_object_to_json_string (json);
+	if (! value)
+		goto error;
 
-		json_element = json_object_array_get_idx (json, i);
-		if (! json_element)
-			goto error;
+	*len = strlen (value);
 
-		if (! state_check_json_type (json_element, int))
-			goto error;
+	*json_string = NIH_MUST (nih_strndup (NULL, value, *len));
 
-		errno = 0;
-		(*array)[i] = json_object_get_int (json_element);
-		if (! (*array)[i] && errno == EINVAL)
-			goto error;
-	}
+	json_object_put (json);
 
 	return 0;
 
 error:
-	nih_free (*array);
+	json_object_put (json);
 	return -1;
 }
 
 /**
- * state_deserialise_int64_array:
- *
- * @parent: parent object for new array,
- * @json: JSON array object representing an integer array,
- * @array: array of 64-bit integers,
- * @len: length of @array.
+ * state_to_data:
  *
- * Convert JSON array object @json into an array of 64-bit integers.
+ * @data: newly-allocated serialisation data,
+ * @len: length of @data.
  *
- * If @len is >0, @array will contain the newly-allocated array.
- * If @len is zero, the contents of @array are undefined.
+ * Serialise internal data structures in the form they are passed to a
+ * new instance across a re-exec by state_write_objects(): in the binary
+ * encoding normally, or as JSON text if a state file has been
+ * requested.
  *
  * Returns: 0 on success, -1 on error.
  **/
 int
-state_deserialise_int64_array (void           *parent,
-			       json_object    *json,
-			       int64_t       **array,
-			       size_t         *len)
+state_to_data (char **data, size_t *len)
 {
-	nih_assert (parent);
-	nih_assert (json);
-	nih_assert (array);
-	nih_assert (len);
-
-	if (! state_check_json_type (json, array))
-		return -1;
+	json_object  *json;
 
-	*len = json_object_array_length (json);
+	nih_assert (data);
+	nih_assert (len);
 
-	if (! *len)
-		return 0;
+	if (state_text_required ())
+		return state_to_string (data, len);
 
-	*array = nih_realloc (*array, parent, (*len) * sizeof (int64_t));
-	if (! *array)
+	json = state_to_json ();
+	if (! json)
 		return -1;
 
-	for (size_t i = 0; i < *len; i++) {
-		json_object  *json_element;
-
-		json_element = json_object_array_get_idx (json, i);
-		if (! json_element)
-			goto error;
-
-		if (! state_check_json_type (json_element, int))
-			goto error;
-
-		errno = 0;
-		(*array)[i] = json_object_get_int64 (json_element);
-		if (! (*array)[i] && errno == EINVAL)
-			goto error;
-	}
+	*data = state_json_to_binary (NULL, json, len);
 
-	return 0;
+	json_object_put (json);
 
-error:
-	nih_free (*array);
-	return -1;
+	return *data ? 0 : -1;
 }
 
 /**
- * state_rlimit_serialise:
- * @limit: rlimit to serialise.
+ * state_from_string:
  *
- * Convert @limit into a JSON representation for serialisation.
- * Caller must free returned value using json_object_put().
+ * @state: JSON-encoded state.
  *
- * Returns: JSON-serialised rlimit structure, or NULL on error.
+ * Convert JSON string back to an internal representation.
+ *
+ * Returns: 0 on success, -1 on error.
  **/
-json_object *
-state_rlimit_serialise (const struct rlimit *rlimit)
+int
+state_from_string (const char *state)
 {
-	json_object  *json;
-
-	nih_assert (rlimit);
+	int                       ret;
+	json_object              *json;
+	enum json_tokener_error   error;
 
-	json = json_object_new_object ();
-	if (! json)
-		return NULL;
+	nih_assert (state);
 
-	if (! state_set_json_int_var_from_obj (json, rlimit, rlim_cur))
-		goto error;
+	json = json_tokener_parse_verbose (state, &error);
 
-	if (! state_set_json_int_var_from_obj (json, rlimit, rlim_max))
-		goto error;
+	if (! json) {
+		nih_error ("%s: %s",
+				_("Detected invalid serialisation data"),
+				json_tokener_error_desc (error));
+		return -1;
+	}
 
-	return json;
+	ret = state_from_json (json);
 
-error:
+	/* Only need to free the root JSON node */
 	json_object_put (json);
-	return NULL;
+
+	return ret;
 }
 
 /**
- * state_rlimit_serialise_all:
+ * state_from_data:
  *
- * @rlimits: array of rlimit structures.
+ * @data: serialisation data,
+ * @len: length of @data.
  *
- * Convert array of rlimit structures to JSON representation.
+ * Recreate internal data structures from serialisation data in either
+ * the binary encoding or as JSON text, which must then be
+ * nul-terminated.
  *
- * Returns: JSON object containing array of rlimits, or NULL on error.
- */
-json_object *
-state_rlimit_serialise_all (struct rlimit * const *rlimits)
+ * Returns: 0 on success, -1 on error.
+ **/
+int
+state_from_data (const char *data, size_t len)
 {
-	json_object    *json;
-	json_object    *json_rlimit;
-	struct rlimit   dummy = { 0x0, 0x0 };
-
-	nih_assert (rlimits);
-
-	json = json_object_new_array ();
-	if (! json)
-		return NULL;
+	int           ret;
+	json_object  *json;
 
-	for (int i = 0; i < RLIMIT_NLIMITS; i++) {
-		/* We must encode a blank entry for missing array elements
-		 * to ensure correct ordering of limits on deserialisation.
-		 */
-		json_rlimit = state_rlimit_serialise (rlimits[i]
-				? rlimits[i] : &dummy);
+	nih_assert (data);
 
-		if (! json_rlimit)
-			goto error;
+	if (! state_data_is_binary (data, len))
+		return state_from_string (data);
 
-		if (json_object_array_add (json, json_rlimit) < 0)
-			goto error;
+	json = state_binary_to_json (data, len);
+	if (! json) {
+		nih_error ("%s",
+				_("Detected invalid serialisation data"));
+		return -1;
 	}
 
-	return json;
-
-error:
+	ret = state_from_json (json);
 
 	json_object_put (json);
-	return NULL;
+
+	return ret;
 }
 
 /**
- * state_rlimit_deserialise:
+ * state_from_json:
  *
- * @json: JSON-serialised rlimit structure to deserialise.
- *
- * Convert @json into an rlimit structure.
+ * @json: JSON object representing internal state.
  *
- * Caller must manually nih_ref() returned object to a parent object.
+ * Recreate internal data structures from @json.
  *
- * Returns: struct rlimit, or NULL on error.
+ * Returns: 0 on success, -1 on error.
  **/
-struct rlimit *
-state_rlimit_deserialise (json_object *json)
+static int
+state_from_json (json_object *json)
 {
-	struct rlimit  *rlimit = NULL;
+	int                       ret = -1;
+	json_object              *json_job_environ;
+	json_object              *json_control_bus_address;
+
+#ifdef ENABLE_CGROUPS
+	json_object              *json_cgroup_manager_address;
+#endif /* ENABLE_CGROUPS */
 
 	nih_assert (json);
 
+	/* This function is called before conf_source_new (), so setup
+	 * the environment.
+	 */
+	conf_init ();
+
 	if (! state_check_json_type (json, object))
-		goto error;
+		goto out;
 
-	rlimit = nih_new (NULL, struct rlimit);
-	if (! rlimit)
-		return NULL;
+	/* Index tables are built on first use, by which point each list
+	 * they cover has been fully deserialised.
+	 */
+	state_index_begin ();
 
-	memset (rlimit, '\0', sizeof (struct rlimit));
+	if (session_deserialise_all (json) < 0) {
+		nih_error ("%s Sessions", _("Failed to deserialise"));
+		goto out;
+	}
 
-	if (! state_get_json_int_var_to_obj (json, rlimit, rlim_cur))
-		goto error;
+	if (event_deserialise_all (json) < 0) {
+		nih_error ("%s Events", _("Failed to deserialise"));
+		goto out;
+	}
 
-	if (! state_get_json_int_var_to_obj (json, rlimit, rlim_max))
-		goto error;
+	ret = json_object_object_get_ex (json, "control_bus_address", &json_control_bus_address);
 
-	return rlimit;
+	if (json_control_bus_address) {
+		if (control_deserialise_bus_address (json_control_bus_address) < 0) {
+			nih_error ("%s control details", _("Failed to deserialise"));
+			goto out;
+		}
+	} else if (! ret) {
+		/* Probably deserialising from older format that doesn't
+		 * encode control details.
+		 */
+		nih_warn ("%s", _("No control details present in state data"));
+	}
 
-error:
-	nih_free (rlimit);
-	return NULL;
+#ifdef ENABLE_CGROUPS
+	ret = json_object_object_get_ex (json, "cgroup_manager_address", &json_cgroup_manager_address);
+
+	if (json_cgroup_manager_address) {
+		if (cgroup_manager_deserialise (json_cgroup_manager_address) < 0) {
+			nih_error ("%s %s",
+					_("Failed to deserialise"),
+					_("cgroup manager address"));
+			goto out;
+		}
+	} else if (! ret) {
+		nih_warn ("No %s in state data", _("cgroup manager address"));
+	}
+#endif /* ENABLE_CGROUPS */
+
+	/* Again, we cannot error here since older JSON state data did
+	 * not encode ConfSource or ConfFile objects.
+	 */
+	if (json_object_object_get_ex (json, "conf_sources", NULL)) {
+		if (conf_source_deserialise_all (json) < 0) {
+			nih_error ("%s ConfSources", _("Failed to deserialise"));
+			goto out;
+		}
+	} else {
+		nih_warn ("%s", _("No ConfSources present in state data"));
+	}
+
+	if (json_object_object_get_ex (json, "job_environment", &json_job_environ)) {
+		if (job_class_deserialise_job_environ (json_job_environ) < 0) {
+			nih_error ("%s global job environment",
+					_("Failed to deserialise"));
+			goto out;
+		}
+	} else {
+		nih_warn ("%s", _("No global job environment data present in state data"));
+	}
+
+	if (job_class_deserialise_all (json) < 0) {
+		nih_error ("%s JobClasses", _("Failed to deserialise"));
+		goto out;
+	}
+
+	if (state_deserialise_resolve_deps (json) < 0) {
+		nih_error (_("Failed to resolve deserialisation dependencies"));
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	state_index_end ();
+
+	return ret;
 }
 
+
 /**
- * state_rlimit_deserialise_all:
+ * state_modify_cloexec:
  *
- * @json: root of JSON-serialised state,
- * @parent: parent of @,
- * @limits: pre-allocated pointer array to hold rlimits array.
+ * @fd: file descriptor,
+ * @set: set close-on-exec flag if TRUE, clear if FALSE.
  *
- * Convert JSON representation of rlimits back into
- * an array of rlimit structures.
+ * Set or clear the close-on-exec file descriptor flag.
  *
  * Returns: 0 on success, -1 on error.
  **/
 int
-state_rlimit_deserialise_all (json_object *json, const void *parent,
-		struct rlimit *(*rlimits)[])
+state_modify_cloexec (int fd, int set)
 {
-	json_object    *json_limits;
-	struct rlimit  *rlimit;
-	int             i = 0;
-
-	nih_assert (json);
-	nih_assert (parent);
-	nih_assert (rlimits);
+	long   flags;
+	int    ret;
 
-	if (! json_object_object_get_ex (json, "limits", &json_limits))
-		goto error;
+	nih_assert (fd >= 0);
 
-	if (! state_check_json_type (json_limits, array))
-		goto error;
+	flags = fcntl (fd, F_GETFD);
 
-	for (i = 0; i < json_object_array_length (json_limits); i++) {
-		json_object *json_rlimit;
+	if (flags < 0)
+		return -1;
 
-		nih_assert (i <= RLIMIT_NLIMITS);
+	if (set)
+		flags |= FD_CLOEXEC;
+	else
+		flags &= ~FD_CLOEXEC;
 
-		json_rlimit = json_object_array_get_idx (json_limits, i);
-		if (! json_rlimit)
-			goto error;
+	ret = fcntl (fd, F_SETFD, flags);
+	if (ret < 0)
+		return -1;
 
-		if (! state_check_json_type (json_rlimit, object))
-			goto error;
+	return 0;
+}
 
-		rlimit = state_rlimit_deserialise (json_rlimit);
-		if (! rlimit)
-			goto error;
+/**
+ * state_fd_valid:
+ * @fd: file descriptor.
+ *
+ * Return TRUE if @fd is valid, else FALSE.
+ **/
+int
+state_fd_valid (int fd)
+{
+	int flags = 0;
 
-		if (! rlimit->rlim_cur && ! rlimit->rlim_max) {
-			/* This limit was simply a placeholder so
-			 * don't set it. Arguably, it is possible to set
-			 * a limit of zero, but that is non-sensical with
-			 * the exception of the nice and rtprio limits,
-			 * which conveniently the kernel defaults to zero
-			 * anyway ;-)
-			 */
-			nih_free (rlimit);
-			(*rlimits)[i] = NULL;
-			continue;
-		}
+	if (fd < 0)
+		return FALSE;
 
-		(*rlimits)[i] = rlimit;
-		nih_ref ((*rlimits)[i], parent);
-	}
+	errno = 0;
+	flags = fcntl (fd, F_GETFL);
 
-	return 0;
+	if (flags < 0)
+		return FALSE;
 
-error:
-	/* Clean up what we can */
-	for (; i >= 0; i--)
-		if ((*rlimits)[i])
-			nih_free ((*rlimits)[i]);
+	/* redundant really */
+	if (errno == EBADF)
+		return FALSE;
 
-	return -1;
+	return TRUE;
 }
 
 /**
- * state_collapse_env:
+ * state_serialise_str_array:
  *
- * @env: string array.
+ * @array: string array to serialise.
  *
- * Convert @env into a flattened string, quoting values as required.
+ * Convert string array @array into a JSON array object.
  *
- * Returns: newly-allocated flattened string representing @env on
- * success, or NULL on error.
+ * Returns: JSON-serialised @array, or NULL on error.
  **/
-char *
-state_collapse_env (const char **env)
+json_object *
+state_serialise_str_array (char ** const array)
 {
-	char          *p;
-	char          *flattened = NULL;
-	const char  **elem;
-
-	if (! env)
-		return NULL;
+	char * const       *elem;
+	json_object        *json;
+	json_object        *json_element;
+	int                 i;
+
+	nih_assert (array);
+
+	json = json_object_new_array ();
+	if (! json)
+		return NULL;
+
+	for (elem = array, i = 0; elem && *elem; ++elem, ++i) {
+
+		json_element = json_object_new_string (*elem);
+
+		if (! json_element)
+			goto error;
+
+		if (json_object_array_put_idx (json, i, json_element) < 0)
+			goto error;
+	}
+
+	return json;
+
+error:
+	json_object_put (json);
+	return NULL;
+}
+
+/**
+ * _state_deserialise_str_array:
+ *
+ * @parent: parent object for new array (may be NULL),
+ * @json: JSON array object representing a string array,
+ * @array: string array,
+ * @len: length of returned array,
+ * @env: TRUE if @json represents an array of environment
+ * variables, FALSE for simple strings.
+ *
+ * Convert JSON array object @json into a string array.
+ *
+ * If @len is >0, @array will contain the newly-allocated array.
+ * If @len is zero, the contents of @array are undefined.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+int
+_state_deserialise_str_array (void           *parent,
+			      json_object    *json,
+			      char         ***array,
+			      size_t         *len,
+			      int             env)
+{
+	nih_assert (json);
+	nih_assert (array);
+	nih_assert (len);
+
+	if (! state_check_json_type (json, array))
+		return -1;
+
+	*len = json_object_array_length (json);
+
+	if (! *len)
+		return 0;
+
+	*array = nih_str_array_new (parent);
+
+	if (! *array)
+		return -1;
+
+	for (size_t i = 0; i < *len; i++) {
+		json_object  *json_element;
+		const char   *element;
+		char        **new;
+
+		json_element = json_object_array_get_idx (json, i);
+		if (! json_element)
+			goto error;
+
+		if (! state_check_json_type (json_element, string))
+			goto error;
+
+		element = json_object_get_string (json_element);
+		if (! element)
+			goto error;
+
+		if (env) {
+			new = environ_add (array, parent, NULL, TRUE, element);
+			if (! new)
+				goto error;
+			*array = new;
+		} else {
+			new = nih_str_array_add (array, parent, NULL, element);
+
+			if (! new)
+				goto error;
+			*array = new;
+		}
+	}
+
+	return 0;
+
+error:
+	nih_free (*array);
+	*array = NULL;
+	return -1;
+}
+
+/**
+ * state_serialise_int32_array:
+ *
+ * @array: array of 32-bit integers,
+ * @count: number of values in @array,
+ *
+ * Convert integer array @array into a JSON array object.
+ *
+ * Returns: JSON-serialised @array, or NULL on error.
+ **/
+json_object *
+state_serialise_int32_array (int32_t *array, int count)
+{
+	json_object   *json;
+	json_object   *json_element;
+	int            i;
+
+	nih_assert (count >= 0);
+
+	json = json_object_new_array ();
+	if (! json)
+		return NULL;
+
+	if (! count || ! array)
+		return json;
+
+	for (i = 0; i < count; ++i) {
+
+		json_element = json_object_new_int (array[i]);
+
+		if (! json_element)
+			goto error;
+
+		if (json_object_array_put_idx (json, i, json_element) < 0)
+			goto error;
+	}
+
+	return json;
+
+error:
+	json_object_put (json);
+	return NULL;
+}
+
+/**
+ * state_serialise_int64_array:
+ *
+ * @array: array of 64-bit integers,
+ * @count: number of values in @array,
+ *
+ * Convert integer array @array into a JSON array object.
+ *
+ * Returns: JSON-serialised @array, or NULL on error.
+ **/
+json_object *
+state_serialise_int64_array (int64_t *array, int count)
+{
+	json_object   *json;
+	json_object   *json_element;
+	int            i;
+
+	nih_assert (count >= 0);
+
+	json = json_object_new_array ();
+	if (! json)
+		return NULL;
+
+	if (! count || ! array)
+		return json;
+
+	for (i = 0; i < count; ++i) {
+
+		json_element = json_object_new_int64 (array[i]);
+
+		if (! json_element)
+			goto error;
+
+		if (json_object_array_put_idx (json, i, json_element) < 0)
+			goto error;
+	}
+
+	return json;
+
+error:
+	json_object_put (json);
+	return NULL;
+}
+
+/**
+ * state_deserialise_int32_array:
+ *
+ * @parent: parent object for new array,
+ * @json: JSON array object representing an integer array,
+ * @array: array of 32-bit integers,
+ * @len: length of @array.
+ *
+ * Convert JSON array object @json into an array of 32-bit integers.
+ *
+ * If @len is >0, @array will contain the newly-allocated array.
+ * If @len is zero, the contents of @array are undefined.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+int
+state_deserialise_int32_array (void          *parent,
+			       json_object   *json,
+			       int32_t      **array,
+			       size_t        *len)
+{
+	nih_assert (parent);
+	nih_assert (json);
+	nih_assert (array);
+	nih_assert (len);
+
+	if (! state_check_json_type (json, array))
+		return -1;
+
+	*len = json_object_array_length (json);
+
+	if (! *len)
+		return 0;
+
+	*array = nih_realloc (*array, parent, (*len) * sizeof (int32_t));
+	if (! *array)
+		return -1;
+
+	for (size_t i = 0; i < *len; i++) {
+		json_object  *json_element;
+
+		json_element = json_object_array_get_idx (json, i);
+		if (! json_element)
+			goto error;
+
+		if (! state_check_json_type (json_element, int))
+			goto error;
+
+		errno = 0;
+		(*array)[i] = json_object_get_int (json_element);
+		if (! (*array)[i] && errno == EINVAL)
+			goto error;
+	}
+
+	return 0;
+
+error:
+	nih_free (*array);
+	return -1;
+}
+
+/**
+ * state_deserialise_int64_array:
+ *
+ * @parent: parent object for new array,
+ * @json: JSON array object representing an integer array,
+ * @array: array of 64-bit integers,
+ * @len: length of @array.
+ *
+ * Convert JSON array object @json into an array of 64-bit integers.
+ *
+ * If @len is >0, @array will contain the newly-allocated array.
+ * If @len is zero, the contents of @array are undefined.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+int
+state_deserialise_int64_array (void           *parent,
+			       json_object    *json,
+			       int64_t       **array,
+			       size_t         *len)
+{
+	nih_assert (parent);
+	nih_assert (json);
+	nih_assert (array);
+	nih_assert (len);
+
+	if (! state_check_json_type (json, array))
+		return -1;
+
+	*len = json_object_array_length (json);
+
+	if (! *len)
+		return 0;
+
+	*array = nih_realloc (*array, parent, (*len) * sizeof (int64_t));
+	if (! *array)
+		return -1;
+
+	for (size_t i = 0; i < *len; i++) {
+		json_object  *json_element;
+
+		json_element = json_object_array_get_idx (json, i);
+		if (! json_element)
+			goto error;
+
+		if (! state_check_json_type (json_element, int))
+			goto error;
+
+		errno = 0;
+		(*array)[i] = json_object_get_int64 (json_element);
+		if (! (*array)[i] && errno == EINVAL)
+			goto error;
+	}
+
+	return 0;
+
+error:
+	nih_free (*array);
+	return -1;
+}
+
+/**
+ * state_rlimit_serialise:
+ * @limit: rlimit to serialise.
+ *
+ * Convert @limit into a JSON representation for serialisation.
+ * Caller must free returned value using json_object_put().
+ *
+ * Returns: JSON-serialised rlimit structure, or NULL on error.
+ **/
+json_object *
+state_rlimit_serialise (const struct rlimit *rlimit)
+{
+	json_object  *json;
+
+	nih_assert (rlimit);
+
+	json = json_object_new_object ();
+	if (! json)
+		return NULL;
+
+	if (! state_set_json_int_var_from_obj (json, rlimit, rlim_cur))
+		goto error;
+
+	if (! state_set_json_int_var_from_obj (json, rlimit, rlim_max))
+		goto error;
+
+	return json;
+
+error:
+	json_object_put (json);
+	return NULL;
+}
+
+/**
+ * state_rlimit_serialise_all:
+ *
+ * @rlimits: array of rlimit structures.
+ *
+ * Convert array of rlimit structures to JSON representation.
+ *
+ * Returns: JSON object containing array of rlimits, or NULL on error.
+ */
+json_object *
+state_rlimit_serialise_all (struct rlimit * const *rlimits)
+{
+	json_object    *json;
+	json_object    *json_rlimit;
+	struct rlimit   dummy = { 0x0, 0x0 };
+
+	nih_assert (rlimits);
+
+	json = json_object_new_array ();
+	if (! json)
+		return NULL;
+
+	for (int i = 0; i < RLIMIT_NLIMITS; i++) {
+		/* We must encode a blank entry for missing array elements
+		 * to ensure correct ordering of limits on deserialisation.
+		 */
+		json_rlimit = state_rlimit_serialise (rlimits[i]
+				? rlimits[i] : &dummy);
+
+		if (! json_rlimit)
+			goto error;
+
+		if (json_object_array_add (json, json_rlimit) < 0)
+			goto error;
+	}
+
+	return json;
+
+error:
+
+	json_object_put (json);
+	return NULL;
+}
+
+/**
+ * state_rlimit_deserialise:
+ *
+ * @json: JSON-serialised rlimit structure to deserialise.
+ *
+ * Convert @json into an rlimit structure.
+ *
+ * Caller must manually nih_ref() returned object to a parent object.
+ *
+ * Returns: struct rlimit, or NULL on error.
+ **/
+struct rlimit *
+state_rlimit_deserialise (json_object *json)
+{
+	struct rlimit  *rlimit = NULL;
+
+	nih_assert (json);
+
+	if (! state_check_json_type (json, object))
+		goto error;
+
+	rlimit = nih_new (NULL, struct rlimit);
+	if (! rlimit)
+		return NULL;
+
+	memset (rlimit, '\0', sizeof (struct rlimit));
+
+	if (! state_get_json_int_var_to_obj (json, rlimit, rlim_cur))
+		goto error;
+
+	if (! state_get_json_int_var_to_obj (json, rlimit, rlim_max))
+		goto error;
+
+	return rlimit;
+
+error:
+	nih_free (rlimit);
+	return NULL;
+}
+
+/**
+ * state_rlimit_deserialise_all:
+ *
+ * @json: root of JSON-serialised state,
+ * @parent: parent of @,
+ * @limits: pre-allocated pointer array to hold rlimits array.
+ *
+ * Convert JSON representation of rlimits back into
+ * an array of rlimit structures.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+int
+state_rlimit_deserialise_all (json_object *json, const void *parent,
+		struct rlimit *(*rlimits)[])
+{
+	json_object    *json_limits;
+	struct rlimit  *rlimit;
+	int             i = 0;
+
+	nih_assert (json);
+	nih_assert (parent);
+	nih_assert (rlimits);
+
+	if (! json_object_object_get_ex (json, "limits", &json_limits))
+		goto error;
+
+	if (! state_check_json_type (json_limits, array))
+		goto error;
+
+	for (i = 0; i < json_object_array_length (json_limits); i++) {
+		json_object *json_rlimit;
+
+		nih_assert (i <= RLIMIT_NLIMITS);
+
+		json_rlimit = json_object_array_get_idx (json_limits, i);
+		if (! json_rlimit)
+			goto error;
+
+		if (! state_check_json_type (json_rlimit, object))
+			goto error;
+
+		rlimit = state_rlimit_deserialise (json_rlimit);
+		if (! rlimit)
+			goto error;
+
+		if (! rlimit->rlim_cur && ! rlimit->rlim_max) {
+			/* This limit was simply a placeholder so
+			 * don't set it. Arguably, it is possible to set
+			 * a limit of zero, but that is non-sensical with
+			 * the exception of the nice and rtprio limits,
+			 * which conveniently the kernel defaults to zero
+			 * anyway ;-)
+			 */
+			nih_free (rlimit);
+			(*rlimits)[i] = NULL;
+			continue;
+		}
+
+		(*rlimits)[i] = rlimit;
+		nih_ref ((*rlimits)[i], parent);
+	}
+
+	return 0;
+
+error:
+	/* Clean up what we can */
+	for (; i >= 0; i--)
+		if ((*rlimits)[i])
+			nih_free ((*rlimits)[i]);
+
+	return -1;
+}
+
+/**
+ * state_collapse_env:
+ *
+ * @env: string array.
+ *
+ * Convert @env into a flattened string, quoting values as required.
+ *
+ * Returns: newly-allocated flattened string representing @env on
+ * success, or NULL on error.
+ **/
+char *
+state_collapse_env (const char **env)
+{
+	char          *p;
+	char          *flattened = NULL;
+	const char  **elem;
+
+	if (! env)
+		return NULL;
+
+	for (elem = env; elem && *elem; ++elem) {
+		p = strchr (*elem, '=');
+
+		/* If an environment variable contains an equals and whitespace
+		 * in the value part, quote the value.
+		 */
+		if (p && strpbrk (p, " \t")) {
+			/* append name and equals */
+			NIH_MUST (nih_strcat_sprintf (&flattened, NULL,
+						"%s%.*s",
+						elem == env ? "" : " ",
+						(int)((p - *elem) + 1), *elem));
+			p++;
+
+			/* add quoted value */
+			if (p) {
+				NIH_MUST (nih_strcat_sprintf
+						(&flattened, NULL, "\"%s\"", p));
+			}
+		} else {
+			/* either a simple 'name' environment variable,
+			 * or a name/value pair without space in the
+			 * value part.
+			 */
+			NIH_MUST (nih_strcat_sprintf
+					(&flattened, NULL,
+					 "%s%s",
+					 elem == env ? "" : " ",
+					 *elem));
+		}
+	}
+
+	return flattened;
+}
+
+/**
+ * state_get_json_type:
+ *
+ * @short_type: name of JSON type without the prefix.
+ *
+ * Convert JSON short-type name to a full JSON type.
+ *
+ * This function is only required due to JSON-C's integer handling:
+ * RFC 4627, the JSON "memo" (not a spec!) alludes to JSON being a
+ * subset of ECMA-262, and yet no mention is made of the maximum integer
+ * size. ECMA-262 defines a 'Number' to be a 64-bit entity, but older
+ * versions of JSON-C defined a number to be the same size as a native
+ * integer (which might be 32-bit or 64-bit). Version 0.10 rectified
+ * this by storing all integer types as 64-bit internally but it does
+ * not define 
+ *
+ * Returns: JSON type.
+ **/
+inline enum json_type
+state_get_json_type (const char *short_type)
+{
+	nih_assert (short_type);
+
+#define state_make_type_check(var, short_type) \
+	else if (! strcmp (var, #short_type)) \
+	return (json_type_ ## short_type)
+
+	if (! strcmp (short_type, "int64"))
+		return json_type_int;
+
+	state_make_type_check (short_type, null);
+	state_make_type_check (short_type, boolean);
+	state_make_type_check (short_type, double);
+	state_make_type_check (short_type, int);
+	state_make_type_check (short_type, object);
+	state_make_type_check (short_type, array);
+	state_make_type_check (short_type, string);
+
+#undef state_make_type_check
+
+	nih_assert_not_reached ();
+
+	/* keep compiler happy */
+	return json_type_null;
+}
+
+/**
+ * state_deserialise_resolve_deps:
+ *
+ * @json: root of JSON-serialised state.
+ *
+ * Resolve circular dependencies between Events and Jobs (via their
+ * parent JobClass) and update JSON accordingly to allow deserialisation
+ * of such dependencies.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+int
+state_deserialise_resolve_deps (json_object *json)
+{
+	int  session_index = -1;
+
+	nih_assert (json);
+
+	/* XXX: Sessions, Events, JobClasses, Jobs and DBusConnections
+	 * must have previously been deserialised before invoking
+	 * this function.
+	 */
+	nih_assert (json_sessions);
+	nih_assert (json_events);
+	nih_assert (json_classes);
+
+	for (int i = 0; i < json_object_array_length (json_events); i++) {
+		json_object  *json_event;
+		Event        *event = NULL;
+
+		json_event = json_object_array_get_idx (json_events, i);
+		if (! json_event)
+			goto error;
+
+		if (! state_check_json_type (json_event, object))
+			goto error;
+
+		event = event_from_index (i);
+		if (! event)
+			goto error;
+
+		if (state_deserialise_blocking (event, &event->blocking, json_event) < 0)
+			goto error;
+	}
+
+	for (int i = 0; i < json_object_array_length (json_classes); i++) {
+		json_object     *json_class;
+		json_object     *json_jobs;
+		JobClass        *class = NULL;
+		nih_local char  *class_name = NULL;
+		Session         *session;
+
+		session_index = -1;
+
+		json_class = json_object_array_get_idx (json_classes, i);
+		if (! json_class)
+			goto error;
+
+		if (! state_check_json_type (json_class, object))
+			goto error;
+		
+		if (! state_get_json_int_var (json_class, "session", session_index))
+			goto error;
+
+		if (session_index > 0) {
+			/* Although ConfSources are now serialised,
+			 * skip JobClasses with associated user/chroot
+			 * sessions to avoid behavioural changes for
+			 * the time being.
+			 */
+			continue;
+		}
+
+		session = session_from_index (session_index);
+
+		/* All (non-NULL) sessions should already exist */
+		if (session_index > 0 && ! session)
+			goto error;
+
+		if (! state_get_json_string_var_strict (json_class, "name", NULL, class_name))
+			goto error;
+
+		/* lookup class associated with JSON class index */
+		class = job_class_get_registered (class_name, session);
+
+		if (! class)
+			goto error;
+
+		/* Sessions have been ignored, but handle the impossible
+		 * anyway.
+		 */
+		if (class->session)
+			goto error;
+
+		if (! state_get_json_var_full (json_class, "jobs", array, json_jobs))
+			goto error;
+
+		/* look for jobs in JSON with associated blocked entries */
+		for (int j = 0; j < json_object_array_length (json_jobs); j++) {
+			json_object     *json_blocking;
+			json_object     *json_job;
+			Job             *job = NULL;
+			nih_local char  *job_name = NULL;
+
+			json_job = json_object_array_get_idx (json_jobs, j);
+			if (! json_job)
+				goto error;
+
+			if (! state_check_json_type (json_job, object))
+				goto error;
+
+			if (! json_object_object_get_ex (json_job, "blocking", &json_blocking))
+				continue;
+
+			if (! state_get_json_string_var_strict (json_job, "name", NULL, job_name))
+				goto error;
+
+			/* lookup job */
+			job = job_find (class->session, NULL, class->name, job_name);
+			if (! job)
+				goto error;
+
+			/* recreate blocked entries */
+			if (state_deserialise_blocking (job, &job->blocking, json_job) < 0)
+				goto error;
+		}
+	}
+
+	return 0;
+
+error:
+	return -1;
+}
+
+/**
+ * state_serialise_blocked:
+ *
+ * @blocked: Blocked object.
+ *
+ * Convert a Blocked object into JSON comprising a 'type'
+ * field and a 'data' field. The 'data' field is type-specific:
+ *
+ * - blocked jobs encode the Job instance ('name')
+ *   and JobClass name ('class').
+ *
+ * - blocked events encode the event index number ('index').
+ *
+ * - all D-Bus blocked types encode the marshalled D-Bus
+ *   message ('msg-data'), the D-Bus message serial
+ *   number ('msg-id') and the D-Bus connection associated with this
+ *   D-Bus message ('msg-connection').
+ *
+ * - blocked EmitEvents method calls additionally encode the number of
+ *   events the batch is still waiting for ('batch-pending') and whether
+ *   any failed ('batch-failed').
+ *
+ * Returns: JSON-serialised Blocked object, or NULL on error.
+ **/
+json_object *
+state_serialise_blocked (const Blocked *blocked)
+{
+	json_object  *json;
+	json_object  *json_blocked_data;
+	int           session_index;
+
+	nih_assert (blocked);
+
+	json = json_object_new_object ();
+
+	if (! json)
+		return NULL;
+
+	json_blocked_data = json_object_new_object ();
+	if (! json_blocked_data)
+		goto error;
+
+	switch (blocked->type) {
+	case BLOCKED_JOB:
+		{
+			/* Need to encode JobClass name and Job name to make
+			 * it unique.
+			 */
+			if (! state_set_json_string_var (json_blocked_data,
+						"class",
+						blocked->job->class->name))
+				goto error;
+
+			session_index = session_get_index (blocked->job->class->session);
+			if (session_index < 0)
+				goto error;
+
+			/* Encode parent classes session index to aid in
+			 * finding the correct job on deserialisation.
+			 */
+			if (! state_set_json_int_var (json_blocked_data,
+						"session",
+						session_index))
+				goto error;
+
+			if (! state_set_json_string_var (json_blocked_data,
+						"name",
+						blocked->job->name))
+				goto error;
 
-	for (elem = env; elem && *elem; ++elem) {
-		p = strchr (*elem, '=');
+			json_object_object_add (json, "data", json_blocked_data);
 
-		/* If an environment variable contains an equals and whitespace
-		 * in the value part, quote the value.
+		}
+		break;
+
+	case BLOCKED_EVENT:
+		{
+			int event_index = 0;
+
+			event_index = event_to_index (blocked->event);
+			if (event_index < 0)
+				goto error;
+
+			if (! state_set_json_int_var (json_blocked_data,
+						"index", event_index))
+				goto error;
+
+			json_object_object_add (json, "data", json_blocked_data);
+		}
+		break;
+
+	case BLOCKED_EMIT_EVENTS_METHOD:
+		/* The batch is shared by every event it waits for, so
+		 * each of them records its message, which identifies it,
+		 * along with the counts they share.
 		 */
-		if (p && strpbrk (p, " \t")) {
-			/* append name and equals */
-			NIH_MUST (nih_strcat_sprintf (&flattened, NULL,
-						"%s%.*s",
-						elem == env ? "" : " ",
-						(int)((p - *elem) + 1), *elem));
-			p++;
+		if (! state_serialise_message (json_blocked_data,
+					       blocked->batch->message))
+			goto error;
 
-			/* add quoted value */
-			if (p) {
-				NIH_MUST (nih_strcat_sprintf
-						(&flattened, NULL, "\"%s\"", p));
-			}
-		} else {
-			/* either a simple 'name' environment variable,
-			 * or a name/value pair without space in the
-			 * value part.
+		if (! state_set_json_int_var (json_blocked_data,
+					"batch-pending",
+					blocked->batch->pending))
+			goto error;
+
+		if (! state_set_json_int_var (json_blocked_data,
+					"batch-failed",
+					blocked->batch->failed))
+			goto error;
+
+		json_object_object_add (json, "data", json_blocked_data);
+		break;
+
+	default:
+		/* Handle the D-Bus types by encoding the D-Bus message
+		 * serial number and marshalled message data.
+		 *
+		 * This scenario occurs when "initctl emit foo" blocks -
+		 * the D-Bus message is "in-flight" but blocked on some
+		 * event. Therefore, we must serialise the entire D-Bus
+		 * message and reconstruct it on deserialisation.
+		 */
+		if (! state_serialise_message (json_blocked_data,
+					       blocked->message))
+			goto error;
+
+		json_object_object_add (json, "data", json_blocked_data);
+		break;
+	}
+
+	if (! state_set_json_enum_var (json,
+				blocked_type_enum_to_str,
+				"type", blocked->type))
+		goto error;
+
+	return json;
+
+error:
+	json_object_put (json);
+	return NULL;
+}
+
+/**
+ * state_serialise_blocking:
+ *
+ * @blocking: list of Blocked objects.
+ *
+ * Convert a list of Blocked objects into JSON.
+ *
+ * Returns: JSON-serialised Blocked list, or NULL on error.
+ **/
+json_object *
+state_serialise_blocking (const NihList *blocking)
+{
+	json_object *json;
+
+	json = json_object_new_array ();
+
+	if (! json)
+		return NULL;
+
+	if (! blocking)
+		return json;
+
+	NIH_LIST_FOREACH (blocking, iter) {
+		Blocked *blocked = (Blocked *)iter;
+
+		json_object *json_blocked;
+
+		/* FIXME: D-Bus blocked objects not serialisable until D-Bus provides
+		 * dbus_connection_open_from_fd() to allow deserialisation.
+		 */
+		if (blocked->type != BLOCKED_EVENT && blocked->type != BLOCKED_JOB) {
+			nih_warn ("D-Bus blocked objects not being serialised yet");
+			continue;
+		}
+
+		json_blocked = state_serialise_blocked (blocked);
+		if (! json_blocked)
+			goto error;
+
+		if (json_object_array_add (json, json_blocked) < 0)
+			goto error;
+
+	}
+
+	return json;
+
+error:
+	json_object_put (json);
+	return NULL;
+}
+
+/**
+ * state_deserialise_blocked:
+ *
+ * @parent: parent,
+ * @json: JSON data representing a blocking array entry,
+ * @list: list to add Blocked entry to.
+ *
+ * Create a single Blocked entry based on data found in JSON and add to
+ * @list.
+ *
+ * Returns: new Blocked object, or NULL on error.
+ **/
+Blocked *
+state_deserialise_blocked (void *parent, json_object *json,
+		NihList *list)
+{
+	json_object     *json_blocked_data;
+	Blocked         *blocked = NULL;
+	nih_local char  *blocked_type_str = NULL;
+	BlockedType      blocked_type;
+
+	nih_assert (parent);
+	nih_assert (json);
+	nih_assert (list);
+	nih_assert (control_conns);
+
+	if (! state_get_json_string_var_strict (json, "type", NULL, blocked_type_str))
+		goto error;
+
+	blocked_type = blocked_type_str_to_enum (blocked_type_str);
+	if (blocked_type == (BlockedType)-1)
+		goto error;
+
+	if (! json_object_object_get_ex (json, "data", &json_blocked_data))
+		goto error;
+
+	switch (blocked_type) {
+	case BLOCKED_JOB:
+		{
+			nih_local char  *job_name = NULL;
+			nih_local char  *job_class_name = NULL;
+			Job             *job;
+			Session         *session;
+			int              session_index;
+
+			if (! state_get_json_string_var_strict (json_blocked_data,
+						"name", NULL, job_name))
+				goto error;
+
+			if (! state_get_json_string_var_strict (json_blocked_data,
+						"class", NULL, job_class_name))
+				goto error;
+
+			/* On error, assume NULL session since the likelihood
+			 * is we're upgrading from Upstart 1.6 that did not set
+			 * the 'session' JSON object.
 			 */
-			NIH_MUST (nih_strcat_sprintf
-					(&flattened, NULL,
-					 "%s%s",
-					 elem == env ? "" : " ",
-					 *elem));
+			if (! state_get_json_int_var (json_blocked_data, "session", session_index))
+				session_index = 0;
+
+			if (session_index < 0)
+				goto error;
+
+			session = session_from_index (session_index);
+
+			job = job_find (session, NULL, job_class_name, job_name);
+			if (! job)
+				goto error;
+
+			blocked = NIH_MUST (blocked_new (parent, BLOCKED_JOB, job));
+			nih_list_add (list, &blocked->entry);
+		}
+		break;
+
+	case BLOCKED_EVENT:
+		{
+			Event  *event = NULL;
+			int     event_index = -1;
+
+			if (! state_get_json_int_var (json_blocked_data,
+						"index", event_index))
+				goto error;
+
+			event = event_from_index (event_index);
+			if (! event)
+				goto error;
+
+			blocked = NIH_MUST (blocked_new (parent, BLOCKED_EVENT, event));
+			nih_list_add (list, &blocked->entry);
+			
+			/* Event must already exist and should have
+			 * blockers associated for it to have a blocked
+			 * object pointing at it.
+			 */
+			nih_assert (blocked->event->blockers);
 		}
+		break;
+
+	case BLOCKED_EMIT_EVENTS_METHOD:
+		{
+			ControlEmitBatch *batch;
+
+			batch = state_deserialise_batch (json_blocked_data);
+			if (! batch)
+				goto error;
+
+			blocked = NIH_MUST (blocked_new (parent, blocked_type, batch));
+			nih_list_add (list, &blocked->entry);
+		}
+		break;
+
+	default:
+
+		/* Handle D-Bus types by demarshalling deserialised D-Bus
+		 * message and then setting the D-Bus serial number.
+		 */
+		{
+			NihDBusMessage  *nih_dbus_msg = NULL;
+
+			/* FIXME: parent is incorrect?!? */
+			nih_dbus_msg = state_deserialise_message (NULL,
+								  json_blocked_data);
+			if (! nih_dbus_msg)
+				goto error;
+
+			blocked = NIH_MUST (blocked_new (parent, blocked_type, nih_dbus_msg));
+			nih_list_add (list, &blocked->entry);
+		}
+		break;
 	}
 
-	return flattened;
+	return blocked;
+
+error:
+	if (blocked)
+		nih_free (blocked);
+
+	return NULL;
 }
 
 /**
- * state_get_json_type:
+ * state_serialise_message:
+ * @json: JSON object to add message to,
+ * @message: D-Bus message.
  *
- * @short_type: name of JSON type without the prefix.
+ * Encode the marshalled D-Bus @message ('msg-data'), its serial number
+ * ('msg-id') and the index of its connection ('msg-connection') into
+ * @json.
  *
- * Convert JSON short-type name to a full JSON type.
+ * Returns: TRUE on success, FALSE on error.
+ **/
+static int
+state_serialise_message (json_object     *json,
+			 NihDBusMessage  *message)
+{
+	char            *dbus_message_data_raw = NULL;
+	nih_local char  *dbus_message_data_str = NULL;
+	int              len = 0;
+	int              conn_index;
+	dbus_uint32_t    serial;
+
+	nih_assert (json);
+	nih_assert (message);
+
+	serial = dbus_message_get_serial (message->message);
+
+	if (! state_set_json_int_var (json, "msg-id", serial))
+		return FALSE;
+
+	if (! dbus_message_marshal (message->message,
+				    &dbus_message_data_raw, &len))
+		return FALSE;
+
+	dbus_message_data_str = state_data_to_hex (NULL,
+			dbus_message_data_raw,
+			len);
+
+	/* returned memory is managed by D-Bus, not NIH */
+	dbus_free (dbus_message_data_raw);
+
+	if (! dbus_message_data_str)
+		return FALSE;
+
+	if (! state_set_json_string_var (json, "msg-data",
+					 dbus_message_data_str))
+		return FALSE;
+
+	conn_index = control_conn_to_index (message->connection);
+	if (conn_index < 0)
+		return FALSE;
+
+	if (! state_set_json_int_var (json, "msg-connection", conn_index))
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * state_deserialise_message:
+ * @parent: parent of new message,
+ * @json: JSON object containing message.
  *
- * This function is only required due to JSON-C's integer handling:
- * RFC 4627, the JSON "memo" (not a spec!) alludes to JSON being a
- * subset of ECMA-262, and yet no mention is made of the maximum integer
- * size. ECMA-262 defines a 'Number' to be a 64-bit entity, but older
- * versions of JSON-C defined a number to be the same size as a native
- * integer (which might be 32-bit or 64-bit). Version 0.10 rectified
- * this by storing all integer types as 64-bit internally but it does
- * not define 
+ * Recreate a D-Bus message encoded by state_serialise_message() by
+ * demarshalling it and then setting the D-Bus serial number.
  *
- * Returns: JSON type.
+ * Returns: new NihDBusMessage, or NULL on error.
  **/
-inline enum json_type
-state_get_json_type (const char *short_type)
+static NihDBusMessage *
+state_deserialise_message (const void   *parent,
+			   json_object  *json)
 {
-	nih_assert (short_type);
+	DBusMessage     *dbus_msg = NULL;
+	DBusConnection  *dbus_conn = NULL;
+	NihDBusMessage  *nih_dbus_msg = NULL;
+	DBusError        error;
+	dbus_uint32_t    serial = 0;
+	size_t           raw_len;
+	nih_local char  *dbus_message_data_str = NULL;
+	nih_local char  *dbus_message_data_raw = NULL;
+	int              conn_index = -1;
 
-#define state_make_type_check(var, short_type) \
-	else if (! strcmp (var, #short_type)) \
-	return (json_type_ ## short_type)
+	nih_assert (json);
 
-	if (! strcmp (short_type, "int64"))
-		return json_type_int;
+	if (! state_get_json_string_var_strict (json, "msg-data", NULL,
+						dbus_message_data_str))
+		return NULL;
 
-	state_make_type_check (short_type, null);
-	state_make_type_check (short_type, boolean);
-	state_make_type_check (short_type, double);
-	state_make_type_check (short_type, int);
-	state_make_type_check (short_type, object);
-	state_make_type_check (short_type, array);
-	state_make_type_check (short_type, string);
+	if (! state_get_json_int_var (json, "msg-id", serial))
+		return NULL;
 
-#undef state_make_type_check
+	if (state_hex_to_data (NULL,
+			       dbus_message_data_str,
+			       strlen (dbus_message_data_str),
+			       &dbus_message_data_raw,
+			       &raw_len) < 0)
+		return NULL;
 
-	nih_assert_not_reached ();
+	if (! state_get_json_int_var (json, "msg-connection", conn_index))
+		return NULL;
 
-	/* keep compiler happy */
-	return json_type_null;
+	dbus_conn = control_conn_from_index (conn_index);
+	if (! dbus_conn)
+		return NULL;
+
+	dbus_error_init (&error);
+	dbus_msg = dbus_message_demarshal (dbus_message_data_raw,
+			(int)raw_len,
+			&error);
+	if (! dbus_msg || dbus_error_is_set (&error)) {
+		nih_error ("%s: %s",
+				_("failed to demarshal D-Bus message"),
+				error.message);
+		dbus_error_free (&error);
+		return NULL;
+	}
+
+	dbus_message_set_serial (dbus_msg, serial);
+
+	/* FIXME:
+	 *
+	 * *EITHER*:
+	 *
+	 * a) call nih_dbus_message_new() then *deref*
+	 * both the DBusMessage and the DBusConnection
+	 * (since they've *ALREADY* been refed by the
+	 * pre-re-exec call to nih_dbus_message_new(),
+	 *
+	 * b) Create nih_dbus_message_renew (const void
+	 * *parent, DBusConnection *connection,
+	 * DBusMessage *   message) that creates a
+	 * NihDBusMessage, but does *NOT* ref() the
+	 * msg+connection (again).
+	 */
+	nih_dbus_msg = nih_dbus_message_new (parent, dbus_conn, dbus_msg);
+
+	return nih_dbus_msg;
 }
 
 /**
- * state_deserialise_resolve_deps:
+ * state_deserialise_batch:
+ * @json: JSON object containing batch.
  *
- * @json: root of JSON-serialised state.
+ * Find the ControlEmitBatch for the EmitEvents method call encoded in
+ * @json, recreating it if this is the first of its events to be
+ * deserialised, so that all of them refer to the same batch again.
  *
- * Resolve circular dependencies between Events and Jobs (via their
- * parent JobClass) and update JSON accordingly to allow deserialisation
- * of such dependencies.
+ * The batch is returned without a parent; it should be referenced by
+ * the Blocked entry that waits for it.
  *
- * Returns: 0 on success, -1 on error.
+ * Returns: ControlEmitBatch, or NULL on error.
  **/
-int
-state_deserialise_resolve_deps (json_object *json)
+static ControlEmitBatch *
+state_deserialise_batch (json_object *json)
 {
-	int  session_index = -1;
+	ControlEmitBatch  *batch;
+	NihListEntry      *entry;
+	DBusConnection    *dbus_conn;
+	dbus_uint32_t      serial = 0;
+	int                conn_index = -1;
+	unsigned int       pending = 0;
+	int                failed = FALSE;
 
 	nih_assert (json);
 
-	/* XXX: Sessions, Events, JobClasses, Jobs and DBusConnections
-	 * must have previously been deserialised before invoking
-	 * this function.
-	 */
-	nih_assert (json_sessions);
-	nih_assert (json_events);
-	nih_assert (json_classes);
+	if (! state_get_json_int_var (json, "msg-id", serial))
+		return NULL;
 
-	for (int i = 0; i < json_object_array_length (json_events); i++) {
-		json_object  *json_event;
-		Event        *event = NULL;
+	if (! state_get_json_int_var (json, "msg-connection", conn_index))
+		return NULL;
 
-		json_event = json_object_array_get_idx (json_events, i);
-		if (! json_event)
-			goto error;
+	if (! state_get_json_int_var (json, "batch-pending", pending))
+		return NULL;
 
-		if (! state_check_json_type (json_event, object))
-			goto error;
+	if (! state_get_json_int_var (json, "batch-failed", failed))
+		return NULL;
 
-		event = event_from_index (i);
-		if (! event)
-			goto error;
+	dbus_conn = control_conn_from_index (conn_index);
+	if (! dbus_conn)
+		return NULL;
 
-		if (state_deserialise_blocking (event, &event->blocking, json_event) < 0)
-			goto error;
+	if (! state_batches)
+		state_batches = NIH_MUST (nih_list_new (NULL));
+
+	/* A method call is identified by its connection and serial */
+	NIH_LIST_FOREACH (state_batches, iter) {
+		entry = (NihListEntry *)iter;
+		batch = (ControlEmitBatch *)entry->data;
+
+		if ((batch->message->connection == dbus_conn)
+		    && (dbus_message_get_serial (batch->message->message)
+			== serial))
+			return batch;
 	}
 
-	for (int i = 0; i < json_object_array_length (json_classes); i++) {
-		json_object     *json_class;
-		json_object     *json_jobs;
-		JobClass        *class = NULL;
-		nih_local char  *class_name = NULL;
-		Session         *session;
+	batch = nih_new (NULL, ControlEmitBatch);
+	if (! batch)
+		return NULL;
 
-		session_index = -1;
+	batch->message = state_deserialise_message (batch, json);
+	if (! batch->message) {
+		nih_free (batch);
+		return NULL;
+	}
 
-		json_class = json_object_array_get_idx (json_classes, i);
-		if (! json_class)
-			goto error;
+	batch->pending = pending;
+	batch->failed = failed;
 
-		if (! state_check_json_type (json_class, object))
-			goto error;
-		
-		if (! state_get_json_int_var (json_class, "session", session_index))
-			goto error;
+	entry = NIH_MUST (nih_list_entry_new (batch));
+	entry->data = batch;
 
-		if (session_index > 0) {
-			/* Although ConfSources are now serialised,
-			 * skip JobClasses with associated user/chroot
-			 * sessions to avoid behavioural changes for
-			 * the time being.
-			 */
-			continue;
-		}
+	nih_list_add (state_batches, &entry->entry);
 
-		session = session_from_index (session_index);
+	return batch;
+}
 
-		/* All (non-NULL) sessions should already exist */
-		if (session_index > 0 && ! session)
-			goto error;
+/**
+ * state_deserialise_blocking:
+ *
+ * @parent: parent,
+ * @list: list to add new blocked entries to,
+ * @json: JSON representing object containing a blocking entry.
+ *
+ * Recreate Blocked objects from JSON encoded blocking array and add to
+ * specified list.
+ *
+ * Returns: 0 on success, or -1 on error.
+ **/
+int
+state_deserialise_blocking (void *parent, NihList *list, json_object *json)
+{
+	json_object *json_blocking;
 
-		if (! state_get_json_string_var_strict (json_class, "name", NULL, class_name))
-			goto error;
+	nih_assert (parent);
+	nih_assert (list);
+	nih_assert (json);
 
-		/* lookup class associated with JSON class index */
-		class = job_class_get_registered (class_name, session);
+	if (! json_object_object_get_ex (json, "blocking", &json_blocking)) {
+		/* parent is not blocking anything */
+		return 0;
+	}
 
-		if (! class)
+	for (int i = 0; i < json_object_array_length (json_blocking); i++) {
+		json_object * json_blocked;
+
+		json_blocked = json_object_array_get_idx (json_blocking, i);
+		if (! json_blocked)
 			goto error;
 
-		/* Sessions have been ignored, but handle the impossible
-		 * anyway.
+		/* Don't error in this scenario to allow for possibility
+		 * that version of Upstart that performed the
+		 * serialisation did not correctly handle user and
+		 * chroot jobs.
 		 */
-		if (class->session)
-			goto error;
+		if (! state_deserialise_blocked (parent, json_blocked, list))
+			;
+	}
 
-		if (! state_get_json_var_full (json_class, "jobs", array, json_jobs))
-			goto error;
+	return 0;
 
-		/* look for jobs in JSON with associated blocked entries */
-		for (int j = 0; j < json_object_array_length (json_jobs); j++) {
-			json_object     *json_blocking;
-			json_object     *json_job;
-			Job             *job = NULL;
-			nih_local char  *job_name = NULL;
+error:
+	return -1;
+}
 
-			json_job = json_object_array_get_idx (json_jobs, j);
-			if (! json_job)
-				goto error;
+/**
+ * state_data_is_binary:
+ *
+ * @data: serialisation data,
+ * @len: length of @data.
+ *
+ * Returns: TRUE if @data is in the binary encoding, FALSE if it should
+ * be JSON text.
+ **/
+static int
+state_data_is_binary (const char *data, size_t len)
+{
+	nih_assert (data);
 
-			if (! state_check_json_type (json_job, object))
-				goto error;
+	return (len >= STATE_BINARY_MAGIC_LEN
+		&& ! memcmp (data, STATE_BINARY_MAGIC, STATE_BINARY_MAGIC_LEN));
+}
 
-			if (! json_object_object_get_ex (json_job, "blocking", &json_blocking))
-				continue;
+/**
+ * state_json_to_binary:
+ *
+ * @parent: parent object for new data,
+ * @json: JSON object to encode,
+ * @len: length of returned data.
+ *
+ * Encode @json in the binary encoding: STATE_BINARY_MAGIC, the
+ * STATE_BINARY_VERSION byte, then each value as a StateBinaryTag
+ * byte followed by its contents.  Unlike JSON text, nothing needs to be
+ * escaped or formatted and the reader never has to scan for the end of
+ * a value.
+ *
+ * If @parent is not NULL, it should be a pointer to another object
+ * which will be used as a parent for the returned data.  When all
+ * parents of the returned data are freed, the returned data will also
+ * be freed.
+ *
+ * Returns: newly-allocated data, or NULL on error.
+ **/
+char *
+state_json_to_binary (const void   *parent,
+		      json_object  *json,
+		      size_t       *len)
+{
+	char     *data;
+	size_t    size = 4096;
+	uint8_t   version = STATE_BINARY_VERSION;
 
-			if (! state_get_json_string_var_strict (json_job, "name", NULL, job_name))
-				goto error;
+	nih_assert (len);
 
-			/* lookup job */
-			job = job_find (class->session, NULL, class->name, job_name);
-			if (! job)
-				goto error;
+	data = nih_alloc (parent, size);
+	if (! data)
+		return NULL;
 
-			/* recreate blocked entries */
-			if (state_deserialise_blocking (job, &job->blocking, json_job) < 0)
-				goto error;
-		}
+	*len = 0;
+
+	if (state_binary_put (&data, len, &size,
+			      STATE_BINARY_MAGIC, STATE_BINARY_MAGIC_LEN) < 0)
+		goto error;
+
+	if (state_binary_put (&data, len, &size, &version, sizeof (version)) < 0)
+		goto error;
+
+	if (state_binary_encode (&data, len, &size, json) < 0)
+		goto error;
+
+	return data;
+
+error:
+	nih_free (data);
+	return NULL;
+}
+
+/**
+ * state_binary_put:
+ *
+ * @data: pointer to data being encoded,
+ * @len: pointer to length of @data,
+ * @size: pointer to allocated size of @data,
+ * @src: bytes to append,
+ * @n: number of bytes in @src.
+ *
+ * Append @n bytes from @src to @data, doubling its allocation as
+ * necessary.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+static int
+state_binary_put (char        **data,
+		  size_t       *len,
+		  size_t       *size,
+		  const void   *src,
+		  size_t        n)
+{
+	nih_assert (data);
+	nih_assert (*data);
+	nih_assert (len);
+	nih_assert (size);
+
+	if (*len + n > *size) {
+		char   *tmp;
+		size_t  new_size = *size;
+
+		while (*len + n > new_size)
+			new_size *= 2;
+
+		tmp = nih_realloc (*data, NULL, new_size);
+		if (! tmp)
+			return -1;
+
+		*data = tmp;
+		*size = new_size;
 	}
 
-	return 0;
+	memcpy (*data + *len, src, n);
+	*len += n;
 
-error:
-	return -1;
+	return 0;
 }
 
 /**
- * state_serialise_blocked:
- *
- * @blocked: Blocked object.
- *
- * Convert a Blocked object into JSON comprising a 'type'
- * field and a 'data' field. The 'data' field is type-specific:
- *
- * - blocked jobs encode the Job instance ('name')
- *   and JobClass name ('class').
+ * state_binary_encode:
  *
- * - blocked events encode the event index number ('index').
+ * @data: pointer to data being encoded,
+ * @len: pointer to length of @data,
+ * @size: pointer to allocated size of @data,
+ * @json: JSON value to encode.
  *
- * - all D-Bus blocked types encode the marshalled D-Bus
- *   message ('msg-data'), the D-Bus message serial
- *   number ('msg-id') and the D-Bus connection associated with this
- *   D-Bus message ('msg-connection').
+ * Append @json and everything within it to @data.
  *
- * Returns: JSON-serialised Blocked object, or NULL on error.
+ * Returns: 0 on success, -1 on error.
  **/
-json_object *
-state_serialise_blocked (const Blocked *blocked)
+static int
+state_binary_encode (char         **data,
+		     size_t        *len,
+		     size_t        *size,
+		     json_object   *json)
 {
-	json_object  *json;
-	json_object  *json_blocked_data;
-	int           session_index;
+	uint8_t   tag;
+	uint32_t  count;
 
-	nih_assert (blocked);
+	switch (json ? json_object_get_type (json) : json_type_null) {
+	case json_type_null:
+		tag = STATE_BINARY_NULL;
+		return state_binary_put (data, len, size, &tag, sizeof (tag));
 
-	json = json_object_new_object ();
+	case json_type_boolean:
+		tag = (json_object_get_boolean (json)
+		       ? STATE_BINARY_TRUE : STATE_BINARY_FALSE);
+		return state_binary_put (data, len, size, &tag, sizeof (tag));
 
-	if (! json)
-		return NULL;
+	case json_type_int: {
+		int64_t value = json_object_get_int64 (json);
 
-	json_blocked_data = json_object_new_object ();
-	if (! json_blocked_data)
-		goto error;
+		tag = STATE_BINARY_INT;
+		if (state_binary_put (data, len, size, &tag, sizeof (tag)) < 0)
+			return -1;
 
-	switch (blocked->type) {
-	case BLOCKED_JOB:
-		{
-			/* Need to encode JobClass name and Job name to make
-			 * it unique.
-			 */
-			if (! state_set_json_string_var (json_blocked_data,
-						"class",
-						blocked->job->class->name))
-				goto error;
+		return state_binary_put (data, len, size, &value, sizeof (value));
+	}
 
-			session_index = session_get_index (blocked->job->class->session);
-			if (session_index < 0)
-				goto error;
+	case json_type_double: {
+		double value = json_object_get_double (json);
 
-			/* Encode parent classes session index to aid in
-			 * finding the correct job on deserialisation.
-			 */
-			if (! state_set_json_int_var (json_blocked_data,
-						"session",
-						session_index))
-				goto error;
+		tag = STATE_BINARY_DOUBLE;
+		if (state_binary_put (data, len, size, &tag, sizeof (tag)) < 0)
+			return -1;
 
-			if (! state_set_json_string_var (json_blocked_data,
-						"name",
-						blocked->job->name))
-				goto error;
+		return state_binary_put (data, len, size, &value, sizeof (value));
+	}
 
-			json_object_object_add (json, "data", json_blocked_data);
+	case json_type_string: {
+		const char *value = json_object_get_string (json);
+		size_t      value_len = strlen (value);
 
-		}
-		break;
+		if (value_len > UINT32_MAX)
+			return -1;
 
-	case BLOCKED_EVENT:
-		{
-			int event_index = 0;
+		tag = STATE_BINARY_STRING;
+		count = (uint32_t)value_len;
+		if (state_binary_put (data, len, size, &tag, sizeof (tag)) < 0)
+			return -1;
+		if (state_binary_put (data, len, size, &count, sizeof (count)) < 0)
+			return -1;
 
-			event_index = event_to_index (blocked->event);
-			if (event_index < 0)
-				goto error;
+		return state_binary_put (data, len, size, value, value_len);
+	}
 
-			if (! state_set_json_int_var (json_blocked_data,
-						"index", event_index))
-				goto error;
+	case json_type_array: {
+		int length = json_object_array_length (json);
 
-			json_object_object_add (json, "data", json_blocked_data);
+		tag = STATE_BINARY_ARRAY;
+		count = (uint32_t)length;
+		if (state_binary_put (data, len, size, &tag, sizeof (tag)) < 0)
+			return -1;
+		if (state_binary_put (data, len, size, &count, sizeof (count)) < 0)
+			return -1;
+
+		for (int i = 0; i < length; i++) {
+			if (state_binary_encode (data, len, size,
+						 json_object_array_get_idx (json, i)) < 0)
+				return -1;
 		}
-		break;
 
-	default:
-		/* Handle the D-Bus types by encoding the D-Bus message
-		 * serial number and marshalled message data.
-		 *
-		 * This scenario occurs when "initctl emit foo" blocks -
-		 * the D-Bus message is "in-flight" but blocked on some
-		 * event. Therefore, we must serialise the entire D-Bus
-		 * message and reconstruct it on deserialisation.
-		 */
-		{
-			DBusMessage     *message;
-			DBusConnection  *connection;
-			char            *dbus_message_data_raw = NULL;
-			char            *dbus_message_data_str = NULL;
-			int              len = 0;
-			int              conn_index;
-			dbus_uint32_t    serial;
+		return 0;
+	}
 
-			message    = blocked->message->message;
-			connection = blocked->message->connection;
+	case json_type_object:
+		tag = STATE_BINARY_OBJECT;
+		count = 0;
 
-			serial = dbus_message_get_serial (message);
+		{
+			json_object_object_foreach (json, key, value) {
+				(void)key;
+				(void)value;
+				count++;
+			}
+		}
 
-			if (! state_set_json_int_var (json_blocked_data,
-						"msg-id",
-						serial))
-				goto error;
+		if (state_binary_put (data, len, size, &tag, sizeof (tag)) < 0)
+			return -1;
+		if (state_binary_put (data, len, size, &count, sizeof (count)) < 0)
+			return -1;
 
-			if (! dbus_message_marshal (message, &dbus_message_data_raw, &len))
-				goto error;
+		{
+			json_object_object_foreach (json, key, value) {
+				uint32_t key_len = (uint32_t)strlen (key);
+
+				if (state_binary_put (data, len, size,
+						      &key_len, sizeof (key_len)) < 0)
+					return -1;
+				if (state_binary_put (data, len, size,
+						      key, key_len) < 0)
+					return -1;
+				if (state_binary_encode (data, len, size, value) < 0)
+					return -1;
+			}
+		}
 
-			dbus_message_data_str = state_data_to_hex (NULL,
-					dbus_message_data_raw,
-					len);
+		return 0;
 
-			if (! dbus_message_data_str)
-				goto error;
+	default:
+		return -1;
+	}
+}
 
-			/* returned memory is managed by D-Bus, not NIH */
-			dbus_free (dbus_message_data_raw);
+/**
+ * state_binary_to_json:
+ *
+ * @data: data in the binary encoding,
+ * @len: length of @data.
+ *
+ * Decode data produced by state_json_to_binary() back into a JSON
+ * object.
+ *
+ * Returns: new JSON object which the caller must release with
+ * json_object_put(), or NULL if @data is not valid.
+ **/
+json_object *
+state_binary_to_json (const char *data, size_t len)
+{
+	StateReader   reader;
+	json_object  *json;
+	int           error = FALSE;
 
-			if (! state_set_json_string_var (json_blocked_data,
-						"msg-data",
-						dbus_message_data_str))
-				goto error;
+	nih_assert (data);
 
-			conn_index = control_conn_to_index (connection);
-			if (conn_index < 0)
-				goto error;
+	if (! state_data_is_binary (data, len))
+		return NULL;
 
-			if (! state_set_json_int_var (json_blocked_data,
-						"msg-connection",
-						conn_index))
-				goto error;
+	reader.fd = -1;
+	reader.buf = NULL;
+	reader.pos = data + STATE_BINARY_MAGIC_LEN;
+	reader.end = data + len;
 
-			json_object_object_add (json, "data", json_blocked_data);
-		}
-		break;
-	}
+	json = state_binary_read (&reader, &error);
+	if (error)
+		return NULL;
 
-	if (! state_set_json_enum_var (json,
-				blocked_type_enum_to_str,
-				"type", blocked->type))
-		goto error;
+	/* Trailing data means the encoding is not what we expect */
+	if (reader.pos != reader.end) {
+		if (json)
+			json_object_put (json);
+		return NULL;
+	}
 
 	return json;
-
-error:
-	json_object_put (json);
-	return NULL;
 }
 
 /**
- * state_serialise_blocking:
+ * state_reader_fill:
  *
- * @blocking: list of Blocked objects.
+ * @reader: reader to fill.
  *
- * Convert a list of Blocked objects into JSON.
+ * Replace the contents of the buffer of @reader, which must all have
+ * been decoded, with the next chunk of data read from its file
+ * descriptor.
  *
- * Returns: JSON-serialised Blocked list, or NULL on error.
+ * Returns: number of bytes read, zero at end of file or if @reader has
+ * no file descriptor, or -1 on error.
  **/
-json_object *
-state_serialise_blocking (const NihList *blocking)
+static ssize_t
+state_reader_fill (StateReader *reader)
 {
-	json_object *json;
+	ssize_t ret;
 
-	json = json_object_new_array ();
+	nih_assert (reader);
+	nih_assert (reader->pos == reader->end);
 
-	if (! json)
-		return NULL;
+	if (reader->fd < 0)
+		return 0;
 
-	if (! blocking)
-		return json;
+	nih_assert (reader->buf);
 
-	NIH_LIST_FOREACH (blocking, iter) {
-		Blocked *blocked = (Blocked *)iter;
+	do {
+		ret = read (reader->fd, reader->buf, STATE_STREAM_CHUNK);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN
+			     || errno == EWOULDBLOCK));
 
-		json_object *json_blocked;
+	if (ret > 0) {
+		reader->pos = reader->buf;
+		reader->end = reader->buf + ret;
+	}
 
-		/* FIXME: D-Bus blocked objects not serialisable until D-Bus provides
-		 * dbus_connection_open_from_fd() to allow deserialisation.
-		 */
-		if (blocked->type != BLOCKED_EVENT && blocked->type != BLOCKED_JOB) {
-			nih_warn ("D-Bus blocked objects not being serialised yet");
-			continue;
-		}
+	return ret;
+}
 
-		json_blocked = state_serialise_blocked (blocked);
-		if (! json_blocked)
-			goto error;
+/**
+ * state_reader_get:
+ *
+ * @reader: reader to take data from,
+ * @dest: destination for data,
+ * @n: number of bytes to copy into @dest.
+ *
+ * Copy the next @n bytes from @reader into @dest, reading further
+ * chunks from its file descriptor as necessary.
+ *
+ * Returns: 0 on success, -1 if fewer than @n bytes remain.
+ **/
+static int
+state_reader_get (StateReader  *reader,
+		  void         *dest,
+		  size_t        n)
+{
+	char *d = dest;
 
-		if (json_object_array_add (json, json_blocked) < 0)
-			goto error;
+	nih_assert (reader);
 
-	}
+	while (n) {
+		size_t available;
 
-	return json;
+		if (reader->pos == reader->end
+		    && state_reader_fill (reader) <= 0)
+			return -1;
 
-error:
-	json_object_put (json);
-	return NULL;
+		available = (size_t)(reader->end - reader->pos);
+		if (available > n)
+			available = n;
+
+		memcpy (d, reader->pos, available);
+		reader->pos += available;
+		d += available;
+		n -= available;
+	}
+
+	return 0;
 }
 
 /**
- * state_deserialise_blocked:
+ * state_binary_get:
  *
- * @parent: parent,
- * @json: JSON data representing a blocking array entry,
- * @list: list to add Blocked entry to.
+ * @reader: reader,
+ * @dest: destination for value.
  *
- * Create a single Blocked entry based on data found in JSON and add to
- * @list.
+ * Copy a value the size of @dest from @reader, failing the enclosing
+ * function if there are not enough bytes left.
+ **/
+#define state_binary_get(reader, dest) \
+	if (state_reader_get ((reader), &(dest), sizeof (dest)) < 0) \
+		goto error
+
+/**
+ * state_binary_read:
  *
- * Returns: new Blocked object, or NULL on error.
+ * @reader: reader positioned just after STATE_BINARY_MAGIC,
+ * @error: set to TRUE on error.
+ *
+ * Check the version of the binary encoding and decode the value that
+ * follows it.
+ *
+ * Returns: new JSON value (which is NULL for a JSON null), or NULL with
+ * @error set on error.
  **/
-Blocked *
-state_deserialise_blocked (void *parent, json_object *json,
-		NihList *list)
+static json_object *
+state_binary_read (StateReader *reader, int *error)
 {
-	json_object     *json_blocked_data;
-	Blocked         *blocked = NULL;
-	nih_local char  *blocked_type_str = NULL;
-	BlockedType      blocked_type;
-	int              ret;
+	uint8_t version;
 
-	nih_assert (parent);
-	nih_assert (json);
-	nih_assert (list);
-	nih_assert (control_conns);
+	nih_assert (reader);
+	nih_assert (error);
 
-	if (! state_get_json_string_var_strict (json, "type", NULL, blocked_type_str))
-		goto error;
+	state_binary_get (reader, version);
 
-	blocked_type = blocked_type_str_to_enum (blocked_type_str);
-	if (blocked_type == (BlockedType)-1)
+	if (version != STATE_BINARY_VERSION) {
+		nih_error ("%s",
+				_("Unsupported serialisation data version"));
 		goto error;
+	}
 
-	if (! json_object_object_get_ex (json, "data", &json_blocked_data))
-		goto error;
+	return state_binary_decode (reader, error);
 
-	switch (blocked_type) {
-	case BLOCKED_JOB:
-		{
-			nih_local char  *job_name = NULL;
-			nih_local char  *job_class_name = NULL;
-			Job             *job;
-			Session         *session;
-			int              session_index;
+error:
+	*error = TRUE;
+	return NULL;
+}
 
-			if (! state_get_json_string_var_strict (json_blocked_data,
-						"name", NULL, job_name))
-				goto error;
+/**
+ * state_binary_decode:
+ *
+ * @reader: reader, advanced past the value decoded,
+ * @error: set to TRUE on error.
+ *
+ * Decode a single value, and everything within it, from @reader.
+ *
+ * Returns: new JSON value (which is NULL for a JSON null), or NULL with
+ * @error set on error.
+ **/
+static json_object *
+state_binary_decode (StateReader *reader, int *error)
+{
+	uint8_t       tag;
+	uint32_t      count;
+	json_object  *json = NULL;
 
-			if (! state_get_json_string_var_strict (json_blocked_data,
-						"class", NULL, job_class_name))
-				goto error;
+	nih_assert (reader);
+	nih_assert (error);
 
-			/* On error, assume NULL session since the likelihood
-			 * is we're upgrading from Upstart 1.6 that did not set
-			 * the 'session' JSON object.
-			 */
-			if (! state_get_json_int_var (json_blocked_data, "session", session_index))
-				session_index = 0;
+	state_binary_get (reader, tag);
+
+	switch (tag) {
+	case STATE_BINARY_NULL:
+		return NULL;
+
+	case STATE_BINARY_FALSE:
+	case STATE_BINARY_TRUE:
+		json = json_object_new_boolean (tag == STATE_BINARY_TRUE);
+		break;
 
-			if (session_index < 0)
-				goto error;
+	case STATE_BINARY_INT: {
+		int64_t value;
 
-			session = session_from_index (session_index);
+		state_binary_get (reader, value);
+		json = json_object_new_int64 (value);
+		break;
+	}
 
-			job = job_find (session, NULL, job_class_name, job_name);
-			if (! job)
-				goto error;
+	case STATE_BINARY_DOUBLE: {
+		double value;
 
-			blocked = NIH_MUST (blocked_new (parent, BLOCKED_JOB, job));
-			nih_list_add (list, &blocked->entry);
-		}
+		state_binary_get (reader, value);
+		json = json_object_new_double (value);
 		break;
+	}
 
-	case BLOCKED_EVENT:
-		{
-			Event  *event = NULL;
-			int     event_index = -1;
+	case STATE_BINARY_STRING:
+		state_binary_get (reader, count);
 
-			if (! state_get_json_int_var (json_blocked_data,
-						"index", event_index))
+		/* Avoid a copy when the string has been read in full */
+		if ((size_t)(reader->end - reader->pos) >= count) {
+			json = json_object_new_string_len (reader->pos, count);
+			reader->pos += count;
+		} else {
+			nih_local char *value = NULL;
+
+			value = nih_alloc (NULL, count ? count : 1);
+			if (! value)
 				goto error;
 
-			event = event_from_index (event_index);
-			if (! event)
+			if (state_reader_get (reader, value, count) < 0)
 				goto error;
 
-			blocked = NIH_MUST (blocked_new (parent, BLOCKED_EVENT, event));
-			nih_list_add (list, &blocked->entry);
-			
-			/* Event must already exist and should have
-			 * blockers associated for it to have a blocked
-			 * object pointing at it.
-			 */
-			nih_assert (blocked->event->blockers);
+			json = json_object_new_string_len (value, count);
 		}
 		break;
 
-	default:
+	case STATE_BINARY_ARRAY:
+		state_binary_get (reader, count);
 
-		/* Handle D-Bus types by demarshalling deserialised D-Bus
-		 * message and then setting the D-Bus serial number.
-		 */
-		{
-			DBusMessage     *dbus_msg = NULL;
-			DBusConnection  *dbus_conn = NULL;
-			NihDBusMessage  *nih_dbus_msg = NULL;
-			DBusError        error;
-			dbus_uint32_t    serial = 0;
-			size_t           raw_len;
-			nih_local char  *dbus_message_data_str = NULL;
-			nih_local char  *dbus_message_data_raw = NULL;
-			int              conn_index = -1;
+		json = json_object_new_array ();
+		if (! json)
+			goto error;
 
-			if (! state_get_json_string_var_strict (json_blocked_data,
-						"msg-data",
-						NULL,
-						dbus_message_data_str))
+		for (uint32_t i = 0; i < count; i++) {
+			json_object *value;
+
+			value = state_binary_decode (reader, error);
+			if (*error)
 				goto error;
 
-			if (! state_get_json_int_var (json_blocked_data,
-						"msg-id", serial))
+			if (json_object_array_add (json, value) < 0)
 				goto error;
+		}
+		break;
 
-			ret = state_hex_to_data (NULL,
-					dbus_message_data_str,
-					strlen (dbus_message_data_str),
-					&dbus_message_data_raw,
-					&raw_len);
+	case STATE_BINARY_OBJECT:
+		state_binary_get (reader, count);
 
-			if (ret < 0)
-				goto error;
+		json = json_object_new_object ();
+		if (! json)
+			goto error;
 
-			if (! state_get_json_int_var (json_blocked_data, "msg-connection", conn_index))
-				goto error;
+		for (uint32_t i = 0; i < count; i++) {
+			uint32_t        key_len;
+			nih_local char *key = NULL;
+			json_object    *value;
 
-			dbus_conn = control_conn_from_index (conn_index);
-			if (! dbus_conn)
+			state_binary_get (reader, key_len);
+
+			key = nih_alloc (NULL, (size_t)key_len + 1);
+			if (! key)
 				goto error;
 
-			dbus_error_init (&error);
-			dbus_msg = dbus_message_demarshal (dbus_message_data_raw,
-					(int)raw_len,
-					&error);
-			if (! dbus_msg || dbus_error_is_set (&error)) {
-				nih_error ("%s: %s",
-						_("failed to demarshal D-Bus message"),
-						error.message);
-				dbus_error_free (&error);
+			if (state_reader_get (reader, key, key_len) < 0)
 				goto error;
-			}
+			key[key_len] = '\0';
 
-			dbus_message_set_serial (dbus_msg, serial);
-
-			/* FIXME:
-			 *
-			 * *EITHER*:
-			 *
-			 * a) call nih_dbus_message_new() then *deref*
-			 * both the DBusMessage and the DBusConnection
-			 * (since they've *ALREADY* been refed by the
-			 * pre-re-exec call to nih_dbus_message_new(),
-			 *
-			 * b) Create nih_dbus_message_renew (const void
-			 * *parent, DBusConnection *connection,
-			 * DBusMessage *   message) that creates a
-			 * NihDBusMessage, but does *NOT* ref() the
-			 * msg+connection (again).
-			 */
-			/* FIXME: parent is incorrect?!? */
-			nih_dbus_msg = nih_dbus_message_new (NULL, dbus_conn, dbus_msg);
-			if (! nih_dbus_msg)
+			value = state_binary_decode (reader, error);
+			if (*error)
 				goto error;
 
-			blocked = NIH_MUST (blocked_new (parent, blocked_type, nih_dbus_msg));
-			nih_list_add (list, &blocked->entry);
+			json_object_object_add (json, key, value);
 		}
 		break;
+
+	default:
+		goto error;
 	}
 
-	return blocked;
+	if (! json)
+		goto error;
+
+	return json;
 
 error:
-	if (blocked)
-		nih_free (blocked);
+	if (json)
+		json_object_put (json);
 
+	*error = TRUE;
 	return NULL;
 }
 
+#undef state_binary_get
+
 /**
- * state_deserialise_blocking:
- *
- * @parent: parent,
- * @list: list to add new blocked entries to,
- * @json: JSON representing object containing a blocking entry.
- *
- * Recreate Blocked objects from JSON encoded blocking array and add to
- * specified list.
+ * state_hex_digits:
  *
- * Returns: 0 on success, or -1 on error.
+ * Hex digit for each nibble value, used by state_data_to_hex().
  **/
-int
-state_deserialise_blocking (void *parent, NihList *list, json_object *json)
-{
-	json_object *json_blocking;
-
-	nih_assert (parent);
-	nih_assert (list);
-	nih_assert (json);
-
-	if (! json_object_object_get_ex (json, "blocking", &json_blocking)) {
-		/* parent is not blocking anything */
-		return 0;
-	}
-
-	for (int i = 0; i < json_object_array_length (json_blocking); i++) {
-		json_object * json_blocked;
-
-		json_blocked = json_object_array_get_idx (json_blocking, i);
-		if (! json_blocked)
-			goto error;
-
-		/* Don't error in this scenario to allow for possibility
-		 * that version of Upstart that performed the
-		 * serialisation did not correctly handle user and
-		 * chroot jobs.
-		 */
-		if (! state_deserialise_blocked (parent, json_blocked, list))
-			;
-	}
-
-	return 0;
+static const char state_hex_digits[16] = "0123456789abcdef";
 
-error:
-	return -1;
-}
+/**
+ * state_hex_values:
+ *
+ * One more than the nibble value of each hex digit character, or zero
+ * for characters that are not hex digits, used by state_hex_to_data().
+ **/
+static const uint8_t state_hex_values[256] = {
+	['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,
+	['4'] = 5,  ['5'] = 6,  ['6'] = 7,  ['7'] = 8,
+	['8'] = 9,  ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
 
 /**
  * state_data_to_hex:
@@ -1853,33 +3324,38 @@ error:
  *
  * Convert @data to a hex-encoded string.
  *
+ * The string is allocated once at its final size and filled from a
+ * lookup table, so this takes time linear in @len.
+ *
  * Returns: newly-allocated hex-encoded string,
  * or NULL on error.
  **/
 char *
 state_data_to_hex (void *parent, const void *data, size_t len)
 {
-	unsigned char  *p;
-	char           *encoded = NULL;
-	size_t          i;
+	const unsigned char  *p;
+	char                 *encoded;
+	char                 *e;
 
 	nih_assert (data);
 	nih_assert (len);
 
-	for (i = 0, p = (unsigned char *)data;
-			i < len;
-			i++, p++) {
-		if (! nih_strcat_sprintf (&encoded, parent, "%02x", *p))
-			goto error;
-	}
+	encoded = nih_alloc (parent, (len * 2) + 1);
+	if (! encoded)
+		return NULL;
 
-	return encoded;
+	p = (const unsigned char *)data;
+	e = encoded;
 
-error:
-	if (encoded)
-		nih_free (encoded);
+	for (size_t i = 0; i < len; i++) {
+		e[0] = state_hex_digits[p[i] >> 4];
+		e[1] = state_hex_digits[p[i] & 0x0f];
+		e += 2;
+	}
 
-	return NULL;
+	*e = '\0';
+
+	return encoded;
 }
 
 /**
@@ -1894,6 +3370,9 @@ error:
  * Convert hex-encoded data @hex back into its
  * natural representation.
  *
+ * Upper and lower case digits are accepted; any other character is an
+ * error.
+ *
  * Returns: 0 on success, -1 on error.
  **/
 int
@@ -1903,10 +3382,10 @@ state_hex_to_data (void      *parent,
 		char        **data,
 		size_t       *data_len)
 {
-	char    *p;
-	char    *d;
-	char    *decoded;
-	size_t   new_len;
+	const unsigned char  *p;
+	unsigned char        *d;
+	size_t                new_len;
+	unsigned int          invalid = 0;
 
 	nih_assert (hex_data);
 	nih_assert (hex_len);
@@ -1916,44 +3395,289 @@ state_hex_to_data (void      *parent,
 
 	new_len = hex_len / 2;
 
-	*data = decoded = nih_alloc (parent, new_len);
-	if (! decoded)
-		return 0;
+	*data = nih_alloc (parent, new_len);
+	if (! *data)
+		return -1;
+
+	p = (const unsigned char *)hex_data;
+	d = (unsigned char *)*data;
+
+	/* Check validity once at the end rather than branching on every
+	 * byte, keeping the loop body straight-line code.
+	 */
+	for (size_t i = 0; i < new_len; i++) {
+		unsigned int high = state_hex_values[p[0]];
+		unsigned int low = state_hex_values[p[1]];
+
+		invalid |= (! high) | (! low);
 
-	memset (decoded, '\0', new_len);
+		d[i] = (unsigned char)((((high - 1) & 0x0f) << 4)
+				       | ((low - 1) & 0x0f));
+		p += 2;
+	}
 
-	d = (char *)decoded;
+	if (invalid) {
+		nih_free (*data);
+		*data = NULL;
+		return -1;
+	}
 
-	for (size_t i = 0; i < hex_len; i += 2, d++) {
-		char   byte;
-		char   str[3] = { '\0' };
-		char  *endptr;
+	*data_len = new_len;
 
-		p = ((char *)hex_data)+i;
+	return 0;
+}
 
-		str[0] = *p;
-		str[1] = *(p+1);
+/**
+ * state_index_begin:
+ *
+ * Allow state_index() to build index tables of the lists referred to by
+ * position in the serialised state, so that each reference costs a
+ * constant time lookup rather than a walk of the list.
+ *
+ * The lists must not change between the first lookup of each and the
+ * following call to state_index_end().
+ **/
+void
+state_index_begin (void)
+{
+	state_index_end ();
 
-		errno = 0;
-		byte = strtol (str, &endptr, 16);
+	state_indexing = TRUE;
+}
 
-		if (errno || *endptr)
-			goto error;
+/**
+ * state_index_end:
+ *
+ * Discard any index tables built since state_index_begin(); lookups
+ * fall back to walking the lists.
+ **/
+void
+state_index_end (void)
+{
+	for (int i = 0; i < STATE_INDEX_LAST; i++) {
+		if (state_indexes[i]) {
+			nih_free (state_indexes[i]);
+			state_indexes[i] = NULL;
+		}
+	}
+
+	state_indexing = FALSE;
+}
+
+/**
+ * state_index:
+ * @type: list to obtain index table for.
+ *
+ * Obtain the index table for the list @type, building it if this is the
+ * first call since state_index_begin().
+ *
+ * Returns: index table, or NULL if not between state_index_begin() and
+ * state_index_end().
+ **/
+StateIndex *
+state_index (StateIndexType type)
+{
+	nih_assert (type < STATE_INDEX_LAST);
+
+	if (! state_indexing)
+		return NULL;
+
+	if (! state_indexes[type])
+		state_indexes[type] = state_index_build (type);
 
-		*d = byte;
+	return state_indexes[type];
+}
+
+/**
+ * state_index_build:
+ * @type: list to build index table for.
+ *
+ * Build an index table of the current contents of the list @type.
+ *
+ * Returns: newly allocated index table.
+ **/
+static StateIndex *
+state_index_build (StateIndexType type)
+{
+	StateIndex *index;
+	NihList    *list = NULL;
+	size_t      count = 0;
+
+	switch (type) {
+	case STATE_INDEX_SESSIONS:
+		session_init ();
+		list = sessions;
+		break;
+	case STATE_INDEX_EVENTS:
+		event_init ();
+		list = events;
+		break;
+	case STATE_INDEX_CONF_SOURCES:
+		conf_init ();
+		list = conf_sources;
+		break;
+	case STATE_INDEX_CONTROL_CONNS:
+		control_init ();
+		list = control_conns;
+		break;
+	default:
+		nih_assert_not_reached ();
 	}
 
-	*data_len = (size_t)(d - decoded);
+	NIH_LIST_FOREACH (list, iter)
+		count++;
 
-	nih_assert (*data_len == new_len);
+	index = state_index_new (NULL, count);
 
-	return 0;
+	NIH_LIST_FOREACH (list, iter) {
+		if (type == STATE_INDEX_CONTROL_CONNS) {
+			NihListEntry *entry = (NihListEntry *)iter;
+
+			state_index_add (index, entry->data);
+		} else {
+			state_index_add (index, iter);
+		}
+	}
+
+	return index;
+}
+
+/**
+ * state_index_new:
+ * @parent: parent object for new index table,
+ * @count: number of objects to be added.
+ *
+ * Allocates an empty index table with room for @count objects, which
+ * are then added in order with state_index_add().
+ *
+ * If @parent is not NULL, it should be a pointer to another object
+ * which will be used as a parent for the returned table.  When all
+ * parents of the returned table are freed, the returned table will also
+ * be freed.
+ *
+ * Returns: newly allocated StateIndex.
+ **/
+StateIndex *
+state_index_new (const void *parent,
+		 size_t      count)
+{
+	StateIndex *index;
+
+	index = NIH_MUST (nih_new (parent, StateIndex));
+
+	index->count = 0;
+
+	/* Keep the hash table at most half full so that probe
+	 * sequences stay short.
+	 */
+	index->size = 8;
+	while (index->size < count * 2)
+		index->size <<= 1;
+
+	index->items = NIH_MUST (nih_alloc (index, sizeof (const void *)
+					    * (count ? count : 1)));
+	index->slots = NIH_MUST (nih_alloc (index, sizeof (size_t)
+					    * index->size));
+	memset (index->slots, 0, sizeof (size_t) * index->size);
+
+	return index;
+}
+
+/**
+ * state_index_slot:
+ * @index: index table,
+ * @item: object.
+ *
+ * Returns: first slot in the hash table of @index to probe for @item.
+ **/
+static inline size_t
+state_index_slot (const StateIndex *index,
+		  const void       *item)
+{
+	uintptr_t hash = (uintptr_t)item;
+
+	hash ^= hash >> 17;
+	hash *= 0x9e3779b1U;
+	hash ^= hash >> 15;
+
+	return hash & (index->size - 1);
+}
+
+/**
+ * state_index_add:
+ * @index: index table,
+ * @item: object to add.
+ *
+ * Adds @item to @index at the next position; @index must have been
+ * allocated with room for it.
+ **/
+void
+state_index_add (StateIndex *index,
+		 const void *item)
+{
+	size_t slot;
+
+	nih_assert (index);
+	nih_assert (item);
+	nih_assert (index->count * 2 < index->size);
+
+	index->items[index->count] = item;
+
+	slot = state_index_slot (index, item);
+	while (index->slots[slot])
+		slot = (slot + 1) & (index->size - 1);
+
+	index->slots[slot] = ++index->count;
+}
+
+/**
+ * state_index_find:
+ * @index: index table,
+ * @item: object to look for.
+ *
+ * Returns: position of @item in @index, or -1 if not present.
+ **/
+ssize_t
+state_index_find (const StateIndex *index,
+		  const void       *item)
+{
+	size_t slot;
+
+	nih_assert (index);
+	nih_assert (item);
+
+	slot = state_index_slot (index, item);
+	while (index->slots[slot]) {
+		size_t i = index->slots[slot] - 1;
+
+		if (index->items[i] == item)
+			return i;
+
+		slot = (slot + 1) & (index->size - 1);
+	}
 
-error:
-	nih_free (*data);
 	return -1;
 }
 
+/**
+ * state_index_get:
+ * @index: index table,
+ * @idx: position.
+ *
+ * Returns: object at position @idx in @index, or NULL if out of range.
+ **/
+const void *
+state_index_get (const StateIndex *index,
+		 size_t            idx)
+{
+	nih_assert (index);
+
+	if (idx >= index->count)
+		return NULL;
+
+	return index->items[idx];
+}
+
 /**
  * perform_reexec:
  *
@@ -2033,17 +3757,20 @@ perform_reexec (void)
  * pipe and then forking. The child then writes its serialised state
  * over the pipe back to PID 1 which has now re-exec'd itself.
  *
+ * Since the state is only generated in the child, the child first
+ * serialises it without keeping the output and acknowledges that it
+ * could do so over a second pipe; if it cannot, PID 1 falls back to a
+ * stateless re-exec before anything has been torn down.
+ *
  * Once the state has been passed, the child can exit.
  **/
 void
 stateful_reexec (void)
 {
 	int             fds[2] = { -1, -1 };
+	int             ack_fds[2] = { -1, -1 };
 	pid_t           pid;
 	sigset_t        mask, oldmask;
-	nih_local char *state_data = NULL;
-	size_t          len;
-
 
 	/* Block signals while we work.  We're the last signal handler
 	 * installed so this should mean that they're all handled now.
@@ -2054,18 +3781,27 @@ stateful_reexec (void)
 	sigfillset (&mask);
 	sigprocmask (SIG_BLOCK, &mask, &oldmask);
 
-	if (state_to_string (&state_data, &len) < 0) {
-		nih_error ("%s - %s",
-				_("Failed to generate serialisation data"),
-				_("reverting to stateless re-exec"));
+	if (pipe (fds) < 0)
 		goto reexec;
-	}
 
-	if (pipe (fds) < 0)
+	if (pipe2 (ack_fds, O_CLOEXEC) < 0) {
+		close (fds[0]);
+		close (fds[1]);
 		goto reexec;
+	}
 
 	nih_info (_("Performing stateful re-exec"));
 
+	/* Bulk data can be passed in file descriptors unless the state
+	 * must be self-contained to be written to a file.
+	 */
+	state_pass_fds = ! state_text_required ();
+
+	/* Changes to configuration waiting to be coalesced would not
+	 * otherwise be seen by the new instance.
+	 */
+	conf_flush_pending ();
+
 	/* retain the D-Bus connection across the re-exec */
 	control_prepare_reexec ();
 
@@ -2074,17 +3810,36 @@ stateful_reexec (void)
 
 	pid = fork ();
 
-	if (pid < 0)
+	if (pid < 0) {
+		job_class_cancel_reexec ();
 		goto reexec;
-	else if (pid > 0) {
+	} else if (pid > 0) {
 		nih_local char *arg = NULL;
+		char            ack;
+		ssize_t         ret;
 
 		/* Parent */
 		close (fds[1]);
+		close (ack_fds[1]);
 
 		/* Tidy up from any previous re-exec */
 		clean_args (&args_copy);
 
+		/* Wait for the child to confirm it can generate the state */
+		while (((ret = read (ack_fds[0], &ack, 1)) < 0)
+		       && (errno == EINTR))
+			;
+		close (ack_fds[0]);
+
+		if (ret != 1) {
+			nih_error ("%s - %s",
+					_("Failed to generate serialisation data"),
+					_("reverting to stateless re-exec"));
+			close (fds[0]);
+			job_class_cancel_reexec ();
+			goto reexec;
+		}
+
 		/* Tell the new instance where to read the
 		 * serialisation data from.
 		 *
@@ -2101,8 +3856,28 @@ stateful_reexec (void)
 		arg = NIH_MUST (nih_sprintf (NULL, "%d", fds[0]));
 		NIH_MUST (nih_str_array_add (&args_copy, NULL, NULL, arg));
 	} else {
+		int null_fd;
+
 		/* Child */
 		close (fds[0]);
+		close (ack_fds[0]);
+
+		/* Check the state can be generated before giving anything
+		 * up, throwing away the output.
+		 */
+		null_fd = open ("/dev/null", O_WRONLY | O_CLOEXEC);
+		if ((null_fd < 0) || (state_write_objects (null_fd) < 0)) {
+			nih_error ("%s",
+				_("Failed to generate serialisation data"));
+			exit (1);
+		}
+		close (null_fd);
+
+		while (write (ack_fds[1], "", 1) < 0) {
+			if (errno != EINTR)
+				exit (1);
+		}
+		close (ack_fds[1]);
 
 		nih_info (_("Passing state from PID %d to parent"), (int)getpid ());
 
@@ -2120,7 +3895,11 @@ stateful_reexec (void)
 
 		control_server_close ();
 
-		if (state_write (fds[1], state_data, len) < 0) {
+		/* The state is serialised here rather than in the parent
+		 * so that it is written out as it is generated without
+		 * adding to the memory used by PID 1.
+		 */
+		if (state_write (fds[1]) < 0) {
 			nih_error ("%s",
 				_("Failed to write serialisation data"));
 			exit (1);
@@ -2142,6 +3921,7 @@ reexec:
 	 */
 
 	/* Restore */
+	state_pass_fds = FALSE;
 	sigprocmask (SIG_SETMASK, &oldmask, NULL);
 }
 
@@ -64,6 +64,14 @@
  *   into an array of Process objects which are then hooked onto a
  *   JobClass object).
  *
+ * == Encoding ==
+ *
+ * The JSON representation is passed to the new instance in a compact
+ * binary encoding (see state_json_to_binary()) which avoids formatting
+ * and tokenising text; the new instance accepts either this or JSON
+ * text, which is still used when a state file is requested and by the
+ * GetState method for debugging.
+ *
  * == Error Handling ==
  *
  * If stateful re-exec fails, Upstart must perform a stateless reexec:
@@ -372,6 +380,96 @@
  **/
 #define STATE_FILE "upstart.state"
 
+/**
+ * STATE_BINARY_MAGIC:
+ *
+ * Bytes at the start of serialisation data in the binary encoding,
+ * which can never begin JSON text.
+ **/
+#define STATE_BINARY_MAGIC "\0UPSTATE"
+
+/**
+ * STATE_BINARY_MAGIC_LEN:
+ *
+ * Length of STATE_BINARY_MAGIC.
+ **/
+#define STATE_BINARY_MAGIC_LEN 8
+
+/**
+ * STATE_BINARY_VERSION:
+ *
+ * Version of the binary encoding, following STATE_BINARY_MAGIC; bump
+ * whenever the layout of encoded values changes.
+ **/
+#define STATE_BINARY_VERSION 1
+
+/**
+ * StateBinaryTag:
+ *
+ * Type of each value in the binary encoding, stored as a single byte
+ * before it.  Values are stored in host byte order, strings, arrays and
+ * objects being preceded by a 32-bit length or count.
+ **/
+typedef enum state_binary_tag {
+	STATE_BINARY_NULL,
+	STATE_BINARY_FALSE,
+	STATE_BINARY_TRUE,
+	STATE_BINARY_INT,
+	STATE_BINARY_DOUBLE,
+	STATE_BINARY_STRING,
+	STATE_BINARY_ARRAY,
+	STATE_BINARY_OBJECT,
+} StateBinaryTag;
+
+/**
+ * STATE_STREAM_CHUNK:
+ *
+ * Size in bytes of the chunks in which serialisation data is written
+ * to and read from the state file descriptor.
+ **/
+#define STATE_STREAM_CHUNK 65536
+
+/**
+ * StateStream:
+ * @fd: file descriptor data is written to,
+ * @binary: TRUE to write the binary encoding, FALSE for JSON text,
+ * @separate: TRUE if the next key or value must be preceded by a
+ * separator in JSON text,
+ * @buf: data not yet written to @fd,
+ * @len: length of @buf,
+ * @size: allocated size of @buf.
+ *
+ * Serialisation data being written to @fd a piece at a time, flushed
+ * whenever @len reaches STATE_STREAM_CHUNK.
+ **/
+typedef struct state_stream {
+	int     fd;
+	int     binary;
+	int     separate;
+	char   *buf;
+	size_t  len;
+	size_t  size;
+} StateStream;
+
+/**
+ * StateReader:
+ * @fd: file descriptor data is read from, or -1 if all data is already
+ * in memory,
+ * @buf: buffer of STATE_STREAM_CHUNK bytes that data from @fd is read
+ * into,
+ * @pos: next byte to be decoded,
+ * @end: end of data read so far.
+ *
+ * Serialisation data being decoded either from memory or from @fd a
+ * chunk at a time.
+ **/
+typedef struct state_reader {
+	int          fd;
+	char        *buf;
+	const char  *pos;
+	const char  *end;
+} StateReader;
+
 /**
  * state_get_timeout:
  *
@@ -1102,6 +1200,38 @@
 	 ? state_deserialise_int32_array (parent, json, (int32_t **)array, len) \
 	 : state_deserialise_int64_array (parent, json, (int64_t **)array, len))
 
+/**
+ * StateIndexType:
+ *
+ * Lists whose objects are referred to by position in the serialised
+ * state, and for which state_index() can provide an index table.
+ **/
+typedef enum state_index_type {
+	STATE_INDEX_SESSIONS,
+	STATE_INDEX_EVENTS,
+	STATE_INDEX_CONF_SOURCES,
+	STATE_INDEX_CONTROL_CONNS,
+	STATE_INDEX_LAST,
+} StateIndexType;
+
+/**
+ * StateIndex:
+ * @items: objects in list order,
+ * @count: number of entries in @items,
+ * @size: number of entries in @slots, a power of two,
+ * @slots: open-addressed hash table of @items by address, each entry
+ * holding one more than the index of an object or zero if empty.
+ *
+ * Index table mapping between objects in a list and their position in
+ * it, in constant time in both directions.
+ **/
+typedef struct state_index {
+	const void **items;
+	size_t       count;
+	size_t       size;
+	size_t      *slots;
+} StateIndex;
+
 NIH_BEGIN_EXTERN
 
 /**
@@ -1129,13 +1259,13 @@ typedef int (*EnumDeserialiser) (const char *name);
 int  state_read          (int fd)
 	__attribute__ ((warn_unused_result));
 
-int  state_write         (int fd, const char *state_data, size_t len)
+int  state_write         (int fd)
 	__attribute__ ((warn_unused_result));
 
 int  state_read_objects  (int fd)
 	__attribute__ ((warn_unused_result));
 
-int  state_write_objects (int fd, const char *state_data, size_t len)
+int  state_write_objects (int fd)
 	__attribute__ ((warn_unused_result));
 
 int  state_to_string (char **json_string, size_t *len)
@@ -1144,6 +1274,19 @@ int  state_to_string (char **json_string, size_t *len)
 int    state_from_string (const char *state)
 	__attribute__ ((warn_unused_result));
 
+int  state_to_data (char **data, size_t *len)
+	__attribute__ ((warn_unused_result));
+
+int  state_from_data (const char *data, size_t len)
+	__attribute__ ((warn_unused_result));
+
+char *state_json_to_binary (const void *parent, json_object *json,
+			    size_t *len)
+	__attribute__ ((warn_unused_result));
+
+json_object *state_binary_to_json (const char *data, size_t len)
+	__attribute__ ((warn_unused_result));
+
 int    state_modify_cloexec (int fd, int set);
 
 json_object *
@@ -1225,6 +1368,20 @@ int state_get_version (void)
 
 extern char **args_copy;
 extern int restart;
+extern int state_pass_fds;
+
+void        state_index_begin (void);
+void        state_index_end   (void);
+
+StateIndex *state_index       (StateIndexType type)
+	__attribute__ ((warn_unused_result));
+StateIndex *state_index_new   (const void *parent, size_t count)
+	__attribute__ ((warn_unused_result));
+void        state_index_add   (StateIndex *index, const void *item);
+ssize_t     state_index_find  (const StateIndex *index, const void *item)
+	__attribute__ ((warn_unused_result));
+const void *state_index_get   (const StateIndex *index, size_t idx)
+	__attribute__ ((warn_unused_result));
 
 void perform_reexec  (void);
 void stateful_reexec (void);
@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <limits.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <nih/macros.h>
@@ -45,12 +46,16 @@
 #include "job_class.h"
 #include "job.h"
 #include "conf.h"
+#include "conf_cache.h"
+#include "errors.h"
 #include "event.h"
 #include "job_process.h"
 #include "blocked.h"
 #include "test_util.h"
 #include "test_util_common.h"
 
+extern int default_console;
+
 /**
  * JOB_STOP_SECONDS:
  *
@@ -5101,22 +5106,1047 @@ test_select_job (void)
 }
 
 
-int
-main (int   argc,
-      char *argv[])
+void
+test_cache (void)
 {
-	/* run tests in legacy (pre-session support) mode */
-	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+	ConfSource *source;
+	ConfFile   *file;
+	JobClass   *job;
+	FILE       *f;
+	char        dirname[PATH_MAX], filename[PATH_MAX];
+	char        cachename[PATH_MAX];
+	char        cachedir[PATH_MAX], savename[PATH_MAX];
+	struct stat statbuf;
+	ConfReloadSummary summary;
 
-	test_source_new ();
-	test_file_new ();
-	test_source_reload_job_dir ();
-	test_source_reload_conf_dir ();
-	test_source_reload_file ();
-	test_source_reload ();
-	test_override ();
-	test_file_destroy ();
-	test_select_job ();
+	TEST_FUNCTION_FEATURE ("conf_reload", "with configuration cache");
+	program_name = "test";
+	nih_log_set_priority (NIH_LOG_FATAL);
+
+	conf_init ();
+	job_class_init ();
+
+	TEST_FILENAME (dirname);
+	mkdir (dirname, 0755);
+
+	TEST_FILENAME (cachename);
+	conf_cache_file = cachename;
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo.conf");
+
+	f = fopen (filename, "w");
+	fprintf (f, "description \"cached\"\n");
+	fprintf (f, "start on startup\n");
+	fprintf (f, "exec /sbin/daemon\n");
+	fclose (f);
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+
+
+	/* Check that a job is parsed when there is no cache, and that the
+	 * cache is written afterwards and not kept in memory.
+	 */
+	TEST_FEATURE ("with no cache");
+	conf_reload ();
+
+	TEST_EQ (conf_cache_hits, 0);
+	TEST_EQ (conf_cache_misses, 1);
+	TEST_EQ_P (conf_cache, NULL);
+	TEST_EQ (stat (cachename, &statbuf), 0);
+	TEST_EQ (statbuf.st_mode & 0777, 0600);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+	TEST_EQ_STR (file->job->description, "cached");
+
+
+	/* Check that an unchanged job is loaded from the cache, and that
+	 * the result is the same as parsing it.
+	 */
+	TEST_FEATURE ("with unchanged job");
+	conf_reload ();
+
+	TEST_EQ (conf_cache_hits, 1);
+	TEST_EQ (conf_cache_misses, 0);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+
+	job = file->job;
+	TEST_NE_P (job, NULL);
+	TEST_EQ_P (job_class_get_registered ("foo", NULL), job);
+	TEST_EQ_STR (job->name, "foo");
+	TEST_EQ_P (job->session, NULL);
+	TEST_EQ_STR (job->description, "cached");
+
+	TEST_NE_P (job->start_on, NULL);
+	TEST_EQ (job->start_on->type, EVENT_MATCH);
+	TEST_EQ_STR (job->start_on->name, "startup");
+
+	TEST_NE_P (job->process[PROCESS_MAIN], NULL);
+	TEST_EQ_STR (job->process[PROCESS_MAIN]->command, "/sbin/daemon");
+
+
+	/* Check that a modified job is parsed again rather than loaded
+	 * from the cache.
+	 */
+	TEST_FEATURE ("with modified job");
+	f = fopen (filename, "w");
+	fprintf (f, "description \"modified\"\n");
+	fprintf (f, "exec /sbin/daemon\n");
+	fclose (f);
+
+	conf_reload ();
+
+	TEST_EQ (conf_cache_hits, 0);
+	TEST_EQ (conf_cache_misses, 1);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+	TEST_EQ_STR (file->job->description, "modified");
+	TEST_EQ_P (file->job->start_on, NULL);
+
+
+	/* Check that an invalid cache is ignored and replaced. */
+	TEST_FEATURE ("with invalid cache");
+	f = fopen (cachename, "w");
+	fprintf (f, "not a cache\n");
+	fclose (f);
+
+	conf_reload ();
+
+	TEST_EQ (conf_cache_hits, 0);
+	TEST_EQ (conf_cache_misses, 1);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+	TEST_EQ_STR (file->job->description, "modified");
+
+	conf_reload ();
+
+	TEST_EQ (conf_cache_hits, 1);
+	TEST_EQ (conf_cache_misses, 0);
+
+
+	/* Check that a cache written with a different default console is
+	 * discarded, since the jobs parsed from it would differ.
+	 */
+	TEST_FEATURE ("with different default console");
+	default_console = CONSOLE_NONE;
+
+	conf_reload ();
+
+	TEST_EQ (conf_cache_hits, 0);
+	TEST_EQ (conf_cache_misses, 1);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+	TEST_EQ (file->job->console, CONSOLE_NONE);
+
+	default_console = -1;
+
+	conf_reload ();
+
+	TEST_EQ (conf_cache_hits, 0);
+	TEST_EQ (conf_cache_misses, 1);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+	TEST_EQ (file->job->console, CONSOLE_LOG);
+
+
+	/* Check that a cache which cannot be saved is kept in memory, and
+	 * saved with its entries for unchanged files by a later reload of
+	 * only changed files.
+	 */
+	TEST_FEATURE ("with cache saved by changed reload");
+	TEST_FILENAME (cachedir);
+
+	strcpy (savename, cachedir);
+	strcat (savename, "/init.cache");
+
+	conf_cache_file = savename;
+
+	conf_reload ();
+
+	TEST_EQ (conf_cache_hits, 0);
+	TEST_EQ (conf_cache_misses, 1);
+	TEST_NE_P (conf_cache, NULL);
+
+	mkdir (cachedir, 0755);
+
+	conf_reload_changed (&summary);
+
+	TEST_EQ_P (conf_cache, NULL);
+	TEST_EQ (stat (savename, &statbuf), 0);
+
+	conf_reload ();
+
+	TEST_EQ (conf_cache_hits, 1);
+	TEST_EQ (conf_cache_misses, 0);
+
+	conf_cache_file = cachename;
+	unlink (savename);
+	rmdir (cachedir);
+
+
+	/* Check that a deleted job is dropped from the cache. */
+	TEST_FEATURE ("with deleted job");
+	unlink (filename);
+
+	conf_reload ();
+
+	TEST_EQ (conf_cache_hits, 0);
+	TEST_EQ (conf_cache_misses, 0);
+	TEST_EQ_P (nih_hash_lookup (source->files, filename), NULL);
+
+	TEST_EQ (conf_cache_load (), 0);
+	TEST_HASH_EMPTY (conf_cache);
+	conf_cache_free ();
+
+
+	nih_free (source);
+
+	conf_cache_file = NULL;
+	unlink (cachename);
+	rmdir (dirname);
+
+	nih_log_set_priority (NIH_LOG_MESSAGE);
+}
+
+
+/**
+ * write_parallel_jobs:
+ * @dirname: directory to write job configuration files in.
+ *
+ * Fills @dirname with 64 job configuration files for test_parallel()
+ * and test_benchmark_parallel(), named job00.conf to job63.conf.
+ **/
+static void
+write_parallel_jobs (const char *dirname)
+{
+	char  filename[PATH_MAX];
+	FILE *f;
+
+	for (int i = 0; i < 64; i++) {
+		sprintf (filename, "%s/job%02d.conf", dirname, i);
+
+		f = fopen (filename, "w");
+		fprintf (f, "description \"job %d\"\n", i);
+		fprintf (f, "start on startup or job-%d\n", i);
+		fprintf (f, "env FOO=%d\n", i);
+		fprintf (f, "script\n");
+		fprintf (f, "  echo %d\n", i);
+		fprintf (f, "end script\n");
+		fclose (f);
+	}
+}
+
+/**
+ * remove_parallel_jobs:
+ * @dirname: directory written by write_parallel_jobs().
+ *
+ * Removes the files written by write_parallel_jobs() and @dirname.
+ **/
+static void
+remove_parallel_jobs (const char *dirname)
+{
+	char filename[PATH_MAX];
+
+	for (int i = 0; i < 64; i++) {
+		sprintf (filename, "%s/job%02d.conf", dirname, i);
+		unlink (filename);
+	}
+
+	rmdir (dirname);
+}
+
+void
+test_parallel (void)
+{
+	ConfSource     *source;
+	ConfFile       *file;
+	FILE           *f;
+	char            dirname[PATH_MAX], filename[PATH_MAX];
+	char            description[32];
+	int             workers;
+
+	TEST_FUNCTION_FEATURE ("conf_reload", "with parallel parsing");
+	program_name = "test";
+	nih_log_set_priority (NIH_LOG_FATAL);
+
+	conf_init ();
+	job_class_init ();
+
+	workers = conf_parse_workers;
+	conf_parse_workers = 4;
+
+	TEST_FILENAME (dirname);
+	mkdir (dirname, 0755);
+
+	write_parallel_jobs (dirname);
+
+	/* A file that cannot be parsed is left to init */
+	sprintf (filename, "%s/bad.conf", dirname);
+
+	f = fopen (filename, "w");
+	fprintf (f, "start on (startup\n");
+	fclose (f);
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+
+
+	/* Check that jobs parsed in parallel are registered with the same
+	 * definitions as if they had been parsed by init, and that every
+	 * job was taken from a worker rather than parsed again by init;
+	 * without a cache file, nothing else can have filled the cache.
+	 */
+	TEST_FEATURE ("with many jobs");
+	conf_reload ();
+
+	TEST_EQ_P (conf_cache, NULL);
+	TEST_EQ (conf_cache_hits, 64);
+	TEST_EQ (conf_cache_misses, 0);
+
+	for (int i = 0; i < 64; i++) {
+		JobClass *job;
+
+		sprintf (filename, "%s/job%02d.conf", dirname, i);
+		sprintf (description, "job %d", i);
+
+		file = (ConfFile *)nih_hash_lookup (source->files, filename);
+		TEST_NE_P (file, NULL);
+
+		job = file->job;
+		TEST_NE_P (job, NULL);
+		TEST_EQ_P (job_class_get_registered (job->name, NULL), job);
+		TEST_EQ_STR (job->description, description);
+
+		TEST_NE_P (job->start_on, NULL);
+		TEST_EQ (job->start_on->type, EVENT_OR);
+
+		TEST_NE_P (job->env, NULL);
+		TEST_NE_P (job->env[0], NULL);
+		TEST_EQ_P (job->env[1], NULL);
+
+		TEST_NE_P (job->process[PROCESS_MAIN], NULL);
+		TEST_TRUE (job->process[PROCESS_MAIN]->script);
+	}
+
+	sprintf (filename, "%s/bad.conf", dirname);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_EQ_P (file->job, NULL);
+
+
+	/* Check that without workers, every job is parsed by init. */
+	TEST_FEATURE ("without workers");
+	conf_parse_workers = 0;
+
+	conf_reload ();
+
+	TEST_EQ (conf_cache_hits, 0);
+	TEST_HASH_NOT_EMPTY (source->files);
+
+
+	nih_free (source);
+
+	sprintf (filename, "%s/bad.conf", dirname);
+	unlink (filename);
+
+	remove_parallel_jobs (dirname);
+
+	conf_parse_workers = workers;
+
+	nih_log_set_priority (NIH_LOG_MESSAGE);
+}
+
+
+/**
+ * test_benchmark_parallel:
+ *
+ * Compare the time taken by conf_reload() to load 64 jobs parsed by
+ * four worker processes and by init itself.
+ **/
+void
+test_benchmark_parallel (void)
+{
+	ConfSource      *source;
+	char             dirname[PATH_MAX];
+	struct timespec  start, end;
+	int              workers;
+
+	TEST_GROUP ("parallel parsing benchmark");
+	program_name = "test";
+	nih_log_set_priority (NIH_LOG_FATAL);
+
+	conf_init ();
+	job_class_init ();
+
+	workers = conf_parse_workers;
+
+	TEST_FILENAME (dirname);
+	mkdir (dirname, 0755);
+
+	write_parallel_jobs (dirname);
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+
+	TEST_FEATURE ("64 jobs");
+	for (int pass = 0; pass < 2; pass++) {
+		conf_parse_workers = pass ? 0 : 4;
+
+		assert0 (clock_gettime (CLOCK_MONOTONIC, &start));
+		conf_reload ();
+		assert0 (clock_gettime (CLOCK_MONOTONIC, &end));
+
+		TEST_HASH_NOT_EMPTY (source->files);
+
+		if (pass) {
+			printf ("\tinit only: %.3f ms\n",
+				(end.tv_sec - start.tv_sec) * 1000.0
+				+ (end.tv_nsec - start.tv_nsec) / 1000000.0);
+		} else {
+			printf ("\t%d processes: %.3f ms\n", conf_parse_workers,
+				(end.tv_sec - start.tv_sec) * 1000.0
+				+ (end.tv_nsec - start.tv_nsec) / 1000000.0);
+		}
+	}
+
+	nih_free (source);
+
+	remove_parallel_jobs (dirname);
+
+	conf_parse_workers = workers;
+
+	nih_log_set_priority (NIH_LOG_MESSAGE);
+}
+
+
+void
+test_reload_changed (void)
+{
+	ConfSource        *source;
+	ConfFile          *file;
+	JobClass          *job;
+	ConfReloadSummary  summary;
+	FILE              *f;
+	char               dirname[PATH_MAX], filename[PATH_MAX];
+	char               override[PATH_MAX], tmpname[PATH_MAX];
+	int                fd;
+
+	TEST_FUNCTION ("conf_reload_changed");
+	program_name = "test";
+	nih_log_set_priority (NIH_LOG_FATAL);
+
+	/* Unwatched sources are always reloaded in full */
+	if ((fd = inotify_init ()) < 0) {
+		printf ("SKIP: inotify not available\n");
+		nih_log_set_priority (NIH_LOG_MESSAGE);
+		return;
+	}
+	close (fd);
+
+	conf_init ();
+	job_class_init ();
+
+	TEST_FILENAME (dirname);
+	mkdir (dirname, 0755);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo.conf");
+
+	f = fopen (filename, "w");
+	fprintf (f, "description \"foo\"\n");
+	fprintf (f, "exec /sbin/daemon\n");
+	fclose (f);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/bar.conf");
+
+	f = fopen (filename, "w");
+	fprintf (f, "exec /sbin/bar\n");
+	fclose (f);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo.conf");
+
+	strcpy (override, dirname);
+	strcat (override, "/foo.override");
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+
+
+	/* Check that a new source is loaded in full, with every file
+	 * counted as added, and that a watch is established on it.
+	 */
+	TEST_FEATURE ("with new source");
+	conf_reload_changed (&summary);
+
+	TEST_EQ (summary.added, 2);
+	TEST_EQ (summary.modified, 0);
+	TEST_EQ (summary.removed, 0);
+	TEST_EQ (summary.unchanged, 0);
+
+	TEST_NE_P (source->watch, NULL);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+
+	job = file->job;
+
+
+	/* Check that when nothing has changed, no file is parsed again
+	 * and the existing job is kept.
+	 */
+	TEST_FEATURE ("with no changes");
+	conf_reload_changed (&summary);
+
+	TEST_EQ (summary.added, 0);
+	TEST_EQ (summary.modified, 0);
+	TEST_EQ (summary.removed, 0);
+	TEST_EQ (summary.unchanged, 2);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_EQ_P (file->job, job);
+	TEST_EQ_P (job_class_get_registered ("foo", NULL), job);
+
+
+	/* Check that a file replaced by an identical copy, with a new
+	 * inode and modification time, is recognised by its contents and
+	 * not parsed again.
+	 */
+	TEST_FEATURE ("with identical replacement");
+	strcpy (tmpname, dirname);
+	strcat (tmpname, "/foo.tmp");
+
+	f = fopen (tmpname, "w");
+	fprintf (f, "description \"foo\"\n");
+	fprintf (f, "exec /sbin/daemon\n");
+	fclose (f);
+
+	TEST_EQ (rename (tmpname, filename), 0);
+
+	conf_reload_changed (&summary);
+
+	TEST_EQ (summary.modified, 0);
+	TEST_EQ (summary.unchanged, 2);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_EQ_P (file->job, job);
+
+
+	/* Check that a modified file is parsed again, replacing its job,
+	 * while the unchanged file is not.
+	 */
+	TEST_FEATURE ("with modified file");
+	f = fopen (filename, "w");
+	fprintf (f, "description \"modified\"\n");
+	fprintf (f, "exec /sbin/daemon\n");
+	fclose (f);
+
+	conf_reload_changed (&summary);
+
+	TEST_EQ (summary.added, 0);
+	TEST_EQ (summary.modified, 1);
+	TEST_EQ (summary.removed, 0);
+	TEST_EQ (summary.unchanged, 1);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+	TEST_EQ_STR (file->job->description, "modified");
+
+	job = file->job;
+
+
+	/* Check that adding an override file causes the job it overrides
+	 * to be parsed again with it applied.
+	 */
+	TEST_FEATURE ("with new override");
+	f = fopen (override, "w");
+	fprintf (f, "description \"overridden\"\n");
+	fclose (f);
+
+	conf_reload_changed (&summary);
+
+	TEST_EQ (summary.modified, 1);
+	TEST_EQ (summary.unchanged, 1);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+	TEST_EQ_STR (file->job->description, "overridden");
+	TEST_EQ_STR (file->override_path, override);
+
+	conf_reload_changed (&summary);
+
+	TEST_EQ (summary.modified, 0);
+	TEST_EQ (summary.unchanged, 2);
+
+
+	/* Check that removing the override file causes the job to be
+	 * parsed again without it.
+	 */
+	TEST_FEATURE ("with removed override");
+	unlink (override);
+
+	conf_reload_changed (&summary);
+
+	TEST_EQ (summary.modified, 1);
+	TEST_EQ (summary.unchanged, 1);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+	TEST_EQ_STR (file->job->description, "modified");
+	TEST_EQ_P (file->override_path, NULL);
+
+
+	/* Check that a new file is parsed and counted as added. */
+	TEST_FEATURE ("with new file");
+	strcpy (tmpname, dirname);
+	strcat (tmpname, "/baz.conf");
+
+	f = fopen (tmpname, "w");
+	fprintf (f, "exec /sbin/baz\n");
+	fclose (f);
+
+	conf_reload_changed (&summary);
+
+	TEST_EQ (summary.added, 1);
+	TEST_EQ (summary.modified, 0);
+	TEST_EQ (summary.removed, 0);
+	TEST_EQ (summary.unchanged, 2);
+
+	TEST_NE_P (job_class_get_registered ("baz", NULL), NULL);
+
+
+	/* Check that a deleted file is removed along with its job. */
+	TEST_FEATURE ("with deleted file");
+	unlink (tmpname);
+
+	conf_reload_changed (&summary);
+
+	TEST_EQ (summary.added, 0);
+	TEST_EQ (summary.modified, 0);
+	TEST_EQ (summary.removed, 1);
+	TEST_EQ (summary.unchanged, 2);
+
+	TEST_EQ_P (nih_hash_lookup (source->files, tmpname), NULL);
+	TEST_EQ_P (job_class_get_registered ("baz", NULL), NULL);
+
+
+	/* Check that a job that failed to parse is parsed again even
+	 * though it has not changed, so the error is reported again.
+	 */
+	TEST_FEATURE ("with unparseable file");
+	f = fopen (filename, "w");
+	fprintf (f, "frodo baggins\n");
+	fclose (f);
+
+	conf_reload_changed (&summary);
+
+	TEST_EQ (summary.modified, 1);
+
+	conf_reload_changed (&summary);
+
+	TEST_EQ (summary.modified, 1);
+	TEST_EQ (summary.unchanged, 1);
+
+
+	nih_free (source);
+
+	unlink (filename);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/bar.conf");
+	unlink (filename);
+
+	rmdir (dirname);
+
+	nih_log_set_priority (NIH_LOG_MESSAGE);
+}
+
+
+void
+test_reload_file (void)
+{
+	ConfSource *source;
+	ConfFile   *file;
+	JobClass   *job;
+	NihError   *err;
+	FILE       *f;
+	char        dirname[PATH_MAX], filename[PATH_MAX];
+	char        override[PATH_MAX], other[PATH_MAX];
+	int         ret;
+
+	TEST_FUNCTION ("conf_reload_file");
+	program_name = "test";
+	nih_log_set_priority (NIH_LOG_FATAL);
+
+	conf_init ();
+	job_class_init ();
+
+	TEST_FILENAME (dirname);
+	mkdir (dirname, 0755);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo.conf");
+
+	f = fopen (filename, "w");
+	fprintf (f, "description \"foo\"\n");
+	fprintf (f, "exec /sbin/daemon\n");
+	fclose (f);
+
+	strcpy (other, dirname);
+	strcat (other, "/bar.conf");
+
+	f = fopen (other, "w");
+	fprintf (f, "description \"bar\"\n");
+	fprintf (f, "exec /sbin/bar\n");
+	fclose (f);
+
+	strcpy (override, dirname);
+	strcat (override, "/foo.override");
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+
+	conf_reload ();
+
+	file = (ConfFile *)nih_hash_lookup (source->files, other);
+	TEST_NE_P (file, NULL);
+	job = file->job;
+
+
+	/* Check that a modified job file is parsed again, without the
+	 * other files in the source being touched.
+	 */
+	TEST_FEATURE ("with modified file");
+	f = fopen (filename, "w");
+	fprintf (f, "description \"modified\"\n");
+	fprintf (f, "exec /sbin/daemon\n");
+	fclose (f);
+
+	f = fopen (other, "w");
+	fprintf (f, "description \"ignored\"\n");
+	fclose (f);
+
+	ret = conf_reload_file (NULL, filename);
+
+	TEST_EQ (ret, 0);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+	TEST_EQ_STR (file->job->description, "modified");
+
+	file = (ConfFile *)nih_hash_lookup (source->files, other);
+	TEST_NE_P (file, NULL);
+	TEST_EQ_P (file->job, job);
+	TEST_EQ_STR (file->job->description, "bar");
+
+
+	/* Check that reloading a new override file applies it to the job
+	 * it overrides.
+	 */
+	TEST_FEATURE ("with override file");
+	f = fopen (override, "w");
+	fprintf (f, "description \"overridden\"\n");
+	fclose (f);
+
+	ret = conf_reload_file (NULL, override);
+
+	TEST_EQ (ret, 0);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+	TEST_EQ_STR (file->job->description, "overridden");
+
+
+	/* Check that reloading a job file also applies its override. */
+	TEST_FEATURE ("with job file and override");
+	ret = conf_reload_file (NULL, filename);
+
+	TEST_EQ (ret, 0);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+	TEST_EQ_STR (file->job->description, "overridden");
+
+	unlink (override);
+
+
+	/* Check that reloading a deleted job file removes it. */
+	TEST_FEATURE ("with deleted file");
+	unlink (other);
+
+	ret = conf_reload_file (NULL, other);
+
+	TEST_EQ (ret, 0);
+	TEST_EQ_P (nih_hash_lookup (source->files, other), NULL);
+	TEST_EQ_P (job_class_get_registered ("bar", NULL), NULL);
+
+
+	/* Check that a file that neither exists nor was loaded is an
+	 * error.
+	 */
+	TEST_FEATURE ("with missing file");
+	ret = conf_reload_file (NULL, other);
+
+	TEST_LT (ret, 0);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, ENOENT);
+	nih_free (err);
+
+
+	/* Check that a file outside every configuration source is an
+	 * error.
+	 */
+	TEST_FEATURE ("with file in no source");
+	ret = conf_reload_file (NULL, "/nonexistent/foo.conf");
+
+	TEST_LT (ret, 0);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, CONF_FILE_UNKNOWN);
+	nih_free (err);
+
+
+	/* Check that a relative path is an error. */
+	TEST_FEATURE ("with relative path");
+	ret = conf_reload_file (NULL, "foo.conf");
+
+	TEST_LT (ret, 0);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, CONF_FILE_UNKNOWN);
+	nih_free (err);
+
+
+	/* Check that a path leading outside the source through a ".."
+	 * component is an error, even though it starts with the path of
+	 * the source.
+	 */
+	TEST_FEATURE ("with path leading outside source");
+	sprintf (other, "%s/../%s/foo.conf",
+		 dirname, strrchr (dirname, '/') + 1);
+
+	ret = conf_reload_file (NULL, other);
+
+	TEST_LT (ret, 0);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, CONF_FILE_UNKNOWN);
+	nih_free (err);
+
+	TEST_EQ_P (nih_hash_lookup (source->files, other), NULL);
+
+
+	/* Check that a file in a directory that walking the source would
+	 * ignore is an error.
+	 */
+	TEST_FEATURE ("with file in ignored directory");
+	sprintf (other, "%s/.hidden/foo.conf", dirname);
+
+	ret = conf_reload_file (NULL, other);
+
+	TEST_LT (ret, 0);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, CONF_FILE_UNKNOWN);
+	nih_free (err);
+
+
+	nih_free (source);
+
+	unlink (filename);
+	rmdir (dirname);
+
+	nih_log_set_priority (NIH_LOG_MESSAGE);
+}
+
+
+void
+test_coalesce (void)
+{
+	ConfSource *source;
+	ConfFile   *file;
+	FILE       *f;
+	char        dirname[PATH_MAX], filename[PATH_MAX];
+	char        override[PATH_MAX], tmpname[PATH_MAX];
+	size_t      saved;
+	int         fd, ret;
+
+	TEST_FUNCTION ("conf_create_modify_handler");
+	program_name = "test";
+	nih_log_set_priority (NIH_LOG_FATAL);
+
+	if ((fd = inotify_init ()) < 0) {
+		printf ("SKIP: inotify not available\n");
+		nih_log_set_priority (NIH_LOG_MESSAGE);
+		return;
+	}
+	close (fd);
+
+	conf_init ();
+	job_class_init ();
+
+	conf_coalesce_window = 100;
+
+	TEST_FILENAME (dirname);
+	mkdir (dirname, 0755);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo.conf");
+
+	strcpy (override, dirname);
+	strcat (override, "/foo.override");
+
+	strcpy (tmpname, dirname);
+	strcat (tmpname, "/foo.conf.tmp");
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+
+	ret = conf_source_reload (source);
+	TEST_EQ (ret, 0);
+
+
+	/* Check that a job written through a temporary file, rewritten and
+	 * then overridden is not reloaded until the coalescing window has
+	 * passed, and then is only reloaded once with the override applied.
+	 */
+	TEST_FEATURE ("with burst of changes");
+	saved = conf_coalesce_saved;
+
+	f = fopen (tmpname, "w");
+	fprintf (f, "description \"foo\"\n");
+	fclose (f);
+
+	TEST_EQ (rename (tmpname, filename), 0);
+
+	f = fopen (filename, "a");
+	fprintf (f, "exec /sbin/daemon\n");
+	fclose (f);
+
+	f = fopen (override, "w");
+	fprintf (f, "description \"overridden\"\n");
+	fclose (f);
+
+	TEST_FORCE_WATCH_UPDATE ();
+
+	TEST_EQ_P (nih_hash_lookup (source->files, filename), NULL);
+	TEST_GT (conf_coalesce_saved, saved);
+
+	TEST_WATCH_UPDATE_TIMEOUT_SECS (5);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+	TEST_EQ_STR (file->job->description, "overridden");
+	TEST_NE_P (file->job->process[PROCESS_MAIN], NULL);
+
+	/* The rewrite, and the reload for the override file */
+	TEST_GT (conf_coalesce_saved, saved + 1);
+
+
+	/* Check that a job modified then deleted within the window is
+	 * just deleted.
+	 */
+	TEST_FEATURE ("with modified then deleted job");
+	unlink (override);
+
+	f = fopen (filename, "a");
+	fprintf (f, "manual\n");
+	fclose (f);
+
+	unlink (filename);
+
+	TEST_FORCE_WATCH_UPDATE ();
+
+	TEST_NE_P (nih_hash_lookup (source->files, filename), NULL);
+
+	TEST_WATCH_UPDATE_TIMEOUT_SECS (5);
+
+	TEST_EQ_P (nih_hash_lookup (source->files, filename), NULL);
+	TEST_EQ_P (job_class_get_registered ("foo", NULL), NULL);
+
+
+	/* Check that pending changes can be flushed without waiting for
+	 * the window to pass.
+	 */
+	TEST_FEATURE ("with flush");
+	f = fopen (filename, "w");
+	fprintf (f, "exec /sbin/daemon\n");
+	fclose (f);
+
+	TEST_FORCE_WATCH_UPDATE ();
+
+	TEST_EQ_P (nih_hash_lookup (source->files, filename), NULL);
+
+	conf_flush_pending ();
+
+	TEST_NE_P (nih_hash_lookup (source->files, filename), NULL);
+
+
+	/* Check that with no window, changes are reloaded immediately. */
+	TEST_FEATURE ("with no window");
+	conf_coalesce_window = 0;
+
+	unlink (filename);
+
+	TEST_FORCE_WATCH_UPDATE ();
+
+	TEST_EQ_P (nih_hash_lookup (source->files, filename), NULL);
+
+
+	nih_free (source);
+
+	rmdir (dirname);
+
+	nih_log_set_priority (NIH_LOG_MESSAGE);
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	/* run tests in legacy (pre-session support) mode */
+	setenv ("UPSTART_NO_SESSIONS", "1", 1);
+
+	/* reload changes as soon as they are seen, except where tested */
+	conf_coalesce_window = 0;
+
+	test_source_new ();
+	test_file_new ();
+	test_source_reload_job_dir ();
+	test_source_reload_conf_dir ();
+	test_source_reload_file ();
+	test_source_reload ();
+	test_override ();
+	test_file_destroy ();
+	test_select_job ();
+	test_cache ();
+	test_parallel ();
+	test_reload_changed ();
+	test_reload_file ();
+	test_coalesce ();
+
+	test_benchmark_parallel ();
 
 	return 0;
 }
@@ -23,6 +23,7 @@
 #include <nih-dbus/test_dbus.h>
 
 #include <sys/types.h>
+#include <sys/inotify.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/wait.h>
@@ -975,15 +976,136 @@ test_reload_configuration (void)
 }
 
 
+void
+test_reload_job_configuration (void)
+{
+	FILE           *f;
+	ConfSource     *source;
+	ConfFile       *file;
+	char            dirname[PATH_MAX], filename[PATH_MAX];
+	char           *paths[2];
+	NihDBusMessage *message;
+	NihError       *error;
+	NihDBusError   *dbus_error;
+	int             ret;
+
+	TEST_FUNCTION ("control_reload_job_configuration");
+	nih_log_set_priority (NIH_LOG_FATAL);
+
+	TEST_FILENAME (dirname);
+	mkdir (dirname, 0755);
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+
+	strcpy (filename, dirname);
+	strcat (filename, "/foo.conf");
+
+	f = fopen (filename, "w");
+	fprintf (f, "description \"foo\"\n");
+	fclose (f);
+
+	conf_reload ();
+
+	paths[0] = filename;
+	paths[1] = NULL;
+
+
+	/* Check that we can ask the daemon to reload a single job file,
+	 * and that the change turns up.
+	 */
+	TEST_FEATURE ("with job file");
+	f = fopen (filename, "w");
+	fprintf (f, "description \"modified\"\n");
+	fclose (f);
+
+	message = nih_new (NULL, NihDBusMessage);
+	message->connection = NULL;
+	message->message = NULL;
+
+	ret = control_reload_job_configuration (NULL, message, paths);
+
+	TEST_EQ (ret, 0);
+
+	nih_free (message);
+
+	file = (ConfFile *)nih_hash_lookup (source->files, filename);
+	TEST_NE_P (file, NULL);
+	TEST_NE_P (file->job, NULL);
+	TEST_EQ_STR (file->job->description, "modified");
+
+
+	/* Check that a file outside every configuration source results
+	 * in an invalid args D-Bus error.
+	 */
+	TEST_FEATURE ("with file in no source");
+	paths[0] = "/nonexistent/foo.conf";
+
+	message = nih_new (NULL, NihDBusMessage);
+	message->connection = NULL;
+	message->message = NULL;
+
+	ret = control_reload_job_configuration (NULL, message, paths);
+
+	TEST_LT (ret, 0);
+
+	error = nih_error_get ();
+	TEST_EQ (error->number, NIH_DBUS_ERROR);
+
+	dbus_error = (NihDBusError *)error;
+	TEST_EQ_STR (dbus_error->name, DBUS_ERROR_INVALID_ARGS);
+
+	nih_free (error);
+
+	nih_free (message);
+
+
+	/* Check that no files at all results in an invalid args D-Bus
+	 * error.
+	 */
+	TEST_FEATURE ("with no files");
+	paths[0] = NULL;
+
+	message = nih_new (NULL, NihDBusMessage);
+	message->connection = NULL;
+	message->message = NULL;
+
+	ret = control_reload_job_configuration (NULL, message, paths);
+
+	TEST_LT (ret, 0);
+
+	error = nih_error_get ();
+	TEST_EQ (error->number, NIH_DBUS_ERROR);
+
+	dbus_error = (NihDBusError *)error;
+	TEST_EQ_STR (dbus_error->name, DBUS_ERROR_INVALID_ARGS);
+
+	nih_free (error);
+
+	nih_free (message);
+
+
+	nih_free (source);
+
+	unlink (filename);
+	rmdir (dirname);
+
+	nih_log_set_priority (NIH_LOG_MESSAGE);
+}
+
+
 void
 test_get_job_by_name (void)
 {
 	NihDBusMessage *message = NULL;
 	JobClass       *class;
+	ConfSource     *source;
+	FILE           *f;
+	char            dirname[PATH_MAX], filename[PATH_MAX];
 	char           *path;
 	NihError       *error;
 	NihDBusError   *dbus_error;
-	int             ret;
+	int             window;
+	int             fd, ret;
 
 	TEST_FUNCTION ("control_get_job_by_name");
 	nih_error_init ();
@@ -1084,6 +1206,60 @@ test_get_job_by_name (void)
 	}
 
 	nih_free (class);
+
+
+	/* Check that a job whose configuration file was added within the
+	 * coalescing window is found, rather than being unknown until the
+	 * window has passed.
+	 */
+	TEST_FEATURE ("with job added within coalescing window");
+	if ((fd = inotify_init ()) < 0) {
+		printf ("SKIP: inotify not available\n");
+		return;
+	}
+	close (fd);
+
+	nih_log_set_priority (NIH_LOG_FATAL);
+
+	TEST_FILENAME (dirname);
+	mkdir (dirname, 0755);
+
+	source = conf_source_new (NULL, dirname, CONF_JOB_DIR);
+	assert0 (conf_source_reload (source));
+
+	window = conf_coalesce_window;
+	conf_coalesce_window = 60000;
+
+	strcpy (filename, dirname);
+	strcat (filename, "/coalesced.conf");
+
+	f = fopen (filename, "w");
+	fprintf (f, "exec /sbin/daemon\n");
+	fclose (f);
+
+	TEST_FORCE_WATCH_UPDATE ();
+
+	TEST_EQ_P (nih_hash_lookup (source->files, filename), NULL);
+
+	message = nih_new (NULL, NihDBusMessage);
+	message->connection = NULL;
+	message->message = NULL;
+
+	ret = control_get_job_by_name (NULL, message, "coalesced", &path);
+
+	TEST_EQ (ret, 0);
+	TEST_NE_P (nih_hash_lookup (source->files, filename), NULL);
+
+	nih_free (message);
+
+	conf_coalesce_window = window;
+
+	nih_free (source);
+
+	unlink (filename);
+	rmdir (dirname);
+
+	nih_log_set_priority (NIH_LOG_MESSAGE);
 }
 
 void
@@ -1214,6 +1390,7 @@ test_emit_event (void)
 	Blocked *        blocked;
 	NihError        *error;
 	NihDBusError    *dbus_error;
+	unsigned int     rejected;
 
 	TEST_FUNCTION ("control_emit_event");
 	nih_error_init ();
@@ -1618,6 +1795,435 @@ test_emit_event (void)
 	dbus_message_unref (method);
 
 
+	/* Check that if the event queue is full, the Busy error is
+	 * returned immediately without the event being queued, and the
+	 * rejection is counted.
+	 */
+	TEST_FEATURE ("with full event queue");
+	method = dbus_message_new_method_call (
+		dbus_bus_get_unique_name (conn),
+		DBUS_PATH_UPSTART,
+		DBUS_INTERFACE_UPSTART,
+		"EmitEvent");
+
+	dbus_connection_send (client_conn, method, &serial);
+	dbus_connection_flush (client_conn);
+	dbus_message_unref (method);
+
+	TEST_DBUS_MESSAGE (conn, method);
+	assert (dbus_message_get_serial (method) == serial);
+
+	message = nih_new (NULL, NihDBusMessage);
+	message->connection = conn;
+	message->message = method;
+
+	env = nih_str_array_new (message);
+
+	event = event_new (NULL, "wibble", NULL);
+
+	event_queue_high_watermark = event_count;
+	rejected = control_rejected_emits_queue;
+
+	ret = control_emit_event (NULL, message, "test", env, FALSE);
+
+	TEST_LT (ret, 0);
+
+	dbus_error = (NihDBusError *)nih_error_get ();
+	TEST_ALLOC_SIZE (dbus_error, sizeof (NihDBusError));
+	TEST_EQ (dbus_error->number, NIH_DBUS_ERROR);
+	TEST_EQ_STR (dbus_error->name, DBUS_INTERFACE_UPSTART ".Error.Busy");
+	nih_free (dbus_error);
+
+	TEST_EQ (control_rejected_emits_queue, rejected + 1);
+
+	TEST_EQ_P (events->next, &event->entry);
+	TEST_EQ_P (event->entry.next, events);
+
+	nih_free (event);
+	nih_free (message);
+	dbus_message_unref (method);
+
+	event_queue_high_watermark = EVENT_QUEUE_HIGH_WATERMARK;
+
+	/* Drain the queue so later emits are accepted again */
+	TEST_TRUE (event_queue_admit (1));
+
+
+	/* Check that once a client has its quota of events outstanding,
+	 * the Busy error is returned for further events from it, and that
+	 * it may emit again once they have finished.
+	 */
+	TEST_FEATURE ("with client over quota");
+	control_emit_quota = 1;
+	rejected = control_rejected_emits_quota;
+
+	method = dbus_message_new_method_call (
+		dbus_bus_get_unique_name (conn),
+		DBUS_PATH_UPSTART,
+		DBUS_INTERFACE_UPSTART,
+		"EmitEvent");
+
+	dbus_connection_send (client_conn, method, &serial);
+	dbus_connection_flush (client_conn);
+	dbus_message_unref (method);
+
+	TEST_DBUS_MESSAGE (conn, method);
+	assert (dbus_message_get_serial (method) == serial);
+
+	message = nih_new (NULL, NihDBusMessage);
+	message->connection = conn;
+	message->message = method;
+
+	env = nih_str_array_new (message);
+
+	ret = control_emit_event (NULL, message, "test", env, FALSE);
+
+	TEST_EQ (ret, 0);
+
+	event = (Event *)events->next;
+	TEST_EQ_STR (event->name, "test");
+
+	nih_free (message);
+	dbus_message_unref (method);
+
+	dbus_connection_flush (conn);
+
+	TEST_DBUS_MESSAGE (client_conn, reply);
+	dbus_message_unref (reply);
+
+	method = dbus_message_new_method_call (
+		dbus_bus_get_unique_name (conn),
+		DBUS_PATH_UPSTART,
+		DBUS_INTERFACE_UPSTART,
+		"EmitEvent");
+
+	dbus_connection_send (client_conn, method, &serial);
+	dbus_connection_flush (client_conn);
+	dbus_message_unref (method);
+
+	TEST_DBUS_MESSAGE (conn, method);
+	assert (dbus_message_get_serial (method) == serial);
+
+	message = nih_new (NULL, NihDBusMessage);
+	message->connection = conn;
+	message->message = method;
+
+	env = nih_str_array_new (message);
+
+	ret = control_emit_event (NULL, message, "test", env, FALSE);
+
+	TEST_LT (ret, 0);
+
+	dbus_error = (NihDBusError *)nih_error_get ();
+	TEST_ALLOC_SIZE (dbus_error, sizeof (NihDBusError));
+	TEST_EQ (dbus_error->number, NIH_DBUS_ERROR);
+	TEST_EQ_STR (dbus_error->name, DBUS_INTERFACE_UPSTART ".Error.Busy");
+	nih_free (dbus_error);
+
+	TEST_EQ (control_rejected_emits_quota, rejected + 1);
+
+	event_poll ();
+
+	TEST_LIST_EMPTY (events);
+
+	ret = control_emit_event (NULL, message, "test", env, FALSE);
+
+	TEST_EQ (ret, 0);
+
+	nih_free (message);
+	dbus_message_unref (method);
+
+	dbus_connection_flush (conn);
+
+	TEST_DBUS_MESSAGE (client_conn, reply);
+	dbus_message_unref (reply);
+
+	event_poll ();
+
+	TEST_LIST_EMPTY (events);
+
+	control_emit_quota = CONTROL_EMIT_QUOTA;
+
+
+	TEST_DBUS_CLOSE (conn);
+	TEST_DBUS_CLOSE (client_conn);
+	TEST_DBUS_END (dbus_pid);
+
+	dbus_shutdown ();
+}
+
+
+void
+test_emit_events (void)
+{
+	DBusConnection                  *conn, *client_conn;
+	pid_t                            dbus_pid;
+	DBusMessage                     *method, *reply;
+	NihDBusMessage                  *message = NULL;
+	dbus_uint32_t                    serial;
+	ControlEmitEventsEventsElement **batch = NULL;
+	int                              ret;
+	Event                           *event1, *event2;
+	Blocked                         *blocked;
+	NihError                        *error;
+	NihDBusError                    *dbus_error;
+
+	TEST_FUNCTION ("control_emit_events");
+	nih_error_init ();
+	nih_main_loop_init ();
+	event_init ();
+
+	TEST_DBUS (dbus_pid);
+	TEST_DBUS_OPEN (conn);
+	TEST_DBUS_OPEN (client_conn);
+
+
+	/* Check that all events in a batch are added to the event queue
+	 * in order, and that the message is only blocked on those that
+	 * asked to wait.  When they are finished, the reply will be sent
+	 * and the message structure freed.
+	 */
+	TEST_FEATURE ("with batch of events");
+	TEST_ALLOC_FAIL {
+		method = dbus_message_new_method_call (
+			dbus_bus_get_unique_name (conn),
+			DBUS_PATH_UPSTART,
+			DBUS_INTERFACE_UPSTART,
+			"EmitEvents");
+
+		dbus_connection_send (client_conn, method, &serial);
+		dbus_connection_flush (client_conn);
+		dbus_message_unref (method);
+
+		TEST_DBUS_MESSAGE (conn, method);
+		assert (dbus_message_get_serial (method) == serial);
+
+		TEST_ALLOC_SAFE {
+			message = nih_new (NULL, NihDBusMessage);
+			message->connection = conn;
+			message->message = method;
+
+			TEST_FREE_TAG (message);
+
+			batch = nih_alloc (message, sizeof (ControlEmitEventsEventsElement *) * 3);
+
+			batch[0] = nih_new (batch, ControlEmitEventsEventsElement);
+			batch[0]->item0 = "foo";
+			batch[0]->item1 = nih_str_array_new (batch[0]);
+			assert (nih_str_array_add (&batch[0]->item1, batch[0],
+						   NULL, "FOO=BAR"));
+			batch[0]->item2 = FALSE;
+
+			batch[1] = nih_new (batch, ControlEmitEventsEventsElement);
+			batch[1]->item0 = "bar";
+			batch[1]->item1 = nih_str_array_new (batch[1]);
+			batch[1]->item2 = TRUE;
+
+			batch[2] = NULL;
+		}
+
+		ret = control_emit_events (NULL, message, batch);
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+
+			error = nih_error_get ();
+			TEST_EQ (error->number, ENOMEM);
+			nih_free (error);
+
+			TEST_LIST_EMPTY (events);
+
+			nih_free (message);
+			dbus_message_unref (method);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_LIST_NOT_EMPTY (events);
+
+		event1 = (Event *)events->next;
+		TEST_ALLOC_SIZE (event1, sizeof (Event));
+		TEST_EQ_STR (event1->name, "foo");
+		TEST_EQ_STR (event1->env[0], "FOO=BAR");
+		TEST_EQ_P (event1->env[1], NULL);
+
+		TEST_LIST_EMPTY (&event1->blocking);
+
+		event2 = (Event *)event1->entry.next;
+		TEST_ALLOC_SIZE (event2, sizeof (Event));
+		TEST_EQ_STR (event2->name, "bar");
+		TEST_EQ_P (event2->env[0], NULL);
+
+		TEST_LIST_NOT_EMPTY (&event2->blocking);
+
+		blocked = (Blocked *)event2->blocking.next;
+		TEST_ALLOC_SIZE (blocked, sizeof (Blocked));
+		TEST_ALLOC_PARENT (blocked, event2);
+		TEST_EQ (blocked->type, BLOCKED_EMIT_EVENTS_METHOD);
+		TEST_EQ_P (blocked->batch->message, message);
+		TEST_EQ (blocked->batch->pending, 1);
+		TEST_FALSE (blocked->batch->failed);
+
+		TEST_ALLOC_PARENT (blocked->batch, blocked);
+		TEST_ALLOC_PARENT (message, blocked->batch);
+
+		TEST_FREE_TAG (blocked);
+
+		nih_discard (message);
+		TEST_NOT_FREE (message);
+
+
+		event_poll ();
+
+		TEST_LIST_EMPTY (events);
+
+		TEST_FREE (blocked);
+
+		TEST_FREE (message);
+		dbus_message_unref (method);
+
+		dbus_connection_flush (conn);
+
+		TEST_DBUS_MESSAGE (client_conn, reply);
+
+		TEST_EQ (dbus_message_get_type (reply),
+			 DBUS_MESSAGE_TYPE_METHOD_RETURN);
+		TEST_EQ (dbus_message_get_reply_serial (reply), serial);
+
+		dbus_message_unref (reply);
+	}
+
+
+	/* Check that if no event in the batch waits, we get the reply
+	 * straight away.
+	 */
+	TEST_FEATURE ("with no wait");
+	TEST_ALLOC_FAIL {
+		method = dbus_message_new_method_call (
+			dbus_bus_get_unique_name (conn),
+			DBUS_PATH_UPSTART,
+			DBUS_INTERFACE_UPSTART,
+			"EmitEvents");
+
+		dbus_connection_send (client_conn, method, &serial);
+		dbus_connection_flush (client_conn);
+		dbus_message_unref (method);
+
+		TEST_DBUS_MESSAGE (conn, method);
+		assert (dbus_message_get_serial (method) == serial);
+
+		TEST_ALLOC_SAFE {
+			message = nih_new (NULL, NihDBusMessage);
+			message->connection = conn;
+			message->message = method;
+
+			TEST_FREE_TAG (message);
+
+			batch = nih_alloc (message, sizeof (ControlEmitEventsEventsElement *) * 2);
+
+			batch[0] = nih_new (batch, ControlEmitEventsEventsElement);
+			batch[0]->item0 = "foo";
+			batch[0]->item1 = nih_str_array_new (batch[0]);
+			batch[0]->item2 = FALSE;
+
+			batch[1] = NULL;
+		}
+
+		ret = control_emit_events (NULL, message, batch);
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+
+			error = nih_error_get ();
+			TEST_EQ (error->number, ENOMEM);
+			nih_free (error);
+
+			TEST_LIST_EMPTY (events);
+
+			nih_free (message);
+			dbus_message_unref (method);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		dbus_connection_flush (conn);
+
+		TEST_DBUS_MESSAGE (client_conn, reply);
+
+		TEST_EQ (dbus_message_get_type (reply),
+			 DBUS_MESSAGE_TYPE_METHOD_RETURN);
+		TEST_EQ (dbus_message_get_reply_serial (reply), serial);
+
+		dbus_message_unref (reply);
+
+		TEST_LIST_NOT_EMPTY (events);
+
+		event1 = (Event *)events->next;
+		TEST_EQ_STR (event1->name, "foo");
+		TEST_LIST_EMPTY (&event1->blocking);
+
+		nih_free (event1);
+
+		TEST_LIST_EMPTY (events);
+
+		nih_free (message);
+		dbus_message_unref (method);
+	}
+
+
+	/* Check that if any event in the batch has an empty name, an
+	 * error is returned immediately and no events are queued.
+	 */
+	TEST_FEATURE ("with empty name in batch");
+	method = dbus_message_new_method_call (
+		dbus_bus_get_unique_name (conn),
+		DBUS_PATH_UPSTART,
+		DBUS_INTERFACE_UPSTART,
+		"EmitEvents");
+
+	dbus_connection_send (client_conn, method, &serial);
+	dbus_connection_flush (client_conn);
+	dbus_message_unref (method);
+
+	TEST_DBUS_MESSAGE (conn, method);
+	assert (dbus_message_get_serial (method) == serial);
+
+	message = nih_new (NULL, NihDBusMessage);
+	message->connection = conn;
+	message->message = method;
+
+	batch = nih_alloc (message, sizeof (ControlEmitEventsEventsElement *) * 3);
+
+	batch[0] = nih_new (batch, ControlEmitEventsEventsElement);
+	batch[0]->item0 = "foo";
+	batch[0]->item1 = nih_str_array_new (batch[0]);
+	batch[0]->item2 = FALSE;
+
+	batch[1] = nih_new (batch, ControlEmitEventsEventsElement);
+	batch[1]->item0 = "";
+	batch[1]->item1 = nih_str_array_new (batch[1]);
+	batch[1]->item2 = FALSE;
+
+	batch[2] = NULL;
+
+	ret = control_emit_events (NULL, message, batch);
+
+	TEST_LT (ret, 0);
+
+	dbus_error = (NihDBusError *)nih_error_get ();
+	TEST_ALLOC_SIZE (dbus_error, sizeof (NihDBusError));
+	TEST_EQ (dbus_error->number, NIH_DBUS_ERROR);
+	TEST_EQ_STR (dbus_error->name, DBUS_ERROR_INVALID_ARGS);
+	nih_free (dbus_error);
+
+	TEST_LIST_EMPTY (events);
+
+	nih_free (message);
+	dbus_message_unref (method);
+
+
 	TEST_DBUS_CLOSE (conn);
 	TEST_DBUS_CLOSE (client_conn);
 	TEST_DBUS_END (dbus_pid);
@@ -2713,11 +3319,13 @@ main (int   argc,
 	test_disconnected ();
 
 	test_reload_configuration ();
+	test_reload_job_configuration ();
 
 	test_get_job_by_name ();
 	test_get_all_jobs ();
 
 	test_emit_event ();
+	test_emit_events ();
 
 	test_get_version ();
 
@@ -39,6 +39,7 @@
 #include "job.h"
 #include "event.h"
 #include "blocked.h"
+#include "trace.h"
 
 
 void
@@ -95,6 +96,66 @@ test_new (void)
 }
 
 
+void
+test_name_intern (void)
+{
+	Event         *event1, *event2;
+	EventOperator *oper;
+	char          *name;
+
+	TEST_FUNCTION ("event_name_intern");
+
+	/* Check that events and operators with the same name share a single
+	 * copy of it, referenced by each of them.
+	 */
+	TEST_FEATURE ("with shared name");
+	event1 = event_new (NULL, "wibble", NULL);
+	event2 = event_new (NULL, "wibble", NULL);
+	oper = event_operator_new (NULL, EVENT_MATCH, "wibble", NULL);
+
+	TEST_EQ_STR (event1->name, "wibble");
+	TEST_EQ_P (event2->name, event1->name);
+	TEST_EQ_P (oper->name, event1->name);
+
+	TEST_ALLOC_PARENT (event1->name, event1);
+	TEST_ALLOC_PARENT (event1->name, event2);
+	TEST_ALLOC_PARENT (event1->name, oper);
+
+	TEST_EQ_P (nih_hash_lookup (event_names, "wibble"),
+		   nih_hash_lookup (event_names, event1->name));
+
+
+	/* Check that a different name is not shared. */
+	TEST_FEATURE ("with different name");
+	name = event_name_intern (event1, "wobble");
+
+	TEST_EQ_STR (name, "wobble");
+	TEST_NE_P (name, event1->name);
+	TEST_ALLOC_PARENT (name, event1);
+	nih_unref (name, event1);
+
+
+	/* Check that the shared copy remains until the last user is freed,
+	 * after which it is removed from the table.
+	 */
+	TEST_FEATURE ("with users freed");
+	name = event1->name;
+	TEST_FREE_TAG (name);
+
+	nih_free (event1);
+	nih_free (oper);
+
+	TEST_NOT_FREE (name);
+	TEST_NE_P (nih_hash_lookup (event_names, "wibble"), NULL);
+
+	nih_free (event2);
+
+	TEST_FREE (name);
+	TEST_EQ_P (nih_hash_lookup (event_names, "wibble"), NULL);
+	TEST_EQ_P (nih_hash_lookup (event_names, "wobble"), NULL);
+}
+
+
 void
 test_block (void)
 {
@@ -133,6 +194,156 @@ test_unblock (void)
 	nih_free (event);
 }
 
+void
+test_queue_admit (void)
+{
+	Event  *event[4];
+	size_t  base;
+	int     i;
+
+	TEST_FUNCTION ("event_queue_admit");
+	event_init ();
+
+	base = event_count;
+	event_queue_high_watermark = base + 4;
+	event_queue_low_watermark = base + 2;
+
+
+	/* Check that events are admitted while there is room for them
+	 * below the high watermark, and that event_count follows the
+	 * events list.
+	 */
+	TEST_FEATURE ("with room in queue");
+	for (i = 0; i < 3; i++)
+		event[i] = event_new (NULL, "test", NULL);
+
+	TEST_EQ (event_count, base + 3);
+	TEST_TRUE (event_queue_admit (1));
+	TEST_FALSE (event_queue_admit (2));
+
+
+	/* Check that once the high watermark is reached, nothing is
+	 * admitted until the queue drains to the low watermark.
+	 */
+	TEST_FEATURE ("with full queue");
+	event[3] = event_new (NULL, "test", NULL);
+
+	TEST_FALSE (event_queue_admit (1));
+
+	nih_free (event[3]);
+	TEST_EQ (event_count, base + 3);
+	TEST_FALSE (event_queue_admit (1));
+
+	nih_free (event[2]);
+	TEST_EQ (event_count, base + 2);
+	TEST_TRUE (event_queue_admit (1));
+
+
+	/* Check that no limit is applied when the high watermark is
+	 * zero.
+	 */
+	TEST_FEATURE ("with no limit");
+	event_queue_high_watermark = 0;
+
+	TEST_TRUE (event_queue_admit (1000000));
+
+	nih_free (event[1]);
+	nih_free (event[0]);
+	TEST_EQ (event_count, base);
+
+	event_queue_high_watermark = EVENT_QUEUE_HIGH_WATERMARK;
+	event_queue_low_watermark = EVENT_QUEUE_LOW_WATERMARK;
+}
+
+void
+test_trace (void)
+{
+	Event             *event;
+	const TraceRecord *record;
+	const TraceRecord *prev;
+
+	TEST_FUNCTION ("trace_record");
+	event_init ();
+
+
+	/* Check that nothing is recorded when tracing is disabled.
+	 */
+	TEST_FEATURE ("with tracing disabled");
+	trace_init (0);
+
+	event = event_new (NULL, "test", NULL);
+	nih_free (event);
+
+	TEST_EQ_P (trace_records, NULL);
+	TEST_EQ (trace_count (), 0);
+	TEST_EQ_P (trace_get (0), NULL);
+
+
+	/* Check that an event passing through the queue records its
+	 * creation, handling and finishing in order, with times that
+	 * never go backwards.
+	 */
+	TEST_FEATURE ("with event lifecycle");
+	trace_init (8);
+
+	event = event_new (NULL, "test", NULL);
+	event_poll ();
+
+	TEST_EQ (trace_count (), 3);
+
+	record = trace_get (0);
+	TEST_EQ (record->type, TRACE_RECORD_EVENT_NEW);
+	TEST_EQ_STR (record->name, "test");
+
+	prev = record;
+	record = trace_get (1);
+	TEST_EQ (record->type, TRACE_RECORD_EVENT_HANDLING);
+	TEST_EQ_STR (record->name, "test");
+	TEST_TRUE ((record->time.tv_sec > prev->time.tv_sec)
+		   || ((record->time.tv_sec == prev->time.tv_sec)
+		       && (record->time.tv_nsec >= prev->time.tv_nsec)));
+
+	prev = record;
+	record = trace_get (2);
+	TEST_EQ (record->type, TRACE_RECORD_EVENT_FINISHED);
+	TEST_EQ_STR (record->name, "test");
+	TEST_TRUE ((record->time.tv_sec > prev->time.tv_sec)
+		   || ((record->time.tv_sec == prev->time.tv_sec)
+		       && (record->time.tv_nsec >= prev->time.tv_nsec)));
+
+	TEST_EQ_P (trace_get (3), NULL);
+
+
+	/* Check that once the ring buffer is full, the oldest records
+	 * are overwritten and indexes still run from oldest to newest.
+	 */
+	TEST_FEATURE ("with full buffer");
+	trace_init (2);
+
+	trace_record (TRACE_RECORD_JOB_STATE, "first", 1, 0, 0);
+	trace_record (TRACE_RECORD_JOB_FORK, "second", 2, 100, 0);
+	trace_record (TRACE_RECORD_JOB_REAP, "third", 2, 100, 256);
+
+	TEST_EQ (trace_total, 3);
+	TEST_EQ (trace_count (), 2);
+
+	record = trace_get (0);
+	TEST_EQ (record->type, TRACE_RECORD_JOB_FORK);
+	TEST_EQ_STR (record->name, "second");
+	TEST_EQ (record->detail, 2);
+	TEST_EQ (record->pid, 100);
+
+	record = trace_get (1);
+	TEST_EQ (record->type, TRACE_RECORD_JOB_REAP);
+	TEST_EQ_STR (record->name, "third");
+	TEST_EQ (record->status, 256);
+
+	TEST_EQ_P (trace_get (2), NULL);
+
+
+	trace_init (0);
+}
+
 
 void
 test_poll (void)
@@ -230,11 +441,47 @@ test_poll (void)
 
 		TEST_NOT_FREE (event);
 		TEST_LIST_NOT_EMPTY (&event->entry);
+		TEST_LIST_EMPTY (&event->queue.entry);
+		TEST_LIST_EMPTY (event_queue);
 
 		nih_free (event);
 	}
 
 
+	/* Check that a blocked handling event is placed back into the
+	 * queue once its last blocker is removed, and is then finished
+	 * and freed by the next poll.
+	 */
+	TEST_FEATURE ("with handling event unblocked after poll");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			event = event_new (NULL, "test", NULL);
+			event->progress = EVENT_HANDLING;
+			event->blockers = 2;
+		}
+
+		TEST_FREE_TAG (event);
+
+		event_poll ();
+
+		TEST_NOT_FREE (event);
+		TEST_LIST_EMPTY (event_queue);
+
+		event_unblock (event);
+
+		TEST_LIST_EMPTY (event_queue);
+
+		event_unblock (event);
+
+		TEST_EQ_P (event_queue->next, &event->queue.entry);
+
+		event_poll ();
+
+		TEST_FREE (event);
+		TEST_LIST_EMPTY (event_queue);
+	}
+
+
 	/* Check that a finished event is freed.
 	 */
 	TEST_FEATURE ("with finished event");
@@ -287,7 +534,7 @@ test_pending (void)
 			class->start_on = event_operator_new (
 				class, EVENT_MATCH, "test", NULL);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -345,7 +592,7 @@ test_pending_handle_jobs (void)
 			class->start_on = event_operator_new (
 				class, EVENT_MATCH, "wibble", NULL);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -391,7 +638,7 @@ test_pending_handle_jobs (void)
 			nih_tree_add (&class->start_on->node, &oper->node,
 				      NIH_TREE_RIGHT);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -456,7 +703,7 @@ test_pending_handle_jobs (void)
 			nih_tree_add (&class->start_on->node, &oper->node,
 				      NIH_TREE_RIGHT);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -573,7 +820,7 @@ test_pending_handle_jobs (void)
 			nih_tree_add (&class->start_on->node, &oper->node,
 				      NIH_TREE_RIGHT);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 
@@ -700,7 +947,7 @@ test_pending_handle_jobs (void)
 			nih_tree_add (&class->start_on->node, &oper->node,
 				      NIH_TREE_RIGHT);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 
 			job = job_new (class, "");
 			job->goal = JOB_STOP;
@@ -869,7 +1116,7 @@ test_pending_handle_jobs (void)
 			nih_tree_add (&class->start_on->node, &oper->node,
 				      NIH_TREE_RIGHT);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 
 			job = job_new (class, "");
 			job->goal = JOB_START;
@@ -981,7 +1228,7 @@ test_pending_handle_jobs (void)
 			class->start_on = event_operator_new (
 				class, EVENT_MATCH, "wibble", NULL);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1061,7 +1308,7 @@ test_pending_handle_jobs (void)
 			class->start_on = event_operator_new (
 				class, EVENT_MATCH, "wibble", NULL);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 
 			job = job_new (class, "brandybuck");
 			job->goal = JOB_STOP;
@@ -1146,7 +1393,7 @@ test_pending_handle_jobs (void)
 			class->start_on = event_operator_new (
 				class, EVENT_MATCH, "wibble", NULL);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		TEST_DIVERT_STDERR (output) {
@@ -1196,7 +1443,7 @@ test_pending_handle_jobs (void)
 			job->goal = JOB_START;
 			job->state = JOB_RUNNING;
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1245,7 +1492,7 @@ test_pending_handle_jobs (void)
 			job->goal = JOB_START;
 			job->state = JOB_RUNNING;
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1321,7 +1568,7 @@ test_pending_handle_jobs (void)
 			job->goal = JOB_START;
 			job->state = JOB_RUNNING;
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1425,7 +1672,7 @@ test_pending_handle_jobs (void)
 			TEST_FREE_TAG (blocked2);
 			TEST_FREE_TAG (event4);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1536,7 +1783,7 @@ test_pending_handle_jobs (void)
 			TEST_FREE_TAG (blocked2);
 			TEST_FREE_TAG (event4);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1607,7 +1854,7 @@ test_pending_handle_jobs (void)
 			assert (nih_str_array_add (&(job->env), job,
 						   NULL, "COLOUR=GOLD"));
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1692,7 +1939,7 @@ test_finished (void)
 			class->start_on = event_operator_new (
 				class, EVENT_MATCH, "test/failed", NULL);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1727,7 +1974,7 @@ test_finished (void)
 			class->start_on = event_operator_new (
 				class, EVENT_MATCH, "test/failed", NULL);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1780,7 +2027,7 @@ test_finished (void)
 			nih_tree_add (&class->start_on->node, &oper->node,
 				      NIH_TREE_RIGHT);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1812,7 +2059,7 @@ test_finished (void)
 			job->state = JOB_STOPPING;
 			job->blocker = NULL;
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1846,7 +2093,7 @@ test_finished (void)
 			job->state = JOB_STARTING;
 			job->blocker = NULL;
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1886,7 +2133,7 @@ test_finished (void)
 
 			TEST_FREE_TAG (blocked);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1929,7 +2176,7 @@ test_finished (void)
 
 			TEST_FREE_TAG (blocked);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -1974,7 +2221,7 @@ test_finished (void)
 
 			TEST_FREE_TAG (blocked);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -2020,7 +2267,7 @@ test_finished (void)
 
 			TEST_FREE_TAG (blocked);
 
-			nih_hash_add (job_classes, &class->entry);
+			job_class_add_safe (class);
 		}
 
 		event_poll ();
@@ -2050,8 +2297,11 @@ main (int   argc,
 	job_class_environment_init ();
 
 	test_new ();
+	test_name_intern ();
 	test_block ();
 	test_unblock ();
+	test_queue_admit ();
+	test_trace ();
 	test_poll ();
 
 	test_pending ();
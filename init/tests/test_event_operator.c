@@ -21,11 +21,19 @@
 
 #include <nih/test.h>
 
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <time.h>
+
 #include <nih/macros.h>
 #include <nih/alloc.h>
 #include <nih/string.h>
 #include <nih/tree.h>
+#include <nih/error.h>
 
+#include "environ.h"
 #include "event_operator.h"
 #include "blocked.h"
 #include "parse_job.h"
@@ -836,6 +844,264 @@ test_operator_match (void)
 }
 
 
+void
+test_operator_compile (void)
+{
+	EventOperator *oper;
+	char          *env[8];
+
+	TEST_FUNCTION ("event_operator_compile");
+
+	/* Check that each kind of operator environment entry is compiled
+	 * into the expected kind of match, with the name and value
+	 * pointing into the original entry.
+	 */
+	TEST_FEATURE ("with each kind of value");
+	oper = event_operator_new (NULL, EVENT_MATCH, "foo", NULL);
+
+	oper->env = env;
+	oper->env[0] = "foo";
+	oper->env[1] = "BAR=b*";
+	oper->env[2] = "BAZ!=*z";
+	oper->env[3] = "QUUX=q?x";
+	oper->env[4] = "FRODO=$BILBO";
+	oper->env[5] = "MERRY=*";
+	oper->env[6] = "PIPPIN=*a*";
+	oper->env[7] = NULL;
+
+	TEST_EQ (event_operator_compile (oper), 0);
+
+	TEST_NE_P (oper->matches, NULL);
+	TEST_ALLOC_PARENT (oper->matches, oper);
+
+	TEST_EQ_P (oper->matches[0].source, env[0]);
+	TEST_EQ (oper->matches[0].type, EVENT_MATCH_EXACT);
+	TEST_FALSE (oper->matches[0].negate);
+	TEST_EQ_P (oper->matches[0].name, NULL);
+	TEST_EQ_STR (oper->matches[0].value, "foo");
+
+	TEST_EQ_P (oper->matches[1].source, env[1]);
+	TEST_EQ (oper->matches[1].type, EVENT_MATCH_PREFIX);
+	TEST_FALSE (oper->matches[1].negate);
+	TEST_EQ_P (oper->matches[1].name, env[1]);
+	TEST_EQ (oper->matches[1].name_len, 3);
+	TEST_EQ (oper->matches[1].value_len, 1);
+	TEST_EQ_STRN (oper->matches[1].value, "b");
+
+	TEST_EQ_P (oper->matches[2].source, env[2]);
+	TEST_EQ (oper->matches[2].type, EVENT_MATCH_SUFFIX);
+	TEST_TRUE (oper->matches[2].negate);
+	TEST_EQ (oper->matches[2].name_len, 3);
+	TEST_EQ_STR (oper->matches[2].value, "z");
+
+	TEST_EQ_P (oper->matches[3].source, env[3]);
+	TEST_EQ (oper->matches[3].type, EVENT_MATCH_GLOB);
+	TEST_EQ_STR (oper->matches[3].value, "q?x");
+
+	TEST_EQ_P (oper->matches[4].source, env[4]);
+	TEST_EQ (oper->matches[4].type, EVENT_MATCH_EXPAND);
+	TEST_EQ_STR (oper->matches[4].value, "$BILBO");
+
+	TEST_EQ_P (oper->matches[5].source, env[5]);
+	TEST_EQ (oper->matches[5].type, EVENT_MATCH_PREFIX);
+	TEST_EQ (oper->matches[5].value_len, 0);
+
+	TEST_EQ_P (oper->matches[6].source, env[6]);
+	TEST_EQ (oper->matches[6].type, EVENT_MATCH_GLOB);
+
+	TEST_EQ_P (oper->matches[7].source, NULL);
+
+	oper->env = NULL;
+	nih_free (oper);
+
+
+	/* Check that an operator created with an environment is compiled
+	 * straight away.
+	 */
+	TEST_FEATURE ("with environment given to new operator");
+	TEST_ALLOC_FAIL {
+		char **oenv;
+
+		TEST_ALLOC_SAFE {
+			oenv = nih_str_array_new (NULL);
+			assert (nih_str_array_add (&oenv, NULL, NULL, "FOO=bar"));
+		}
+
+		oper = event_operator_new (NULL, EVENT_MATCH, "foo", oenv);
+
+		if (test_alloc_failed) {
+			TEST_EQ_P (oper, NULL);
+			nih_free (oenv);
+			continue;
+		}
+
+		TEST_NE_P (oper->matches, NULL);
+		TEST_EQ_P (oper->matches[0].source, oper->env[0]);
+		TEST_EQ (oper->matches[0].type, EVENT_MATCH_EXACT);
+		TEST_EQ_P (oper->matches[1].source, NULL);
+
+		nih_discard (oenv);
+		nih_free (oper);
+	}
+}
+
+
+/* The event_operator_match() implementation prior to compiled matches,
+ * used as a reference for test_operator_match_benchmark().
+ */
+static int
+reference_match (EventOperator *oper,
+		 Event         *event,
+		 char * const  *env)
+{
+	char * const *oenv;
+	char * const *eenv;
+
+	if (strcmp (oper->name, event->name))
+		return FALSE;
+
+	for (oenv = oper->env, eenv = event->env; oenv && *oenv;
+	     oenv++, eenv++) {
+		nih_local char *expoval = NULL;
+		char           *oval, *eval;
+		int             negate = FALSE;
+		int             ret;
+
+		oval = strstr (*oenv, "!=");
+		if (! oval)
+			oval = strchr (*oenv, '=');
+
+		if (oval) {
+			eenv = environ_lookup (event->env, *oenv,
+					       oval - *oenv);
+
+			if (*oval == '!') {
+				negate = TRUE;
+				oval++;
+			}
+
+			oval++;
+		} else {
+			oval = *oenv;
+		}
+
+		if (! (eenv && *eenv))
+			return FALSE;
+
+		eval = strchr (*eenv, '=');
+		eval++;
+
+		while (! (expoval = environ_expand (NULL, oval, env))) {
+			NihError *err;
+
+			err = nih_error_get ();
+			if (err->number != ENOMEM) {
+				nih_free (err);
+				return FALSE;
+			}
+			nih_free (err);
+		}
+
+		ret = fnmatch (expoval, eval, 0);
+
+		if (negate ? (! ret) : ret)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Returns the time elapsed since @start in seconds. */
+static double
+elapsed (const struct timespec *start)
+{
+	struct timespec now;
+
+	assert0 (clock_gettime (CLOCK_MONOTONIC, &now));
+
+	return ((now.tv_sec - start->tv_sec)
+		+ (now.tv_nsec - start->tv_nsec) / 1000000000.0);
+}
+
+void
+test_operator_match_benchmark (void)
+{
+	EventOperator   *oper;
+	Event           *event;
+	struct timespec  start;
+	double           old_time, new_time;
+	char            *eenv[6], *jenv[2];
+	const size_t     loops = 1000;
+	int              expected, i;
+	const char      *opers[][4] = {
+		{ "JOB=foo", "INSTANCE=", NULL },
+		{ "JOB=f*", "RESULT!=failed", NULL },
+		{ "JOB=*o", "INSTANCE=*", NULL },
+		{ "foo", "", "ok", "hup" },
+		{ "JOB=f?o", "RESULT=[a-z]*", NULL },
+		{ "JOB=$NAME", NULL },
+		{ "JOB=bar", NULL },
+		{ "JOB=*x", "RESULT=ok", NULL },
+		{ NULL }
+	};
+
+	TEST_FUNCTION ("event_operator_match");
+
+	/* Check that the compiled matcher agrees with the matcher it
+	 * replaced for a variety of operators, and report the time taken
+	 * by each.
+	 */
+	TEST_FEATURE ("with compiled and reference matchers");
+	event = event_new (NULL, "foo", NULL);
+	event->env = eenv;
+	event->env[0] = "JOB=foo";
+	event->env[1] = "INSTANCE=";
+	event->env[2] = "RESULT=ok";
+	event->env[3] = "PROCESS=main";
+	event->env[4] = "EXIT_SIGNAL=HUP";
+	event->env[5] = NULL;
+
+	jenv[0] = "NAME=foo";
+	jenv[1] = NULL;
+
+	for (i = 0; opers[i][0]; i++) {
+		char **oenv;
+
+		oenv = NIH_MUST (nih_str_array_new (NULL));
+		for (int j = 0; (j < 4) && opers[i][j]; j++)
+			NIH_MUST (nih_str_array_add (&oenv, NULL, NULL,
+						     opers[i][j]));
+
+		oper = NIH_MUST (event_operator_new (NULL, EVENT_MATCH,
+						     "foo", oenv));
+		nih_discard (oenv);
+
+		expected = reference_match (oper, event, jenv);
+
+		assert0 (clock_gettime (CLOCK_MONOTONIC, &start));
+		for (size_t n = 0; n < loops; n++)
+			TEST_EQ (reference_match (oper, event, jenv),
+				 expected);
+		old_time = elapsed (&start);
+
+		assert0 (clock_gettime (CLOCK_MONOTONIC, &start));
+		for (size_t n = 0; n < loops; n++)
+			TEST_EQ (event_operator_match (oper, event, jenv),
+				 expected);
+		new_time = elapsed (&start);
+
+		printf ("...%s %s: reference %.3fs, compiled %.3fs\n",
+			opers[i][0], expected ? "(match)" : "(no match)",
+			old_time, new_time);
+
+		nih_free (oper);
+	}
+
+	event->env = NULL;
+	nih_free (event);
+}
+
+
 void
 test_operator_handle (void)
 {
@@ -1443,7 +1709,9 @@ main (int   argc,
 	test_operator_copy ();
 	test_operator_destroy ();
 	test_operator_update ();
+	test_operator_compile ();
 	test_operator_match ();
+	test_operator_match_benchmark ();
 	test_operator_handle ();
 	test_operator_environment ();
 	test_operator_events ();
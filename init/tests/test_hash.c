@@ -0,0 +1,317 @@
+/* upstart
+ *
+ * test_hash.c - test suite for init/hash.c
+ *
+ * Copyright © 2015 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/test.h>
+
+#include <stdio.h>
+#include <time.h>
+
+#include "hash.h"
+
+
+/**
+ * new_entry:
+ * @parent: parent for new entry,
+ * @key: key for new entry.
+ *
+ * Returns: new NihListEntry keyed by a copy of @key.
+ **/
+static NihListEntry *
+new_entry (const void *parent,
+	   const char *key)
+{
+	NihListEntry *entry;
+
+	entry = NIH_MUST (nih_list_entry_new (parent));
+	entry->str = NIH_MUST (nih_strdup (entry, key));
+
+	return entry;
+}
+
+
+void
+test_add (void)
+{
+	NihHash      *hash;
+	NihListEntry *entry;
+	NihListEntry *first;
+	NihList      *ret;
+	size_t        size;
+	char          key[32];
+
+	TEST_FUNCTION ("hash_add");
+
+	/* Check that adding an entry adds it to the table and returns it,
+	 * and that a table with few entries is left at its original size.
+	 */
+	TEST_FEATURE ("with few entries");
+	hash = NIH_MUST (nih_hash_string_new (NULL, 0));
+	size = hash->size;
+
+	entry = new_entry (hash, "foo");
+
+	ret = hash_add (hash, &entry->entry);
+
+	TEST_EQ_P (ret, &entry->entry);
+	TEST_EQ_P (nih_hash_lookup (hash, "foo"), &entry->entry);
+	TEST_EQ (hash->size, size);
+	TEST_EQ (hash_count (hash), 1);
+
+	nih_free (hash);
+
+
+	/* Check that adding many entries grows the table so that bins
+	 * stay short, and that every entry can still be found.
+	 */
+	TEST_FEATURE ("with many entries");
+	hash = NIH_MUST (nih_hash_string_new (NULL, 0));
+	size = hash->size;
+
+	for (int i = 0; i < 10000; i++) {
+		sprintf (key, "entry-%d", i);
+		entry = new_entry (hash, key);
+
+		hash_add (hash, &entry->entry);
+	}
+
+	TEST_GT (hash->size, size);
+	TEST_GT (hash->size * 4, 10000);
+	TEST_EQ (hash_count (hash), 10000);
+
+	for (int i = 0; i < 10000; i++) {
+		sprintf (key, "entry-%d", i);
+		entry = (NihListEntry *)nih_hash_lookup (hash, key);
+
+		TEST_NE_P (entry, NULL);
+		TEST_EQ_STR (entry->str, key);
+	}
+
+	nih_free (hash);
+
+
+	/* Check that entries sharing a key, which no size of table can
+	 * separate, do not grow the table at all, and are still found in
+	 * the order they were added.
+	 */
+	TEST_FEATURE ("with entries sharing a key");
+	hash = NIH_MUST (nih_hash_string_new (NULL, 0));
+	size = hash->size;
+
+	first = new_entry (hash, "foo");
+	hash_add (hash, &first->entry);
+
+	for (int i = 1; i < 1000; i++) {
+		entry = new_entry (hash, "foo");
+		hash_add (hash, &entry->entry);
+	}
+
+	TEST_EQ (hash->size, size);
+	TEST_EQ (hash_count (hash), 1000);
+	TEST_EQ_P (nih_hash_lookup (hash, "foo"), &first->entry);
+
+	ret = NULL;
+	for (int i = 0; i < 1000; i++) {
+		ret = nih_hash_search (hash, "foo", ret);
+		TEST_NE_P (ret, NULL);
+	}
+
+	TEST_EQ_P (ret, &entry->entry);
+	TEST_EQ_P (nih_hash_search (hash, "foo", ret), NULL);
+
+	nih_free (hash);
+}
+
+void
+test_resize (void)
+{
+	NihHash      *hash;
+	NihListEntry *entry;
+	NihList      *bins;
+	char          key[32];
+	int           ret;
+
+	TEST_FUNCTION ("hash_resize");
+
+	/* Check that resizing moves every entry into the new bins, and
+	 * that the table is unchanged if memory cannot be allocated.
+	 */
+	TEST_FEATURE ("with entries");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			hash = NIH_MUST (nih_hash_string_new (NULL, 0));
+
+			for (int i = 0; i < 100; i++) {
+				sprintf (key, "entry-%d", i);
+				entry = new_entry (hash, key);
+
+				nih_hash_add (hash, &entry->entry);
+			}
+		}
+
+		bins = hash->bins;
+
+		ret = hash_resize (hash, 331);
+
+		if (test_alloc_failed) {
+			TEST_LT (ret, 0);
+			TEST_EQ_P (hash->bins, bins);
+		} else {
+			TEST_EQ (ret, 0);
+			TEST_EQ (hash->size, 331);
+		}
+
+		TEST_EQ (hash_count (hash), 100);
+
+		for (int i = 0; i < 100; i++) {
+			sprintf (key, "entry-%d", i);
+			entry = (NihListEntry *)nih_hash_lookup (hash, key);
+
+			TEST_NE_P (entry, NULL);
+			TEST_EQ_STR (entry->str, key);
+		}
+
+		nih_free (hash);
+	}
+}
+
+void
+test_grow (void)
+{
+	NihHash      *hash;
+	NihListEntry *entry;
+	size_t        size;
+	char          key[32];
+
+	TEST_FUNCTION ("hash_grow");
+
+	/* Check that a table within its load limit is left alone. */
+	TEST_FEATURE ("with table within load limit");
+	hash = NIH_MUST (nih_hash_string_new (NULL, 0));
+	size = hash->size;
+
+	for (size_t i = 0; i < size * HASH_LOAD_MAX; i++) {
+		sprintf (key, "entry-%zu", i);
+		entry = new_entry (hash, key);
+
+		nih_hash_add (hash, &entry->entry);
+	}
+
+	TEST_EQ (hash_grow (hash), 0);
+	TEST_EQ (hash->size, size);
+
+	/* Check that a table beyond its load limit is resized to hold
+	 * twice its entries.
+	 */
+	TEST_FEATURE ("with table beyond load limit");
+	for (size_t i = size * HASH_LOAD_MAX; i < 1000; i++) {
+		sprintf (key, "entry-%zu", i);
+		entry = new_entry (hash, key);
+
+		nih_hash_add (hash, &entry->entry);
+	}
+
+	TEST_EQ (hash_grow (hash), 0);
+	TEST_GT (hash->size, 1999);
+	TEST_EQ (hash_count (hash), 1000);
+
+	nih_free (hash);
+}
+
+
+/**
+ * test_benchmark_lookup:
+ *
+ * Measure nih_hash_lookup() in tables of 10, 1,000 and 100,000 entries
+ * built with nih_hash_add(), which never grows the default sized table,
+ * and with hash_add().
+ **/
+void
+test_benchmark_lookup (void)
+{
+	const size_t     sizes[] = { 10, 1000, 100000 };
+	const size_t     lookups = 10000;
+	struct timespec  start;
+	struct timespec  end;
+	char             key[32];
+
+	TEST_GROUP ("hash lookup benchmark");
+
+	for (size_t s = 0; s < NIH_N_ELEMENTS (sizes); s++) {
+		double elapsed[2];
+
+		TEST_FEATURE (s == 0 ? "10 entries"
+			      : s == 1 ? "1000 entries" : "100000 entries");
+
+		for (int pass = 0; pass < 2; pass++) {
+			NihHash *hash;
+
+			hash = NIH_MUST (nih_hash_string_new (NULL, 0));
+
+			for (size_t i = 0; i < sizes[s]; i++) {
+				NihListEntry *entry;
+
+				sprintf (key, "entry-%zu", i);
+				entry = new_entry (hash, key);
+
+				if (pass) {
+					hash_add (hash, &entry->entry);
+				} else {
+					nih_hash_add (hash, &entry->entry);
+				}
+			}
+
+			assert0 (clock_gettime (CLOCK_MONOTONIC, &start));
+
+			for (size_t i = 0; i < lookups; i++) {
+				sprintf (key, "entry-%zu", (i * 7919) % sizes[s]);
+				TEST_NE_P (nih_hash_lookup (hash, key), NULL);
+			}
+
+			assert0 (clock_gettime (CLOCK_MONOTONIC, &end));
+
+			elapsed[pass] = ((end.tv_sec - start.tv_sec) * 1000.0
+					 + (end.tv_nsec - start.tv_nsec) / 1000000.0);
+
+			nih_free (hash);
+		}
+
+		printf ("\t%zu lookups, fixed %.3f ms, growing %.3f ms\n",
+			lookups, elapsed[0], elapsed[1]);
+	}
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	test_add ();
+	test_resize ();
+	test_grow ();
+
+	test_benchmark_lookup ();
+
+	return 0;
+}
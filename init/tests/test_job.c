@@ -62,6 +62,8 @@
 #include "state.h"
 #include "test_util_common.h"
 
+extern int skip_unobserved_events;
+
 void
 job_quit_with_state (void *data, NihMainLoopFunc *loop)
 {
@@ -4544,7 +4546,7 @@ test_finished (void)
 void
 test_emit_event (void)
 {
-	JobClass *class;
+	JobClass *class, *other;
 	Job      *job;
 	Event    *event;
 	Blocked  *blocked;
@@ -5673,6 +5675,124 @@ test_emit_event (void)
 	}
 
 	nih_free (class);
+
+
+	/* Check that when unobserved events are being skipped, no event
+	 * is emitted for a job in the starting state if no job class
+	 * refers to it.
+	 */
+	TEST_FEATURE ("with unobserved event skipped");
+	skip_unobserved_events = TRUE;
+
+	class = job_class_new (NULL, "test", NULL);
+
+	job = job_new (class, "");
+	job->goal = JOB_START;
+	job->state = JOB_STARTING;
+
+	TEST_ALLOC_FAIL {
+		event = job_emit_event (job);
+
+		TEST_EQ_P (event, NULL);
+		TEST_LIST_EMPTY (events);
+	}
+
+	nih_free (class);
+	skip_unobserved_events = FALSE;
+
+
+	/* Check that when unobserved events are being skipped, the event
+	 * is still emitted and blocks the job if a job class refers to it.
+	 */
+	TEST_FEATURE ("with observed event not skipped");
+	skip_unobserved_events = TRUE;
+
+	other = job_class_new (NULL, "other", NULL);
+	other->start_on = event_operator_new (other, EVENT_MATCH,
+					      "starting", NULL);
+	job_class_add_safe (other);
+
+	class = job_class_new (NULL, "test", NULL);
+
+	job = job_new (class, "");
+	job->goal = JOB_START;
+	job->state = JOB_STARTING;
+
+	TEST_ALLOC_FAIL {
+		event = job_emit_event (job);
+
+		TEST_ALLOC_SIZE (event, sizeof (Event));
+		TEST_EQ_STR (event->name, "starting");
+
+		TEST_LIST_NOT_EMPTY (&event->blocking);
+
+		blocked = (Blocked *)event->blocking.next;
+		TEST_EQ (blocked->type, BLOCKED_JOB);
+		TEST_EQ_P (blocked->job, job);
+		nih_free (blocked);
+
+		nih_free (event);
+	}
+
+	nih_free (class);
+	nih_free (other);
+
+	skip_unobserved_events = FALSE;
+}
+
+
+void
+test_poll_deferred (void)
+{
+	JobClass *class;
+	Job      *job;
+
+	TEST_FUNCTION ("job_poll_deferred");
+	skip_unobserved_events = TRUE;
+
+	class = job_class_new (NULL, "test", NULL);
+
+
+	/* Check that a job whose stopping event is skipped is left in the
+	 * stopping state rather than being run through to waiting, and
+	 * only carries on, and is destroyed, once polled.
+	 */
+	TEST_FEATURE ("with skipped stopping event");
+	job = job_new (class, "");
+	job->goal = JOB_STOP;
+	job->state = JOB_RUNNING;
+
+	job_change_state (job, JOB_STOPPING);
+
+	TEST_EQ (job->state, JOB_STOPPING);
+	TEST_EQ_P (job->blocker, NULL);
+	TEST_HASH_NOT_EMPTY (class->instances);
+
+	TEST_TRUE (job_poll_deferred ());
+
+	TEST_HASH_EMPTY (class->instances);
+	TEST_FALSE (job_poll_deferred ());
+
+
+	/* Check that a job freed while waiting to be polled is forgotten.
+	 */
+	TEST_FEATURE ("with freed job");
+	job = job_new (class, "");
+	job->goal = JOB_STOP;
+	job->state = JOB_RUNNING;
+
+	job_change_state (job, JOB_STOPPING);
+
+	TEST_EQ (job->state, JOB_STOPPING);
+
+	nih_free (job);
+
+	TEST_FALSE (job_poll_deferred ());
+
+
+	nih_free (class);
+
+	skip_unobserved_events = FALSE;
 }
 
 
@@ -7973,6 +8093,7 @@ main (int   argc,
 	test_failed ();
 	test_finished ();
 	test_emit_event ();
+	test_poll_deferred ();
 
 	test_name ();
 	test_goal_name ();
@@ -36,6 +36,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pwd.h>
 
 #include <nih/macros.h>
 #include <nih/alloc.h>
@@ -60,6 +61,7 @@
 #include "job.h"
 #include "conf.h"
 #include "control.h"
+#include "errors.h"
 
 
 void
@@ -153,11 +155,230 @@ test_new (void)
 
 		TEST_LIST_EMPTY (&class->cgroups);
 
+		TEST_FALSE (class->fast_spawn);
+
 		nih_free (class);
 	}
 }
 
 
+void
+test_fast_spawn (void)
+{
+	JobClass      *class;
+	struct rlimit  limit;
+
+	TEST_FUNCTION ("job_class_fast_spawn");
+	job_class_init ();
+
+	/* Check that the default class, which logs its output, may not be
+	 * spawned quickly.
+	 */
+	TEST_FEATURE ("with console log");
+	class = job_class_new (NULL, "test", NULL);
+
+	TEST_FALSE (job_class_fast_spawn (class));
+
+	nih_free (class);
+
+
+	/* Check that a class with no console and no other settings may be
+	 * spawned quickly.
+	 */
+	TEST_FEATURE ("with console none");
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+
+	TEST_TRUE (job_class_fast_spawn (class));
+
+	nih_free (class);
+
+
+	/* Check that a class whose main process is traced may not be
+	 * spawned quickly.
+	 */
+	TEST_FEATURE ("with expect daemon");
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+	class->expect = EXPECT_DAEMON;
+
+	TEST_FALSE (job_class_fast_spawn (class));
+
+	nih_free (class);
+
+
+	/* Check that a class with a working directory may not be spawned
+	 * quickly.
+	 */
+	TEST_FEATURE ("with chdir");
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+	class->chdir = "/tmp";
+
+	TEST_FALSE (job_class_fast_spawn (class));
+
+	nih_free (class);
+
+
+	/* Check that a class that changes user may not be spawned
+	 * quickly.
+	 */
+	TEST_FEATURE ("with setuid");
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+	class->setuid = "nobody";
+
+	TEST_FALSE (job_class_fast_spawn (class));
+
+	nih_free (class);
+
+
+	/* Check that a class with a resource limit may not be spawned
+	 * quickly.
+	 */
+	TEST_FEATURE ("with limit");
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+
+	limit.rlim_cur = limit.rlim_max = 1024;
+	class->limits[RLIMIT_NOFILE] = &limit;
+
+	TEST_FALSE (job_class_fast_spawn (class));
+
+	class->limits[RLIMIT_NOFILE] = NULL;
+	nih_free (class);
+}
+
+
+void
+test_credentials (void)
+{
+	JobClass       *class;
+	JobCredentials *creds;
+	struct passwd  *pwd;
+	NihError       *err;
+	time_t          resolved;
+
+	TEST_FUNCTION ("job_class_credentials");
+	job_class_init ();
+
+	/* Check that a class with no setuid or setgid stanza is given
+	 * credentials that leave the user and group unchanged, and the
+	 * supplementary groups of our own user if we're root.
+	 */
+	TEST_FEATURE ("with no setuid or setgid");
+	class = job_class_new (NULL, "test", NULL);
+
+	TEST_EQ (job_class_credentials (class), 0);
+
+	creds = class->credentials;
+	TEST_NE_P (creds, NULL);
+	TEST_ALLOC_PARENT (creds, class);
+	TEST_EQ (creds->uid, (uid_t)-1);
+	TEST_EQ (creds->gid, (gid_t)-1);
+
+	if (geteuid () == 0) {
+		TEST_NE_P (creds->groups, NULL);
+		TEST_GT (creds->ngroups, 0);
+	} else {
+		TEST_EQ_P (creds->groups, NULL);
+	}
+
+	nih_free (class);
+
+
+	/* Check that the user id and group id of the user named in the
+	 * setuid stanza are resolved, and kept for later calls.
+	 */
+	TEST_FEATURE ("with setuid");
+	class = job_class_new (NULL, "test", NULL);
+
+	pwd = getpwuid (getuid ());
+	TEST_NE_P (pwd, NULL);
+
+	class->setuid = nih_strdup (class, pwd->pw_name);
+
+	TEST_EQ (job_class_credentials (class), 0);
+
+	creds = class->credentials;
+	TEST_NE_P (creds, NULL);
+	TEST_EQ (creds->uid, pwd->pw_uid);
+	TEST_EQ (creds->gid, pwd->pw_gid);
+
+	TEST_EQ (job_class_credentials (class), 0);
+	TEST_EQ_P (class->credentials, creds);
+
+	nih_free (class);
+
+
+	/* Check that credentials are resolved again once they are older
+	 * than JOB_CREDENTIALS_TTL.
+	 */
+	TEST_FEATURE ("with expired credentials");
+	class = job_class_new (NULL, "test", NULL);
+
+	TEST_EQ (job_class_credentials (class), 0);
+	TEST_NE_P (class->credentials, NULL);
+
+	class->credentials->resolved -= JOB_CREDENTIALS_TTL;
+	resolved = class->credentials->resolved;
+
+	TEST_EQ (job_class_credentials (class), 0);
+	TEST_NE_P (class->credentials, NULL);
+	TEST_GT (class->credentials->resolved, resolved);
+
+	nih_free (class);
+
+
+	/* Check that a user that doesn't exist results in an error being
+	 * raised and no credentials being set.
+	 */
+	TEST_FEATURE ("with unknown user");
+	class = job_class_new (NULL, "test", NULL);
+	class->setuid = nih_strdup (class, "upstart-no-such-user");
+
+	TEST_LT (job_class_credentials (class), 0);
+	TEST_EQ_P (class->credentials, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, JOB_PROCESS_INVALID_SETUID);
+	nih_free (err);
+
+	nih_free (class);
+
+
+	/* Check that a group that doesn't exist results in an error being
+	 * raised and no credentials being set.
+	 */
+	TEST_FEATURE ("with unknown group");
+	class = job_class_new (NULL, "test", NULL);
+	class->setgid = nih_strdup (class, "upstart-no-such-group");
+
+	TEST_LT (job_class_credentials (class), 0);
+	TEST_EQ_P (class->credentials, NULL);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, JOB_PROCESS_INVALID_SETGID);
+	nih_free (err);
+
+	nih_free (class);
+
+
+	/* Check that nothing is resolved for a class with a chroot, since
+	 * the user must be looked up within it.
+	 */
+	TEST_FEATURE ("with chroot");
+	class = job_class_new (NULL, "test", NULL);
+	class->chroot = nih_strdup (class, "/tmp");
+	class->setuid = nih_strdup (class, "upstart-no-such-user");
+
+	TEST_EQ (job_class_credentials (class), 0);
+	TEST_EQ_P (class->credentials, NULL);
+
+	nih_free (class);
+}
+
+
 void
 test_consider (void)
 {
@@ -780,6 +1001,161 @@ test_reconsider (void)
 }
 
 
+void
+test_subscribers (void)
+{
+	JobClass      *class1, *class2;
+	EventOperator *oper;
+	NihList       *list;
+	JobClassSubscriber *subscriber;
+	int            ret;
+
+	TEST_FUNCTION ("job_class_subscribers");
+	job_class_init ();
+
+	class1 = job_class_new (NULL, "frodo", NULL);
+	class1->start_on = event_operator_new (class1, EVENT_AND, NULL, NULL);
+
+	oper = event_operator_new (class1->start_on, EVENT_MATCH,
+				   "foo", NULL);
+	nih_tree_add (&class1->start_on->node, &oper->node, NIH_TREE_LEFT);
+
+	oper = event_operator_new (class1->start_on, EVENT_MATCH,
+				   "foo", NULL);
+	nih_tree_add (&class1->start_on->node, &oper->node, NIH_TREE_RIGHT);
+
+	class1->stop_on = event_operator_new (class1, EVENT_MATCH,
+					      "bar", NULL);
+
+	class2 = job_class_new (NULL, "bilbo", NULL);
+	class2->start_on = event_operator_new (class2, EVENT_MATCH,
+					       "foo", NULL);
+
+
+	/* Check that an event not named by any registered class has
+	 * no subscribers.
+	 */
+	TEST_FEATURE ("with unknown event");
+	list = job_class_subscribers ("foo");
+
+	TEST_EQ_P (list, NULL);
+
+
+	/* Check that registering a class subscribes it once to each of
+	 * the events in its start on and stop on conditions, even when
+	 * an event is named more than once.
+	 */
+	TEST_FEATURE ("with registered class");
+	job_class_add_safe (class1);
+
+	list = job_class_subscribers ("foo");
+	TEST_NE_P (list, NULL);
+
+	subscriber = (JobClassSubscriber *)list->next;
+	TEST_ALLOC_PARENT (subscriber, class1);
+	TEST_EQ_P (subscriber->class, class1);
+	TEST_EQ_P (subscriber->entry.next, list);
+
+	list = job_class_subscribers ("bar");
+	TEST_NE_P (list, NULL);
+
+	subscriber = (JobClassSubscriber *)list->next;
+	TEST_EQ_P (subscriber->class, class1);
+	TEST_EQ_P (subscriber->entry.next, list);
+
+
+	/* Check that classes are subscribed in the order they were
+	 * registered.
+	 */
+	TEST_FEATURE ("with multiple registered classes");
+	job_class_add_safe (class2);
+
+	list = job_class_subscribers ("foo");
+	TEST_NE_P (list, NULL);
+
+	subscriber = (JobClassSubscriber *)list->next;
+	TEST_EQ_P (subscriber->class, class1);
+
+	subscriber = (JobClassSubscriber *)subscriber->entry.next;
+	TEST_EQ_P (subscriber->class, class2);
+	TEST_EQ_P (subscriber->entry.next, list);
+
+
+	/* Check that removing a class unsubscribes it, and that events
+	 * left with no subscribers are forgotten.
+	 */
+	TEST_FEATURE ("with removed class");
+	ret = job_class_reconsider (class1);
+
+	TEST_TRUE (ret);
+
+	list = job_class_subscribers ("foo");
+	TEST_NE_P (list, NULL);
+
+	subscriber = (JobClassSubscriber *)list->next;
+	TEST_EQ_P (subscriber->class, class2);
+	TEST_EQ_P (subscriber->entry.next, list);
+
+	list = job_class_subscribers ("bar");
+	TEST_EQ_P (list, NULL);
+
+	nih_free (class1);
+
+
+	/* Check that freeing a registered class removes it from the
+	 * subscriber lists, and that events left with no subscribers are
+	 * forgotten.
+	 */
+	TEST_FEATURE ("with freed class");
+	nih_free (class2);
+
+	list = job_class_subscribers ("foo");
+	TEST_EQ_P (list, NULL);
+
+
+	/* Check that a class is not subscribed twice to an event named in
+	 * both its start on and stop on conditions, even while the event
+	 * is being dispatched and the subscriber list holds an iteration
+	 * cursor.
+	 */
+	TEST_FEATURE ("with class registered during dispatch");
+	class1 = job_class_new (NULL, "frodo", NULL);
+	class1->start_on = event_operator_new (class1, EVENT_MATCH,
+					       "foo", NULL);
+
+	class2 = job_class_new (NULL, "bilbo", NULL);
+	class2->start_on = event_operator_new (class2, EVENT_MATCH,
+					       "foo", NULL);
+	class2->stop_on = event_operator_new (class2, EVENT_MATCH,
+					      "foo", NULL);
+
+	job_class_add_safe (class1);
+
+	list = job_class_subscribers ("foo");
+	TEST_NE_P (list, NULL);
+
+	NIH_LIST_FOREACH_SAFE (list, iter) {
+		subscriber = (JobClassSubscriber *)iter;
+
+		if (subscriber->class == class1)
+			job_class_add_safe (class2);
+	}
+
+	subscriber = (JobClassSubscriber *)list->next;
+	TEST_EQ_P (subscriber->class, class1);
+
+	subscriber = (JobClassSubscriber *)subscriber->entry.next;
+	TEST_EQ_P (subscriber->class, class2);
+	TEST_EQ_P (subscriber->entry.next, list);
+
+	nih_free (class1);
+	nih_free (class2);
+
+	list = job_class_subscribers ("foo");
+	TEST_EQ_P (list, NULL);
+}
+
+
 void
 test_register (void)
 {
@@ -3784,8 +4160,11 @@ main (int   argc,
 	setenv ("UPSTART_NO_SESSIONS", "1", 1);
 
 	test_new ();
+	test_fast_spawn ();
+	test_credentials ();
 	test_consider ();
 	test_reconsider ();
+	test_subscribers ();
 	test_register ();
 	test_unregister ();
 	test_environment ();
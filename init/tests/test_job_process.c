@@ -26,7 +26,9 @@
 #endif /* HAVE_VALGRIND_VALGRIND_H */
 
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <sys/ptrace.h>
 
@@ -42,9 +44,11 @@
 #include <dirent.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
 #include <pwd.h>
 #include <grp.h>
 #include <fnmatch.h>
+#include <fcntl.h>
 
 #include <nih/macros.h>
 #include <nih/string.h>
@@ -60,6 +64,9 @@
 #include "blocked.h"
 #include "conf.h"
 #include "errors.h"
+#include "spawner.h"
+#include "state.h"
+#include "hash.h"
 #include "test_util_common.h"
 
 #define EXPECTED_JOB_LOGDIR       "/var/log/upstart"
@@ -82,6 +89,9 @@
 /* number of iterations to perform to check file contents */
 #define MAX_ITERATIONS            5
 
+/* number of processes to spawn when measuring the spawn rate */
+#define TEST_SPAWN_RATE_COUNT     100
+
 /**
  * SHELL_CHARS:
  *
@@ -506,6 +516,9 @@ test_start (void)
 	pid_t            pid;
 	int              i;
 	siginfo_t        siginfo;
+#ifdef MFD_ALLOW_SEALING
+	int              fd;
+#endif
 
 	log_unflushed_init ();
 	job_class_init ();
@@ -676,6 +689,68 @@ test_start (void)
 	}
 
 
+	/* Check that a multi-line script is fed to the shell from a single
+	 * file created for the process, which is shared by each instance
+	 * that runs it.
+	 */
+	TEST_FEATURE ("with multi-line script run by two instances");
+	TEST_HASH_EMPTY (job_classes);
+
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+	class->process[PROCESS_MAIN] = process_new (class);
+	class->process[PROCESS_MAIN]->script = TRUE;
+	class->process[PROCESS_MAIN]->command = nih_sprintf (
+		class->process[PROCESS_MAIN],
+		"echo $UPSTART_INSTANCE >> %s\necho ok >> %s\n",
+		filename, filename);
+
+	job = job_new (class, "foo");
+	job->goal = JOB_START;
+	job->state = JOB_SPAWNED;
+
+	job_process_start (job, PROCESS_MAIN);
+
+	TEST_NE (job->pid[PROCESS_MAIN], 0);
+
+	waitpid (job->pid[PROCESS_MAIN], &status, 0);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+
+#ifdef MFD_ALLOW_SEALING
+	fd = class->process[PROCESS_MAIN]->script_fd;
+	TEST_GT (fd, 9);
+	TEST_EQ_P (job->process_data[PROCESS_MAIN]->script, NULL);
+#endif
+
+	job = job_new (class, "bar");
+	job->goal = JOB_START;
+	job->state = JOB_SPAWNED;
+
+	job_process_start (job, PROCESS_MAIN);
+
+	TEST_NE (job->pid[PROCESS_MAIN], 0);
+
+	waitpid (job->pid[PROCESS_MAIN], &status, 0);
+	TEST_TRUE (WIFEXITED (status));
+	TEST_EQ (WEXITSTATUS (status), 0);
+
+#ifdef MFD_ALLOW_SEALING
+	TEST_EQ (class->process[PROCESS_MAIN]->script_fd, fd);
+#endif
+
+	output = fopen (filename, "r");
+	TEST_FILE_EQ (output, "foo\n");
+	TEST_FILE_EQ (output, "ok\n");
+	TEST_FILE_EQ (output, "bar\n");
+	TEST_FILE_EQ (output, "ok\n");
+	TEST_FILE_END (output);
+	fclose (output);
+	unlink (filename);
+
+	nih_free (class);
+
+
 	/* Check that shell scripts are run with the -e option set, so that
 	 * any failing command causes the entire script to fail.
 	 */
@@ -4315,6 +4390,9 @@ test_spawn (void)
 	pid = job_process_spawn_with_fd (job, args, NULL, FALSE, -1, PROCESS_MAIN, &job_process_fd);
 	TEST_GT (pid, 0);
 
+	/* Nothing to resolve for a job that runs as ourselves */
+	TEST_EQ_P (class->credentials, NULL);
+
 	waitpid (pid, NULL, 0);
 	output = fopen (filename, "r");
 
@@ -5318,183 +5396,656 @@ test_spawn (void)
 }
 
 void
-test_log_path (void)
+test_spawner (void)
 {
-	JobClass        *class = NULL;
-	Job             *job = NULL;
-	nih_local char  *log_path = NULL;
-	nih_local char  *expected = NULL;
-	nih_local char  *home = NULL;
-	char             dirname[PATH_MAX];
+	FILE                   *output;
+	char                    function[PATH_MAX], filename[PATH_MAX];
+	char                    dirname[PATH_MAX];
+	char                    buf[80];
+	char                   *args[4];
+	JobClass               *class;
+	Job                    *job;
+	pid_t                   pid;
+	pid_t                   pid_of_spawner;
+	NihError               *err;
+	JobProcessError        *perr;
+	int                     job_process_fd = -1;
+	nih_local NihIoBuffer  *buffer = NULL;
+	static char             request[SPAWNER_REQUEST_MAX];
+	char                    control[CMSG_SPACE (sizeof (int) * 2)];
+	struct msghdr           msg;
+	struct iovec            iov;
+	struct cmsghdr         *cmsg;
+	int                     sock[2], fds[2];
+	int                     timeout, status;
 
-	TEST_FILENAME (dirname);       
+	TEST_FILENAME (dirname);
+	TEST_EQ (mkdir (dirname, 0755), 0);
 
-	TEST_FUNCTION ("job_process_log_path");
+	TEST_EQ (setenv ("UPSTART_LOGDIR", dirname, 1), 0);
 
-	/************************************************************/
-	TEST_FEATURE ("with system job with simple name");
-	TEST_HASH_EMPTY (job_classes);
+	TEST_FUNCTION ("spawner_spawn");
+	TEST_FILENAME (filename);
 
-	class = job_class_new (NULL, "system", NULL);
-	TEST_NE_P (class, NULL);
-	job = job_new (class, "");
-	TEST_NE_P (job, NULL);
+	TEST_EQ (spawner_start (), 0);
+	TEST_TRUE (spawner_available ());
+	TEST_GT (spawner_pid, 0);
 
-	log_path = job_process_log_path (job, FALSE);
-	TEST_NE_P (log_path, NULL);
+	pid_of_spawner = spawner_pid;
 
-	expected = NIH_MUST (nih_sprintf (NULL, "%s/%s.log",
-				EXPECTED_JOB_LOGDIR, "system"));
-	TEST_EQ_STR (log_path, expected);
-	nih_free (class);
+	args[0] = argv0;
+	args[1] = function;
+	args[2] = filename;
+	args[3] = NULL;
 
-	/************************************************************/
-	TEST_FEATURE ("with system job containing illegal path characters");
+	/* Check that a job spawned by the spawner is our child rather than
+	 * the spawner's, and is otherwise set up exactly as if we had
+	 * forked it ourselves.
+	 */
+	TEST_FEATURE ("with simple job");
 	TEST_HASH_EMPTY (job_classes);
 
-	class = job_class_new (NULL, "//hello_foo bar.z/", NULL);
-	TEST_NE_P (class, NULL);
-	job = job_new (class, "");
-	TEST_NE_P (job, NULL);
+	sprintf (function, "%d", TEST_PIDS);
 
-	log_path = job_process_log_path (job, FALSE);
-	TEST_NE_P (log_path, NULL);
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+	job   = job_new (class, "");
 
-	expected = NIH_MUST (nih_sprintf (NULL, "%s/%s.log",
-				EXPECTED_JOB_LOGDIR, "__hello_foo bar.z_"));
-	TEST_EQ_STR (log_path, expected);
-	nih_free (class);
+	pid = job_process_spawn_with_fd (job, args, NULL, FALSE, -1, PROCESS_MAIN, &job_process_fd);
+	TEST_GT (pid, 0);
+	TEST_NE (pid, spawner_pid);
 
-	/************************************************************/
-	TEST_FEATURE ("with system job with named instance");
-	TEST_HASH_EMPTY (job_classes);
+	TEST_EQ (waitpid (pid, NULL, 0), pid);
+	output = fopen (filename, "r");
 
-	class = job_class_new (NULL, "foo bar", NULL);
-	TEST_NE_P (class, NULL);
-	job = job_new (class, "bar foo");
-	TEST_NE_P (job, NULL);
+	sprintf (buf, "pid: %d\n", pid);
+	TEST_FILE_EQ (output, buf);
 
-	log_path = job_process_log_path (job, FALSE);
-	TEST_NE_P (log_path, NULL);
+	sprintf (buf, "ppid: %d\n", getpid ());
+	TEST_FILE_EQ (output, buf);
 
-	expected = NIH_MUST (nih_sprintf (NULL, "%s/%s.log",
-				EXPECTED_JOB_LOGDIR, "foo bar-bar foo"));
-	TEST_EQ_STR (log_path, expected);
-	nih_free (class);
+	sprintf (buf, "pgrp: %d\n", pid);
+	TEST_FILE_EQ (output, buf);
 
-	/************************************************************/
-	TEST_FEATURE ("with system job with named instance and illegal path characters");
-	TEST_HASH_EMPTY (job_classes);
+	sprintf (buf, "sid: %d\n", pid);
+	TEST_FILE_EQ (output, buf);
 
-	class = job_class_new (NULL, "a/b", NULL);
-	TEST_NE_P (class, NULL);
-	job = job_new (class, "c/d_?/");
-	TEST_NE_P (job, NULL);
+	TEST_FILE_END (output);
 
-	log_path = job_process_log_path (job, FALSE);
-	TEST_NE_P (log_path, NULL);
+	fclose (output);
+	assert0 (unlink (filename));
+	close (job_process_fd);
 
-	expected = NIH_MUST (nih_sprintf (NULL, "%s/%s.log",
-				EXPECTED_JOB_LOGDIR, "a_b-c_d_?_"));
-	TEST_EQ_STR (log_path, expected);
 	nih_free (class);
 
-	/************************************************************/
-	TEST_FEATURE ("with subverted logdir and system job with named instance and illegal path characters");
+
+	/* Check that a job spawned by the spawner with a log console has
+	 * its output bound to the pseudo-tty we created.
+	 */
+	TEST_FEATURE ("with console logging");
 	TEST_HASH_EMPTY (job_classes);
 
-	TEST_EQ (setenv ("UPSTART_LOGDIR", dirname, 1), 0);
+	sprintf (function, "%d", TEST_CONSOLE);
 
-	class = job_class_new (NULL, "a/b", NULL);
-	TEST_NE_P (class, NULL);
-	job = job_new (class, "c/d_?/");
-	TEST_NE_P (job, NULL);
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_LOG;
+	job = job_new (class, "");
 
-	log_path = job_process_log_path (job, FALSE);
-	TEST_NE_P (log_path, NULL);
+	pid = job_process_spawn_with_fd (job, args, NULL, FALSE, -1, PROCESS_MAIN, &job_process_fd);
+	TEST_GT (pid, 0);
+	TEST_TRUE (spawner_available ());
 
-	expected = NIH_MUST (nih_sprintf (NULL, "%s/%s.log",
-				dirname, "a_b-c_d_?_"));
-	TEST_EQ_STR (log_path, expected);
-	nih_free (class);
+	TEST_EQ (waitpid (pid, NULL, 0), pid);
+	output = fopen (filename, "r");
 
-	TEST_EQ (unsetenv ("UPSTART_LOGDIR"), 0);
-	TEST_HASH_EMPTY (job_classes);
-}
+	TEST_FILE_EQ (output, "0: 1 3\n");
 
+	{
+		unsigned int major, saved_major;
+		unsigned int unused;
 
-void
-test_kill (void)
-{
-	JobClass *      class;
-	Job *           job = NULL;
-	NihTimer *      timer;
-	struct timespec now;
-	pid_t           pid;
-	int             status;
+		TEST_EQ (fscanf (output, "1: %u %u\n", &major, &unused), 2);
+		TEST_TRUE (major >= 136 && major <= 143);
+		saved_major = major;
 
-	TEST_FUNCTION ("job_process_kill");
-	nih_timer_init ();
-	event_init ();
+		TEST_EQ (fscanf (output, "2: %u %u\n", &major, &unused), 2);
+		TEST_TRUE (major == saved_major);
+	}
 
-	class = job_class_new (NULL, "test", NULL);
-	class->kill_timeout = 1000;
+	TEST_FILE_END (output);
 
-	class->process[PROCESS_MAIN] = process_new (class);
-	class->process[PROCESS_MAIN]->command = nih_strdup (
-		class->process[PROCESS_MAIN], "echo");
+	fclose (output);
+	assert0 (unlink (filename));
+	close (job_process_fd);
 
+	nih_free (class);
 
-	/* Check that an easily killed process goes away with just a single
-	 * call to job_process_kill, having received the TERM signal.
-	 * A kill timer should be set to handle the case where the child
-	 * doesn't get reaped.
+
+	/* Check that an error setting up a job spawned by the spawner is
+	 * returned over the child setup pipe just as it is for a job we
+	 * forked ourselves.
 	 */
-	TEST_FEATURE ("with easily killed process");
-	TEST_ALLOC_FAIL {
-		TEST_ALLOC_SAFE {
-			job = job_new (class, "");
-		}
+	TEST_FEATURE ("with no such file");
+	TEST_HASH_EMPTY (job_classes);
 
-		job->goal = JOB_STOP;
-		job->state = JOB_KILLED;
-		TEST_CHILD (job->pid[PROCESS_MAIN]) {
-			pause ();
-		}
-		pid = job->pid[PROCESS_MAIN];
-		setpgid (pid, pid);
+	args[0] = filename;
+	args[1] = filename;
+	args[2] = NULL;
 
-		job_process_kill (job, PROCESS_MAIN);
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+	job   = job_new (class, "");
 
-		TEST_EQ (job->goal, JOB_STOP);
-		TEST_EQ (job->state, JOB_KILLED);
-		TEST_EQ (job->pid[PROCESS_MAIN], pid);
+	pid = job_process_spawn_with_fd (job, args, NULL, FALSE, -1, PROCESS_MAIN, &job_process_fd);
+	TEST_GT (pid, 0);
+	TEST_TRUE (spawner_available ());
 
-		waitpid (job->pid[PROCESS_MAIN], &status, 0);
-		TEST_TRUE (WIFSIGNALED (status));
-		TEST_EQ (WTERMSIG (status), SIGTERM);
+	TEST_EQ (waitpid (pid, NULL, 0), pid);
 
-		assert0 (clock_gettime (CLOCK_MONOTONIC, &now));
+	buffer = read_from_fd (NULL, job_process_fd);
+	TEST_NE_P (buffer, NULL);
+	job_process_error_handler (buffer->buf, buffer->len);
 
-		TEST_NE_P (job->kill_timer, NULL);
-		TEST_ALLOC_SIZE (job->kill_timer, sizeof (NihTimer));
-		TEST_ALLOC_PARENT (job->kill_timer, job);
-		TEST_GE (job->kill_timer->due, now.tv_sec + 950);
-		TEST_LE (job->kill_timer->due, now.tv_sec + 1000);
+	err = nih_error_get ();
+	TEST_EQ (err->number, JOB_PROCESS_ERROR);
+	TEST_ALLOC_SIZE (err, sizeof (JobProcessError));
 
-		TEST_EQ (job->kill_process, PROCESS_MAIN);
+	perr = (JobProcessError *)err;
+	TEST_EQ (perr->type, JOB_PROCESS_ERROR_EXEC);
+	TEST_EQ (perr->arg, 0);
+	TEST_EQ (perr->errnum, ENOENT);
+	nih_free (perr);
 
-		nih_free (job->kill_timer);
-		job->kill_timer = NULL;
-		job->kill_process = PROCESS_INVALID;
+	nih_free (class);
 
-		nih_free (job);
 
-		event_poll ();
-	}
+	/* Check that once the spawner has been stopped, jobs are spawned
+	 * by ourselves again.
+	 */
+	TEST_FEATURE ("with spawner stopped");
+	TEST_HASH_EMPTY (job_classes);
 
+	spawner_stop ();
+	TEST_FALSE (spawner_available ());
+	TEST_EQ (waitpid (pid_of_spawner, NULL, 0), pid_of_spawner);
 
-	/* Check that a process that's hard to kill doesn't go away, but
+	args[0] = argv0;
+	args[1] = function;
+	args[2] = filename;
+	args[3] = NULL;
+
+	sprintf (function, "%d", TEST_PIDS);
+
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+	job   = job_new (class, "");
+
+	pid = job_process_spawn_with_fd (job, args, NULL, FALSE, -1, PROCESS_MAIN, &job_process_fd);
+	TEST_GT (pid, 0);
+
+	TEST_EQ (waitpid (pid, NULL, 0), pid);
+	output = fopen (filename, "r");
+
+	sprintf (buf, "pid: %d\n", pid);
+	TEST_FILE_EQ (output, buf);
+
+	sprintf (buf, "ppid: %d\n", getpid ());
+	TEST_FILE_EQ (output, buf);
+
+	fclose (output);
+	assert0 (unlink (filename));
+	close (job_process_fd);
+
+	nih_free (class);
+
+
+	/* Check that should the spawner not reply in time, it is killed
+	 * and the job spawned by ourselves instead, and that the gate any
+	 * process it did create waits at is closed so that process exits.
+	 */
+	TEST_FEATURE ("with spawner not replying");
+	TEST_HASH_EMPTY (job_classes);
+
+	assert0 (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sock));
+
+	TEST_CHILD (pid_of_spawner) {
+		pause ();
+	}
+
+	spawner_fd = sock[0];
+	spawner_pid = pid_of_spawner;
+
+	timeout = spawner_reply_timeout;
+	spawner_reply_timeout = 100;
+
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+	job   = job_new (class, "");
+
+	pid = job_process_spawn_with_fd (job, args, NULL, FALSE, -1, PROCESS_MAIN, &job_process_fd);
+	TEST_GT (pid, 0);
+	TEST_NE (pid, pid_of_spawner);
+	TEST_FALSE (spawner_available ());
+
+	TEST_EQ (waitpid (pid_of_spawner, &status, 0), pid_of_spawner);
+	TEST_TRUE (WIFSIGNALED (status));
+	TEST_EQ (WTERMSIG (status), SIGKILL);
+
+	TEST_EQ (waitpid (pid, NULL, 0), pid);
+	output = fopen (filename, "r");
+
+	sprintf (buf, "pid: %d\n", pid);
+	TEST_FILE_EQ (output, buf);
+
+	sprintf (buf, "ppid: %d\n", getpid ());
+	TEST_FILE_EQ (output, buf);
+
+	fclose (output);
+	assert0 (unlink (filename));
+	close (job_process_fd);
+
+	iov.iov_base = request;
+	iov.iov_len = sizeof (request);
+
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof (control);
+
+	TEST_GT (recvmsg (sock[1], &msg, 0), 0);
+
+	cmsg = CMSG_FIRSTHDR (&msg);
+	TEST_NE_P (cmsg, NULL);
+	TEST_EQ (cmsg->cmsg_len, CMSG_LEN (sizeof (int) * 2));
+	memcpy (fds, CMSG_DATA (cmsg), sizeof (fds));
+
+	TEST_EQ (read (fds[1], buf, 1), 0);
+
+	close (fds[0]);
+	close (fds[1]);
+	close (sock[1]);
+
+	spawner_reply_timeout = timeout;
+
+	nih_free (class);
+
+	assert0 (rmdir (dirname));
+	TEST_EQ (unsetenv ("UPSTART_LOGDIR"), 0);
+}
+
+void
+test_spawn_fast (void)
+{
+	FILE                   *output;
+	char                    function[PATH_MAX], filename[PATH_MAX];
+	char                    buf[80];
+	char                   *args[4];
+	JobClass               *class;
+	Job                    *job;
+	pid_t                   pid;
+	NihError               *err;
+	JobProcessError        *perr;
+	int                     job_process_fd = -1;
+	nih_local NihIoBuffer  *buffer = NULL;
+
+	TEST_FUNCTION ("job_process_spawn_with_fd");
+	TEST_FILENAME (filename);
+
+	args[0] = argv0;
+	args[1] = function;
+	args[2] = filename;
+	args[3] = NULL;
+
+	/* Check that a job whose class may be spawned quickly is set up
+	 * as if it had been forked, and that its setup pipe is already
+	 * closed.
+	 */
+	TEST_FEATURE ("with fast spawn");
+	TEST_HASH_EMPTY (job_classes);
+
+	sprintf (function, "%d", TEST_PIDS);
+
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+	class->fast_spawn = job_class_fast_spawn (class);
+	TEST_TRUE (class->fast_spawn);
+	job   = job_new (class, "");
+
+	pid = job_process_spawn_with_fd (job, args, NULL, FALSE, -1, PROCESS_MAIN, &job_process_fd);
+	TEST_GT (pid, 0);
+
+	buffer = read_from_fd (NULL, job_process_fd);
+	TEST_NE_P (buffer, NULL);
+	TEST_EQ (buffer->len, 0);
+	nih_free (buffer);
+	buffer = NULL;
+
+	TEST_EQ (waitpid (pid, NULL, 0), pid);
+	output = fopen (filename, "r");
+
+	sprintf (buf, "pid: %d\n", pid);
+	TEST_FILE_EQ (output, buf);
+
+	sprintf (buf, "ppid: %d\n", getpid ());
+	TEST_FILE_EQ (output, buf);
+
+	sprintf (buf, "pgrp: %d\n", pid);
+	TEST_FILE_EQ (output, buf);
+
+	sprintf (buf, "sid: %d\n", pid);
+	TEST_FILE_EQ (output, buf);
+
+	TEST_FILE_END (output);
+
+	fclose (output);
+	assert0 (unlink (filename));
+
+	nih_free (class);
+
+
+	/* Check that a job spawned quickly has its standard file
+	 * descriptors bound to the /dev/null device.
+	 */
+	TEST_FEATURE ("with fast spawn and no console");
+	TEST_HASH_EMPTY (job_classes);
+
+	sprintf (function, "%d", TEST_CONSOLE);
+
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+	class->fast_spawn = job_class_fast_spawn (class);
+	job = job_new (class, "");
+
+	pid = job_process_spawn_with_fd (job, args, NULL, FALSE, -1, PROCESS_MAIN, &job_process_fd);
+	TEST_GT (pid, 0);
+
+	TEST_EQ (waitpid (pid, NULL, 0), pid);
+	output = fopen (filename, "r");
+
+	TEST_FILE_EQ (output, "0: 1 3\n");
+	TEST_FILE_EQ (output, "1: 1 3\n");
+	TEST_FILE_EQ (output, "2: 1 3\n");
+	TEST_FILE_END (output);
+
+	fclose (output);
+	assert0 (unlink (filename));
+	close (job_process_fd);
+
+	nih_free (class);
+
+
+	/* Check that a job that cannot be executed is still reported over
+	 * the child setup pipe, since it is spawned again the usual way.
+	 */
+	TEST_FEATURE ("with fast spawn and no such file");
+	TEST_HASH_EMPTY (job_classes);
+
+	args[0] = filename;
+	args[1] = NULL;
+
+	class = job_class_new (NULL, "test", NULL);
+	class->console = CONSOLE_NONE;
+	class->fast_spawn = job_class_fast_spawn (class);
+	job   = job_new (class, "");
+
+	pid = job_process_spawn_with_fd (job, args, NULL, FALSE, -1, PROCESS_MAIN, &job_process_fd);
+	TEST_GT (pid, 0);
+
+	TEST_EQ (waitpid (pid, NULL, 0), pid);
+
+	buffer = read_from_fd (NULL, job_process_fd);
+	TEST_NE_P (buffer, NULL);
+	job_process_error_handler (buffer->buf, buffer->len);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, JOB_PROCESS_ERROR);
+
+	perr = (JobProcessError *)err;
+	TEST_EQ (perr->type, JOB_PROCESS_ERROR_EXEC);
+	TEST_EQ (perr->errnum, ENOENT);
+	nih_free (perr);
+
+	nih_free (class);
+}
+
+
+void
+test_spawn_rate (void)
+{
+	char             *args[2];
+	JobClass         *class;
+	Job              *job;
+	pid_t             pid;
+	int               job_process_fd = -1;
+	struct timespec   start, end;
+	double            secs;
+	int               fast;
+	int               i;
+
+	TEST_FUNCTION ("job_process_spawn_with_fd");
+
+	args[0] = "/bin/true";
+	args[1] = NULL;
+
+	/* Benchmark the number of processes that can be spawned, and
+	 * reaped, each second both with and without the fast path; the
+	 * only check is that all were spawned.
+	 */
+	for (fast = FALSE; fast <= TRUE; fast++) {
+		TEST_FEATURE (fast ? "with spawn rate of /bin/true (fast)"
+			      : "with spawn rate of /bin/true");
+		TEST_HASH_EMPTY (job_classes);
+
+		class = job_class_new (NULL, "test", NULL);
+		class->console = CONSOLE_NONE;
+		class->fast_spawn = fast ? job_class_fast_spawn (class) : FALSE;
+		job = job_new (class, "");
+
+		assert0 (clock_gettime (CLOCK_MONOTONIC, &start));
+
+		for (i = 0; i < TEST_SPAWN_RATE_COUNT; i++) {
+			pid = job_process_spawn_with_fd (job, args, NULL, FALSE,
+							 -1, PROCESS_MAIN,
+							 &job_process_fd);
+			TEST_GT (pid, 0);
+
+			TEST_EQ (waitpid (pid, NULL, 0), pid);
+			close (job_process_fd);
+		}
+
+		assert0 (clock_gettime (CLOCK_MONOTONIC, &end));
+
+		secs = (end.tv_sec - start.tv_sec)
+			+ (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+		TEST_GT (secs, 0);
+
+		printf ("...%d spawns in %.3fs (%.0f spawns/sec)\n",
+			TEST_SPAWN_RATE_COUNT, secs,
+			TEST_SPAWN_RATE_COUNT / secs);
+
+		nih_free (class);
+	}
+}
+
+void
+test_log_path (void)
+{
+	JobClass        *class = NULL;
+	Job             *job = NULL;
+	nih_local char  *log_path = NULL;
+	nih_local char  *expected = NULL;
+	nih_local char  *home = NULL;
+	char             dirname[PATH_MAX];
+
+	TEST_FILENAME (dirname);       
+
+	TEST_FUNCTION ("job_process_log_path");
+
+	/************************************************************/
+	TEST_FEATURE ("with system job with simple name");
+	TEST_HASH_EMPTY (job_classes);
+
+	class = job_class_new (NULL, "system", NULL);
+	TEST_NE_P (class, NULL);
+	job = job_new (class, "");
+	TEST_NE_P (job, NULL);
+
+	log_path = job_process_log_path (job, FALSE);
+	TEST_NE_P (log_path, NULL);
+
+	expected = NIH_MUST (nih_sprintf (NULL, "%s/%s.log",
+				EXPECTED_JOB_LOGDIR, "system"));
+	TEST_EQ_STR (log_path, expected);
+	nih_free (class);
+
+	/************************************************************/
+	TEST_FEATURE ("with system job containing illegal path characters");
+	TEST_HASH_EMPTY (job_classes);
+
+	class = job_class_new (NULL, "//hello_foo bar.z/", NULL);
+	TEST_NE_P (class, NULL);
+	job = job_new (class, "");
+	TEST_NE_P (job, NULL);
+
+	log_path = job_process_log_path (job, FALSE);
+	TEST_NE_P (log_path, NULL);
+
+	expected = NIH_MUST (nih_sprintf (NULL, "%s/%s.log",
+				EXPECTED_JOB_LOGDIR, "__hello_foo bar.z_"));
+	TEST_EQ_STR (log_path, expected);
+	nih_free (class);
+
+	/************************************************************/
+	TEST_FEATURE ("with system job with named instance");
+	TEST_HASH_EMPTY (job_classes);
+
+	class = job_class_new (NULL, "foo bar", NULL);
+	TEST_NE_P (class, NULL);
+	job = job_new (class, "bar foo");
+	TEST_NE_P (job, NULL);
+
+	log_path = job_process_log_path (job, FALSE);
+	TEST_NE_P (log_path, NULL);
+
+	expected = NIH_MUST (nih_sprintf (NULL, "%s/%s.log",
+				EXPECTED_JOB_LOGDIR, "foo bar-bar foo"));
+	TEST_EQ_STR (log_path, expected);
+	nih_free (class);
+
+	/************************************************************/
+	TEST_FEATURE ("with system job with named instance and illegal path characters");
+	TEST_HASH_EMPTY (job_classes);
+
+	class = job_class_new (NULL, "a/b", NULL);
+	TEST_NE_P (class, NULL);
+	job = job_new (class, "c/d_?/");
+	TEST_NE_P (job, NULL);
+
+	log_path = job_process_log_path (job, FALSE);
+	TEST_NE_P (log_path, NULL);
+
+	expected = NIH_MUST (nih_sprintf (NULL, "%s/%s.log",
+				EXPECTED_JOB_LOGDIR, "a_b-c_d_?_"));
+	TEST_EQ_STR (log_path, expected);
+	nih_free (class);
+
+	/************************************************************/
+	TEST_FEATURE ("with subverted logdir and system job with named instance and illegal path characters");
+	TEST_HASH_EMPTY (job_classes);
+
+	TEST_EQ (setenv ("UPSTART_LOGDIR", dirname, 1), 0);
+
+	class = job_class_new (NULL, "a/b", NULL);
+	TEST_NE_P (class, NULL);
+	job = job_new (class, "c/d_?/");
+	TEST_NE_P (job, NULL);
+
+	log_path = job_process_log_path (job, FALSE);
+	TEST_NE_P (log_path, NULL);
+
+	expected = NIH_MUST (nih_sprintf (NULL, "%s/%s.log",
+				dirname, "a_b-c_d_?_"));
+	TEST_EQ_STR (log_path, expected);
+	nih_free (class);
+
+	TEST_EQ (unsetenv ("UPSTART_LOGDIR"), 0);
+	TEST_HASH_EMPTY (job_classes);
+}
+
+
+void
+test_kill (void)
+{
+	JobClass *      class;
+	Job *           job = NULL;
+	NihTimer *      timer;
+	struct timespec now;
+	pid_t           pid;
+	int             status;
+
+	TEST_FUNCTION ("job_process_kill");
+	nih_timer_init ();
+	event_init ();
+
+	class = job_class_new (NULL, "test", NULL);
+	class->kill_timeout = 1000;
+
+	class->process[PROCESS_MAIN] = process_new (class);
+	class->process[PROCESS_MAIN]->command = nih_strdup (
+		class->process[PROCESS_MAIN], "echo");
+
+
+	/* Check that an easily killed process goes away with just a single
+	 * call to job_process_kill, having received the TERM signal.
+	 * A kill timer should be set to handle the case where the child
+	 * doesn't get reaped.
+	 */
+	TEST_FEATURE ("with easily killed process");
+	TEST_ALLOC_FAIL {
+		TEST_ALLOC_SAFE {
+			job = job_new (class, "");
+		}
+
+		job->goal = JOB_STOP;
+		job->state = JOB_KILLED;
+		TEST_CHILD (job->pid[PROCESS_MAIN]) {
+			pause ();
+		}
+		pid = job->pid[PROCESS_MAIN];
+		setpgid (pid, pid);
+
+		job_process_kill (job, PROCESS_MAIN);
+
+		TEST_EQ (job->goal, JOB_STOP);
+		TEST_EQ (job->state, JOB_KILLED);
+		TEST_EQ (job->pid[PROCESS_MAIN], pid);
+
+		waitpid (job->pid[PROCESS_MAIN], &status, 0);
+		TEST_TRUE (WIFSIGNALED (status));
+		TEST_EQ (WTERMSIG (status), SIGTERM);
+
+		assert0 (clock_gettime (CLOCK_MONOTONIC, &now));
+
+		TEST_NE_P (job->kill_timer, NULL);
+		TEST_ALLOC_SIZE (job->kill_timer, sizeof (NihTimer));
+		TEST_ALLOC_PARENT (job->kill_timer, job);
+		TEST_GE (job->kill_timer->due, now.tv_sec + 950);
+		TEST_LE (job->kill_timer->due, now.tv_sec + 1000);
+
+		TEST_EQ (job->kill_process, PROCESS_MAIN);
+
+		nih_free (job->kill_timer);
+		job->kill_timer = NULL;
+		job->kill_process = PROCESS_INVALID;
+
+		nih_free (job);
+
+		event_poll ();
+	}
+
+
+	/* Check that a process that's hard to kill doesn't go away, but
 	 * that the kill timer sends the KILL signal which should finally
 	 * get rid of it.
 	 */
@@ -5632,7 +6183,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -5683,7 +6234,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -5748,7 +6299,7 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_KILLED;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -5799,7 +6350,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_KILLED;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -5883,8 +6434,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_PRE_START;
-		job->pid[PROCESS_MAIN] = 0;
-		job->pid[PROCESS_PRE_START] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 0);
+		job_process_set_pid (job, PROCESS_PRE_START, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -5948,7 +6499,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_PRE_START;
-		job->pid[PROCESS_PRE_START] = 1;
+		job_process_set_pid (job, PROCESS_PRE_START, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6023,7 +6574,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_PRE_START;
-		job->pid[PROCESS_PRE_START] = 1;
+		job_process_set_pid (job, PROCESS_PRE_START, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6102,7 +6653,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6190,7 +6741,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6280,7 +6831,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6357,7 +6908,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6427,7 +6978,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6508,7 +7059,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6576,7 +7127,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6647,7 +7198,7 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_KILLED;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6698,7 +7249,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6766,7 +7317,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6838,7 +7389,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6902,7 +7453,7 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_POST_STOP;
-		job->pid[PROCESS_POST_STOP] = 1;
+		job_process_set_pid (job, PROCESS_POST_STOP, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -6947,7 +7498,7 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_POST_STOP;
-		job->pid[PROCESS_POST_STOP] = 1;
+		job_process_set_pid (job, PROCESS_POST_STOP, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7000,7 +7551,7 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_POST_STOP;
-		job->pid[PROCESS_POST_STOP] = 1;
+		job_process_set_pid (job, PROCESS_POST_STOP, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7055,8 +7606,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_POST_START;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_POST_START] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_POST_START, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7120,7 +7671,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_POST_START;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7189,8 +7740,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_POST_START;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_POST_START] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_POST_START, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7249,8 +7800,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_POST_START;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_POST_START] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_POST_START, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7340,8 +7891,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_POST_START;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_POST_START] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_POST_START, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7440,8 +7991,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_POST_START;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_POST_START] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_POST_START, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7547,8 +8098,8 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_PRE_STOP;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_PRE_STOP] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_PRE_STOP, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7625,7 +8176,7 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_PRE_STOP;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7693,8 +8244,8 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_PRE_STOP;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_PRE_STOP] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_PRE_STOP, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7757,8 +8308,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_PRE_STOP;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_PRE_STOP] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_PRE_STOP, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7867,8 +8418,8 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_PRE_STOP;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_PRE_STOP] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_PRE_STOP, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -7966,7 +8517,7 @@ test_handler (void)
 
 		job->goal = JOB_STOP;
 		job->state = JOB_STOPPING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -8038,8 +8589,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = 1;
-		job->pid[PROCESS_POST_START] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
+		job_process_set_pid (job, PROCESS_POST_START, pid);
 
 		TEST_FREE_TAG (blocked);
 
@@ -8111,8 +8662,8 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_POST_START;
-		job->pid[PROCESS_MAIN] = pid;
-		job->pid[PROCESS_POST_START] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
+		job_process_set_pid (job, PROCESS_POST_START, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -8182,7 +8733,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_FREE_TAG (blocked);
 
@@ -8255,7 +8806,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_FREE_TAG (blocked);
 
@@ -8327,7 +8878,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_FREE_TAG (blocked);
 
@@ -8393,7 +8944,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid,
@@ -8440,7 +8991,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid,
@@ -8488,7 +9039,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid,
@@ -8537,7 +9088,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid,
@@ -8587,7 +9138,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid,
@@ -8662,7 +9213,7 @@ test_handler (void)
 		/* Now carry on with the test */
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid, NIH_CHILD_PTRACE,
@@ -8731,7 +9282,7 @@ test_handler (void)
 		/* Now carry on with the test */
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid, NIH_CHILD_PTRACE,
@@ -8790,7 +9341,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid, NIH_CHILD_PTRACE,
@@ -8845,7 +9396,7 @@ test_handler (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_SPAWNED;
-		job->pid[PROCESS_MAIN] = pid;
+		job_process_set_pid (job, PROCESS_MAIN, pid);
 
 		TEST_DIVERT_STDERR (output) {
 			job_process_handler (NULL, pid, NIH_CHILD_PTRACE,
@@ -9165,9 +9716,11 @@ test_handler (void)
 void
 test_find (void)
 {
-	JobClass    *class1, *class2, *class3;
+	JobClass    *class1, *class2, *class3, *class4;
 	Job         *job1, *job2, *job3, *job4, *job5, *ptr;
 	ProcessType  process;
+	size_t       size, count;
+	struct rlimit rlim, low;
 
 	TEST_FUNCTION ("job_process_find");
 	class1 = job_class_new (NULL, "foo", NULL);
@@ -9188,20 +9741,20 @@ test_find (void)
 	nih_hash_add (job_classes, &class3->entry);
 
 	job1 = job_new (class1, "foo");
-	job1->pid[PROCESS_MAIN] = 10;
-	job1->pid[PROCESS_POST_START] = 15;
+	job_process_set_pid (job1, PROCESS_MAIN, 10);
+	job_process_set_pid (job1, PROCESS_POST_START, 15);
 
 	job2 = job_new (class1, "bar");
 
 	job3 = job_new (class2, "foo");
-	job3->pid[PROCESS_PRE_START] = 20;
+	job_process_set_pid (job3, PROCESS_PRE_START, 20);
 
 	job4 = job_new (class2, "bar");
-	job4->pid[PROCESS_MAIN] = 25;
-	job4->pid[PROCESS_PRE_STOP] = 30;
+	job_process_set_pid (job4, PROCESS_MAIN, 25);
+	job_process_set_pid (job4, PROCESS_PRE_STOP, 30);
 
 	job5 = job_new (class3, "");
-	job5->pid[PROCESS_POST_STOP] = 35;
+	job_process_set_pid (job5, PROCESS_POST_STOP, 35);
 
 
 	/* Check that we can find a job that exists by the pid of its
@@ -9261,6 +9814,77 @@ test_find (void)
 	TEST_EQ_P (ptr, NULL);
 
 
+	/* Check that when the pid of a process changes, the job is found
+	 * by its new pid and no longer by the old one.
+	 */
+	TEST_FEATURE ("with changed pid");
+	job_process_set_pid (job1, PROCESS_MAIN, 12);
+
+	ptr = job_process_find (10, NULL);
+
+	TEST_EQ_P (ptr, NULL);
+
+	ptr = job_process_find (12, &process);
+
+	TEST_EQ_P (ptr, job1);
+	TEST_EQ (process, PROCESS_MAIN);
+
+
+	/* Check that when the pid of a process is cleared, the job is no
+	 * longer found by it.
+	 */
+	TEST_FEATURE ("with cleared pid");
+	job_process_set_pid (job1, PROCESS_MAIN, 0);
+
+	ptr = job_process_find (12, NULL);
+
+	TEST_EQ_P (ptr, NULL);
+	TEST_EQ (job1->pid[PROCESS_MAIN], 0);
+
+
+	/* Check that the table of pids grows as processes are added, so
+	 * that finding one doesn't take longer the more there are.  No
+	 * pidfds are opened for the made-up pids.
+	 */
+	TEST_FEATURE ("with many pids");
+	class4 = job_class_new (NULL, "frodo", NULL);
+
+	size = job_process_pids->size;
+	count = size * HASH_CHAIN_MAX + 1;
+
+	assert0 (getrlimit (RLIMIT_NOFILE, &rlim));
+	low = rlim;
+	low.rlim_cur = 0;
+	assert0 (setrlimit (RLIMIT_NOFILE, &low));
+
+	for (size_t i = 0; i < count; i++) {
+		nih_local char *name = NULL;
+		Job            *job;
+
+		name = NIH_MUST (nih_sprintf (NULL, "%zu", i));
+		job = job_new (class4, name);
+		job_process_set_pid (job, PROCESS_MAIN, 1000000 + i);
+	}
+
+	assert0 (setrlimit (RLIMIT_NOFILE, &rlim));
+
+	TEST_GT (job_process_pids->size, size);
+	TEST_GE (job_process_pids->size * HASH_CHAIN_MAX, count);
+
+	ptr = job_process_find (1000000 + count - 1, &process);
+
+	TEST_NE_P (ptr, NULL);
+	TEST_EQ_P (ptr->class, class4);
+	TEST_EQ (process, PROCESS_MAIN);
+
+	ptr = job_process_find (15, &process);
+
+	TEST_EQ_P (ptr, job1);
+	TEST_EQ (process, PROCESS_POST_START);
+
+	nih_free (class4);
+
+
 	/* Check that we get NULL if there are jobs in the hash, but none
 	 * have pids.
 	 */
@@ -9337,7 +9961,7 @@ test_utmp (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -9402,7 +10026,7 @@ test_utmp (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 1;
+		job_process_set_pid (job, PROCESS_MAIN, 1);
 
 		TEST_FREE_TAG (blocked);
 
@@ -9470,7 +10094,7 @@ test_utmp (void)
 
 		job->goal = JOB_START;
 		job->state = JOB_RUNNING;
-		job->pid[PROCESS_MAIN] = 2;
+		job_process_set_pid (job, PROCESS_MAIN, 2);
 
 		TEST_FREE_TAG (blocked);
 
@@ -9530,16 +10154,232 @@ test_utmp (void)
 	unlink (utmpname);
 }
 
+void
+test_pidfd (void)
+{
+	JobClass  *class;
+	Job       *job, *job2;
+	pid_t      pid;
+	int        fds[2];
+	int        pidfd, fd;
+	int        status;
+	NihError  *err;
+	struct rlimit rlim, low;
+
+	TEST_FUNCTION ("job_process_set_pid_with_fd");
+
+	/* Check that a job process is reaped through its pidfd once it
+	 * exits, and handlers registered for it are called.  pidfds are
+	 * only checked where the kernel supports them.
+	 */
+	TEST_FEATURE ("with pidfd");
+	TEST_HASH_EMPTY (job_classes);
+
+	assert0 (pipe (fds));
+
+	TEST_CHILD (pid) {
+		char c;
+
+		close (fds[1]);
+		assert (read (fds[0], &c, 1) == 0);
+		exit (0);
+	}
+	close (fds[0]);
+
+	class = job_class_new (NULL, "test", NULL);
+	job = job_new (class, "");
+
+	job_process_set_pid (job, PROCESS_MAIN, pid);
+	TEST_EQ (job->pid[PROCESS_MAIN], pid);
+
+	pidfd = job_process_pidfd (job, PROCESS_MAIN);
+	if (pidfd >= 0) {
+		TEST_RESET_MAIN_LOOP ();
+
+		child_exit_after = 1;
+		child_exit_status[0] = -1;
+
+		NIH_MUST (nih_child_add_watch (NULL, pid, NIH_CHILD_EXITED,
+					       test_job_process_handler,
+					       NULL));
+
+		close (fds[1]);
+		TEST_EQ (nih_main_loop (), 0);
+
+		TEST_EQ (child_exit_status[0], 0);
+		TEST_EQ (waitpid (pid, NULL, WNOHANG), -1);
+		TEST_EQ (errno, ECHILD);
+	} else {
+		close (fds[1]);
+		TEST_EQ (waitpid (pid, NULL, 0), pid);
+	}
+
+	nih_free (class);
+
+
+	/* Check that a job process can be signalled, and that once it has
+	 * been reaped, signalling it fails rather than reaching any other
+	 * process given its pid.
+	 */
+	TEST_FEATURE ("with signal");
+	TEST_HASH_EMPTY (job_classes);
+
+	TEST_CHILD (pid) {
+		pause ();
+		exit (0);
+	}
+
+	class = job_class_new (NULL, "test", NULL);
+	job = job_new (class, "");
+
+	job_process_set_pid (job, PROCESS_MAIN, pid);
+
+	TEST_EQ (job_process_send_signal (job, PROCESS_MAIN, SIGTERM, FALSE), 0);
+
+	TEST_EQ (waitpid (pid, &status, 0), pid);
+	TEST_TRUE (WIFSIGNALED (status));
+	TEST_EQ (WTERMSIG (status), SIGTERM);
+
+	TEST_LT (job_process_send_signal (job, PROCESS_MAIN, SIGTERM, FALSE), 0);
+
+	err = nih_error_get ();
+	TEST_EQ (err->number, ESRCH);
+	nih_free (err);
+
+	nih_free (class);
+
+
+	/* Check that a pidfd passed over a re-exec is adopted if it refers
+	 * to the process, and ignored if it doesn't.
+	 */
+	TEST_FEATURE ("with pidfd passed over re-exec");
+	TEST_HASH_EMPTY (job_classes);
+
+	TEST_CHILD (pid) {
+		pause ();
+		exit (0);
+	}
+
+	class = job_class_new (NULL, "test", NULL);
+	job = job_new (class, "foo");
+
+	job_process_set_pid (job, PROCESS_MAIN, pid);
+
+	pidfd = job_process_pidfd (job, PROCESS_MAIN);
+	if (pidfd >= 0) {
+		fd = dup (pidfd);
+		TEST_GT (fd, 0);
+
+		job2 = job_new (class, "bar");
+		job_process_set_pid_with_fd (job2, PROCESS_MAIN, pid, fd);
+
+		TEST_EQ (job_process_pidfd (job2, PROCESS_MAIN), fd);
+		TEST_TRUE (fcntl (fd, F_GETFD) & FD_CLOEXEC);
+
+		fd = dup (pidfd);
+		TEST_GT (fd, 0);
+
+		job2 = job_new (class, "baz");
+		job_process_set_pid_with_fd (job2, PROCESS_MAIN, getpid (), fd);
+
+		TEST_NE (job_process_pidfd (job2, PROCESS_MAIN), fd);
+		close (fd);
+	}
+
+	kill (pid, SIGTERM);
+	TEST_EQ (waitpid (pid, NULL, 0), pid);
+
+	nih_free (class);
+
+
+	/* Check that no pidfd is held once too many of the file descriptors
+	 * we may open would be taken up by them, the process being left to
+	 * SIGCHLD instead.
+	 */
+	TEST_FEATURE ("with too many pidfds held");
+	TEST_HASH_EMPTY (job_classes);
+
+	TEST_CHILD (pid) {
+		pause ();
+		exit (0);
+	}
+
+	class = job_class_new (NULL, "test", NULL);
+	job = job_new (class, "");
+
+	assert0 (getrlimit (RLIMIT_NOFILE, &rlim));
+	low = rlim;
+	low.rlim_cur = 0;
+	assert0 (setrlimit (RLIMIT_NOFILE, &low));
+
+	job_process_set_pid (job, PROCESS_MAIN, pid);
+
+	assert0 (setrlimit (RLIMIT_NOFILE, &rlim));
+
+	TEST_EQ (job->pid[PROCESS_MAIN], pid);
+	TEST_EQ (job_process_pidfd (job, PROCESS_MAIN), -1);
+
+	kill (pid, SIGTERM);
+	TEST_EQ (waitpid (pid, NULL, 0), pid);
+
+	nih_free (class);
+
+
+	/* Check that should a stateful re-exec fall back to a stateless
+	 * one, the pidfds that were to be passed are closed by it again.
+	 */
+	TEST_FEATURE ("with stateful re-exec cancelled");
+	TEST_HASH_EMPTY (job_classes);
+
+	TEST_CHILD (pid) {
+		pause ();
+		exit (0);
+	}
+
+	class = job_class_new (NULL, "test", NULL);
+	job = job_new (class, "");
+
+	/* XXX: Manually add the class so job_class_prepare_reexec()
+	 * finds it.
+	 */
+	nih_hash_add (job_classes, &class->entry);
+
+	job_process_set_pid (job, PROCESS_MAIN, pid);
+
+	pidfd = job_process_pidfd (job, PROCESS_MAIN);
+	if (pidfd >= 0) {
+		state_pass_fds = TRUE;
+		job_class_prepare_reexec ();
+		state_pass_fds = FALSE;
+
+		TEST_FALSE (fcntl (pidfd, F_GETFD) & FD_CLOEXEC);
+
+		job_class_cancel_reexec ();
+
+		TEST_TRUE (fcntl (pidfd, F_GETFD) & FD_CLOEXEC);
+	}
+
+	kill (pid, SIGTERM);
+	TEST_EQ (waitpid (pid, NULL, 0), pid);
+
+	nih_free (class);
+}
+
+
 void
 run_tests (void)
 {
 	test_start ();
 	test_spawn ();
+	test_spawner ();
+	test_spawn_fast ();
+	test_spawn_rate ();
 	test_log_path ();
 	test_kill ();
 	test_handler ();
 	test_utmp ();
 	test_find ();
+	test_pidfd ();
 }
 
 /**
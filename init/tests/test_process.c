@@ -21,6 +21,9 @@
 
 #include <nih/test.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <nih/macros.h>
 #include <nih/alloc.h>
 
@@ -48,12 +51,56 @@ test_new (void)
 
 		TEST_EQ (process->script, FALSE);
 		TEST_EQ_P (process->command, NULL);
+		TEST_EQ (process->script_fd, -1);
 
 		nih_free (process);
 	}
 }
 
 
+void
+test_set_script (void)
+{
+	Process *process[PROCESS_SCRIPT_FDS_MAX + 1];
+	int      fd;
+
+	TEST_FUNCTION ("process_set_script");
+
+	for (int i = 0; i <= PROCESS_SCRIPT_FDS_MAX; i++)
+		process[i] = process_new (NULL);
+
+	/* Check that script files are kept up to the limit, and that one
+	 * beyond it is left for the caller to close.
+	 */
+	TEST_FEATURE ("with too many scripts");
+	for (int i = 0; i < PROCESS_SCRIPT_FDS_MAX; i++) {
+		fd = open ("/dev/null", O_RDONLY | O_CLOEXEC);
+		TEST_GE (fd, 0);
+
+		TEST_TRUE (process_set_script (process[i], fd));
+		TEST_EQ (process[i]->script_fd, fd);
+	}
+
+	fd = open ("/dev/null", O_RDONLY | O_CLOEXEC);
+	TEST_GE (fd, 0);
+
+	TEST_FALSE (process_set_script (process[PROCESS_SCRIPT_FDS_MAX], fd));
+	TEST_EQ (process[PROCESS_SCRIPT_FDS_MAX]->script_fd, -1);
+
+
+	/* Check that once a script file is closed, another may be kept. */
+	TEST_FEATURE ("after script cleared");
+	process_clear_script (process[0]);
+	TEST_EQ (process[0]->script_fd, -1);
+
+	TEST_TRUE (process_set_script (process[PROCESS_SCRIPT_FDS_MAX], fd));
+	TEST_EQ (process[PROCESS_SCRIPT_FDS_MAX]->script_fd, fd);
+
+	for (int i = 0; i <= PROCESS_SCRIPT_FDS_MAX; i++)
+		nih_free (process[i]);
+}
+
+
 void
 test_name (void)
 {
@@ -175,6 +222,7 @@ main (int   argc,
 	setenv ("UPSTART_NO_SESSIONS", "1", 1);
 
 	test_new ();
+	test_set_script ();
 
 	test_name ();
 	test_from_name ();
@@ -21,14 +21,17 @@
  */
 
 #include <unistd.h>
+#include <time.h>
 #include <stdint.h>
 #include <limits.h>
 #include <errno.h>
 #include <pty.h>
 #include <libgen.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <nih/test.h>
+#include <nih-dbus/test_dbus.h>
 #include <nih/timer.h>
 #include <nih/child.h>
 #include <nih/signal.h>
@@ -36,6 +39,10 @@
 #include <nih/string.h>
 #include <nih/logging.h>
 
+#include <nih-dbus/dbus_message.h>
+
+#include "dbus/upstart.h"
+
 #include "state.h"
 #include "session.h"
 #include "process.h"
@@ -58,6 +65,8 @@ extern char *cgroup_manager_address;
 
 #endif /* ENABLE_CGROUPS */
 
+extern int write_state_file;
+
 #ifndef TEST_DATA_DIR
 #error ERROR: TEST_DATA_DIR not defined
 #endif
@@ -1289,6 +1298,14 @@ test_blocking (void)
 	json_object             *json_blocked;
 	Session                 *session;
 	Session                 *new_session;
+	pid_t                    dbus_pid;
+	DBusConnection          *conn;
+	DBusMessage             *dbus_message;
+	NihListEntry            *conn_entry;
+	ControlEmitBatch        *batch;
+	Blocked                 *blocked2;
+	Blocked                 *new_blocked2;
+	json_object             *json_blocked2;
 
 	conf_init ();
 	session_init ();
@@ -1797,6 +1814,88 @@ test_blocking (void)
 	TEST_LIST_EMPTY (conf_sources);
 	TEST_HASH_EMPTY (job_classes);
 
+	/*******************************/
+	TEST_FEATURE ("BLOCKED_EMIT_EVENTS_METHOD serialisation and deserialisation");
+
+	TEST_DBUS (dbus_pid);
+	TEST_DBUS_OPEN (conn);
+
+	conn_entry = nih_list_entry_new (NULL);
+	TEST_NE_P (conn_entry, NULL);
+	conn_entry->data = conn;
+	nih_list_add (control_conns, &conn_entry->entry);
+
+	dbus_message = dbus_message_new_method_call (DBUS_SERVICE_UPSTART,
+						     DBUS_PATH_UPSTART,
+						     DBUS_INTERFACE_UPSTART,
+						     "EmitEvents");
+	TEST_NE_P (dbus_message, NULL);
+	dbus_message_set_serial (dbus_message, 42);
+
+	/* A batch waiting for two events, one of which has failed */
+	batch = nih_new (NULL, ControlEmitBatch);
+	TEST_NE_P (batch, NULL);
+
+	batch->message = nih_dbus_message_new (batch, conn, dbus_message);
+	TEST_NE_P (batch->message, NULL);
+	dbus_message_unref (dbus_message);
+
+	batch->pending = 2;
+	batch->failed = TRUE;
+
+	blocked = blocked_new (NULL, BLOCKED_EMIT_EVENTS_METHOD, batch);
+	TEST_NE_P (blocked, NULL);
+
+	blocked2 = blocked_new (NULL, BLOCKED_EMIT_EVENTS_METHOD, batch);
+	TEST_NE_P (blocked2, NULL);
+
+	json_blocked = state_serialise_blocked (blocked);
+	TEST_NE_P (json_blocked, NULL);
+
+	json_blocked2 = state_serialise_blocked (blocked2);
+	TEST_NE_P (json_blocked2, NULL);
+
+	nih_list_init (&blocked_list);
+
+	new_blocked = state_deserialise_blocked (parent_str,
+			json_blocked, &blocked_list);
+	TEST_NE_P (new_blocked, NULL);
+
+	new_blocked2 = state_deserialise_blocked (parent_str,
+			json_blocked2, &blocked_list);
+	TEST_NE_P (new_blocked2, NULL);
+
+	TEST_EQ (new_blocked->type, BLOCKED_EMIT_EVENTS_METHOD);
+	TEST_EQ (new_blocked2->type, BLOCKED_EMIT_EVENTS_METHOD);
+
+	/* Both events must share a single restored batch */
+	TEST_NE_P (new_blocked->batch, batch);
+	TEST_EQ_P (new_blocked2->batch, new_blocked->batch);
+
+	TEST_EQ (new_blocked->batch->pending, 2);
+	TEST_TRUE (new_blocked->batch->failed);
+
+	TEST_EQ_P (new_blocked->batch->message->connection, conn);
+	TEST_EQ (dbus_message_get_serial (new_blocked->batch->message->message),
+		 42);
+	TEST_EQ_STR (dbus_message_get_member (new_blocked->batch->message->message),
+		     "EmitEvents");
+
+	json_object_put (json_blocked);
+	json_object_put (json_blocked2);
+
+	nih_free (blocked);
+	nih_free (blocked2);
+	nih_free (new_blocked);
+	nih_free (new_blocked2);
+
+	nih_free (conn_entry);
+
+	TEST_DBUS_CLOSE (conn);
+	TEST_DBUS_END (dbus_pid);
+
+	dbus_shutdown ();
+
 	/*******************************/
 }
 
@@ -2166,6 +2265,98 @@ test_log_serialise (void)
 	TEST_TRUE (NIH_LIST_EMPTY (nih_io_watches));
 	TEST_EQ (unlink (filename), 0);
 
+	/*******************************/
+	TEST_FEATURE ("with unflushed data passed in memfd");
+
+	TEST_FILENAME (filename);
+
+	TEST_TRUE (NIH_LIST_EMPTY (nih_io_watches));
+
+	TEST_EQ (openpty (&pty_master, &pty_slave, NULL, NULL, NULL), 0);
+
+	/* Make file inaccessible to ensure data cannot be written
+	 * and will thus be added to the unflushed buffer.
+	 */
+	fd = open (filename, O_CREAT | O_EXCL, 0);
+	TEST_NE (fd, -1);
+	close (fd);
+
+	/* Set up logging that we know won't go anywhere yet */
+	log = log_new (NULL, filename, pty_master, 0);
+	TEST_NE_P (log, NULL);
+	TEST_FALSE (NIH_LIST_EMPTY (nih_io_watches));
+
+	TEST_CHILD_WAIT (pid, wait_fd) {
+
+		close (pty_master);
+
+		len = TEST_ARRAY_SIZE (test_data);
+		errno = 0;
+
+		/* Now write some data with embedded nulls */
+		ret = write (pty_slave, test_data, len);
+		TEST_EQ ((size_t)ret, len);
+
+		/* let parent continue */
+		TEST_CHILD_RELEASE (wait_fd);
+
+		/* keep child running until the parent is ready (to
+		 * simulate a job which continues to run across
+		 * a re-exec).
+		 */
+		pause ();
+	}
+
+	close (pty_slave);
+
+	/* Ensure that unflushed buffer contains data */
+	TEST_WATCH_UPDATE ();
+
+	TEST_GT (log->unflushed->len, 0);
+
+	/* Serialise the log as for a re-exec */
+	state_pass_fds = TRUE;
+	log_prepare_reexec (log);
+	json = log_serialise (log);
+	state_pass_fds = FALSE;
+	TEST_NE_P (json, NULL);
+
+	/* Data should be in a sealed memfd rather than inline */
+	ret = json_object_object_get_ex (json, "unflushed", NULL);
+	TEST_EQ (ret, FALSE);
+
+	ret = json_object_object_get_ex (json, "unflushed_fd", NULL);
+	TEST_EQ (ret, TRUE);
+	TEST_GT (log->unflushed_fd, -1);
+
+	ret = write (log->unflushed_fd, "x", 1);
+	TEST_EQ (ret, -1);
+	TEST_EQ (errno, EPERM);
+
+	new_log = log_deserialise (NULL, json);
+	TEST_NE_P (new_log, NULL);
+
+	/* Descriptor is closed by deserialisation */
+	log->unflushed_fd = -1;
+
+	TEST_EQ (new_log->unflushed->len, log->unflushed->len);
+	TEST_EQ_MEM (new_log->unflushed->buf, log->unflushed->buf,
+		     log->unflushed->len);
+
+	assert0 (log_diff (log, new_log));
+
+	/* Wait for child to finish */
+	assert0 (kill (pid, SIGTERM));
+	TEST_EQ (waitpid (pid, &status, 0), pid);
+
+	/* Restore access to allow log to be written on destruction */
+	TEST_EQ (chmod (filename, 0644), 0);
+
+	nih_free (log);
+	nih_free (new_log);
+	TEST_TRUE (NIH_LIST_EMPTY (nih_io_watches));
+	TEST_EQ (unlink (filename), 0);
+
 	/*******************************/
 }
 
@@ -2393,11 +2584,11 @@ test_enums (void)
 	/*******************************/
 	TEST_FEATURE ("BlockedType");
 
-	for (i = -3; i < BLOCKED_INSTANCE_RESTART_METHOD+3; i++) {
+	for (i = -3; i < BLOCKED_EMIT_EVENTS_METHOD+3; i++) {
 
 		/* convert to string value */
 		string_value = blocked_type_enum_to_str (i);
-		if (i < 0 || i > BLOCKED_INSTANCE_RESTART_METHOD) {
+		if (i < 0 || i > BLOCKED_EMIT_EVENTS_METHOD) {
 			TEST_EQ_P (string_value, NULL);
 			continue;
 		} else {
@@ -2406,7 +2597,7 @@ test_enums (void)
 
 		/* convert back to enum */
 		blocked_value = blocked_type_str_to_enum (string_value);
-		if (i < 0 || i > BLOCKED_INSTANCE_RESTART_METHOD) {
+		if (i < 0 || i > BLOCKED_EMIT_EVENTS_METHOD) {
 			TEST_EQ (blocked_value, -1);
 		} else {
 			TEST_NE (blocked_value, -1);
@@ -2825,6 +3016,532 @@ test_hex_encoding (void)
 
 	ret = TEST_CMP_INT_ARRAYS (test_data, new_data, test_data_len, new_data_len);
 	TEST_EQ (ret, 0);
+
+	/*******************************/
+	TEST_FEATURE ("with every byte value");
+
+	{
+		unsigned char    bytes[256];
+		nih_local char  *hex = NULL;
+		nih_local char  *decoded = NULL;
+		size_t           decoded_len;
+
+		for (int i = 0; i < 256; i++)
+			bytes[i] = (unsigned char)i;
+
+		hex = state_data_to_hex (NULL, bytes, sizeof (bytes));
+		TEST_NE_P (hex, NULL);
+		TEST_EQ (strlen (hex), sizeof (bytes) * 2);
+		TEST_EQ_STRN (hex, "000102030405060708090a0b0c0d0e0f10");
+		TEST_EQ_STR (hex + 480, "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff");
+
+		ret = state_hex_to_data (NULL, hex, strlen (hex),
+				&decoded, &decoded_len);
+		TEST_EQ (ret, 0);
+		TEST_EQ (decoded_len, sizeof (bytes));
+		TEST_EQ_MEM (decoded, bytes, sizeof (bytes));
+	}
+
+	/*******************************/
+	TEST_FEATURE ("with upper-case digits");
+
+	{
+		nih_local char  *decoded = NULL;
+		size_t           decoded_len;
+
+		ret = state_hex_to_data (NULL, "DEadBEef", 8,
+				&decoded, &decoded_len);
+		TEST_EQ (ret, 0);
+		TEST_EQ (decoded_len, 4);
+		TEST_EQ_MEM (decoded, "\xde\xad\xbe\xef", 4);
+	}
+
+	/*******************************/
+	TEST_FEATURE ("with invalid digits");
+
+	{
+		char  *decoded = NULL;
+		size_t decoded_len;
+
+		ret = state_hex_to_data (NULL, "00g0", 4,
+				&decoded, &decoded_len);
+		TEST_EQ (ret, -1);
+		TEST_EQ_P (decoded, NULL);
+
+		ret = state_hex_to_data (NULL, "0x10", 4,
+				&decoded, &decoded_len);
+		TEST_EQ (ret, -1);
+		TEST_EQ_P (decoded, NULL);
+	}
+}
+
+/**
+ * test_benchmark_hex:
+ *
+ * Measure hex encoding and decoding of a buffer the size of a large
+ * amount of unflushed job output.
+ **/
+void
+test_benchmark_hex (void)
+{
+	const size_t     size = 4 * 1024 * 1024;
+	nih_local char  *data = NULL;
+	nih_local char  *hex = NULL;
+	nih_local char  *decoded = NULL;
+	size_t           decoded_len;
+	struct timespec  start;
+	struct timespec  end;
+	double           elapsed;
+
+	TEST_GROUP ("hex encoding benchmark");
+
+	data = nih_alloc (NULL, size);
+	TEST_NE_P (data, NULL);
+
+	for (size_t i = 0; i < size; i++)
+		data[i] = (char)(i * 7);
+
+	/*******************************/
+	TEST_FEATURE ("encoding");
+
+	assert0 (clock_gettime (CLOCK_MONOTONIC, &start));
+	hex = state_data_to_hex (NULL, data, size);
+	assert0 (clock_gettime (CLOCK_MONOTONIC, &end));
+
+	TEST_NE_P (hex, NULL);
+
+	elapsed = ((end.tv_sec - start.tv_sec) * 1000.0
+		   + (end.tv_nsec - start.tv_nsec) / 1000000.0);
+	printf ("\t%zu bytes, %.3f ms\n", size, elapsed);
+
+	/*******************************/
+	TEST_FEATURE ("decoding");
+
+	assert0 (clock_gettime (CLOCK_MONOTONIC, &start));
+	assert0 (state_hex_to_data (NULL, hex, size * 2,
+				    &decoded, &decoded_len));
+	assert0 (clock_gettime (CLOCK_MONOTONIC, &end));
+
+	TEST_EQ (decoded_len, size);
+	TEST_EQ_MEM (decoded, data, size);
+
+	elapsed = ((end.tv_sec - start.tv_sec) * 1000.0
+		   + (end.tv_nsec - start.tv_nsec) / 1000000.0);
+	printf ("\t%zu bytes, %.3f ms\n", size, elapsed);
+}
+
+void
+test_index (void)
+{
+	StateIndex  *index;
+	char         items[1000];
+	Event       *event[3];
+	Session     *session[2];
+
+	TEST_GROUP ("serialisation index tables");
+
+	/*******************************/
+	TEST_FEATURE ("with many objects");
+
+	index = state_index_new (NULL, TEST_ARRAY_SIZE (items));
+	TEST_NE_P (index, NULL);
+
+	for (size_t i = 0; i < TEST_ARRAY_SIZE (items); i++)
+		state_index_add (index, &items[i]);
+
+	TEST_EQ (index->count, TEST_ARRAY_SIZE (items));
+
+	for (size_t i = 0; i < TEST_ARRAY_SIZE (items); i++) {
+		TEST_EQ (state_index_find (index, &items[i]), (ssize_t)i);
+		TEST_EQ_P (state_index_get (index, i), &items[i]);
+	}
+
+	TEST_EQ (state_index_find (index, &index), -1);
+	TEST_EQ_P (state_index_get (index, TEST_ARRAY_SIZE (items)), NULL);
+
+	nih_free (index);
+
+	/*******************************/
+	TEST_FEATURE ("with empty table");
+
+	index = state_index_new (NULL, 0);
+	TEST_NE_P (index, NULL);
+
+	TEST_EQ (state_index_find (index, &index), -1);
+	TEST_EQ_P (state_index_get (index, 0), NULL);
+
+	nih_free (index);
+
+	/*******************************/
+	TEST_FEATURE ("with events and sessions");
+
+	event_init ();
+	session_init ();
+
+	TEST_LIST_EMPTY (events);
+	TEST_LIST_EMPTY (sessions);
+
+	for (int i = 0; i < 3; i++) {
+		event[i] = event_new (NULL, "foo", NULL);
+		TEST_NE_P (event[i], NULL);
+	}
+
+	session[0] = session_new (NULL, "/abc");
+	TEST_NE_P (session[0], NULL);
+
+	session[1] = session_new (NULL, "/def");
+	TEST_NE_P (session[1], NULL);
+
+	TEST_EQ_P (state_index (STATE_INDEX_EVENTS), NULL);
+
+	state_index_begin ();
+
+	TEST_NE_P (state_index (STATE_INDEX_EVENTS), NULL);
+	TEST_NE_P (state_index (STATE_INDEX_SESSIONS), NULL);
+
+	for (int i = 0; i < 3; i++) {
+		TEST_EQ (event_to_index (event[i]), i);
+		TEST_EQ_P (event_from_index (i), event[i]);
+	}
+	TEST_EQ_P (event_from_index (3), NULL);
+
+	TEST_EQ (session_get_index (NULL), 0);
+	TEST_EQ_P (session_from_index (0), NULL);
+
+	for (int i = 0; i < 2; i++) {
+		TEST_EQ (session_get_index (session[i]), i + 1);
+		TEST_EQ_P (session_from_index (i + 1), session[i]);
+	}
+
+	state_index_end ();
+
+	TEST_EQ_P (state_index (STATE_INDEX_EVENTS), NULL);
+
+	/* Lookups without tables walk the lists and must agree */
+	for (int i = 0; i < 3; i++) {
+		TEST_EQ (event_to_index (event[i]), i);
+		TEST_EQ_P (event_from_index (i), event[i]);
+		nih_free (event[i]);
+	}
+
+	for (int i = 0; i < 2; i++) {
+		TEST_EQ (session_get_index (session[i]), i + 1);
+		nih_free (session[i]);
+	}
+
+	TEST_LIST_EMPTY (events);
+	TEST_LIST_EMPTY (sessions);
+}
+
+void
+test_binary_encoding (void)
+{
+	json_object     *json;
+	json_object     *json_array;
+	json_object     *new_json;
+	json_object     *value;
+	nih_local char  *data = NULL;
+	size_t           len;
+	Event           *event;
+	nih_local char **env = NULL;
+	size_t           env_len = 0;
+
+	TEST_GROUP ("binary state encoding");
+
+	/*******************************/
+	TEST_FEATURE ("with every value type");
+
+	json = json_object_new_object ();
+	json_object_object_add (json, "null", NULL);
+	json_object_object_add (json, "true", json_object_new_boolean (TRUE));
+	json_object_object_add (json, "false", json_object_new_boolean (FALSE));
+	json_object_object_add (json, "int", json_object_new_int64 (-1234567890123LL));
+	json_object_object_add (json, "double", json_object_new_double (0.5));
+	json_object_object_add (json, "string", json_object_new_string ("hello \"world\"\n"));
+
+	json_array = json_object_new_array ();
+	json_object_array_add (json_array, json_object_new_int (1));
+	json_object_array_add (json_array, json_object_new_string (""));
+	json_object_array_add (json_array, json_object_new_object ());
+	json_object_object_add (json, "array", json_array);
+
+	data = state_json_to_binary (NULL, json, &len);
+	TEST_NE_P (data, NULL);
+	TEST_GT (len, STATE_BINARY_MAGIC_LEN);
+	TEST_EQ_MEM (data, STATE_BINARY_MAGIC, STATE_BINARY_MAGIC_LEN);
+
+	new_json = state_binary_to_json (data, len);
+	TEST_NE_P (new_json, NULL);
+
+	TEST_EQ_STR (json_object_to_json_string (new_json),
+		     json_object_to_json_string (json));
+
+	TEST_TRUE (json_object_object_get_ex (new_json, "int", &value));
+	TEST_EQ (json_object_get_int64 (value), -1234567890123LL);
+
+	json_object_put (new_json);
+
+	/*******************************/
+	TEST_FEATURE ("with truncated data");
+
+	for (size_t i = 0; i < len; i++)
+		TEST_EQ_P (state_binary_to_json (data, i), NULL);
+
+	/*******************************/
+	TEST_FEATURE ("with unknown version");
+
+	data[STATE_BINARY_MAGIC_LEN] = STATE_BINARY_VERSION + 1;
+	TEST_EQ_P (state_binary_to_json (data, len), NULL);
+
+	json_object_put (json);
+
+	/*******************************/
+	TEST_FEATURE ("with full state");
+
+	event_init ();
+	session_init ();
+	job_class_init ();
+
+	TEST_LIST_EMPTY (sessions);
+	TEST_LIST_EMPTY (events);
+
+	env = nih_str_array_new (NULL);
+	TEST_NE_P (env, NULL);
+	TEST_NE_P (environ_add (&env, NULL, &env_len, TRUE, "FOO=BAR"), NULL);
+
+	event = event_new (NULL, "foo", env);
+	TEST_NE_P (event, NULL);
+
+	nih_discard (data);
+	data = NULL;
+
+	assert0 (state_to_data (&data, &len));
+	TEST_EQ_MEM (data, STATE_BINARY_MAGIC, STATE_BINARY_MAGIC_LEN);
+
+	nih_list_remove (&event->entry);
+	TEST_LIST_EMPTY (events);
+
+	job_class_environment_clear ();
+
+	assert0 (state_from_data (data, len));
+
+	TEST_LIST_NOT_EMPTY (events);
+
+	{
+		Event *new_event = (Event *)nih_list_remove (events->next);
+
+		assert0 (event_diff (event, new_event, ALREADY_SEEN_SET));
+		nih_free (new_event);
+	}
+
+	nih_free (event);
+
+	TEST_LIST_EMPTY (events);
+}
+
+void
+test_stream (void)
+{
+	const int        num_events = 1000;
+	char             filename[PATH_MAX];
+	nih_local char **env = NULL;
+	size_t           env_len = 0;
+	char             value[128];
+	int              fd;
+
+	TEST_GROUP ("streamed state");
+
+	event_init ();
+	session_init ();
+	job_class_init ();
+
+	/* Make each event large enough that the events span several
+	 * chunks, with values crossing chunk boundaries.
+	 */
+	memset (value, 'x', sizeof (value));
+	memcpy (value, "FOO=", 4);
+	value[sizeof (value) - 1] = '\0';
+
+	env = nih_str_array_new (NULL);
+	TEST_NE_P (env, NULL);
+	TEST_NE_P (environ_add (&env, NULL, &env_len, TRUE, value), NULL);
+
+	for (int pass = 0; pass < 2; pass++) {
+		nih_local char *data = NULL;
+		nih_local char *buf = NULL;
+		size_t          len;
+		off_t           size;
+		int             count;
+
+		TEST_FEATURE (pass ? "with JSON text" : "with binary encoding");
+
+		TEST_LIST_EMPTY (events);
+
+		for (int i = 0; i < num_events; i++)
+			TEST_NE_P (event_new (NULL, "foo", env), NULL);
+
+		write_state_file = pass;
+
+		assert0 (state_to_data (&data, &len));
+
+		TEST_FILENAME (filename);
+		fd = open (filename, O_CREAT | O_EXCL | O_RDWR, 0600);
+		TEST_GT (fd, -1);
+
+		assert0 (state_write_objects (fd));
+
+		write_state_file = FALSE;
+
+		size = lseek (fd, 0, SEEK_CUR);
+		TEST_GT (size, STATE_STREAM_CHUNK);
+
+		TEST_EQ (lseek (fd, 0, SEEK_SET), 0);
+
+		buf = nih_alloc (NULL, (size_t)size);
+		TEST_NE_P (buf, NULL);
+		TEST_EQ (read (fd, buf, (size_t)size), size);
+
+		/* The binary encoding is the same as that of the whole
+		 * document.
+		 */
+		if (pass) {
+			TEST_EQ (buf[0], '{');
+			TEST_EQ (buf[size - 1], '}');
+		} else {
+			TEST_EQ ((size_t)size, len);
+			TEST_EQ_MEM (buf, data, len);
+		}
+
+		NIH_LIST_FOREACH_SAFE (events, iter) {
+			nih_free (iter);
+		}
+
+		job_class_environment_clear ();
+
+		TEST_EQ (lseek (fd, 0, SEEK_SET), 0);
+
+		assert0 (state_read_objects (fd));
+
+		close (fd);
+		TEST_EQ (unlink (filename), 0);
+
+		count = 0;
+		NIH_LIST_FOREACH (events, iter) {
+			Event *event = (Event *)iter;
+
+			TEST_EQ_STR (event->name, "foo");
+			TEST_EQ_STR (event->env[0], value);
+			TEST_EQ_P (event->env[1], NULL);
+			count++;
+		}
+
+		TEST_EQ (count, num_events);
+
+		NIH_LIST_FOREACH_SAFE (events, iter) {
+			nih_free (iter);
+		}
+
+		TEST_LIST_EMPTY (events);
+	}
+
+	/*******************************/
+	TEST_FEATURE ("with truncated data");
+
+	TEST_NE_P (event_new (NULL, "foo", env), NULL);
+
+	TEST_FILENAME (filename);
+	fd = open (filename, O_CREAT | O_EXCL | O_RDWR, 0600);
+	TEST_GT (fd, -1);
+
+	assert0 (state_write_objects (fd));
+
+	NIH_LIST_FOREACH_SAFE (events, iter) {
+		nih_free (iter);
+	}
+
+	TEST_EQ (ftruncate (fd, lseek (fd, 0, SEEK_CUR) - 1), 0);
+	TEST_EQ (lseek (fd, 0, SEEK_SET), 0);
+
+	TEST_LT (state_read_objects (fd), 0);
+	TEST_LIST_EMPTY (events);
+
+	close (fd);
+	TEST_EQ (unlink (filename), 0);
+}
+
+/**
+ * test_benchmark_encodings:
+ *
+ * Measure a full serialise and deserialise round trip of a large number
+ * of events in both the JSON text and binary encodings.
+ **/
+void
+test_benchmark_encodings (void)
+{
+	const int        num_events = 5000;
+	struct timespec  start;
+	struct timespec  end;
+	double           elapsed[2];
+	nih_local char **env = NULL;
+	size_t           env_len = 0;
+
+	TEST_GROUP ("state encoding benchmark");
+
+	event_init ();
+	session_init ();
+	job_class_init ();
+
+	env = nih_str_array_new (NULL);
+	TEST_NE_P (env, NULL);
+	TEST_NE_P (environ_add (&env, NULL, &env_len, TRUE, "JOB=foo"), NULL);
+	TEST_NE_P (environ_add (&env, NULL, &env_len, TRUE, "INSTANCE=bar"), NULL);
+	TEST_NE_P (environ_add (&env, NULL, &env_len, TRUE, "RESULT=ok"), NULL);
+
+	for (int pass = 0; pass < 2; pass++) {
+		nih_local char *data = NULL;
+		size_t          len;
+
+		TEST_FEATURE (pass ? "binary" : "json");
+
+		TEST_LIST_EMPTY (events);
+
+		for (int i = 0; i < num_events; i++)
+			TEST_NE_P (event_new (NULL, "foo", env), NULL);
+
+		assert0 (clock_gettime (CLOCK_MONOTONIC, &start));
+
+		if (pass) {
+			assert0 (state_to_data (&data, &len));
+		} else {
+			assert0 (state_to_string (&data, &len));
+		}
+
+		NIH_LIST_FOREACH_SAFE (events, iter) {
+			nih_free (iter);
+		}
+
+		job_class_environment_clear ();
+
+		if (pass) {
+			assert0 (state_from_data (data, len));
+		} else {
+			assert0 (state_from_string (data));
+		}
+
+		assert0 (clock_gettime (CLOCK_MONOTONIC, &end));
+
+		elapsed[pass] = ((end.tv_sec - start.tv_sec) * 1000.0
+				 + (end.tv_nsec - start.tv_nsec) / 1000000.0);
+
+		printf ("\t%d events, %zu bytes, %.3f ms\n",
+			num_events, len, elapsed[pass]);
+
+		NIH_LIST_FOREACH_SAFE (events, iter) {
+			nih_free (iter);
+		}
+
+		TEST_LIST_EMPTY (events);
+	}
 }
 
 void
@@ -4749,6 +5466,9 @@ main (int   argc,
 	test_int_arrays ();
 	test_string_arrays ();
 	test_hex_encoding ();
+	test_index ();
+	test_binary_encoding ();
+	test_stream ();
 	test_rlimit_encoding ();
 	test_session_serialise ();
 	test_process_serialise ();
@@ -4758,6 +5478,8 @@ main (int   argc,
 	test_job_serialise ();
 	test_job_class_serialise ();
 	test_upgrade ();
+	test_benchmark_encodings ();
+	test_benchmark_hex ();
 
 	return 0;
 }
@@ -0,0 +1,190 @@
+/* upstart
+ *
+ * trace.c - event and job lifecycle latency tracing
+ *
+ * Copyright © 2015 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <string.h>
+#include <time.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/logging.h>
+
+#include "trace.h"
+
+
+/**
+ * trace_records:
+ *
+ * Ring buffer of trace_size records, or NULL if tracing is disabled.
+ **/
+TraceRecord *trace_records = NULL;
+
+/**
+ * trace_size:
+ *
+ * Number of records in trace_records.
+ **/
+size_t trace_size = 0;
+
+/**
+ * trace_total:
+ *
+ * Number of records ever added to trace_records; the next record is
+ * written at this index modulo trace_size.
+ **/
+size_t trace_total = 0;
+
+
+/**
+ * trace_init:
+ * @size: number of records to keep.
+ *
+ * Allocates the trace ring buffer with room for @size records, discarding
+ * any existing records.  If @size is zero, tracing is disabled and the
+ * TRACE() macro does nothing.
+ **/
+void
+trace_init (size_t size)
+{
+	if (trace_records) {
+		nih_free (trace_records);
+		trace_records = NULL;
+	}
+
+	trace_size = size;
+	trace_total = 0;
+
+	if (! size)
+		return;
+
+	trace_records = NIH_MUST (nih_alloc (NULL, sizeof (TraceRecord) * size));
+	memset (trace_records, 0, sizeof (TraceRecord) * size);
+}
+
+/**
+ * trace_record:
+ * @type: lifecycle point,
+ * @name: event or job name,
+ * @detail: detail for record,
+ * @pid: process id for record,
+ * @status: wait status for record.
+ *
+ * Timestamps and adds a record to the trace ring buffer, overwriting the
+ * oldest record once the buffer is full.  Nothing is allocated, so this
+ * is safe to call from any point in the event and job state machines.
+ *
+ * Normally called through the TRACE() macro, which checks that tracing
+ * is enabled first.
+ **/
+void
+trace_record (TraceRecordType  type,
+	      const char      *name,
+	      int              detail,
+	      pid_t            pid,
+	      int              status)
+{
+	TraceRecord *record;
+
+	nih_assert (trace_records != NULL);
+	nih_assert (trace_size > 0);
+
+	record = &trace_records[trace_total++ % trace_size];
+
+	(void)clock_gettime (CLOCK_MONOTONIC, &record->time);
+
+	record->type = type;
+
+	strncpy (record->name, name ? name : "", sizeof (record->name) - 1);
+	record->name[sizeof (record->name) - 1] = '\0';
+
+	record->detail = detail;
+	record->pid = pid;
+	record->status = status;
+}
+
+/**
+ * trace_count:
+ *
+ * Returns: number of records currently held in the trace ring buffer.
+ **/
+size_t
+trace_count (void)
+{
+	return trace_total < trace_size ? trace_total : trace_size;
+}
+
+/**
+ * trace_get:
+ * @index: index of record.
+ *
+ * Obtains a record from the trace ring buffer, index zero being the
+ * oldest record held.
+ *
+ * Returns: record at @index, or NULL if @index is out of range.
+ **/
+const TraceRecord *
+trace_get (size_t index)
+{
+	size_t first;
+
+	if (index >= trace_count ())
+		return NULL;
+
+	first = trace_total - trace_count ();
+
+	return &trace_records[(first + index) % trace_size];
+}
+
+/**
+ * trace_record_type_name:
+ * @type: TraceRecordType.
+ *
+ * Converts @type into a string for display.
+ *
+ * Returns: static string or NULL if @type not known.
+ **/
+const char *
+trace_record_type_name (TraceRecordType type)
+{
+	switch (type) {
+	case TRACE_RECORD_EVENT_NEW:
+		return "event-new";
+	case TRACE_RECORD_EVENT_HANDLING:
+		return "event-handling";
+	case TRACE_RECORD_EVENT_UNBLOCKED:
+		return "event-unblocked";
+	case TRACE_RECORD_EVENT_FINISHED:
+		return "event-finished";
+	case TRACE_RECORD_JOB_STATE:
+		return "job-state";
+	case TRACE_RECORD_JOB_FORK:
+		return "job-fork";
+	case TRACE_RECORD_JOB_EXEC:
+		return "job-exec";
+	case TRACE_RECORD_JOB_REAP:
+		return "job-reap";
+	default:
+		return NULL;
+	}
+}
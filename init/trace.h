@@ -0,0 +1,117 @@
+/* upstart
+ *
+ * Copyright © 2015 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef INIT_TRACE_H
+#define INIT_TRACE_H
+
+#include <sys/types.h>
+
+#include <time.h>
+
+#include <nih/macros.h>
+
+
+/**
+ * TRACE_NAME_MAX:
+ *
+ * Size of the buffer holding the event or job name in each TraceRecord,
+ * longer names are truncated.
+ **/
+#define TRACE_NAME_MAX 64
+
+
+/**
+ * TraceRecordType:
+ *
+ * Point in the lifecycle of an event or job that a TraceRecord was
+ * taken at.
+ **/
+typedef enum trace_record_type {
+	TRACE_RECORD_EVENT_NEW,
+	TRACE_RECORD_EVENT_HANDLING,
+	TRACE_RECORD_EVENT_UNBLOCKED,
+	TRACE_RECORD_EVENT_FINISHED,
+	TRACE_RECORD_JOB_STATE,
+	TRACE_RECORD_JOB_FORK,
+	TRACE_RECORD_JOB_EXEC,
+	TRACE_RECORD_JOB_REAP,
+} TraceRecordType;
+
+/**
+ * TraceRecord:
+ * @time: monotonic time the record was taken,
+ * @type: lifecycle point,
+ * @name: event name or job name, truncated to fit,
+ * @detail: new JobState for TRACE_RECORD_JOB_STATE, ProcessType for the
+ * other job records, otherwise zero,
+ * @pid: process id for TRACE_RECORD_JOB_FORK, TRACE_RECORD_JOB_EXEC
+ * and TRACE_RECORD_JOB_REAP, otherwise zero,
+ * @status: wait status for TRACE_RECORD_JOB_REAP, otherwise zero.
+ *
+ * Entries in the trace ring buffer.
+ **/
+typedef struct trace_record {
+	struct timespec time;
+	TraceRecordType type;
+	char            name[TRACE_NAME_MAX];
+	int             detail;
+	pid_t           pid;
+	int             status;
+} TraceRecord;
+
+
+/**
+ * TRACE:
+ * @type: TraceRecordType,
+ * @name: event or job name,
+ * @detail: detail for record,
+ * @pid: process id for record,
+ * @status: wait status for record.
+ *
+ * Adds a record to the trace ring buffer if tracing is enabled; when it
+ * is not, the arguments are not evaluated and this costs a single test.
+ **/
+#define TRACE(type, name, detail, pid, status)                            \
+	do {                                                              \
+		if (trace_records)                                        \
+			trace_record ((type), (name), (detail),           \
+				      (pid), (status));                    \
+	} while (0)
+
+
+NIH_BEGIN_EXTERN
+
+extern TraceRecord *trace_records;
+extern size_t       trace_size;
+extern size_t       trace_total;
+
+void        trace_init             (size_t size);
+void        trace_record           (TraceRecordType type, const char *name,
+				    int detail, pid_t pid, int status);
+
+const TraceRecord *trace_get       (size_t index)
+	__attribute__ ((warn_unused_result));
+size_t      trace_count            (void)
+	__attribute__ ((warn_unused_result));
+
+const char *trace_record_type_name (TraceRecordType type)
+	__attribute__ ((warn_unused_result));
+
+NIH_END_EXTERN
+
+#endif /* INIT_TRACE_H */
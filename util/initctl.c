@@ -26,6 +26,7 @@
 
 #include <sys/types.h>
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -78,6 +79,10 @@ static void   start_reply_handler (char **job_path, NihDBusMessage *message,
 static void   reply_handler       (int *ret, NihDBusMessage *message);
 static void   error_handler       (void *data, NihDBusMessage *message);
 
+static int    emit_events_send    (NihDBusProxy *upstart,
+				   UpstartEmitEventsEventsElement * const *batch);
+static int    emit_events_read    (NihDBusProxy *upstart, FILE *stream);
+
 static void   job_class_condition_handler (void *data,
 		NihDBusMessage *message,
 		char ** const *value);
@@ -129,6 +134,7 @@ int emit_action                          (NihCommand *command, char * const *arg
 int reload_configuration_action          (NihCommand *command, char * const *args);
 int version_action                       (NihCommand *command, char * const *args);
 int log_priority_action                  (NihCommand *command, char * const *args);
+int trace_action                         (NihCommand *command, char * const *args);
 int show_config_action                   (NihCommand *command, char * const *args);
 int check_config_action                  (NihCommand *command, char * const *args);
 int usage_action                         (NihCommand *command, char * const *args);
@@ -189,6 +195,22 @@ const char *dest_address = DBUS_ADDRESS_UPSTART;
  **/
 int no_wait = FALSE;
 
+/**
+ * emit_batch:
+ *
+ * If TRUE, the emit command reads the events to emit from standard input
+ * rather than from its arguments.
+ **/
+int emit_batch = FALSE;
+
+/**
+ * reload_summary:
+ *
+ * If TRUE, the reload-configuration command outputs a summary of the
+ * configuration files that changed.
+ **/
+int reload_summary = FALSE;
+
 /**
  * enumerate_events:
  *
@@ -1739,6 +1761,21 @@ emit_action (NihCommand *  command,
 	nih_assert (command != NULL);
 	nih_assert (args != NULL);
 
+	if (emit_batch) {
+		if (args[0]) {
+			fprintf (stderr, _("%s: unexpected event name with --batch\n"),
+				 program_name);
+			nih_main_suggest_help ();
+			return 1;
+		}
+
+		upstart = upstart_open (NULL);
+		if (! upstart)
+			return 1;
+
+		return emit_events_read (upstart, stdin);
+	}
+
 	if (! args[0]) {
 		fprintf (stderr, _("%s: missing event name\n"), program_name);
 		nih_main_suggest_help ();
@@ -1770,12 +1807,152 @@ error:
 }
 
 
+/**
+ * emit_events_read:
+ * @upstart: proxy for the init daemon,
+ * @stream: stream to read events from.
+ *
+ * Reads events from @stream, one per line, each given as the event name
+ * followed by zero or more KEY=VALUE environment variables separated by
+ * whitespace.  Blank lines and lines beginning with '#' are ignored.
+ *
+ * The events are sent to the init daemon with the EmitEvents method,
+ * up to EMIT_BATCH_SIZE at a time, waiting for each call to complete
+ * unless no_wait is set.
+ *
+ * Returns: command exit status.
+ **/
+static int
+emit_events_read (NihDBusProxy *upstart,
+		  FILE         *stream)
+{
+	nih_local UpstartEmitEventsEventsElement **batch = NULL;
+	size_t                                     len = 0;
+	char *                                     line = NULL;
+	size_t                                     line_size = 0;
+	int                                        ret = 0;
+	NihError *                                 err;
+
+	nih_assert (upstart != NULL);
+	nih_assert (stream != NULL);
+
+	while (getline (&line, &line_size, stream) >= 0) {
+		UpstartEmitEventsEventsElement *element;
+		char **                         words;
+
+		if (! batch) {
+			batch = nih_alloc (NULL, sizeof (UpstartEmitEventsEventsElement *)
+					   * (EMIT_BATCH_SIZE + 1));
+			if (! batch) {
+				nih_error_raise_no_memory ();
+				goto error;
+			}
+
+			batch[0] = NULL;
+			len = 0;
+		}
+
+		element = nih_new (batch, UpstartEmitEventsEventsElement);
+		if (! element) {
+			nih_error_raise_no_memory ();
+			goto error;
+		}
+
+		words = nih_str_split (element, line, " \t\r\n", TRUE);
+		if (! words) {
+			nih_error_raise_no_memory ();
+			goto error;
+		}
+
+		if ((! words[0]) || (words[0][0] == '#')) {
+			nih_free (element);
+			continue;
+		}
+
+		element->item0 = words[0];
+		element->item1 = &words[1];
+		element->item2 = (! no_wait);
+
+		batch[len++] = element;
+		batch[len] = NULL;
+
+		if (len == EMIT_BATCH_SIZE) {
+			ret = emit_events_send (upstart, batch);
+			if (ret)
+				break;
+
+			nih_free (batch);
+			batch = NULL;
+		}
+	}
+
+	free (line);
+
+	if ((! ret) && batch && len)
+		ret = emit_events_send (upstart, batch);
+
+	return ret;
+
+error:
+	free (line);
+
+	err = nih_error_get ();
+	nih_error ("%s", err->message);
+	nih_free (err);
+
+	return 1;
+}
+
+/**
+ * emit_events_send:
+ * @upstart: proxy for the init daemon,
+ * @batch: NULL-terminated array of events.
+ *
+ * Calls the EmitEvents method of the init daemon for @batch and waits
+ * for the reply.
+ *
+ * Returns: command exit status.
+ **/
+static int
+emit_events_send (NihDBusProxy                           *upstart,
+		  UpstartEmitEventsEventsElement * const *batch)
+{
+	DBusPendingCall *pending_call;
+	int              ret = 1;
+	NihError *       err;
+
+	nih_assert (upstart != NULL);
+	nih_assert (batch != NULL);
+
+	pending_call = upstart_emit_events (upstart, batch,
+					    (UpstartEmitEventsReply)reply_handler,
+					    error_handler, &ret,
+					    NIH_DBUS_TIMEOUT_NEVER);
+	if (! pending_call)
+		goto error;
+
+	dbus_pending_call_block (pending_call);
+	dbus_pending_call_unref (pending_call);
+
+	return ret;
+
+error:
+	err = nih_error_get ();
+	nih_error ("%s", err->message);
+	nih_free (err);
+
+	return 1;
+}
+
+
 /**
  * reload_configuration_action:
  * @command: NihCommand invoked,
  * @args: command-line arguments.
  *
- * This function is called for the "reload-configuration" command.
+ * This function is called for the "reload-configuration" command; with
+ * --summary, the number of configuration files that changed is output.
+ * If configuration files are given as arguments, only those are reloaded.
  *
  * Returns: command exit status.
  **/
@@ -1785,17 +1962,68 @@ reload_configuration_action (NihCommand *  command,
 {
 	nih_local NihDBusProxy *upstart = NULL;
 	NihError *              err;
+	uint32_t                added, modified, removed, unchanged;
 
 	nih_assert (command != NULL);
 	nih_assert (args != NULL);
 
+	if (*args && reload_summary) {
+		fprintf (stderr, _("%s: --summary may not be given with files\n"),
+			 program_name);
+		nih_main_suggest_help ();
+		return 1;
+	}
+
 	upstart = upstart_open (NULL);
 	if (! upstart)
 		return 1;
 
-	if (upstart_reload_configuration_sync (NULL, upstart) < 0)
+	if (*args) {
+		nih_local char **paths = NULL;
+		char             cwd[PATH_MAX];
+
+		paths = NIH_MUST (nih_str_array_new (NULL));
+
+		/* Relative paths are relative to us, not the init daemon */
+		for (char * const *arg = args; *arg; arg++) {
+			nih_local char *path = NULL;
+
+			if (**arg == '/') {
+				path = NIH_MUST (nih_strdup (NULL, *arg));
+			} else if (getcwd (cwd, sizeof (cwd))) {
+				path = NIH_MUST (nih_sprintf (NULL, "%s/%s",
+							      cwd, *arg));
+			} else {
+				nih_error_raise_system ();
+				goto error;
+			}
+
+			NIH_MUST (nih_str_array_addp (&paths, NULL, NULL, path));
+		}
+
+		if (upstart_reload_job_configuration_sync (NULL, upstart,
+							   paths) < 0)
+			goto error;
+
+		return 0;
+	}
+
+	if (! reload_summary) {
+		if (upstart_reload_configuration_sync (NULL, upstart) < 0)
+			goto error;
+
+		return 0;
+	}
+
+	if (upstart_reload_configuration_with_summary_sync (NULL, upstart,
+							    &added, &modified,
+							    &removed,
+							    &unchanged) < 0)
 		goto error;
 
+	nih_message (_("%u added, %u modified, %u removed, %u unchanged"),
+		     added, modified, removed, unchanged);
+
 	return 0;
 
 error:
@@ -1894,6 +2122,81 @@ error:
 }
 
 
+/**
+ * trace_action:
+ * @command: NihCommand invoked,
+ * @args: command-line arguments.
+ *
+ * This function is called for the "trace" command.
+ *
+ * Outputs the init daemon's event and job lifecycle trace, oldest first,
+ * with times in seconds relative to the oldest record.
+ *
+ * Returns: command exit status.
+ **/
+int
+trace_action (NihCommand *  command,
+	      char * const *args)
+{
+	nih_local NihDBusProxy *                   upstart = NULL;
+	nih_local UpstartGetTraceRecordsElement ** records = NULL;
+	NihError *                                 err;
+	uint64_t                                   start;
+
+	nih_assert (command != NULL);
+	nih_assert (args != NULL);
+
+	upstart = upstart_open (NULL);
+	if (! upstart)
+		return 1;
+
+	if (upstart_get_trace_sync (NULL, upstart, &records) < 0)
+		goto error;
+
+	if (! records[0])
+		return 0;
+
+	start = records[0]->item0;
+
+	for (UpstartGetTraceRecordsElement **record = records;
+	     *record; record++) {
+		uint64_t elapsed = (*record)->item0 - start;
+		char     stamp[32];
+
+		snprintf (stamp, sizeof (stamp), "%llu.%06llu",
+			  (unsigned long long)(elapsed / 1000000000ULL),
+			  (unsigned long long)((elapsed % 1000000000ULL) / 1000ULL));
+
+		if (! strcmp ((*record)->item1, "job-reap")) {
+			nih_message ("%s %s %s %s %d %d", stamp,
+				     (*record)->item1, (*record)->item2,
+				     (*record)->item3, (*record)->item4,
+				     (*record)->item5);
+		} else if ((*record)->item4) {
+			nih_message ("%s %s %s %s %d", stamp,
+				     (*record)->item1, (*record)->item2,
+				     (*record)->item3, (*record)->item4);
+		} else if (*(*record)->item3) {
+			nih_message ("%s %s %s %s", stamp,
+				     (*record)->item1, (*record)->item2,
+				     (*record)->item3);
+		} else {
+			nih_message ("%s %s %s", stamp,
+				     (*record)->item1, (*record)->item2);
+		}
+	}
+
+	return 0;
+
+error:
+	err = nih_error_get ();
+	nih_error ("%s", err->message);
+	nih_free (err);
+
+	return 1;
+}
+
+
 /**
  * check_config_action:
  * @command: NihCommand invoked,
@@ -3020,6 +3323,8 @@ NihOption list_options[] = {
 NihOption emit_options[] = {
 	{ 'n', "no-wait", N_("do not wait for event to finish before exiting"),
 	  NULL, NULL, &no_wait, NULL },
+	{ 0, "batch", N_("read events to emit from standard input, one per line"),
+	  NULL, NULL, &emit_batch, NULL },
 
 	NIH_OPTION_LAST
 };
@@ -3030,6 +3335,10 @@ NihOption emit_options[] = {
  * Command-line options accepted for the reload-configuration command.
  **/
 NihOption reload_configuration_options[] = {
+	{ 's', "summary", N_("output the number of configuration files added, "
+			     "modified, removed and unchanged"),
+	  NULL, NULL, &reload_summary, NULL },
+
 	NIH_OPTION_LAST
 };
 
@@ -3042,6 +3351,15 @@ NihOption version_options[] = {
 	NIH_OPTION_LAST
 };
 
+/**
+ * trace_options:
+ *
+ * Command-line options accepted for the trace command.
+ **/
+NihOption trace_options[] = {
+	NIH_OPTION_LAST
+};
+
 /**
  * log_priority_options:
  *
@@ -3229,12 +3547,21 @@ static NihCommand commands[] = {
 	  N_("Emit an event."),
 	  N_("EVENT is the name of an event the init daemon should emit, "
 	     "this may be followed by zero or more environment variables "
-	     "to be included in the event.\n"),
+	     "to be included in the event.\n"
+	     "\n"
+	     "With --batch, events are instead read from standard input, "
+	     "one per line in the same form, and sent to the init daemon "
+	     "together.\n"),
 	  &event_commands, emit_options, emit_action },
 
-	{ "reload-configuration", NULL,
+	{ "reload-configuration", N_("[FILE]..."),
 	  N_("Reload the configuration of the init daemon."),
-	  NULL,
+	  N_("Only configuration files that have changed since they were "
+	     "last loaded are parsed again.  If FILEs are given, only those "
+	     "job configuration or override files are reloaded.\n"
+	     "\n"
+	     "With --summary, the number of files added, modified, removed "
+	     "and unchanged is output."),
 	  NULL, reload_configuration_options, reload_configuration_action },
 	{ "version", NULL,
 	  N_("Request the version of the init daemon."),
@@ -3259,6 +3586,17 @@ static NihCommand commands[] = {
 	     "\n"
 	     "Without arguments, this outputs the current log priority."),
 	  NULL, log_priority_options, log_priority_action },
+	{ "trace", NULL,
+	  N_("Show event and job lifecycle timestamps."),
+	  N_("Outputs the init daemon's trace of event and job lifecycle "
+	     "points, oldest first, with times in seconds relative to the "
+	     "oldest.  Each line gives the time, kind of record, event or "
+	     "job name, then the new job state or job process concerned, "
+	     "its process id and wait status where relevant.\n"
+	     "\n"
+	     "The init daemon only keeps a trace when started with "
+	     "--trace-records."),
+	  NULL, trace_options, trace_action },
 
 	{ "show-config", N_("[CONF]"),
 	  N_("Show emits, start on and stop on details for job configurations."),
@@ -20,6 +20,14 @@
 #ifndef INITCTL_H
 #define INITCTL_H
 
+/**
+ * EMIT_BATCH_SIZE:
+ *
+ * Maximum number of events sent in a single EmitEvents method call by
+ * "emit --batch"; longer input is sent in several calls.
+ **/
+#define EMIT_BATCH_SIZE 1024
+
 /**
  * IS_OP_AND:
  * @token: string token to check.
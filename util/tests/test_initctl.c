@@ -61,6 +61,8 @@ extern int dbus_bus_type;
 extern char *dest_name;
 extern const char *dest_address;
 extern int no_wait;
+extern int emit_batch;
+extern int reload_summary;
 
 extern NihDBusProxy *upstart_open (const void *parent)
 	__attribute__ ((warn_unused_result));
@@ -78,6 +80,7 @@ extern int emit_action                 (NihCommand *command, char * const *args)
 extern int reload_configuration_action (NihCommand *command, char * const *args);
 extern int version_action              (NihCommand *command, char * const *args);
 extern int log_priority_action         (NihCommand *command, char * const *args);
+extern int trace_action                (NihCommand *command, char * const *args);
 extern int usage_action                (NihCommand *command, char * const *args);
 
 
@@ -14972,6 +14975,8 @@ test_emit_action (void)
 	char *          args[4];
 	int             ret = 0;
 	int             status;
+	FILE *          input;
+	int             stdin_fd;
 
 	TEST_FUNCTION ("emit_action");
 	TEST_DBUS (dbus_pid);
@@ -15382,6 +15387,153 @@ test_emit_action (void)
 	}
 
 
+	/* Check that with --batch, events are read from standard input
+	 * one per line, skipping blank lines and comments, and passed to
+	 * the server together in a single EmitEvents command.
+	 */
+	TEST_FEATURE ("with batch from standard input");
+	input = tmpfile ();
+	fputs ("wibble FOO=foo BAR=bar\n", input);
+	fputs ("\n", input);
+	fputs ("# comment\n", input);
+	fputs ("wobble\n", input);
+	fflush (input);
+
+	stdin_fd = dup (STDIN_FILENO);
+	assert (stdin_fd >= 0);
+	assert (dup2 (fileno (input), STDIN_FILENO) == STDIN_FILENO);
+
+	emit_batch = TRUE;
+
+	TEST_ALLOC_FAIL {
+		TEST_CHILD (server_pid) {
+			DBusMessageIter iter, array_iter, struct_iter;
+			DBusMessageIter env_iter;
+
+			/* Expect the EmitEvents method call on the manager
+			 * object, make sure the arguments are right and
+			 * reply to acknowledge.
+			 */
+			TEST_DBUS_MESSAGE (server_conn, method_call);
+
+			TEST_TRUE (dbus_message_is_method_call (method_call,
+								DBUS_INTERFACE_UPSTART,
+								"EmitEvents"));
+
+			TEST_EQ_STR (dbus_message_get_path (method_call),
+							    DBUS_PATH_UPSTART);
+
+			TEST_TRUE (dbus_message_iter_init (method_call, &iter));
+			TEST_EQ (dbus_message_iter_get_arg_type (&iter),
+				 DBUS_TYPE_ARRAY);
+			dbus_message_iter_recurse (&iter, &array_iter);
+
+			/* First event */
+			TEST_EQ (dbus_message_iter_get_arg_type (&array_iter),
+				 DBUS_TYPE_STRUCT);
+			dbus_message_iter_recurse (&array_iter, &struct_iter);
+
+			dbus_message_iter_get_basic (&struct_iter, &name_value);
+			TEST_EQ_STR (name_value, "wibble");
+			dbus_message_iter_next (&struct_iter);
+
+			dbus_message_iter_recurse (&struct_iter, &env_iter);
+			dbus_message_iter_get_basic (&env_iter, &name_value);
+			TEST_EQ_STR (name_value, "FOO=foo");
+			dbus_message_iter_next (&env_iter);
+			dbus_message_iter_get_basic (&env_iter, &name_value);
+			TEST_EQ_STR (name_value, "BAR=bar");
+			TEST_FALSE (dbus_message_iter_next (&env_iter));
+			dbus_message_iter_next (&struct_iter);
+
+			dbus_message_iter_get_basic (&struct_iter, &wait_value);
+			TEST_TRUE (wait_value);
+
+			/* Second event */
+			TEST_TRUE (dbus_message_iter_next (&array_iter));
+			dbus_message_iter_recurse (&array_iter, &struct_iter);
+
+			dbus_message_iter_get_basic (&struct_iter, &name_value);
+			TEST_EQ_STR (name_value, "wobble");
+			dbus_message_iter_next (&struct_iter);
+
+			TEST_EQ (dbus_message_iter_get_arg_type (&struct_iter),
+				 DBUS_TYPE_ARRAY);
+			dbus_message_iter_recurse (&struct_iter, &env_iter);
+			TEST_EQ (dbus_message_iter_get_arg_type (&env_iter),
+				 DBUS_TYPE_INVALID);
+			dbus_message_iter_next (&struct_iter);
+
+			dbus_message_iter_get_basic (&struct_iter, &wait_value);
+			TEST_TRUE (wait_value);
+
+			TEST_FALSE (dbus_message_iter_next (&array_iter));
+
+			TEST_ALLOC_SAFE {
+				reply = dbus_message_new_method_return (method_call);
+			}
+
+			dbus_connection_send (server_conn, reply, NULL);
+			dbus_connection_flush (server_conn);
+
+			dbus_message_unref (method_call);
+			dbus_message_unref (reply);
+
+			TEST_DBUS_CLOSE (server_conn);
+
+			dbus_shutdown ();
+
+			exit (0);
+		}
+
+		memset (&command, 0, sizeof command);
+
+		args[0] = NULL;
+
+		rewind (stdin);
+
+		TEST_DIVERT_STDOUT (output) {
+			TEST_DIVERT_STDERR (errors) {
+				ret = emit_action (&command, args);
+			}
+		}
+		rewind (output);
+		rewind (errors);
+
+		if (test_alloc_failed
+		    && (ret != 0)) {
+			TEST_FILE_END (output);
+			TEST_FILE_RESET (output);
+
+			TEST_FILE_EQ (errors, "test: Cannot allocate memory\n");
+			TEST_FILE_END (errors);
+			TEST_FILE_RESET (errors);
+
+			kill (server_pid, SIGTERM);
+			waitpid (server_pid, NULL, 0);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_FILE_END (output);
+		TEST_FILE_RESET (output);
+
+		TEST_FILE_END (errors);
+		TEST_FILE_RESET (errors);
+
+		waitpid (server_pid, &status, 0);
+		TEST_TRUE (WIFEXITED (status));
+		TEST_EQ (WEXITSTATUS (status), 0);
+	}
+
+	emit_batch = FALSE;
+
+	assert (dup2 (stdin_fd, STDIN_FILENO) == STDIN_FILENO);
+	close (stdin_fd);
+	fclose (input);
+
+
 	fclose (errors);
 	fclose (output);
 
@@ -15406,6 +15558,12 @@ test_reload_configuration_action (void)
 	char *          args[1];
 	int             ret = 0;
 	int             status;
+	uint32_t        added, modified, removed, unchanged;
+	char **         args_value;
+	int             args_elements;
+	char            cwd[PATH_MAX];
+	char            expected[PATH_MAX * 2];
+	char *          file_args[3];
 
 	TEST_FUNCTION ("reload_configuration_action");
 	TEST_DBUS (dbus_pid);
@@ -15503,6 +15661,187 @@ test_reload_configuration_action (void)
 	}
 
 
+	/* Check that with --summary the ReloadConfigurationWithSummary
+	 * method is called instead, and the counts it returns are output.
+	 */
+	TEST_FEATURE ("with summary");
+	reload_summary = TRUE;
+
+	TEST_ALLOC_FAIL {
+		TEST_CHILD (server_pid) {
+			/* Expect the ReloadConfigurationWithSummary method
+			 * call for the manager object, reply with the counts.
+			 */
+			TEST_DBUS_MESSAGE (server_conn, method_call);
+
+			TEST_TRUE (dbus_message_is_method_call (method_call,
+								DBUS_INTERFACE_UPSTART,
+								"ReloadConfigurationWithSummary"));
+
+			TEST_EQ_STR (dbus_message_get_path (method_call),
+							    DBUS_PATH_UPSTART);
+
+			TEST_ALLOC_SAFE {
+				reply = dbus_message_new_method_return (method_call);
+
+				added = 1;
+				modified = 2;
+				removed = 0;
+				unchanged = 42;
+
+				dbus_message_append_args (reply,
+							  DBUS_TYPE_UINT32, &added,
+							  DBUS_TYPE_UINT32, &modified,
+							  DBUS_TYPE_UINT32, &removed,
+							  DBUS_TYPE_UINT32, &unchanged,
+							  DBUS_TYPE_INVALID);
+			}
+
+			dbus_connection_send (server_conn, reply, NULL);
+			dbus_connection_flush (server_conn);
+
+			dbus_message_unref (method_call);
+			dbus_message_unref (reply);
+
+			TEST_DBUS_CLOSE (server_conn);
+
+			dbus_shutdown ();
+
+			exit (0);
+		}
+
+		memset (&command, 0, sizeof command);
+
+		args[0] = NULL;
+
+		TEST_DIVERT_STDOUT (output) {
+			TEST_DIVERT_STDERR (errors) {
+				ret = reload_configuration_action (&command, args);
+			}
+		}
+		rewind (output);
+		rewind (errors);
+
+		if (test_alloc_failed
+		    && (ret != 0)) {
+			TEST_FILE_END (output);
+			TEST_FILE_RESET (output);
+
+			TEST_FILE_EQ (errors, "test: Cannot allocate memory\n");
+			TEST_FILE_END (errors);
+			TEST_FILE_RESET (errors);
+
+			kill (server_pid, SIGTERM);
+			waitpid (server_pid, NULL, 0);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_FILE_EQ (output, "1 added, 2 modified, 0 removed, 42 unchanged\n");
+		TEST_FILE_END (output);
+		TEST_FILE_RESET (output);
+
+		TEST_FILE_END (errors);
+		TEST_FILE_RESET (errors);
+
+		waitpid (server_pid, &status, 0);
+		TEST_TRUE (WIFEXITED (status));
+		TEST_EQ (WEXITSTATUS (status), 0);
+	}
+
+	reload_summary = FALSE;
+
+
+	/* Check that when files are given, the ReloadJobConfiguration
+	 * method is called with them, relative paths being made absolute.
+	 */
+	TEST_FEATURE ("with files");
+	assert (getcwd (cwd, sizeof (cwd)));
+	sprintf (expected, "%s/bar.conf", cwd);
+
+	TEST_ALLOC_FAIL {
+		TEST_CHILD (server_pid) {
+			/* Expect the ReloadJobConfiguration method call for
+			 * the manager object, reply to acknowledge.
+			 */
+			TEST_DBUS_MESSAGE (server_conn, method_call);
+
+			TEST_TRUE (dbus_message_is_method_call (method_call,
+								DBUS_INTERFACE_UPSTART,
+								"ReloadJobConfiguration"));
+
+			TEST_EQ_STR (dbus_message_get_path (method_call),
+							    DBUS_PATH_UPSTART);
+
+			TEST_TRUE (dbus_message_get_args (method_call, NULL,
+							  DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &args_value, &args_elements,
+							  DBUS_TYPE_INVALID));
+
+			TEST_EQ (args_elements, 2);
+			TEST_EQ_STR (args_value[0], "/etc/init/foo.conf");
+			TEST_EQ_STR (args_value[1], expected);
+			dbus_free_string_array (args_value);
+
+			TEST_ALLOC_SAFE {
+				reply = dbus_message_new_method_return (method_call);
+			}
+
+			dbus_connection_send (server_conn, reply, NULL);
+			dbus_connection_flush (server_conn);
+
+			dbus_message_unref (method_call);
+			dbus_message_unref (reply);
+
+			TEST_DBUS_CLOSE (server_conn);
+
+			dbus_shutdown ();
+
+			exit (0);
+		}
+
+		memset (&command, 0, sizeof command);
+
+		file_args[0] = "/etc/init/foo.conf";
+		file_args[1] = "bar.conf";
+		file_args[2] = NULL;
+
+		TEST_DIVERT_STDOUT (output) {
+			TEST_DIVERT_STDERR (errors) {
+				ret = reload_configuration_action (&command, file_args);
+			}
+		}
+		rewind (output);
+		rewind (errors);
+
+		if (test_alloc_failed
+		    && (ret != 0)) {
+			TEST_FILE_END (output);
+			TEST_FILE_RESET (output);
+
+			TEST_FILE_EQ (errors, "test: Cannot allocate memory\n");
+			TEST_FILE_END (errors);
+			TEST_FILE_RESET (errors);
+
+			kill (server_pid, SIGTERM);
+			waitpid (server_pid, NULL, 0);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_FILE_END (output);
+		TEST_FILE_RESET (output);
+
+		TEST_FILE_END (errors);
+		TEST_FILE_RESET (errors);
+
+		waitpid (server_pid, &status, 0);
+		TEST_TRUE (WIFEXITED (status));
+		TEST_EQ (WEXITSTATUS (status), 0);
+	}
+
+
 	/* Check that if an error is received from the command,
 	 * the message attached is printed to standard error and the
 	 * command exits.
@@ -16209,6 +16548,206 @@ test_log_priority_action (void)
 }
 
 
+void
+test_trace_action (void)
+{
+	pid_t           dbus_pid;
+	DBusConnection *server_conn;
+	FILE *          output;
+	FILE *          errors;
+	pid_t           server_pid;
+	DBusMessage *   method_call;
+	DBusMessage *   reply = NULL;
+	DBusMessageIter iter;
+	DBusMessageIter arrayiter;
+	DBusMessageIter structiter;
+	uint64_t        time_value;
+	const char *    str_value;
+	int32_t         int_value;
+	NihCommand      command;
+	char *          args[1];
+	int             ret = 0;
+	int             status;
+
+	TEST_FUNCTION ("trace_action");
+	TEST_DBUS (dbus_pid);
+	TEST_DBUS_OPEN (server_conn);
+
+	assert (dbus_bus_request_name (server_conn, DBUS_SERVICE_UPSTART,
+				       0, NULL)
+			== DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER);
+
+	TEST_DBUS_MESSAGE (server_conn, method_call);
+	assert (dbus_message_is_signal (method_call, DBUS_INTERFACE_DBUS,
+					"NameAcquired"));
+	dbus_message_unref (method_call);
+
+	dbus_bus_type = DBUS_BUS_SYSTEM;
+	dest_name = DBUS_SERVICE_UPSTART;
+	dest_address = DBUS_ADDRESS_UPSTART;
+
+	output = tmpfile ();
+	errors = tmpfile ();
+
+
+	/* Check that the trace action calls the GetTrace method, and
+	 * prints each record with its time relative to the first.
+	 */
+	TEST_FEATURE ("with valid reply");
+	TEST_ALLOC_FAIL {
+		TEST_CHILD (server_pid) {
+			/* Expect the GetTrace method call, reply with
+			 * an event record followed by a job record.
+			 */
+			TEST_DBUS_MESSAGE (server_conn, method_call);
+
+			TEST_TRUE (dbus_message_is_method_call (method_call,
+								DBUS_INTERFACE_UPSTART,
+								"GetTrace"));
+
+			TEST_EQ_STR (dbus_message_get_path (method_call),
+							    DBUS_PATH_UPSTART);
+
+			TEST_ALLOC_SAFE {
+				reply = dbus_message_new_method_return (method_call);
+
+				dbus_message_iter_init_append (reply, &iter);
+
+				dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+								  (DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+								   DBUS_TYPE_UINT64_AS_STRING
+								   DBUS_TYPE_STRING_AS_STRING
+								   DBUS_TYPE_STRING_AS_STRING
+								   DBUS_TYPE_STRING_AS_STRING
+								   DBUS_TYPE_INT32_AS_STRING
+								   DBUS_TYPE_INT32_AS_STRING
+								   DBUS_STRUCT_END_CHAR_AS_STRING),
+								  &arrayiter);
+
+				dbus_message_iter_open_container (&arrayiter, DBUS_TYPE_STRUCT,
+								  NULL, &structiter);
+
+				time_value = 5000000000ULL;
+				dbus_message_iter_append_basic (&structiter, DBUS_TYPE_UINT64,
+								&time_value);
+
+				str_value = "event-new";
+				dbus_message_iter_append_basic (&structiter, DBUS_TYPE_STRING,
+								&str_value);
+
+				str_value = "startup";
+				dbus_message_iter_append_basic (&structiter, DBUS_TYPE_STRING,
+								&str_value);
+
+				str_value = "";
+				dbus_message_iter_append_basic (&structiter, DBUS_TYPE_STRING,
+								&str_value);
+
+				int_value = 0;
+				dbus_message_iter_append_basic (&structiter, DBUS_TYPE_INT32,
+								&int_value);
+				dbus_message_iter_append_basic (&structiter, DBUS_TYPE_INT32,
+								&int_value);
+
+				dbus_message_iter_close_container (&arrayiter, &structiter);
+
+				dbus_message_iter_open_container (&arrayiter, DBUS_TYPE_STRUCT,
+								  NULL, &structiter);
+
+				time_value = 5001500000ULL;
+				dbus_message_iter_append_basic (&structiter, DBUS_TYPE_UINT64,
+								&time_value);
+
+				str_value = "job-fork";
+				dbus_message_iter_append_basic (&structiter, DBUS_TYPE_STRING,
+								&str_value);
+
+				str_value = "test";
+				dbus_message_iter_append_basic (&structiter, DBUS_TYPE_STRING,
+								&str_value);
+
+				str_value = "main";
+				dbus_message_iter_append_basic (&structiter, DBUS_TYPE_STRING,
+								&str_value);
+
+				int_value = 1000;
+				dbus_message_iter_append_basic (&structiter, DBUS_TYPE_INT32,
+								&int_value);
+
+				int_value = 0;
+				dbus_message_iter_append_basic (&structiter, DBUS_TYPE_INT32,
+								&int_value);
+
+				dbus_message_iter_close_container (&arrayiter, &structiter);
+
+				dbus_message_iter_close_container (&iter, &arrayiter);
+			}
+
+			dbus_connection_send (server_conn, reply, NULL);
+			dbus_connection_flush (server_conn);
+
+			dbus_message_unref (method_call);
+			dbus_message_unref (reply);
+
+			TEST_DBUS_CLOSE (server_conn);
+
+			dbus_shutdown ();
+
+			exit (0);
+		}
+
+		memset (&command, 0, sizeof command);
+
+		args[0] = NULL;
+
+		TEST_DIVERT_STDOUT (output) {
+			TEST_DIVERT_STDERR (errors) {
+				ret = trace_action (&command, args);
+			}
+		}
+		rewind (output);
+		rewind (errors);
+
+		if (test_alloc_failed
+		    && (ret != 0)) {
+			TEST_FILE_END (output);
+			TEST_FILE_RESET (output);
+
+			TEST_FILE_EQ (errors, "test: Cannot allocate memory\n");
+			TEST_FILE_END (errors);
+			TEST_FILE_RESET (errors);
+
+			kill (server_pid, SIGTERM);
+			waitpid (server_pid, NULL, 0);
+			continue;
+		}
+
+		TEST_EQ (ret, 0);
+
+		TEST_FILE_EQ (output, "0.000000 event-new startup\n");
+		TEST_FILE_EQ (output, "0.001500 job-fork test main 1000\n");
+		TEST_FILE_END (output);
+		TEST_FILE_RESET (output);
+
+		TEST_FILE_END (errors);
+		TEST_FILE_RESET (errors);
+
+		waitpid (server_pid, &status, 0);
+		TEST_TRUE (WIFEXITED (status));
+		TEST_EQ (WEXITSTATUS (status), 0);
+	}
+
+
+	fclose (errors);
+	fclose (output);
+
+	TEST_DBUS_CLOSE (server_conn);
+	TEST_DBUS_END (dbus_pid);
+
+	dbus_shutdown ();
+}
+
+
 void
 test_usage (void)
 {
@@ -18417,6 +18956,7 @@ main (int   argc,
 	test_reload_configuration_action ();
 	test_version_action ();
 	test_log_priority_action ();
+	test_trace_action ();
 	test_usage ();
 
 	test_job_env ();